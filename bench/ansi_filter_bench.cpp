@@ -0,0 +1,152 @@
+// Throughput of the --mirror-clean filter: the original per-chunk
+// make_clean_cmd_out() against AnsiFilter with each scan implementation.
+// Input is fed in 4 KB pieces, as the PTY pump delivers it.
+//
+//   ansi-filter-bench [corpus_mb]
+
+#include "ansi_filter.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+// The implementation this replaces, kept verbatim for comparison. It restarts
+// on every chunk and drops all non-ASCII bytes.
+static std::vector<uint8_t> make_clean_cmd_out(const std::vector<uint8_t>& in) {
+    std::vector<uint8_t> out;
+    out.reserve(in.size());
+    size_t i = 0;
+    while (i < in.size()) {
+        uint8_t c = in[i];
+        if (c == 0x1B) {
+            if (i + 1 >= in.size()) break;
+            uint8_t n = in[i + 1];
+            if (n == '[') {
+                i += 2;
+                while (i < in.size()) { uint8_t ch = in[i++]; if (ch >= 0x40 && ch <= 0x7E) break; }
+                continue;
+            } else if (n == ']') {
+                i += 2; bool done = false;
+                while (i < in.size() && !done) { uint8_t ch = in[i++]; if (ch == 0x07) done = true; else if (ch == 0x1B && i < in.size() && in[i] == '\\') { i++; done = true; } }
+                continue;
+            } else if (n == 'P') {
+                i += 2; bool done = false;
+                while (i < in.size() && !done) { uint8_t ch = in[i++]; if (ch == 0x1B && i < in.size() && in[i] == '\\') { i++; done = true; } }
+                continue;
+            } else {
+                i += 2; while (i < in.size()) { uint8_t ch = in[i++]; if (ch >= 0x40 && ch <= 0x7E) break; }
+                continue;
+            }
+        }
+        if (c == 0x08) { out.push_back(0x08); out.push_back(0x20); out.push_back(0x08); i++; continue; }
+        if (c == 9 || c == 10 || c == 13 || (c >= 32 && c <= 126)) { out.push_back(c); }
+        i++;
+    }
+    return out;
+}
+
+static const size_t kChunk = 4096;
+
+static std::vector<uint8_t> make_corpus(const std::string& kind, size_t size) {
+    std::mt19937 rng(42);
+    std::vector<uint8_t> out;
+    out.reserve(size + 256);
+    auto put = [&](const std::string& s) { out.insert(out.end(), s.begin(), s.end()); };
+    const char* words[] = {"build", "src/tls_channel.cpp", "warning:", "compiling", "[ 42%]", "linking", "ok", "-O2"};
+    const char* utf8[] = {"h\xC3\xA9llo", "\xE2\x9C\x93", "\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E", "\xF0\x9F\x9A\x80", "na\xC3\xAFve"};
+    while (out.size() < size) {
+        if (kind == "plain") {
+            for (int w = 0; w < 10; ++w) { put(words[rng() % 8]); put(" "); }
+            put("\r\n");
+        } else if (kind == "color") {
+            // ls --color / compiler diagnostics: short runs between SGR codes.
+            for (int w = 0; w < 8; ++w) {
+                put("\x1b[01;3" + std::to_string(rng() % 8) + "m");
+                put(words[rng() % 8]);
+                put("\x1b[0m  ");
+            }
+            put("\r\n");
+        } else if (kind == "utf8") {
+            for (int w = 0; w < 10; ++w) { put(utf8[rng() % 5]); put(" "); put(words[rng() % 8]); put(" "); }
+            put("\r\n");
+        } else { // top-style full-screen redraw
+            put("\x1b]0;top - 10:00:00\x07\x1b[H\x1b[2J");
+            for (int row = 1; row < 24; ++row) {
+                put("\x1b[" + std::to_string(row) + ";1H\x1b[7m");
+                put(words[rng() % 8]);
+                put("\x1b[27m ");
+                put(utf8[rng() % 5]);
+                put("   12345 root 20 0 1.2g 3.4m S 0.3 0.1 \x1b[K");
+            }
+        }
+    }
+    out.resize(size);
+    return out;
+}
+
+template <typename Fn>
+static double run_mbps(const std::vector<uint8_t>& corpus, int reps, Fn fn) {
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < reps; ++r) {
+        for (size_t off = 0; off < corpus.size(); off += kChunk) {
+            fn(corpus.data() + off, std::min(kChunk, corpus.size() - off));
+        }
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return static_cast<double>(corpus.size()) * reps / secs / (1024.0 * 1024.0);
+}
+
+int main(int argc, char* argv[]) {
+    size_t mb = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 16;
+    const int reps = 4;
+    const AnsiFilter::ScanImpl impls[] = {AnsiFilter::ScanImpl::Scalar, AnsiFilter::ScanImpl::Sse2,
+                                          AnsiFilter::ScanImpl::Avx2};
+    bool all_ok = true;
+
+    std::printf("%-8s %12s", "corpus", "legacy MB/s");
+    for (auto impl : impls) std::printf(" %12s", AnsiFilter::impl_name(AnsiFilter(impl).impl()));
+    std::printf("   chunk-safe\n");
+
+    for (const char* kind : {"plain", "color", "utf8", "screen"}) {
+        auto corpus = make_corpus(kind, mb * 1024 * 1024);
+        std::printf("%-8s", kind);
+
+        uint64_t sink = 0;
+        double legacy = run_mbps(corpus, reps, [&](const uint8_t* p, size_t n) {
+            auto out = make_clean_cmd_out(std::vector<uint8_t>(p, p + n));
+            sink += out.size();
+        });
+        std::printf(" %12.0f", legacy);
+
+        // Reference: the whole corpus in one call, so no sequence is split.
+        std::vector<uint8_t> whole;
+        AnsiFilter(AnsiFilter::ScanImpl::Scalar).filter(corpus.data(), corpus.size(), whole);
+
+        bool ok = true;
+        for (auto impl : impls) {
+            AnsiFilter filter(impl);
+            std::vector<uint8_t> out;
+            double mbps = run_mbps(corpus, reps, [&](const uint8_t* p, size_t n) {
+                out.clear();
+                filter.filter(p, n, out);
+                sink += out.size();
+            });
+            std::printf(" %12.0f", mbps);
+
+            // Odd-sized pieces split escapes and UTF-8 everywhere.
+            AnsiFilter chunked(impl);
+            std::vector<uint8_t> pieces;
+            for (size_t off = 0; off < corpus.size(); off += 7) {
+                chunked.filter(corpus.data() + off, std::min<size_t>(7, corpus.size() - off), pieces);
+            }
+            ok = ok && pieces == whole;
+        }
+        std::printf("   %s\n", ok ? "yes" : "NO");
+        all_ok = all_ok && ok;
+        if (sink == 0) std::printf("(empty output)\n");
+    }
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,216 @@
+// Loopback throughput of -L port forwarding. Load connections write into a
+// client-side PortForwarder, cross one TLS connection over a socketpair as
+// channels, and leave the server-side forwarder for a local sink. Each side
+// of the tunnel runs its own EventLoop thread, and the load and sink share a
+// third, so no connection gets a thread of its own. The total volume is the
+// same for every row; only the number of connections it is split over
+// changes.
+//
+//   forward-bench [cert.pem key.pem [total_mb]]
+
+#include "channel_mux.hpp"
+#include "control_codec.hpp"
+#include "event_loop.hpp"
+#include "port_forward.hpp"
+#include "tls_channel.hpp"
+#include "tls_wrapper.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// One end of the tunnel, wired the way the session bridges wire theirs.
+struct Tunnel {
+    EventLoop loop;
+    TLSChannel channel;
+    ChannelMux mux;
+    PortForwarder forwarder;
+
+    Tunnel(TLSWrapper& tls, bool client) : channel(loop, tls), mux(channel, client), forwarder(loop, mux, !client) {
+        channel.on_frame = [this](uint8_t type, const std::vector<uint8_t>& payload) {
+            control::Message msg;
+            if (type == (uint8_t)framing::FrameType::CONTROL && control::decode(payload.data(), payload.size(), msg)) {
+                mux.on_control(msg);
+            }
+        };
+        channel.on_channel_frame = [this](uint32_t id, uint8_t type, const std::vector<uint8_t>& payload) {
+            mux.on_frame(id, type, payload);
+        };
+        channel.on_drained = [this]() { mux.pump(); };
+        mux.on_open_request = [this](uint32_t id, uint8_t kind, const std::string& target, ChannelMux::Handler& handler) {
+            return forwarder.accept(id, kind, target, handler);
+        };
+    }
+};
+
+static int listen_loopback(uint16_t& port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (fd < 0 || bind(fd, (sockaddr*)&addr, len) != 0 || listen(fd, SOMAXCONN) != 0) return -1;
+    getsockname(fd, (sockaddr*)&addr, &len);
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+struct Result {
+    bool ok = false;
+    double seconds = 0;
+    uint64_t received = 0;
+};
+
+static Result run_round(const char* cert, const char* key, int connections, size_t per_connection) {
+    Result result;
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return result;
+    TLSWrapper server_tls;
+    TLSWrapper client_tls;
+    bool ready = server_tls.configure_ssl(true, cert, key, "") && client_tls.configure_ssl(false, "", "", "");
+    server_tls.attach_socket(sv[0]);
+    client_tls.attach_socket(sv[1]);
+    bool server_ok = false;
+    std::thread handshake([&]() { server_ok = ready && server_tls.perform_handshake(); });
+    bool client_ok = ready && client_tls.perform_handshake();
+    if (!client_ok) shutdown(sv[1], SHUT_RDWR);
+    handshake.join();
+    if (!client_ok || !server_ok) {
+        close(sv[0]);
+        close(sv[1]);
+        return result;
+    }
+
+    EventLoop load;
+    uint16_t sink_port = 0;
+    int sink = listen_loopback(sink_port);
+    Tunnel server(server_tls, false);
+    Tunnel client(client_tls, true);
+    uint16_t forward_port = 0;
+    if (sink >= 0 && server.channel.start() && client.channel.start()) {
+        ForwardSpec spec;
+        spec.host = "127.0.0.1";
+        spec.port = sink_port;
+        forward_port = client.forwarder.add_local(spec);
+    }
+    if (forward_port == 0) {
+        if (sink >= 0) close(sink);
+        close(sv[0]);
+        close(sv[1]);
+        return result;
+    }
+    std::thread server_thread([&]() { server.loop.run(); });
+    std::thread client_thread([&]() { client.loop.run(); });
+
+    static const std::vector<uint8_t> chunk(64 * 1024, 'x');
+    std::vector<uint8_t> scratch(64 * 1024);
+    std::unordered_map<int, size_t> sent;
+    int finished = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    // Sink: count bytes until every relayed connection has closed.
+    load.add(sink, EventLoop::READABLE, [&](uint32_t) {
+        for (;;) {
+            int fd = accept4(sink, nullptr, nullptr, SOCK_NONBLOCK);
+            if (fd < 0) return;
+            load.add(fd, EventLoop::READABLE, [&, fd](uint32_t) {
+                for (;;) {
+                    ssize_t r = read(fd, scratch.data(), scratch.size());
+                    if (r > 0) {
+                        result.received += static_cast<uint64_t>(r);
+                        continue;
+                    }
+                    if (r < 0 && errno == EAGAIN) return;
+                    load.remove(fd);
+                    close(fd);
+                    if (++finished == connections) {
+                        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                        load.stop();
+                    }
+                    return;
+                }
+            });
+        }
+    });
+
+    // Load: write per_connection bytes into the forwarded port, then EOF.
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(forward_port);
+    for (int i = 0; i < connections; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) break;
+        connect(fd, (sockaddr*)&addr, sizeof(addr));
+        sent[fd] = 0;
+        load.add(fd, EventLoop::WRITABLE, [&, fd](uint32_t events) {
+            size_t& done = sent[fd];
+            if (done == per_connection) {
+                // Written and shut down; wait for the tunnel to close its end.
+                if ((events & EventLoop::READABLE) && read(fd, scratch.data(), scratch.size()) <= 0) {
+                    load.remove(fd);
+                    close(fd);
+                }
+                return;
+            }
+            while (done < per_connection) {
+                ssize_t w = write(fd, chunk.data(), std::min(chunk.size(), per_connection - done));
+                if (w <= 0) return;
+                done += static_cast<size_t>(w);
+            }
+            shutdown(fd, SHUT_WR);
+            load.modify(fd, EventLoop::READABLE);
+        });
+    }
+    load.run();
+
+    for (auto& entry : sent) {
+        load.remove(entry.first);
+        close(entry.first);
+    }
+    load.remove(sink);
+    close(sink);
+    server.loop.stop();
+    client.loop.stop();
+    server_thread.join();
+    client_thread.join();
+    result.ok = finished == connections && result.received == per_connection * connections;
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    const char* cert = argc > 2 ? argv[1] : "cert.pem";
+    const char* key = argc > 2 ? argv[2] : "key.pem";
+    size_t total_mb = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 256;
+
+    // Four descriptors per forwarded connection in this one process.
+    rlimit lim{};
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+
+    std::printf("%12s %10s %10s %10s\n", "connections", "MB", "seconds", "MB/s");
+    for (int connections : {1, 16, 256}) {
+        size_t per_connection = total_mb * 1024 * 1024 / connections;
+        Result r = run_round(cert, key, connections, per_connection);
+        if (!r.ok) {
+            std::fprintf(stderr, "round with %d connections failed (%llu bytes arrived); check %s and %s\n",
+                         connections, (unsigned long long)r.received, cert, key);
+            return 1;
+        }
+        double mb = r.received / (1024.0 * 1024.0);
+        std::printf("%12d %10.0f %10.2f %10.1f\n", connections, mb, r.seconds, mb / r.seconds);
+    }
+    return 0;
+}
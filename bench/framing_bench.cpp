@@ -0,0 +1,145 @@
+// Copy cost of building and sending DATA frames, before and after in-place
+// framing. mbedTLS is replaced by a sink that does what mbedtls_ssl_write()
+// does with plaintext: copy at most one record into its output buffer.
+//
+//   framing-bench [total_mb]
+
+#include "framing.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+static std::atomic<uint64_t> g_allocs{0};
+
+void* operator new(size_t n) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+static const size_t kRecord = 16384;
+
+struct RecordSink {
+    std::vector<uint8_t> record = std::vector<uint8_t>(kRecord);
+    uint64_t copied = 0;
+    uint64_t checksum = 0;
+
+    size_t write(const uint8_t* p, size_t n) {
+        n = std::min(n, kRecord);
+        std::memcpy(record.data(), p, n);
+        copied += n;
+        checksum += record[n - 1];
+        return n;
+    }
+    void write_all(const uint8_t* p, size_t n) {
+        while (n > 0) {
+            size_t w = write(p, n);
+            p += w;
+            n -= w;
+        }
+    }
+};
+
+struct Result {
+    double ns_per_frame;
+    double copies_per_byte;
+    double allocs_per_frame;
+};
+
+// The original pump: payload vector, then build_frame(), then TLS.
+static void send_baseline(RecordSink& sink, uint64_t& copied, const uint8_t* buf, size_t len) {
+    std::vector<uint8_t> payload(buf, buf + len);
+    auto frame = framing::build_frame(framing::FrameType::DATA, payload);
+    copied += len + frame.size();
+    sink.write_all(frame.data(), frame.size());
+}
+
+// The channel before this change: header and payload appended to a send
+// queue that is then written out.
+static void send_queued(RecordSink& sink, uint64_t& copied, std::vector<uint8_t>& queue, const uint8_t* buf,
+                        size_t len) {
+    uint8_t header[framing::HEADER_SIZE];
+    framing::write_header(framing::FrameType::DATA, len, header);
+    queue.insert(queue.end(), header, header + sizeof(header));
+    queue.insert(queue.end(), buf, buf + len);
+    copied += framing::HEADER_SIZE + len;
+    sink.write_all(queue.data(), queue.size());
+    queue.clear();
+}
+
+// TLSChannel::send_frame_in_place(): the header lands in reserved headroom.
+static void send_in_place(RecordSink& sink, uint8_t* payload, size_t len) {
+    uint8_t* frame = framing::frame_in_place(framing::FrameType::DATA, payload, len);
+    sink.write_all(frame, framing::HEADER_SIZE + len);
+}
+
+// TLSWrapper::tls_writev() with a separate header: one record is staged.
+static void send_gather(RecordSink& sink, uint64_t& copied, std::vector<uint8_t>& staging, const uint8_t* buf,
+                        size_t len) {
+    uint8_t header[framing::HEADER_SIZE];
+    framing::write_header(framing::FrameType::DATA, len, header);
+    size_t first = std::min(len, kRecord - framing::HEADER_SIZE);
+    std::memcpy(staging.data(), header, framing::HEADER_SIZE);
+    std::memcpy(staging.data() + framing::HEADER_SIZE, buf, first);
+    copied += framing::HEADER_SIZE + first;
+    sink.write_all(staging.data(), framing::HEADER_SIZE + first);
+    if (first < len) sink.write_all(buf + first, len - first);
+}
+
+template <typename Fn>
+static Result measure(size_t payload, uint64_t total_bytes, RecordSink& sink, uint64_t& extra_copied, Fn fn) {
+    uint64_t frames = std::max<uint64_t>(1, total_bytes / payload);
+    fn(); // warm up vector capacities
+    sink.copied = 0;
+    extra_copied = 0;
+    uint64_t allocs = g_allocs.load();
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < frames; ++i) fn();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    Result r;
+    r.ns_per_frame = std::chrono::duration<double, std::nano>(elapsed).count() / static_cast<double>(frames);
+    r.copies_per_byte = static_cast<double>(sink.copied + extra_copied) / static_cast<double>(frames * payload);
+    r.allocs_per_frame = static_cast<double>(g_allocs.load() - allocs) / static_cast<double>(frames);
+    return r;
+}
+
+int main(int argc, char* argv[]) {
+    uint64_t total_mb = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 256;
+    uint64_t total = total_mb * 1024 * 1024;
+
+    std::printf("%-10s %-10s %12s %16s %14s\n", "payload", "path", "ns/frame", "copies/byte", "allocs/frame");
+    for (size_t payload : {size_t(64), size_t(1024), kRecord - framing::HEADER_SIZE}) {
+        std::vector<uint8_t> buf(framing::HEADER_SIZE + payload);
+        for (size_t i = 0; i < buf.size(); ++i) buf[i] = static_cast<uint8_t>(i * 31);
+        uint8_t* data = buf.data() + framing::HEADER_SIZE;
+        std::vector<uint8_t> queue;
+        std::vector<uint8_t> staging(kRecord);
+        RecordSink sink;
+        uint64_t copied = 0;
+
+        struct Row {
+            const char* name;
+            Result r;
+        } rows[] = {
+            {"baseline", measure(payload, total, sink, copied, [&] { send_baseline(sink, copied, data, payload); })},
+            {"queued", measure(payload, total, sink, copied, [&] { send_queued(sink, copied, queue, data, payload); })},
+            {"gather", measure(payload, total, sink, copied, [&] { send_gather(sink, copied, staging, data, payload); })},
+            {"in-place", measure(payload, total, sink, copied, [&] { send_in_place(sink, data, payload); })},
+        };
+        for (const auto& row : rows) {
+            std::printf("%-10zu %-10s %12.1f %16.3f %14.2f\n", payload, row.name, row.r.ns_per_frame,
+                        row.r.copies_per_byte, row.r.allocs_per_frame);
+        }
+    }
+    std::printf("(checksum-only sink; copies/byte includes the unavoidable record copy)\n");
+    return 0;
+}
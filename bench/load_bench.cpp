@@ -0,0 +1,555 @@
+// End-to-end load against a running `--listen --max-sessions N` server.
+// Opens sessions the way a client does (TLS handshake, hello, a shell), then
+// has each one type a command a key at a time, waiting for every key's echo,
+// run it for a burst of output and resize the window while the burst comes
+// back. Each step of the ramp reports keystroke-to-echo latency percentiles,
+// the handshake rate of the sessions it added, output throughput and the
+// server's CPU use, then doubles the session count until p99 latency breaks
+// away from the first step's.
+//
+//   load-bench --connect IP --port PORT [--sessions N] [--max-sessions M]
+//              [--step-seconds S] [--threads T] [--burst-kb K]
+//              [--server-pid PID] [--cert c.pem --key k.pem] [--cacert ca.pem]
+
+#include "control_codec.hpp"
+#include "credit_window.hpp"
+#include "event_loop.hpp"
+#include "framing.hpp"
+#include "nlohmann/json.hpp"
+#include "tls_channel.hpp"
+#include "tls_wrapper.hpp"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// Pause between keys: a fast typist.
+static const std::chrono::milliseconds kKeyInterval(50);
+static const std::chrono::seconds kPingInterval(1);
+static const std::chrono::seconds kOpenTimeout(30);
+static const size_t kInitialCreditWindow = 64 * 1024;
+static const size_t kMaxCreditWindow = 16 * 1024 * 1024;
+
+// The prompt every session sets, so its end is easy to spot in the output.
+// Set as 'lb''$ ' so the echoed command line doesn't contain it.
+static const char kPrompt[] = "lb$ ";
+static const char kSetPrompt[] = " PS1='lb''$ ' PROMPT_COMMAND=\r";
+
+// A step is past the knee once its p99 is both this many times the first
+// step's and this much above it.
+static const double kKneeFactor = 2.0;
+static const double kKneeMarginMs = 10.0;
+
+struct Options {
+    sockaddr_in addr{};
+    std::string cert;
+    std::string key;
+    std::string ca;
+    size_t sessions = 8;
+    size_t max_sessions = 256;
+    int step_seconds = 10;
+    int threads = 0;
+    size_t burst_kb = 64;
+    int server_pid = 0;
+};
+
+// What one client thread's sessions measured since it was last collected.
+struct Sample {
+    std::vector<uint32_t> echo_us;
+    uint64_t bytes = 0;
+    uint64_t bursts = 0;
+};
+
+class Driver;
+
+// One client connection working through the script.
+class LoadSession {
+public:
+    LoadSession(Driver& driver, EventLoop& loop, const Options& options, int index);
+    ~LoadSession();
+
+    void start();
+
+private:
+    enum class State {
+        HANDSHAKE,
+        // Waiting for hello_ack.
+        WANT_ACK,
+        // Waiting for the prompt, first after setting it, then after a burst.
+        WANT_PROMPT,
+        // A key is out; waiting for its echo.
+        WANT_ECHO,
+        // Between keys.
+        PAUSED,
+        CLOSED
+    };
+
+    void on_handshake_events(uint32_t events);
+    void begin();
+    void on_frame(uint8_t type, const std::vector<uint8_t>& payload);
+    void on_output(const uint8_t* data, size_t len);
+    void next_key();
+    void send_key(uint8_t key);
+    void send_ping();
+    void fail();
+
+    Driver& driver_;
+    EventLoop& loop_;
+    const Options& options_;
+    int index_;
+    int fd_ = -1;
+    bool handshaking_ = false;
+    State state_ = State::HANDSHAKE;
+    std::unique_ptr<TLSWrapper> tls_;
+    std::unique_ptr<TLSChannel> channel_;
+    std::unique_ptr<CreditWindow> credit_;
+    std::string command_;
+    size_t typed_ = 0;
+    uint8_t expect_ = 0;
+    Clock::time_point sent_at_;
+    size_t prompt_matched_ = 0;
+    bool ready_ = false;
+    bool wide_ = false;
+    uint32_t ping_seq_ = 0;
+    uint64_t ping_timer_ = 0;
+    uint64_t key_timer_ = 0;
+};
+
+// A thread running one EventLoop for a share of the sessions.
+class Driver {
+public:
+    explicit Driver(const Options& options) : options_(options) {}
+    ~Driver() { stop(); }
+
+    bool start() {
+        if (!loop_.valid()) return false;
+        thread_ = std::thread([this]() {
+            loop_.run();
+            sessions_.clear();
+        });
+        return true;
+    }
+
+    void stop() {
+        if (thread_.joinable()) {
+            loop_.stop();
+            thread_.join();
+        }
+    }
+
+    // Callable from any thread.
+    void open(int index) {
+        loop_.post([this, index]() {
+            sessions_.push_back(std::make_unique<LoadSession>(*this, loop_, options_, index));
+            sessions_.back()->start();
+        });
+    }
+
+    Sample collect() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Sample s = std::move(sample_);
+        sample_ = Sample();
+        return s;
+    }
+
+    void record_echo(Clock::duration d) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sample_.echo_us.push_back(
+            static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(d).count()));
+    }
+    void record_output(size_t n) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sample_.bytes += n;
+    }
+    void record_burst() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sample_.bursts++;
+    }
+
+    // Sessions that finished the handshake, reached their first prompt, or
+    // died; never reset.
+    std::atomic<size_t> handshakes{0};
+    std::atomic<size_t> ready{0};
+    std::atomic<size_t> failed{0};
+
+private:
+    const Options& options_;
+    EventLoop loop_;
+    std::thread thread_;
+    std::vector<std::unique_ptr<LoadSession>> sessions_;
+    std::mutex mutex_;
+    Sample sample_;
+};
+
+LoadSession::LoadSession(Driver& driver, EventLoop& loop, const Options& options, int index)
+    : driver_(driver), loop_(loop), options_(options), index_(index) {
+    // Printable output that never repeats, so nothing along the way can
+    // shortcut it.
+    command_ = "head -c " + std::to_string(options.burst_kb * 3 / 4 * 1024) + " /dev/urandom | base64";
+}
+
+LoadSession::~LoadSession() {
+    if (ping_timer_) loop_.cancel_timer(ping_timer_);
+    if (key_timer_) loop_.cancel_timer(key_timer_);
+    if (handshaking_) loop_.remove(fd_);
+    channel_.reset();
+    tls_.reset();
+    if (fd_ >= 0) close(fd_);
+}
+
+void LoadSession::start() {
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd_ < 0 || connect(fd_, reinterpret_cast<const sockaddr*>(&options_.addr), sizeof(options_.addr)) != 0) {
+        fail();
+        return;
+    }
+    fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL, 0) | O_NONBLOCK);
+    tls_ = std::make_unique<TLSWrapper>();
+    if (!tls_->configure_ssl(false, options_.cert, options_.key, options_.ca) || !tls_->attach_socket(fd_) ||
+        !loop_.add(fd_, EventLoop::READABLE, [this](uint32_t events) { on_handshake_events(events); })) {
+        fail();
+        return;
+    }
+    handshaking_ = true;
+    on_handshake_events(0);
+}
+
+void LoadSession::on_handshake_events(uint32_t) {
+    int ret = tls_->continue_handshake();
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        loop_.modify(fd_, ret == MBEDTLS_ERR_SSL_WANT_WRITE ? EventLoop::WRITABLE : EventLoop::READABLE);
+        return;
+    }
+    loop_.remove(fd_);
+    handshaking_ = false;
+    if (ret != 0) {
+        fail();
+        return;
+    }
+    driver_.handshakes++;
+    begin();
+}
+
+void LoadSession::begin() {
+    channel_ = std::make_unique<TLSChannel>(loop_, *tls_);
+    channel_->on_frame = [this](uint8_t type, const std::vector<uint8_t>& payload) { on_frame(type, payload); };
+    channel_->on_closed = [this]() { fail(); };
+    if (!channel_->start()) {
+        fail();
+        return;
+    }
+    state_ = State::WANT_ACK;
+    std::string hello = nlohmann::json{{"type", "hello"},
+                                       {"compress", nlohmann::json::array()},
+                                       {"credit", kInitialCreditWindow}}.dump();
+    channel_->send_frame(framing::FrameType::CONTROL, reinterpret_cast<const uint8_t*>(hello.data()), hello.size());
+}
+
+void LoadSession::on_frame(uint8_t type, const std::vector<uint8_t>& payload) {
+    if (type == (uint8_t)framing::FrameType::DATA) {
+        on_output(payload.data(), payload.size());
+        return;
+    }
+    if (type != (uint8_t)framing::FrameType::CONTROL) return;
+    control::Message msg;
+    if (control::decode(payload.data(), payload.size(), msg)) {
+        if (msg.type == control::MsgType::PING) {
+            uint8_t buf[control::kMaxEncodedSize];
+            size_t n = control::encode_ping(control::MsgType::PONG, msg.ping.seq, msg.ping.sent_us, buf);
+            channel_->send_frame(framing::FrameType::CONTROL, buf, n);
+        } else if (msg.type == control::MsgType::PONG && credit_) {
+            auto now = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch());
+            credit_->set_rtt(now - std::chrono::microseconds(msg.ping.sent_us));
+        }
+        return;
+    }
+    if (state_ != State::WANT_ACK || !control::is_json(payload.data(), payload.size())) return;
+    auto ack = nlohmann::json::parse(payload.begin(), payload.end(), nullptr, false);
+    if (!ack.is_object() || ack.value("type", "") != "hello_ack") return;
+    if (ack.value("credit", false)) {
+        credit_ = std::make_unique<CreditWindow>(kInitialCreditWindow, kMaxCreditWindow);
+        send_ping();
+    }
+    state_ = State::WANT_PROMPT;
+    for (const char* p = kSetPrompt; *p; ++p) send_key(static_cast<uint8_t>(*p));
+}
+
+void LoadSession::on_output(const uint8_t* data, size_t len) {
+    driver_.record_output(len);
+    if (credit_) {
+        size_t grant = credit_->consumed(len, CreditWindow::Clock::now());
+        if (grant > 0) {
+            uint8_t buf[control::kMaxEncodedSize];
+            size_t n = control::encode_credit(static_cast<uint32_t>(grant), buf);
+            channel_->send_frame(framing::FrameType::CONTROL, buf, n);
+        }
+    }
+    if (state_ == State::WANT_ECHO && std::memchr(data, expect_, len)) {
+        driver_.record_echo(Clock::now() - sent_at_);
+        state_ = State::PAUSED;
+        key_timer_ = loop_.add_timer(kKeyInterval, [this]() {
+            key_timer_ = 0;
+            next_key();
+        });
+        return;
+    }
+    if (state_ != State::WANT_PROMPT) return;
+    // "lb$ " repeats no prefix of itself, so a mismatch restarts the match.
+    for (size_t i = 0; i < len && prompt_matched_ < sizeof(kPrompt) - 1; ++i) {
+        if (data[i] == kPrompt[prompt_matched_]) {
+            prompt_matched_++;
+        } else {
+            prompt_matched_ = data[i] == kPrompt[0] ? 1 : 0;
+        }
+    }
+    if (prompt_matched_ < sizeof(kPrompt) - 1) return;
+    prompt_matched_ = 0;
+    if (ready_) {
+        driver_.record_burst();
+    } else {
+        ready_ = true;
+        driver_.ready++;
+    }
+    state_ = State::PAUSED;
+    key_timer_ = loop_.add_timer(kKeyInterval, [this]() {
+        key_timer_ = 0;
+        next_key();
+    });
+}
+
+void LoadSession::next_key() {
+    if (state_ == State::CLOSED) return;
+    if (typed_ < command_.size()) {
+        expect_ = static_cast<uint8_t>(command_[typed_++]);
+        state_ = State::WANT_ECHO;
+        sent_at_ = Clock::now();
+        send_key(expect_);
+        return;
+    }
+    typed_ = 0;
+    state_ = State::WANT_PROMPT;
+    send_key('\r');
+    // While the burst runs, so the shell has nothing to redraw.
+    wide_ = !wide_;
+    uint8_t buf[control::kMaxEncodedSize];
+    size_t n = control::encode_winch(wide_ ? 50 : 40, wide_ ? 160 : 120, buf);
+    channel_->send_frame(framing::FrameType::CONTROL, buf, n);
+}
+
+void LoadSession::send_key(uint8_t key) {
+    // Keystrokes go out urgent, as the client sends them.
+    uint8_t buf[framing::HEADER_SIZE + 1];
+    buf[framing::HEADER_SIZE] = key;
+    channel_->send_frame_in_place(framing::FrameType::DATA, buf + framing::HEADER_SIZE, 1, SendPriority::URGENT);
+}
+
+void LoadSession::send_ping() {
+    ping_timer_ = 0;
+    uint8_t buf[control::kMaxEncodedSize];
+    auto now = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch());
+    size_t n = control::encode_ping(control::MsgType::PING, ping_seq_++, static_cast<uint64_t>(now.count()), buf);
+    channel_->send_frame(framing::FrameType::CONTROL, buf, n);
+    ping_timer_ = loop_.add_timer(kPingInterval, [this]() { send_ping(); });
+}
+
+void LoadSession::fail() {
+    if (state_ == State::CLOSED) return;
+    state_ = State::CLOSED;
+    driver_.failed++;
+    if (ping_timer_) loop_.cancel_timer(ping_timer_);
+    if (key_timer_) loop_.cancel_timer(key_timer_);
+    ping_timer_ = key_timer_ = 0;
+    std::fprintf(stderr, "session %d closed\n", index_);
+}
+
+// CPU seconds this process has used, all threads.
+static double own_cpu_seconds() {
+    rusage ru{};
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+// CPU seconds process pid has used, all threads; -1 if it can't be read.
+static double process_cpu_seconds(int pid) {
+    char path[64];
+    std::snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE* f = std::fopen(path, "r");
+    if (!f) return -1;
+    char buf[1024];
+    size_t n = std::fread(buf, 1, sizeof(buf) - 1, f);
+    std::fclose(f);
+    buf[n] = 0;
+    // Fields after the command name, which may hold spaces: state is the
+    // first, utime and stime the 12th and 13th.
+    const char* p = std::strrchr(buf, ')');
+    unsigned long long utime = 0;
+    unsigned long long stime = 0;
+    if (!p || std::sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+        return -1;
+    }
+    return static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double percentile_ms(const std::vector<uint32_t>& sorted, double q) {
+    if (sorted.empty()) return 0;
+    size_t i = std::min(sorted.size() - 1, static_cast<size_t>(q * sorted.size()));
+    return sorted[i] / 1000.0;
+}
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    std::string ip;
+    int port = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool more = i + 1 < argc;
+        if (arg == "--connect" && more) {
+            ip = argv[++i];
+        } else if (arg == "--port" && more) {
+            port = std::atoi(argv[++i]);
+        } else if (arg == "--sessions" && more) {
+            options.sessions = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--max-sessions" && more) {
+            options.max_sessions = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--step-seconds" && more) {
+            options.step_seconds = std::atoi(argv[++i]);
+        } else if (arg == "--threads" && more) {
+            options.threads = std::atoi(argv[++i]);
+        } else if (arg == "--burst-kb" && more) {
+            options.burst_kb = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--server-pid" && more) {
+            options.server_pid = std::atoi(argv[++i]);
+        } else if (arg == "--cert" && more) {
+            options.cert = argv[++i];
+        } else if (arg == "--key" && more) {
+            options.key = argv[++i];
+        } else if (arg == "--cacert" && more) {
+            options.ca = argv[++i];
+        }
+    }
+    options.addr.sin_family = AF_INET;
+    options.addr.sin_port = htons(static_cast<uint16_t>(port));
+    if (ip.empty() || port <= 0 || inet_pton(AF_INET, ip.c_str(), &options.addr.sin_addr) != 1 ||
+        options.sessions == 0 || options.step_seconds <= 0 || options.burst_kb == 0) {
+        std::fprintf(stderr, "usage: load-bench --connect IP --port PORT [--sessions N] [--max-sessions M] "
+                             "[--step-seconds S] [--threads T] [--burst-kb K] [--server-pid PID] "
+                             "[--cert c.pem --key k.pem] [--cacert ca.pem]\n");
+        return 1;
+    }
+    options.max_sessions = std::max(options.max_sessions, options.sessions);
+    if (options.threads <= 0) options.threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency() / 2));
+
+    std::vector<std::unique_ptr<Driver>> drivers;
+    for (int i = 0; i < options.threads; ++i) {
+        drivers.push_back(std::make_unique<Driver>(options));
+        if (!drivers.back()->start()) return 1;
+    }
+    auto total = [&drivers](std::atomic<size_t> Driver::*counter) {
+        size_t n = 0;
+        for (auto& d : drivers) n += (*d.*counter).load();
+        return n;
+    };
+
+    // srv_cpu is the server process; gen_cpu is this one, which should stay
+    // well short of its threads' worth for the numbers to be the server's.
+    std::printf("%8s %8s %9s %9s %9s %8s %8s %8s %8s %8s %7s\n", "sessions", "hs/s", "p50_ms", "p99_ms", "p999_ms",
+                "keys", "bursts", "MB/s", "srv_cpu", "gen_cpu", "failed");
+    size_t open = 0;
+    double baseline_p99 = -1;
+    size_t last_good = 0;
+    double last_good_p99 = 0;
+    int rc = 0;
+    for (size_t target = options.sessions; open < options.max_sessions; target *= 2) {
+        target = std::min(target, options.max_sessions);
+        size_t added = target - open;
+        size_t failed_before = total(&Driver::failed);
+        auto open_start = Clock::now();
+        for (size_t i = open; i < target; ++i) drivers[i % drivers.size()]->open(static_cast<int>(i));
+        // Handshake rate of this step's new sessions, which all start at once.
+        while (total(&Driver::handshakes) + total(&Driver::failed) - failed_before < target &&
+               Clock::now() - open_start < kOpenTimeout) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        double open_seconds = seconds_since(open_start);
+        // Measured once every shell has reached its prompt.
+        while (total(&Driver::ready) + total(&Driver::failed) < target && Clock::now() - open_start < kOpenTimeout) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        open = target;
+        for (auto& d : drivers) d->collect();
+
+        double server_before = options.server_pid > 0 ? process_cpu_seconds(options.server_pid) : -1;
+        double own_before = own_cpu_seconds();
+        auto step_start = Clock::now();
+        std::this_thread::sleep_for(std::chrono::seconds(options.step_seconds));
+        Sample step;
+        for (auto& d : drivers) {
+            Sample s = d->collect();
+            step.echo_us.insert(step.echo_us.end(), s.echo_us.begin(), s.echo_us.end());
+            step.bytes += s.bytes;
+            step.bursts += s.bursts;
+        }
+        double step_seconds = seconds_since(step_start);
+        double server_after = server_before >= 0 ? process_cpu_seconds(options.server_pid) : -1;
+        double own = own_cpu_seconds() - own_before;
+        std::sort(step.echo_us.begin(), step.echo_us.end());
+        double p99 = percentile_ms(step.echo_us, 0.99);
+        size_t failed = total(&Driver::failed) - failed_before;
+
+        char server_col[16] = "-";
+        if (server_before >= 0 && server_after >= 0) {
+            std::snprintf(server_col, sizeof(server_col), "%.0f%%", 100 * (server_after - server_before) / step_seconds);
+        }
+        char own_col[16];
+        std::snprintf(own_col, sizeof(own_col), "%.0f%%", 100 * own / step_seconds);
+        std::printf("%8zu %8.0f %9.2f %9.2f %9.2f %8zu %8llu %8.2f %8s %8s %7zu\n", target, added / open_seconds,
+                    percentile_ms(step.echo_us, 0.5), p99, percentile_ms(step.echo_us, 0.999), step.echo_us.size(),
+                    (unsigned long long)step.bursts, step.bytes / step_seconds / (1024 * 1024), server_col, own_col,
+                    failed);
+        std::fflush(stdout);
+
+        if (step.echo_us.empty()) {
+            std::fprintf(stderr, "No echoes at %zu sessions; is the server running with --max-sessions %zu?\n", target,
+                         options.max_sessions);
+            rc = 1;
+            break;
+        }
+        if (baseline_p99 < 0) baseline_p99 = p99;
+        if (failed > 0 || (p99 > baseline_p99 * kKneeFactor && p99 > baseline_p99 + kKneeMarginMs)) {
+            if (last_good == 0) {
+                std::printf("Knee: below %zu sessions%s\n", target, failed > 0 ? ", with sessions failing" : "");
+            } else {
+                std::printf("Knee: p99 went from %.2f ms at %zu sessions to %.2f ms at %zu%s\n", last_good_p99,
+                            last_good, p99, target, failed > 0 ? ", with sessions failing" : "");
+            }
+            break;
+        }
+        last_good = target;
+        last_good_p99 = p99;
+    }
+    if (rc == 0 && last_good == open) std::printf("No knee up to %zu sessions\n", open);
+
+    for (auto& d : drivers) d->stop();
+    return rc;
+}
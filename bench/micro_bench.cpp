@@ -0,0 +1,379 @@
+// Microbenchmarks for the per-byte data path: framing, header decode,
+// --mirror-clean filtering, control message parsing, metrics updates,
+// session recording, the egress queue and TLS record protection. Every case prints one JSON
+// object per line,
+//
+//   {"bench":"build_frame","bytes":4096,"ops":...,"ns_per_op":...,
+//    "ns_per_byte":...,"allocs_per_op":...}
+//
+// so runs can be diffed or collected over time. Allocations are counted
+// through operator new, plus the buffers the pool had to take from the
+// heap; mbedTLS allocates with calloc and isn't counted.
+// The TLS cases run two TLSWrappers over an in-memory pipe, so they time
+// record encryption and decryption without sockets.
+//
+//   secure-tunnel-bench [cert.pem key.pem [min_ms]]
+
+#include "ansi_filter.hpp"
+#include "buffer_pool.hpp"
+#include "control_codec.hpp"
+#include "egress_queue.hpp"
+#include "framing.hpp"
+#include "metrics.hpp"
+#include "nlohmann/json.hpp"
+#include "session_recording.hpp"
+#include "tls_wrapper.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+static std::atomic<uint64_t> g_allocs{0};
+
+void* operator new(size_t n) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+static uint64_t allocations() {
+    return g_allocs.load(std::memory_order_relaxed) + buffer_pool::stats().heap_allocations;
+}
+
+using Clock = std::chrono::steady_clock;
+
+static std::chrono::milliseconds g_min_time(200);
+// Keeps results alive so the compiler can't drop the work.
+static volatile uint64_t g_sink = 0;
+
+static void report(const char* bench, size_t bytes, uint64_t ops, double ns, uint64_t allocs) {
+    std::printf("{\"bench\":\"%s\",\"bytes\":%zu,\"ops\":%llu,\"ns_per_op\":%.1f,\"ns_per_byte\":%.4f,"
+                "\"allocs_per_op\":%.3f}\n",
+                bench, bytes, (unsigned long long)ops, ns / ops, bytes ? ns / ops / bytes : 0.0,
+                static_cast<double>(allocs) / ops);
+    std::fflush(stdout);
+}
+
+// Runs op in batches until g_min_time has passed; op() returns the work it
+// did, folded into g_sink.
+template <typename Op>
+static void run(const char* bench, size_t bytes, Op op) {
+    for (int i = 0; i < 16; ++i) g_sink += op();
+    uint64_t ops = 0;
+    uint64_t allocs = allocations();
+    auto start = Clock::now();
+    auto end = start;
+    do {
+        for (int i = 0; i < 64; ++i) g_sink += op();
+        ops += 64;
+        end = Clock::now();
+    } while (end - start < g_min_time);
+    allocs = allocations() - allocs;
+    report(bench, bytes, ops, std::chrono::duration<double, std::nano>(end - start).count(), allocs);
+}
+
+static std::vector<uint8_t> payload_of(size_t n) {
+    std::vector<uint8_t> p(n);
+    for (size_t i = 0; i < n; ++i) p[i] = static_cast<uint8_t>('a' + i % 26);
+    return p;
+}
+
+static void bench_build_frame(size_t n) {
+    std::vector<uint8_t> payload = payload_of(n);
+    run("build_frame", n, [&]() {
+        std::vector<uint8_t> frame = framing::build_frame(framing::FrameType::DATA, payload);
+        return frame.back();
+    });
+}
+
+// Frames decoded the way TLSChannel reads them: next_size() bytes at a time
+// out of what one record delivered.
+static void bench_decode(size_t n) {
+    std::vector<uint8_t> payload = payload_of(n);
+    std::vector<uint8_t> stream;
+    for (int i = 0; i < 64; ++i) {
+        std::vector<uint8_t> frame = framing::build_frame(framing::FrameType::DATA, payload);
+        stream.insert(stream.end(), frame.begin(), frame.end());
+    }
+    framing::FrameDecoder decoder;
+    size_t off = 0;
+    run("frame_decode", n, [&]() {
+        for (;;) {
+            if (off == stream.size()) off = 0;
+            size_t take = std::min(decoder.next_size(), stream.size() - off);
+            std::memcpy(decoder.next_buffer(), stream.data() + off, take);
+            off += take;
+            if (decoder.advance(take)) return static_cast<uint64_t>(decoder.payload().size());
+        }
+    });
+}
+
+// Shell output with colours, cursor moves and a title, as --mirror-clean
+// sees it. AnsiFilter replaced make_clean_cmd_out() on that path.
+static void bench_clean(size_t n) {
+    static const char kLine[] =
+        "\x1b[01;34mdrwxr-xr-x\x1b[0m  2 user user 4096 Oct 17 12:00 \x1b[01;32mbuild\x1b[0m\r\n"
+        "\x1b]0;user@host: ~/src\x07\x1b[?2004h\x1b[32muser@host\x1b[0m:\x1b[34m~/src\x1b[0m$ make -j8\r\n"
+        "[ 42%] Building CXX object CMakeFiles/secure-tunnel.dir/src/io_bridge.cpp.o\r\n";
+    std::vector<uint8_t> in;
+    while (in.size() < n) in.insert(in.end(), kLine, kLine + sizeof(kLine) - 1);
+    in.resize(n);
+    AnsiFilter filter;
+    std::vector<uint8_t> out;
+    out.reserve(n);
+    run("ansi_clean", n, [&]() {
+        out.clear();
+        filter.filter(in.data(), in.size(), out);
+        return static_cast<uint64_t>(out.size());
+    });
+}
+
+// The JSON winch older peers still send, parsed the way the server does,
+// next to the binary message that replaced it.
+static void bench_winch() {
+    std::string text = "{\"type\":\"winch\",\"rows\":50,\"cols\":200}";
+    run("winch_json", text.size(), [&]() {
+        auto msg = nlohmann::json::parse(text);
+        return static_cast<uint64_t>(msg.value("rows", 24) + msg.value("cols", 80));
+    });
+    uint8_t buf[control::kMaxEncodedSize];
+    size_t len = control::encode_winch(50, 200, buf);
+    run("winch_binary", len, [&]() {
+        control::Message msg;
+        control::decode(buf, len, msg);
+        return static_cast<uint64_t>(msg.winch.rows + msg.winch.cols);
+    });
+}
+
+// What the metrics cost each frame on the data path: two counters and a
+// frame-size histogram sample.
+static void bench_metrics() {
+    auto stats = std::make_unique<TrafficStats>();
+    uint64_t size = 1;
+    run("metrics_frame", 0, [&]() {
+        size = size * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint64_t n = size >> 50;
+        stats_add(stats->bytes_out, n);
+        stats_add(stats->frames_out, 1);
+        stats->frame_bytes_out.record(n);
+        return n;
+    });
+}
+
+// What --record-dir costs the loop thread per PTY read: appending the
+// bytes to the chunk being filled, and handing off a full one. Deflating
+// and writing happen on the recorder's own thread; this outruns it, so
+// past its queue limit chunks are dropped, which the loop thread never
+// waits for either way.
+static void bench_recorder(size_t n) {
+    static const char kPath[] = "secure-tunnel-bench.strec";
+    std::remove(kPath);
+    auto recorder = SessionRecorder::create(kPath, "bench", 24, 80);
+    if (!recorder) return;
+    std::vector<uint8_t> payload = payload_of(n);
+    run("record_output", n, [&]() {
+        recorder->output(payload.data(), payload.size());
+        return payload[0];
+    });
+    recorder.reset();
+    std::remove(kPath);
+}
+
+// A frame pushed to an EgressQueue and drained, as shell output and
+// forwarded data reach a connection's owner. On one thread, and then with
+// a producer thread pushing while this one drains, so buffers are freed
+// on another thread than the one that took them. Once warm, neither
+// should touch the heap.
+static void bench_egress(size_t n) {
+    std::vector<uint8_t> payload = payload_of(n);
+    EgressQueue queue;
+    uint64_t last = 0;
+    auto take = [&last](EgressQueue::Frame& frame) { last += frame.bytes.data()[frame.bytes.size() - 1]; };
+    run("egress_frame", n, [&]() {
+        queue.push(framing::FrameType::DATA, payload.data(), payload.size(), SendPriority::BULK);
+        queue.drain(take);
+        return last;
+    });
+
+    // The producer pushes up to `wanted` frames, keeping no more than
+    // 256 KB queued, as the PTY pump does.
+    std::atomic<uint64_t> wanted{0};
+    std::atomic<bool> done{false};
+    std::thread producer([&]() {
+        uint64_t pushed = 0;
+        while (!done.load(std::memory_order_relaxed)) {
+            if (pushed == wanted.load(std::memory_order_acquire) || queue.queued_bytes() >= 256 * 1024) {
+                std::this_thread::yield();
+                continue;
+            }
+            queue.push(framing::FrameType::DATA, payload.data(), payload.size(), SendPriority::BULK);
+            ++pushed;
+        }
+    });
+    uint64_t drained = 0;
+    auto take_counted = [&drained](EgressQueue::Frame& frame) { drained += frame.bytes.size() > 0; };
+    auto round = [&](uint64_t frames) {
+        wanted.fetch_add(frames, std::memory_order_release);
+        uint64_t until = drained + frames;
+        for (;;) {
+            queue.drain(take_counted);
+            if (drained >= until) break;
+            std::this_thread::yield();
+        }
+    };
+    for (int i = 0; i < 16; ++i) round(4096);
+    uint64_t frames = 0;
+    uint64_t allocs = allocations();
+    auto start = Clock::now();
+    auto end = start;
+    do {
+        round(4096);
+        frames += 4096;
+        end = Clock::now();
+    } while (end - start < g_min_time);
+    allocs = allocations() - allocs;
+    done = true;
+    producer.join();
+    report("egress_frame_xthread", n, frames, std::chrono::duration<double, std::nano>(end - start).count(), allocs);
+}
+
+// One direction of an in-memory transport. Its buffer keeps its capacity,
+// so the steady state doesn't allocate.
+struct MemPipe {
+    std::vector<uint8_t> buf;
+    size_t off = 0;
+};
+
+struct MemEnd {
+    MemPipe* out;
+    MemPipe* in;
+};
+
+static int mem_send(void* ctx, const unsigned char* p, size_t n) {
+    MemPipe* out = static_cast<MemEnd*>(ctx)->out;
+    out->buf.insert(out->buf.end(), p, p + n);
+    return static_cast<int>(n);
+}
+
+static int mem_recv(void* ctx, unsigned char* p, size_t n) {
+    MemPipe* in = static_cast<MemEnd*>(ctx)->in;
+    size_t avail = in->buf.size() - in->off;
+    if (avail == 0) return MBEDTLS_ERR_SSL_WANT_READ;
+    n = std::min(n, avail);
+    std::memcpy(p, in->buf.data() + in->off, n);
+    in->off += n;
+    if (in->off == in->buf.size()) {
+        in->buf.clear();
+        in->off = 0;
+    }
+    return static_cast<int>(n);
+}
+
+struct MemLink {
+    MemPipe to_server;
+    MemPipe to_client;
+    MemEnd server_end{&to_client, &to_server};
+    MemEnd client_end{&to_server, &to_client};
+    TLSWrapper server;
+    TLSWrapper client;
+
+    bool connect(const char* cert, const char* key) {
+        if (!server.configure_ssl(true, cert, key, "") || !client.configure_ssl(false, "", "", "")) return false;
+        server.attach_bio(&server_end, mem_send, mem_recv);
+        client.attach_bio(&client_end, mem_send, mem_recv);
+        // Both ends step in turn until neither is waiting on the other.
+        bool client_done = false;
+        bool server_done = false;
+        for (int i = 0; i < 1000 && !(client_done && server_done); ++i) {
+            if (!client_done) {
+                int r = client.continue_handshake();
+                if (r == 0) client_done = true;
+                else if (r != MBEDTLS_ERR_SSL_WANT_READ && r != MBEDTLS_ERR_SSL_WANT_WRITE) return false;
+            }
+            if (!server_done) {
+                int r = server.continue_handshake();
+                if (r == 0) server_done = true;
+                else if (r != MBEDTLS_ERR_SSL_WANT_READ && r != MBEDTLS_ERR_SSL_WANT_WRITE) return false;
+            }
+        }
+        return client_done && server_done;
+    }
+};
+
+// Records are written in batches of kBatch, then read back, timing each
+// half on its own.
+static void bench_tls(MemLink& link, size_t n) {
+    static const int kBatch = 64;
+    std::vector<uint8_t> out = payload_of(n);
+    std::vector<uint8_t> in(n);
+    link.to_server.buf.reserve(kBatch * (n + 64));
+    double write_ns = 0;
+    double read_ns = 0;
+    uint64_t write_allocs = 0;
+    uint64_t read_allocs = 0;
+    uint64_t ops = 0;
+    auto deadline = Clock::now() + g_min_time;
+    bool ok = true;
+    while (ok && Clock::now() < deadline) {
+        uint64_t a0 = g_allocs.load(std::memory_order_relaxed);
+        auto t0 = Clock::now();
+        for (int i = 0; i < kBatch && ok; ++i) ok = link.client.tls_write(out.data(), n) == static_cast<int>(n);
+        auto t1 = Clock::now();
+        uint64_t a1 = g_allocs.load(std::memory_order_relaxed);
+        for (int i = 0; i < kBatch && ok; ++i) {
+            size_t got = 0;
+            while (ok && got < n) {
+                int r = link.server.tls_read(in.data() + got, n - got);
+                ok = r > 0;
+                if (ok) got += static_cast<size_t>(r);
+            }
+            g_sink += in[n - 1];
+        }
+        auto t2 = Clock::now();
+        read_allocs += g_allocs.load(std::memory_order_relaxed) - a1;
+        write_allocs += a1 - a0;
+        write_ns += std::chrono::duration<double, std::nano>(t1 - t0).count();
+        read_ns += std::chrono::duration<double, std::nano>(t2 - t1).count();
+        ops += kBatch;
+    }
+    if (!ok) {
+        std::fprintf(stderr, "TLS write/read of %zu bytes failed\n", n);
+        return;
+    }
+    report("tls_write", n, ops, write_ns, write_allocs);
+    report("tls_read", n, ops, read_ns, read_allocs);
+}
+
+int main(int argc, char* argv[]) {
+    const char* cert = argc > 2 ? argv[1] : "cert.pem";
+    const char* key = argc > 2 ? argv[2] : "key.pem";
+    if (argc > 3) g_min_time = std::chrono::milliseconds(std::strtoul(argv[3], nullptr, 10));
+
+    for (size_t n : {64, 4096, 16384}) bench_build_frame(n);
+    for (size_t n : {64, 4096, 16384}) bench_decode(n);
+    for (size_t n : {4096, 65536}) bench_clean(n);
+    bench_winch();
+    bench_metrics();
+    for (size_t n : {64, 4096, 16384}) bench_egress(n);
+    for (size_t n : {64, 4096}) bench_recorder(n);
+
+    MemLink link;
+    if (!link.connect(cert, key)) {
+        std::fprintf(stderr, "TLS cases skipped: no handshake with %s and %s\n", cert, key);
+        return 1;
+    }
+    size_t record = link.client.max_record_payload();
+    for (size_t n : {size_t(64), size_t(1024), record}) bench_tls(link, n);
+    return 0;
+}
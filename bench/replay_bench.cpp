@@ -0,0 +1,393 @@
+// Replays recorded terminal traces (see trace-capture) through the session
+// pipeline as fast as it will go, one stage at a time, so each stage's
+// throughput is measured on real terminal output rather than synthetic
+// bytes:
+//
+//   filter     --mirror-clean's AnsiFilter over each PTY read
+//   frame      OutputCoalescer packing reads into DATA frames, with flushes
+//              timed by the trace's own clock
+//   deflate    FrameCompressor over those frames, as a session that agreed
+//              to compression sends them
+//   tls_write  the frames sealed into TLS records
+//   tls_read   the records opened again
+//   decode     the client's FrameDecoder and FrameDecompressor
+//
+// Throughput is in trace bytes, so stages compare directly. Each trace gets
+// a summary line and one line per stage, as JSON for diffing between
+// versions. The decode stage checks the output matches the trace.
+//
+//   replay-bench [--cert cert.pem --key key.pem] [--min-ms N] trace...
+
+#include "ansi_filter.hpp"
+#include "compression.hpp"
+#include "framing.hpp"
+#include "output_coalescer.hpp"
+#include "terminal_trace.hpp"
+#include "tls_wrapper.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static std::chrono::milliseconds g_min_time(200);
+
+struct Trace {
+    std::string name;
+    // PTY reads and when they happened, relative to the first.
+    std::vector<std::vector<uint8_t>> reads;
+    std::vector<std::chrono::microseconds> at;
+    uint64_t bytes = 0;
+};
+
+// Frames as a flat buffer with the offset each one ends at.
+struct Frames {
+    std::vector<uint8_t> bytes;
+    std::vector<size_t> ends;
+
+    void clear() {
+        bytes.clear();
+        ends.clear();
+    }
+    void add(const uint8_t* data, size_t len) {
+        bytes.insert(bytes.end(), data, data + len);
+        ends.push_back(bytes.size());
+    }
+};
+
+static bool load(const std::string& path, Trace& trace) {
+    TraceReader reader;
+    if (!reader.open(path)) return false;
+    trace.name = path.substr(path.find_last_of('/') + 1);
+    TraceEvent event;
+    std::chrono::microseconds clock(0);
+    while (reader.next(event)) {
+        clock += event.delay;
+        if (event.type != TraceEvent::Type::OUTPUT || event.data.empty()) continue;
+        trace.bytes += event.data.size();
+        trace.reads.push_back(std::move(event.data));
+        trace.at.push_back(clock);
+    }
+    return !reader.error() && trace.bytes > 0;
+}
+
+static void report(const Trace& trace, const char* stage, double ns, uint64_t passes) {
+    double per_pass = ns / passes;
+    std::printf("{\"trace\":\"%s\",\"stage\":\"%s\",\"mb_per_s\":%.1f,\"ns_per_byte\":%.3f}\n", trace.name.c_str(),
+                stage, trace.bytes / (per_pass / 1e9) / (1024 * 1024), per_pass / trace.bytes);
+    std::fflush(stdout);
+}
+
+// Runs pass() over the whole trace until g_min_time has passed.
+template <typename Pass>
+static void run(const Trace& trace, const char* stage, Pass pass) {
+    pass();
+    uint64_t passes = 0;
+    auto start = Clock::now();
+    auto end = start;
+    do {
+        pass();
+        ++passes;
+        end = Clock::now();
+    } while (end - start < g_min_time);
+    report(trace, stage, std::chrono::duration<double, std::nano>(end - start).count(), passes);
+}
+
+// Packs the reads into DATA payloads the way ServerBridge does: a full
+// frame goes at once, and after each read the coalescer says whether to
+// flush or how long to hold, which the next read's timestamp settles.
+static void coalesce(const Trace& trace, size_t max_payload, Frames& out) {
+    out.clear();
+    OutputCoalescer coalescer(max_payload);
+    // Far from the clock's epoch, which the coalescer reads as "never".
+    const Clock::time_point base = Clock::time_point() + std::chrono::hours(1);
+    bool armed = false;
+    Clock::time_point deadline;
+    auto flush = [&]() {
+        if (coalescer.empty()) return;
+        out.add(coalescer.data(), coalescer.size());
+        coalescer.flushed();
+    };
+    for (size_t i = 0; i < trace.reads.size(); ++i) {
+        Clock::time_point now = base + trace.at[i];
+        if (armed && now >= deadline) {
+            // The flush timer fired before this read, with nothing new.
+            armed = false;
+            flush();
+            coalescer.idle();
+        }
+        const std::vector<uint8_t>& read = trace.reads[i];
+        for (size_t off = 0; off < read.size();) {
+            if (coalescer.room() == 0) flush();
+            size_t n = std::min(coalescer.room(), read.size() - off);
+            std::memcpy(coalescer.tail(), read.data() + off, n);
+            coalescer.commit(n);
+            off += n;
+        }
+        auto delay = coalescer.flush_delay(now);
+        if (delay.count() == 0) {
+            armed = false;
+            flush();
+        } else if (!armed) {
+            armed = true;
+            deadline = now + delay;
+        }
+    }
+    flush();
+}
+
+// Frames the payloads as they go on the wire: DATA_COMPRESSED where the
+// compressor takes them, DATA otherwise.
+static bool deflate_frames(const Frames& payloads, Frames& out) {
+    out.clear();
+    FrameCompressor compressor;
+    if (!compressor.init(framing::HEADER_SIZE)) return false;
+    std::vector<uint8_t> frame;
+    size_t start = 0;
+    for (size_t end : payloads.ends) {
+        const uint8_t* data = payloads.bytes.data() + start;
+        size_t len = end - start;
+        start = end;
+        if (compressor.worth_compressing(len)) {
+            size_t zlen = 0;
+            uint8_t* z = compressor.compress(data, len, zlen);
+            if (!z) return false;
+            out.add(framing::frame_in_place(framing::FrameType::DATA_COMPRESSED, z, zlen), framing::HEADER_SIZE + zlen);
+        } else {
+            frame.resize(framing::HEADER_SIZE + len);
+            framing::write_header(framing::FrameType::DATA, len, frame.data());
+            std::memcpy(frame.data() + framing::HEADER_SIZE, data, len);
+            out.add(frame.data(), frame.size());
+        }
+    }
+    return true;
+}
+
+// Feeds the byte stream to a FrameDecoder as TLSChannel does and inflates
+// what needs it. Returns the terminal bytes recovered, or -1 on a bad frame.
+static int64_t decode(const std::vector<uint8_t>& stream, std::vector<uint8_t>* out) {
+    framing::FrameDecoder decoder;
+    FrameDecompressor decompressor;
+    if (!decompressor.init()) return -1;
+    int64_t total = 0;
+    auto sink = [&](const uint8_t* data, size_t len) {
+        total += static_cast<int64_t>(len);
+        if (out) out->insert(out->end(), data, data + len);
+    };
+    for (size_t off = 0; off < stream.size();) {
+        size_t take = std::min(decoder.next_size(), stream.size() - off);
+        std::memcpy(decoder.next_buffer(), stream.data() + off, take);
+        off += take;
+        if (!decoder.advance(take)) {
+            if (decoder.error()) return -1;
+            continue;
+        }
+        const std::vector<uint8_t>& payload = decoder.payload();
+        if (decoder.type() == (uint8_t)framing::FrameType::DATA) {
+            sink(payload.data(), payload.size());
+        } else if (!decompressor.decompress(payload.data(), payload.size(), sink)) {
+            return -1;
+        }
+    }
+    return total;
+}
+
+// One direction of an in-memory transport for the TLS stages.
+struct MemPipe {
+    std::vector<uint8_t> buf;
+    size_t off = 0;
+};
+
+struct MemEnd {
+    MemPipe* out;
+    MemPipe* in;
+};
+
+static int mem_send(void* ctx, const unsigned char* p, size_t n) {
+    MemPipe* out = static_cast<MemEnd*>(ctx)->out;
+    out->buf.insert(out->buf.end(), p, p + n);
+    return static_cast<int>(n);
+}
+
+static int mem_recv(void* ctx, unsigned char* p, size_t n) {
+    MemPipe* in = static_cast<MemEnd*>(ctx)->in;
+    size_t avail = in->buf.size() - in->off;
+    if (avail == 0) return MBEDTLS_ERR_SSL_WANT_READ;
+    n = std::min(n, avail);
+    std::memcpy(p, in->buf.data() + in->off, n);
+    in->off += n;
+    if (in->off == in->buf.size()) {
+        in->buf.clear();
+        in->off = 0;
+    }
+    return static_cast<int>(n);
+}
+
+// Server and client TLSWrappers handshaken over a pair of MemPipes.
+struct MemLink {
+    MemPipe to_server;
+    MemPipe to_client;
+    MemEnd server_end{&to_client, &to_server};
+    MemEnd client_end{&to_server, &to_client};
+    TLSWrapper server;
+    TLSWrapper client;
+
+    bool connect(const std::string& cert, const std::string& key) {
+        if (!server.configure_ssl(true, cert, key, "") || !client.configure_ssl(false, "", "", "")) return false;
+        server.attach_bio(&server_end, mem_send, mem_recv);
+        client.attach_bio(&client_end, mem_send, mem_recv);
+        bool client_done = false;
+        bool server_done = false;
+        for (int i = 0; i < 1000 && !(client_done && server_done); ++i) {
+            if (!client_done) {
+                int r = client.continue_handshake();
+                if (r == 0) client_done = true;
+                else if (r != MBEDTLS_ERR_SSL_WANT_READ && r != MBEDTLS_ERR_SSL_WANT_WRITE) return false;
+            }
+            if (!server_done) {
+                int r = server.continue_handshake();
+                if (r == 0) server_done = true;
+                else if (r != MBEDTLS_ERR_SSL_WANT_READ && r != MBEDTLS_ERR_SSL_WANT_WRITE) return false;
+            }
+        }
+        return client_done && server_done;
+    }
+};
+
+// Server to client, a record per frame as TLSChannel writes them.
+static bool seal(MemLink& link, const Frames& wire) {
+    size_t start = 0;
+    for (size_t end : wire.ends) {
+        while (start < end) {
+            int w = link.server.tls_write(wire.bytes.data() + start, end - start);
+            if (w <= 0) return false;
+            start += static_cast<size_t>(w);
+        }
+    }
+    return true;
+}
+
+static bool open_all(MemLink& link, size_t len, std::vector<uint8_t>& out) {
+    out.resize(len);
+    for (size_t got = 0; got < len;) {
+        int r = link.client.tls_read(out.data() + got, len - got);
+        if (r <= 0) return false;
+        got += static_cast<size_t>(r);
+    }
+    return true;
+}
+
+static bool replay(const Trace& trace, MemLink* link) {
+    size_t record = link ? link->server.max_record_payload() : 16384;
+    size_t max_payload = record - framing::HEADER_SIZE;
+
+    AnsiFilter filter;
+    std::vector<uint8_t> cleaned;
+    run(trace, "filter", [&]() {
+        filter.reset();
+        for (const auto& read : trace.reads) {
+            cleaned.clear();
+            filter.filter(read.data(), read.size(), cleaned);
+        }
+    });
+
+    Frames payloads;
+    run(trace, "frame", [&]() { coalesce(trace, max_payload, payloads); });
+    Frames wire;
+    bool ok = true;
+    run(trace, "deflate", [&]() { ok = deflate_frames(payloads, wire) && ok; });
+    if (!ok) {
+        std::fprintf(stderr, "%s: deflate failed\n", trace.name.c_str());
+        return false;
+    }
+    std::printf("{\"trace\":\"%s\",\"bytes\":%llu,\"reads\":%zu,\"frames\":%zu,\"avg_frame\":%.0f,"
+                "\"wire_bytes\":%zu,\"wire_ratio\":%.3f}\n",
+                trace.name.c_str(), (unsigned long long)trace.bytes, trace.reads.size(), payloads.ends.size(),
+                static_cast<double>(payloads.bytes.size()) / payloads.ends.size(), wire.bytes.size(),
+                static_cast<double>(wire.bytes.size()) / trace.bytes);
+
+    if (link) {
+        // Sealed records are read back after every pass, so the pipe
+        // doesn't grow; each half is timed on its own.
+        std::vector<uint8_t> opened;
+        double write_ns = 0;
+        double read_ns = 0;
+        uint64_t passes = 0;
+        auto deadline = Clock::now() + g_min_time;
+        while (ok && (passes == 0 || Clock::now() < deadline)) {
+            auto t0 = Clock::now();
+            ok = seal(*link, wire);
+            auto t1 = Clock::now();
+            ok = ok && open_all(*link, wire.bytes.size(), opened);
+            auto t2 = Clock::now();
+            write_ns += std::chrono::duration<double, std::nano>(t1 - t0).count();
+            read_ns += std::chrono::duration<double, std::nano>(t2 - t1).count();
+            ++passes;
+        }
+        if (!ok || opened != wire.bytes) {
+            std::fprintf(stderr, "%s: TLS round trip failed\n", trace.name.c_str());
+            return false;
+        }
+        report(trace, "tls_write", write_ns, passes);
+        report(trace, "tls_read", read_ns, passes);
+    }
+
+    std::vector<uint8_t> shown;
+    if (decode(wire.bytes, &shown) != static_cast<int64_t>(trace.bytes)) {
+        std::fprintf(stderr, "%s: decoded output differs from the trace\n", trace.name.c_str());
+        return false;
+    }
+    size_t off = 0;
+    for (const auto& read : trace.reads) {
+        if (std::memcmp(shown.data() + off, read.data(), read.size()) != 0) {
+            std::fprintf(stderr, "%s: decoded output differs from the trace\n", trace.name.c_str());
+            return false;
+        }
+        off += read.size();
+    }
+    run(trace, "decode", [&]() { ok = decode(wire.bytes, nullptr) >= 0 && ok; });
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    std::string cert = "cert.pem";
+    std::string key = "key.pem";
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--cert" && i + 1 < argc) {
+            cert = argv[++i];
+        } else if (arg == "--key" && i + 1 < argc) {
+            key = argv[++i];
+        } else if (arg == "--min-ms" && i + 1 < argc) {
+            g_min_time = std::chrono::milliseconds(std::strtoul(argv[++i], nullptr, 10));
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.empty()) {
+        std::fprintf(stderr, "usage: replay-bench [--cert cert.pem --key key.pem] [--min-ms N] trace...\n");
+        return 1;
+    }
+
+    MemLink link;
+    bool tls = link.connect(cert, key);
+    if (!tls) std::fprintf(stderr, "TLS stages skipped: no handshake with %s and %s\n", cert.c_str(), key.c_str());
+
+    int rc = tls ? 0 : 1;
+    for (const auto& path : paths) {
+        Trace trace;
+        if (!load(path, trace)) {
+            std::fprintf(stderr, "%s: not a trace, or empty\n", path.c_str());
+            rc = 1;
+            continue;
+        }
+        if (!replay(trace, tls ? &link : nullptr)) rc = 1;
+    }
+    return rc;
+}
@@ -0,0 +1,151 @@
+// Records a program's terminal output, with timing, into a trace for
+// replay-bench. The program runs on a PTY of its own, like under script(1):
+// its output is shown as well as recorded, and this terminal's input and
+// window size go to it. Input can be piped in instead to script a session.
+//
+//   trace-capture out.trace [--size ROWSxCOLS] -- command [args...]
+
+#include "terminal_trace.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using Clock = std::chrono::steady_clock;
+
+static bool write_all(int fd, const uint8_t* data, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        data += w;
+        len -= static_cast<size_t>(w);
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    int cmd = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--") == 0) {
+            cmd = i + 1;
+            break;
+        }
+    }
+    if (argc < 2 || cmd == 0 || cmd >= argc) {
+        std::fprintf(stderr, "usage: trace-capture out.trace [--size ROWSxCOLS] -- command [args...]\n");
+        return 1;
+    }
+    std::string path = argv[1];
+
+    // The recording's size: as asked, else this terminal's, else 24x80.
+    winsize ws{};
+    bool follow = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 && ws.ws_col > 0;
+    if (!follow) {
+        ws.ws_row = 24;
+        ws.ws_col = 80;
+    }
+    for (int i = 2; i + 1 < cmd - 1; ++i) {
+        unsigned rows = 0;
+        unsigned cols = 0;
+        if (std::strcmp(argv[i], "--size") == 0 && std::sscanf(argv[i + 1], "%ux%u", &rows, &cols) == 2 && rows &&
+            cols) {
+            ws.ws_row = static_cast<unsigned short>(rows);
+            ws.ws_col = static_cast<unsigned short>(cols);
+            follow = false;
+        }
+    }
+
+    TraceWriter trace;
+    if (!trace.open(path, ws.ws_row, ws.ws_col)) {
+        std::fprintf(stderr, "cannot write %s\n", path.c_str());
+        return 1;
+    }
+
+    int master = -1;
+    pid_t child = forkpty(&master, nullptr, nullptr, &ws);
+    if (child < 0) {
+        std::perror("forkpty");
+        return 1;
+    }
+    if (child == 0) {
+        execvp(argv[cmd], argv + cmd);
+        std::perror(argv[cmd]);
+        _exit(127);
+    }
+
+    termios saved{};
+    bool raw = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &saved) == 0;
+    if (raw) {
+        termios t = saved;
+        cfmakeraw(&t);
+        tcsetattr(STDIN_FILENO, TCSANOW, &t);
+    }
+
+    uint8_t buf[65536];
+    uint64_t bytes = 0;
+    uint64_t events = 0;
+    bool input_open = true;
+    auto last = Clock::now();
+    auto started = last;
+    auto since_last = [&last]() {
+        auto now = Clock::now();
+        auto delay = std::chrono::duration_cast<std::chrono::microseconds>(now - last);
+        last = now;
+        return delay;
+    };
+    for (;;) {
+        pollfd fds[2] = {{master, POLLIN, 0}, {STDIN_FILENO, static_cast<short>(input_open ? POLLIN : 0), 0}};
+        // Wakes now and then to notice this terminal being resized.
+        int n = poll(fds, 2, follow ? 100 : -1);
+        if (n < 0 && errno != EINTR) break;
+        winsize now{};
+        if (follow && ioctl(STDOUT_FILENO, TIOCGWINSZ, &now) == 0 &&
+            (now.ws_row != ws.ws_row || now.ws_col != ws.ws_col)) {
+            ws = now;
+            ioctl(master, TIOCSWINSZ, &ws);
+            trace.write_resize(since_last(), ws.ws_row, ws.ws_col);
+            events++;
+        }
+        if (n <= 0) continue;
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t r = read(master, buf, sizeof(buf));
+            // EIO once the program and everything it started have exited.
+            if (r <= 0) break;
+            trace.write(TraceEvent::Type::OUTPUT, since_last(), buf, static_cast<size_t>(r));
+            write_all(STDOUT_FILENO, buf, static_cast<size_t>(r));
+            bytes += static_cast<uint64_t>(r);
+            events++;
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t r = read(STDIN_FILENO, buf, sizeof(buf));
+            if (r <= 0) {
+                // Piped input ran out: the program keeps going to the end.
+                input_open = false;
+            } else if (!write_all(master, buf, static_cast<size_t>(r))) {
+                break;
+            }
+        }
+    }
+
+    if (raw) tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    close(master);
+    int status = 0;
+    waitpid(child, &status, 0);
+    bool ok = trace.close();
+    double seconds = std::chrono::duration<double>(Clock::now() - started).count();
+    std::fprintf(stderr, "%s: %llu bytes in %llu events over %.1f s%s\n", path.c_str(), (unsigned long long)bytes,
+                 (unsigned long long)events, seconds, ok ? "" : " (write failed)");
+    return ok ? 0 : 1;
+}
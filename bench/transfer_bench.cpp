@@ -0,0 +1,222 @@
+// Loopback throughput of --send next to the raw TLSWrapper link it rides
+// on. The raw row streams records between two in-process peers over a
+// socketpair; the --send row pushes a file through FileTransfers on the same
+// kind of link, hashing it end to end and writing it to disk; the resumed
+// row repeats the transfer with half the file already in place. Files go
+// to a scratch directory under /tmp, which is removed afterwards.
+//
+//   transfer-bench [cert.pem key.pem [file_mb]]
+
+#include "channel_mux.hpp"
+#include "control_codec.hpp"
+#include "event_loop.hpp"
+#include "file_transfer.hpp"
+#include "tls_channel.hpp"
+#include "tls_wrapper.hpp"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// One end of the link, wired the way the session bridges wire theirs.
+struct Tunnel {
+    EventLoop loop;
+    TLSChannel channel;
+    ChannelMux mux;
+    FileTransfers transfers;
+
+    Tunnel(TLSWrapper& tls, bool client) : channel(loop, tls), mux(channel, client), transfers(mux, !client) {
+        channel.on_frame = [this](uint8_t type, const std::vector<uint8_t>& payload) {
+            control::Message msg;
+            if (type == (uint8_t)framing::FrameType::CONTROL && control::decode(payload.data(), payload.size(), msg)) {
+                mux.on_control(msg);
+            }
+        };
+        channel.on_channel_frame = [this](uint32_t id, uint8_t type, const std::vector<uint8_t>& payload) {
+            mux.on_frame(id, type, payload);
+        };
+        channel.on_drained = [this]() { mux.pump(); };
+        mux.on_open_request = [this](uint32_t id, uint8_t kind, const std::string& target, ChannelMux::Handler& handler) {
+            return transfers.accept(id, kind, target, handler);
+        };
+    }
+};
+
+// Two TLS peers joined by a socketpair, handshaken.
+struct Link {
+    int sv[2] = {-1, -1};
+    TLSWrapper server;
+    TLSWrapper client;
+
+    ~Link() {
+        if (sv[0] >= 0) close(sv[0]);
+        if (sv[1] >= 0) close(sv[1]);
+    }
+
+    bool connect(const char* cert, const char* key) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return false;
+        bool ready = server.configure_ssl(true, cert, key, "") && client.configure_ssl(false, "", "", "");
+        server.attach_socket(sv[0]);
+        client.attach_socket(sv[1]);
+        bool server_ok = false;
+        std::thread handshake([&]() { server_ok = ready && server.perform_handshake(); });
+        bool client_ok = ready && client.perform_handshake();
+        if (!client_ok) shutdown(sv[1], SHUT_RDWR);
+        handshake.join();
+        return client_ok && server_ok;
+    }
+};
+
+static double elapsed(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Seconds to stream bytes from client to server as full records, or -1.
+static double raw_round(const char* cert, const char* key, size_t bytes) {
+    Link link;
+    if (!link.connect(cert, key)) return -1;
+    size_t record = link.client.max_record_payload();
+    std::vector<uint8_t> out(record, 'x');
+    size_t received = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::thread reader([&]() {
+        std::vector<uint8_t> in(record);
+        while (received < bytes) {
+            int r = link.server.tls_read(in.data(), in.size());
+            if (r <= 0) return;
+            received += static_cast<size_t>(r);
+        }
+    });
+    for (size_t sent = 0; sent < bytes;) {
+        size_t n = std::min(record, bytes - sent);
+        if (link.client.tls_write_all(out.data(), n) < 0) break;
+        sent += n;
+    }
+    reader.join();
+    return received == bytes ? elapsed(start) : -1;
+}
+
+// Seconds to --send path into the working directory, or -1.
+static double send_round(const char* cert, const char* key, const std::string& path) {
+    Link link;
+    if (!link.connect(cert, key)) return -1;
+    Tunnel server(link.server, false);
+    Tunnel client(link.client, true);
+    if (!server.channel.start() || !client.channel.start()) return -1;
+    bool ok = false;
+    auto start = std::chrono::steady_clock::now();
+    double seconds = -1;
+    client.transfers.on_done = [&]() {
+        seconds = elapsed(start);
+        ok = !client.transfers.failed();
+        client.loop.stop();
+    };
+    client.loop.post([&]() {
+        if (!client.transfers.send(path)) client.loop.stop();
+    });
+    std::thread server_thread([&]() { server.loop.run(); });
+    client.loop.run();
+    server.loop.stop();
+    server_thread.join();
+    return ok ? seconds : -1;
+}
+
+static bool same_file(const std::string& a, const std::string& b) {
+    FILE* fa = std::fopen(a.c_str(), "rb");
+    FILE* fb = std::fopen(b.c_str(), "rb");
+    bool same = fa && fb;
+    std::vector<char> ba(1 << 20), bb(1 << 20);
+    while (same) {
+        size_t na = std::fread(ba.data(), 1, ba.size(), fa);
+        size_t nb = std::fread(bb.data(), 1, bb.size(), fb);
+        if (na != nb || std::memcmp(ba.data(), bb.data(), na) != 0) same = false;
+        if (na == 0) break;
+    }
+    if (fa) std::fclose(fa);
+    if (fb) std::fclose(fb);
+    return same;
+}
+
+int main(int argc, char* argv[]) {
+    const char* cert = argc > 2 ? argv[1] : "cert.pem";
+    const char* key = argc > 2 ? argv[2] : "key.pem";
+    size_t file_mb = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 256;
+    size_t bytes = file_mb * 1024 * 1024;
+
+    // Certificates are read before the working directory changes.
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) return 1;
+    std::string cert_path = cert[0] == '/' ? cert : std::string(cwd) + "/" + cert;
+    std::string key_path = key[0] == '/' ? key : std::string(cwd) + "/" + key;
+
+    char scratch[] = "/tmp/transfer-bench.XXXXXX";
+    if (!mkdtemp(scratch)) return 1;
+    std::string dir = scratch;
+    std::string source = dir + "/source.bin";
+    std::string out_dir = dir + "/out";
+    std::string received = out_dir + "/source.bin";
+    mkdir(out_dir.c_str(), 0700);
+
+    // Not compressible or repetitive, like most files worth sending.
+    FILE* f = std::fopen(source.c_str(), "wb");
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+    std::vector<uint64_t> block(1 << 17);
+    for (size_t done = 0; f && done < bytes; done += block.size() * 8) {
+        for (auto& word : block) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            word = x;
+        }
+        std::fwrite(block.data(), 1, std::min(block.size() * 8, bytes - done), f);
+    }
+    if (f) std::fclose(f);
+
+    int rc = 0;
+    std::printf("%12s %10s %10s %10s\n", "path", "MB", "seconds", "MB/s");
+    double raw = raw_round(cert_path.c_str(), key_path.c_str(), bytes);
+    if (raw > 0) {
+        std::printf("%12s %10zu %10.2f %10.1f\n", "raw TLS", file_mb, raw, file_mb / raw);
+    } else {
+        std::fprintf(stderr, "raw round failed; check %s and %s\n", cert, key);
+        rc = 1;
+    }
+
+    if (rc == 0 && chdir(out_dir.c_str()) == 0) {
+        double full = send_round(cert_path.c_str(), key_path.c_str(), source);
+        if (full > 0 && same_file(source, received)) {
+            std::printf("%12s %10zu %10.2f %10.1f\n", "--send", file_mb, full, file_mb / full);
+        } else {
+            std::fprintf(stderr, "--send round failed or the copy differs\n");
+            rc = 1;
+        }
+        // Half the file left from an interrupted transfer.
+        if (rc == 0 && rename(received.c_str(), (received + ".part").c_str()) == 0 &&
+            truncate((received + ".part").c_str(), static_cast<off_t>(bytes / 2)) == 0) {
+            double resumed = send_round(cert_path.c_str(), key_path.c_str(), source);
+            double mb = (bytes - bytes / 2) / (1024.0 * 1024.0);
+            if (resumed > 0 && same_file(source, received)) {
+                std::printf("%12s %10.0f %10.2f %10.1f\n", "resumed", mb, resumed, mb / resumed);
+            } else {
+                std::fprintf(stderr, "resumed round failed or the copy differs\n");
+                rc = 1;
+            }
+        }
+    }
+
+    unlink(received.c_str());
+    unlink((received + ".part").c_str());
+    unlink(source.c_str());
+    rmdir(out_dir.c_str());
+    rmdir(dir.c_str());
+    return rc;
+}
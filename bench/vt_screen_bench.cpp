@@ -0,0 +1,107 @@
+// Parse throughput of the server-side screen model, which sees every byte
+// a detachable shell writes, and the size and cost of the repaint sent on
+// reattach. Input is fed in 4 KB pieces, as the PTY is read.
+//
+//   vt-screen-bench [corpus_mb [rows cols]]
+
+#include "vt_screen.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+static const size_t kChunk = 4096;
+
+static std::vector<uint8_t> make_corpus(const std::string& kind, size_t size, int rows) {
+    std::mt19937 rng(42);
+    std::vector<uint8_t> out;
+    out.reserve(size + 4096);
+    auto put = [&](const std::string& s) { out.insert(out.end(), s.begin(), s.end()); };
+    const char* words[] = {"build", "src/tls_channel.cpp", "warning:", "compiling", "[ 42%]", "linking", "ok", "-O2"};
+    const char* utf8[] = {"h\xC3\xA9llo", "\xE2\x9C\x93", "\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E", "\xF0\x9F\x9A\x80", "na\xC3\xAFve"};
+    while (out.size() < size) {
+        if (kind == "plain") {
+            for (int w = 0; w < 10; ++w) { put(words[rng() % 8]); put(" "); }
+            put("\r\n");
+        } else if (kind == "color") {
+            for (int w = 0; w < 8; ++w) {
+                put("\x1b[01;3" + std::to_string(rng() % 8) + "m");
+                put(words[rng() % 8]);
+                put("\x1b[0m  ");
+            }
+            put("\r\n");
+        } else if (kind == "utf8") {
+            for (int w = 0; w < 10; ++w) { put(utf8[rng() % 5]); put(" "); put(words[rng() % 8]); put(" "); }
+            put("\r\n");
+        } else { // top-style full-screen redraw on the alternate screen
+            put("\x1b[?1049h\x1b]0;top - 10:00:00\x07\x1b[H\x1b[2J");
+            for (int row = 1; row < rows; ++row) {
+                put("\x1b[" + std::to_string(row) + ";1H\x1b[7m");
+                put(words[rng() % 8]);
+                put("\x1b[27m ");
+                put(utf8[rng() % 5]);
+                put("   12345 root 20 0 1.2g 3.4m S \x1b[38;5;" + std::to_string(rng() % 256) + "m0.3\x1b[39m 0.1 \x1b[K");
+            }
+        }
+    }
+    out.resize(size);
+    return out;
+}
+
+int main(int argc, char* argv[]) {
+    size_t mb = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 16;
+    int rows = argc > 3 ? std::atoi(argv[2]) : 50;
+    int cols = argc > 3 ? std::atoi(argv[3]) : 160;
+    const int reps = 4;
+    bool all_ok = true;
+
+    std::printf("%dx%d screen\n", rows, cols);
+    std::printf("%-8s %10s %14s %12s %12s %12s\n", "corpus", "MB/s", "repaint bytes", "repaint us", "chunk-safe",
+                "round-trip");
+    for (const char* kind : {"plain", "color", "utf8", "screen"}) {
+        auto corpus = make_corpus(kind, mb * 1024 * 1024, rows);
+
+        auto start = std::chrono::steady_clock::now();
+        VtScreen screen(rows, cols);
+        for (int r = 0; r < reps; ++r) {
+            for (size_t off = 0; off < corpus.size(); off += kChunk) {
+                screen.feed(corpus.data() + off, std::min(kChunk, corpus.size() - off));
+            }
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double mbps = static_cast<double>(corpus.size()) * reps / secs / (1024.0 * 1024.0);
+
+        // Reference state from the whole corpus in one call.
+        VtScreen whole(rows, cols);
+        whole.feed(corpus.data(), corpus.size());
+        std::vector<uint8_t> expected;
+        auto t0 = std::chrono::steady_clock::now();
+        whole.repaint(expected);
+        double repaint_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+
+        // Odd-sized pieces split escapes and UTF-8 everywhere.
+        VtScreen pieces(rows, cols);
+        for (size_t off = 0; off < corpus.size(); off += 7) {
+            pieces.feed(corpus.data() + off, std::min<size_t>(7, corpus.size() - off));
+        }
+        std::vector<uint8_t> got;
+        pieces.repaint(got);
+        bool chunk_safe = got == expected;
+
+        // A fresh terminal fed the repaint must end up in the same state.
+        VtScreen replayed(rows, cols);
+        replayed.feed(expected.data(), expected.size());
+        got.clear();
+        replayed.repaint(got);
+        bool round_trip = got == expected;
+
+        std::printf("%-8s %10.0f %14zu %12.0f %12s %12s\n", kind, mbps, expected.size(), repaint_us,
+                    chunk_safe ? "yes" : "NO", round_trip ? "yes" : "NO");
+        all_ok = all_ok && chunk_safe && round_trip;
+    }
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,311 @@
+#include "ansi_filter.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define ANSI_FILTER_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define ANSI_FILTER_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static const uint8_t ESC = 0x1B;
+
+// Bytes copied through untouched: printable ASCII plus tab, LF and CR.
+static inline bool is_plain(uint8_t c) {
+    return (c >= 0x20 && c <= 0x7E) || c == '\t' || c == '\n' || c == '\r';
+}
+
+static inline unsigned lowest_bit(unsigned mask) {
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanForward(&idx, mask);
+    return static_cast<unsigned>(idx);
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+static size_t scan_plain_scalar(const uint8_t* p, size_t n) {
+    size_t i = 0;
+    while (i < n && is_plain(p[i])) ++i;
+    return i;
+}
+
+#ifdef ANSI_FILTER_SSE2
+// Bit i set when byte i of v needs the state machine.
+static inline unsigned special_mask_sse2(__m128i v) {
+    // Signed compare: bytes >= 0x80 are negative, so they land in "< 0x20".
+    __m128i special = _mm_or_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(0x20)), _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F)));
+    __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')),
+                              _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+    return static_cast<unsigned>(_mm_movemask_epi8(_mm_andnot_si128(ws, special)));
+}
+
+static size_t scan_plain_sse2(const uint8_t* p, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        unsigned mask = special_mask_sse2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)));
+        if (mask != 0) return i + lowest_bit(mask);
+    }
+    return i + scan_plain_scalar(p + i, n - i);
+}
+#endif
+
+#ifdef ANSI_FILTER_AVX2
+__attribute__((target("avx2"))) static size_t scan_plain_avx2(const uint8_t* p, size_t n) {
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i del = _mm256_set1_epi8(0x7F);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        __m256i special = _mm256_or_si256(_mm256_cmpgt_epi8(space, v), _mm256_cmpeq_epi8(v, del));
+        __m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, tab),
+                                     _mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, cr)));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_andnot_si256(ws, special)));
+        if (mask != 0) return i + lowest_bit(mask);
+    }
+    return i + scan_plain_sse2(p + i, n - i);
+}
+
+static bool cpu_has_avx2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+AnsiFilter::AnsiFilter(ScanImpl impl) {
+    if (impl == ScanImpl::Auto) impl = ScanImpl::Avx2;
+#ifdef ANSI_FILTER_AVX2
+    if (impl == ScanImpl::Avx2 && !cpu_has_avx2()) impl = ScanImpl::Sse2;
+#else
+    if (impl == ScanImpl::Avx2) impl = ScanImpl::Sse2;
+#endif
+#ifndef ANSI_FILTER_SSE2
+    if (impl == ScanImpl::Sse2) impl = ScanImpl::Scalar;
+#endif
+    impl_ = impl;
+    switch (impl) {
+#ifdef ANSI_FILTER_AVX2
+    case ScanImpl::Avx2: scan_ = scan_plain_avx2; break;
+#endif
+#ifdef ANSI_FILTER_SSE2
+    case ScanImpl::Sse2: scan_ = scan_plain_sse2; break;
+#endif
+    default: scan_ = scan_plain_scalar; break;
+    }
+}
+
+const char* AnsiFilter::impl_name(ScanImpl impl) {
+    switch (impl) {
+    case ScanImpl::Avx2: return "avx2";
+    case ScanImpl::Sse2: return "sse2";
+    case ScanImpl::Scalar: return "scalar";
+    default: return "auto";
+    }
+}
+
+void AnsiFilter::reset() {
+    state_ = State::Ground;
+    utf8_len_ = 0;
+    utf8_need_ = 0;
+}
+
+// Length of a UTF-8 sequence from its lead byte (0 if not a valid lead), and
+// the allowed range of the first continuation byte, which rules out
+// overlongs, surrogates and code points above U+10FFFF.
+static inline size_t utf8_lead(uint8_t c, uint8_t& lo, uint8_t& hi) {
+    lo = 0x80;
+    hi = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) return 2;
+    if (c >= 0xE0 && c <= 0xEF) {
+        if (c == 0xE0) lo = 0xA0;
+        if (c == 0xED) hi = 0x9F;
+        return 3;
+    }
+    if (c >= 0xF0 && c <= 0xF4) {
+        if (c == 0xF0) lo = 0x90;
+        if (c == 0xF4) hi = 0x8F;
+        return 4;
+    }
+    return 0;
+}
+
+// U+0080..U+009F are C1 controls, not text.
+static inline bool is_c1(const uint8_t* seq) {
+    return seq[0] == 0xC2 && seq[1] < 0xA0;
+}
+
+void AnsiFilter::filter(const uint8_t* in, size_t len, std::vector<uint8_t>& out) {
+    // Backspace is the only expansion (one byte becomes three).
+    size_t base = out.size();
+    out.resize(base + len * 3);
+    uint8_t* o = out.data() + base;
+    const uint8_t* p = in;
+    const uint8_t* end = in + len;
+    State st = state_; // kept in a register across the hot loop
+
+    while (p < end) {
+        switch (st) {
+        case State::Ground: {
+#ifdef ANSI_FILTER_SSE2
+            if (end - p >= 16 && impl_ != ScanImpl::Scalar) {
+                // Escape-dense output has short text runs; settle those with
+                // one inline block before paying for a call. The 16-byte store
+                // fits: at least 48 bytes of output room remain.
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                unsigned mask = special_mask_sse2(v);
+                if (mask != 0) {
+                    unsigned run = lowest_bit(mask);
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(o), v);
+                    o += run;
+                    p += run;
+                } else {
+                    size_t run = 16 + scan_(p + 16, static_cast<size_t>(end - p) - 16);
+                    std::memcpy(o, p, run);
+                    o += run;
+                    p += run;
+                }
+            } else
+#endif
+            {
+                size_t run = scan_(p, static_cast<size_t>(end - p));
+                std::memcpy(o, p, run);
+                o += run;
+                p += run;
+            }
+            if (p == end) break;
+            uint8_t c = *p++;
+            if (c == ESC) {
+                st = State::Escape;
+            } else if (c == 0x08) {
+                *o++ = 0x08;
+                *o++ = 0x20;
+                *o++ = 0x08;
+            } else if (c >= 0x80) {
+                uint8_t lo, hi;
+                size_t n = utf8_lead(c, lo, hi);
+                if (n == 0) break; // stray continuation or invalid lead
+                if (static_cast<size_t>(end - p) >= n - 1) {
+                    // Whole sequence in this chunk: validate and copy in place,
+                    // then carry on through any sequences directly after it.
+                    for (;;) {
+                        bool ok = p[0] >= lo && p[0] <= hi;
+                        for (size_t k = 1; ok && k < n - 1; ++k) ok = p[k] >= 0x80 && p[k] <= 0xBF;
+                        if (!ok) break; // drop the lead, rescan what follows
+                        if (!is_c1(p - 1)) {
+                            std::memcpy(o, p - 1, n);
+                            o += n;
+                        }
+                        p += n - 1;
+                        if (p == end || *p < 0x80) break;
+                        n = utf8_lead(*p, lo, hi);
+                        if (n == 0 || static_cast<size_t>(end - p) < n) break;
+                        ++p;
+                    }
+                } else {
+                    utf8_[0] = c;
+                    utf8_len_ = 1;
+                    utf8_need_ = static_cast<uint8_t>(n - 1);
+                    utf8_lo_ = lo;
+                    utf8_hi_ = hi;
+                    st = State::Utf8;
+                }
+            }
+            // Other C0 controls and DEL are dropped.
+            break;
+        }
+        case State::Utf8: {
+            uint8_t c = *p;
+            if (c < utf8_lo_ || c > utf8_hi_) {
+                // Truncated sequence: drop it and look at c afresh.
+                st = State::Ground;
+                break;
+            }
+            ++p;
+            utf8_[utf8_len_++] = c;
+            utf8_lo_ = 0x80;
+            utf8_hi_ = 0xBF;
+            if (--utf8_need_ == 0) {
+                st = State::Ground;
+                if (!is_c1(utf8_)) {
+                    std::memcpy(o, utf8_, utf8_len_);
+                    o += utf8_len_;
+                }
+            }
+            break;
+        }
+        case State::Escape: {
+            uint8_t c = *p++;
+            if (c == '[') st = State::Csi;
+            else if (c == ']') st = State::Osc;
+            else if (c == 'P' || c == 'X' || c == '^' || c == '_') st = State::String;
+            else if (c >= 0x20 && c <= 0x2F) st = State::EscIntermediate;
+            else if (c != ESC) st = State::Ground;
+            break;
+        }
+        case State::EscIntermediate: {
+            uint8_t c = *p++;
+            if (c < 0x20 || c > 0x2F) st = State::Ground;
+            break;
+        }
+        case State::Csi:
+            while (p < end) {
+                uint8_t c = *p++;
+                if (c >= 0x40 && c <= 0x7E) {
+                    st = State::Ground;
+                    break;
+                }
+                if (c == ESC) {
+                    st = State::Escape;
+                    break;
+                }
+            }
+            break;
+        case State::Osc:
+            while (p < end) {
+                uint8_t c = *p++;
+                if (c == 0x07) {
+                    st = State::Ground;
+                    break;
+                }
+                if (c == ESC) {
+                    st = State::OscEscape;
+                    break;
+                }
+            }
+            break;
+        case State::String: {
+            const void* esc = std::memchr(p, ESC, static_cast<size_t>(end - p));
+            if (!esc) {
+                p = end;
+                break;
+            }
+            p = static_cast<const uint8_t*>(esc) + 1;
+            st = State::StringEscape;
+            break;
+        }
+        case State::OscEscape:
+        case State::StringEscape:
+            // ESC \ is the terminator; any other ESC starts a new sequence.
+            if (*p == '\\') {
+                ++p;
+                st = State::Ground;
+            } else {
+                st = State::Escape;
+            }
+            break;
+        }
+    }
+    state_ = st;
+    out.resize(static_cast<size_t>(o - out.data()));
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Streaming filter behind --mirror-clean: removes escape sequences (CSI, OSC,
+// DCS and friends) and stray control bytes from PTY output, expands
+// backspace to "\b \b" for consoles that don't erase, and keeps printable
+// ASCII, tab/CR/LF and well-formed UTF-8. Parser state carries over between
+// calls, so sequences split across reads are handled like whole ones.
+//
+// Runs of plain text are found with SSE2 or AVX2 where available and copied
+// in one go; only the bytes around ESC, controls and non-ASCII go through
+// the state machine.
+class AnsiFilter {
+public:
+    enum class ScanImpl { Auto, Scalar, Sse2, Avx2 };
+
+    // Requests for an implementation the CPU lacks fall back to the best
+    // one it has.
+    explicit AnsiFilter(ScanImpl impl = ScanImpl::Auto);
+
+    // Appends the cleaned form of in[0..len) to out.
+    void filter(const uint8_t* in, size_t len, std::vector<uint8_t>& out);
+    void reset();
+
+    ScanImpl impl() const { return impl_; }
+    static const char* impl_name(ScanImpl impl);
+
+private:
+    enum class State : uint8_t {
+        Ground,
+        Utf8,
+        Escape,
+        EscIntermediate,
+        Csi,
+        Osc,
+        OscEscape,
+        String, // DCS, SOS, PM, APC: ended by ST only
+        StringEscape
+    };
+
+    using ScanFn = size_t (*)(const uint8_t* p, size_t n);
+
+    ScanImpl impl_;
+    ScanFn scan_;
+    State state_ = State::Ground;
+    uint8_t utf8_[4] = {0};
+    uint8_t utf8_len_ = 0;
+    uint8_t utf8_need_ = 0;
+    uint8_t utf8_lo_ = 0x80;
+    uint8_t utf8_hi_ = 0xBF;
+};
@@ -1,7 +1,10 @@
 #ifndef APP_CONFIG_HPP
 #define APP_CONFIG_HPP
 
+#include "port_forward.hpp"
+
 #include <string>
+#include <vector>
 
 struct AppConfig {
     std::string mode;
@@ -15,9 +18,40 @@ struct AppConfig {
     bool verify_required = false;
     std::string key_type = "ecdsa";
     bool debug = false;
+    std::string log_file = "secure_tunnel.log";
+    int log_max_mb = 10;
     bool mirror_output = false;
     bool mirror_input = false;
     bool mirror_clean = false;
+    int max_sessions = 1;
+    int workers = 0;
+    int stats_interval = 60;
+    std::string metrics_file;
+    std::string metrics_socket;
+    std::string record_dir;
+    bool compress = true;
+    bool flow_control = true;
+    int ticket_lifetime = 3600;
+    std::string ticket_cache;
+    bool use_ticket_cache = true;
+    bool early_data = false;
+    bool kernel_tls = false;
+    int detach_lifetime = 0;
+    int scrollback_kb = 256;
+    bool new_session = false;
+    bool screen_model = false;
+    int predict_echo_ms = -1;
+    bool trace_latency = false;
+    bool forwarding = true;
+    std::vector<std::string> local_forwards;
+    std::vector<std::string> remote_forwards;
+    bool file_transfer = true;
+    std::vector<std::string> send_files;
+    std::vector<std::string> recv_files;
+
+    // Keeps accepting clients after the first one: several at once, or one
+    // at a time with shells that survive a disconnect.
+    bool serving() const { return max_sessions > 1 || detach_lifetime > 0; }
 
     bool validate() const {
         if (mode != "listen" && mode != "connect") {
@@ -29,6 +63,23 @@ struct AppConfig {
         if (mode == "connect" && connect_ip.empty()) {
             return false;
         }
+        if (max_sessions < 1 || workers < 0 || stats_interval < 0) {
+            return false;
+        }
+        // TLS 1.3 caps ticket lifetimes at seven days.
+        if (ticket_lifetime < 0 || ticket_lifetime > 604800) {
+            return false;
+        }
+        if (detach_lifetime < 0 || scrollback_kb < 0 || log_max_mb < 0) {
+            return false;
+        }
+        ForwardSpec spec;
+        for (const auto& text : local_forwards) {
+            if (!parse_forward_spec(text, spec)) return false;
+        }
+        for (const auto& text : remote_forwards) {
+            if (!parse_forward_spec(text, spec)) return false;
+        }
         return true;
     }
 };
@@ -0,0 +1,208 @@
+#include "buffer_pool.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+namespace buffer_pool {
+
+namespace {
+
+// In front of every block: its class, or kClasses for one from the heap.
+struct alignas(16) Header {
+    uint32_t cls;
+    size_t size;
+};
+
+// What a free block's memory holds: the next free block, and on the first
+// block of a batch in the depot, the next batch and its length.
+struct FreeBlock {
+    FreeBlock* next;
+    FreeBlock* next_batch;
+    size_t count;
+};
+
+// Blocks that move between a thread's cache and the depot at once: about
+// 256 KB, and at least a few.
+size_t batch_size(size_t cls) {
+    return std::min<size_t>(std::max<size_t>((256 * 1024) / kClassSize[cls], 4), 64);
+}
+
+// Past this, free blocks go back to the heap instead of the depot.
+const size_t kMaxDepotBytesPerClass = 16u << 20;
+
+std::atomic<uint64_t> g_heap_allocations{0};
+std::atomic<uint64_t> g_heap_bytes{0};
+std::atomic<uint64_t> g_depot_bytes{0};
+
+struct Depot {
+    std::mutex mutex;
+    FreeBlock* batches[kClasses] = {};
+    size_t bytes[kClasses] = {};
+};
+
+// Never destroyed: threads may still return blocks during exit.
+Depot& depot() {
+    static Depot* instance = new Depot;
+    return *instance;
+}
+
+Header* header_of(const void* p) {
+    return reinterpret_cast<Header*>(const_cast<char*>(static_cast<const char*>(p)) - sizeof(Header));
+}
+
+void* heap_block(uint32_t cls, size_t size) {
+    auto* h = static_cast<Header*>(std::malloc(sizeof(Header) + size));
+    if (!h) throw std::bad_alloc();
+    h->cls = cls;
+    h->size = size;
+    g_heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    g_heap_bytes.fetch_add(size, std::memory_order_relaxed);
+    return h + 1;
+}
+
+void free_chain(FreeBlock* block) {
+    while (block) {
+        FreeBlock* next = block->next;
+        std::free(header_of(block));
+        block = next;
+    }
+}
+
+// Takes a batch for cls from the depot; null when it has none.
+FreeBlock* take_batch(size_t cls, size_t& count) {
+    Depot& d = depot();
+    std::lock_guard<std::mutex> lock(d.mutex);
+    FreeBlock* batch = d.batches[cls];
+    if (!batch) return nullptr;
+    d.batches[cls] = batch->next_batch;
+    count = batch->count;
+    d.bytes[cls] -= count * kClassSize[cls];
+    g_depot_bytes.fetch_sub(count * kClassSize[cls], std::memory_order_relaxed);
+    return batch;
+}
+
+void give_batch(size_t cls, FreeBlock* batch, size_t count) {
+    Depot& d = depot();
+    {
+        std::lock_guard<std::mutex> lock(d.mutex);
+        if (d.bytes[cls] + count * kClassSize[cls] <= kMaxDepotBytesPerClass) {
+            batch->next_batch = d.batches[cls];
+            batch->count = count;
+            d.batches[cls] = batch;
+            d.bytes[cls] += count * kClassSize[cls];
+            g_depot_bytes.fetch_add(count * kClassSize[cls], std::memory_order_relaxed);
+            return;
+        }
+    }
+    free_chain(batch);
+}
+
+struct Cache {
+    struct List {
+        FreeBlock* head = nullptr;
+        size_t count = 0;
+    };
+    List lists[kClasses];
+
+    ~Cache();
+};
+
+// Set once this thread's cache is gone, for blocks released by later
+// thread-exit destructors.
+thread_local bool t_cache_gone = false;
+thread_local Cache t_cache;
+
+Cache::~Cache() {
+    for (size_t cls = 0; cls < kClasses; ++cls) {
+        if (lists[cls].head) give_batch(cls, lists[cls].head, lists[cls].count);
+        lists[cls] = List();
+    }
+    t_cache_gone = true;
+}
+
+size_t class_of(size_t size) {
+    for (size_t cls = 0; cls < kClasses; ++cls) {
+        if (size <= kClassSize[cls]) return cls;
+    }
+    return kClasses;
+}
+
+}  // namespace
+
+void* allocate(size_t size) {
+    size_t cls = class_of(size);
+    if (cls == kClasses) return heap_block(static_cast<uint32_t>(cls), size);
+    if (t_cache_gone) return heap_block(static_cast<uint32_t>(cls), kClassSize[cls]);
+    Cache::List& list = t_cache.lists[cls];
+    if (!list.head) list.head = take_batch(cls, list.count);
+    if (!list.head) return heap_block(static_cast<uint32_t>(cls), kClassSize[cls]);
+    FreeBlock* block = list.head;
+    list.head = block->next;
+    --list.count;
+    return block;
+}
+
+void release(void* p) {
+    if (!p) return;
+    Header* h = header_of(p);
+    if (h->cls >= kClasses || t_cache_gone) {
+        std::free(h);
+        return;
+    }
+    size_t cls = h->cls;
+    Cache::List& list = t_cache.lists[cls];
+    auto* block = static_cast<FreeBlock*>(p);
+    block->next = list.head;
+    list.head = block;
+    size_t batch = batch_size(cls);
+    if (++list.count < 2 * batch) return;
+    // Keep one batch for this thread's next allocations; pass the rest on.
+    FreeBlock* last = list.head;
+    for (size_t i = 1; i < batch; ++i) last = last->next;
+    FreeBlock* rest = last->next;
+    last->next = nullptr;
+    give_batch(cls, rest, list.count - batch);
+    list.count = batch;
+}
+
+size_t capacity(const void* p) {
+    return header_of(p)->size;
+}
+
+Stats stats() {
+    return Stats{g_heap_allocations.load(std::memory_order_relaxed), g_heap_bytes.load(std::memory_order_relaxed),
+                 g_depot_bytes.load(std::memory_order_relaxed)};
+}
+
+}  // namespace buffer_pool
+
+PooledBuffer::PooledBuffer(size_t size)
+    : block_(new (buffer_pool::allocate(sizeof(Block) + size)) Block{{1}, size}) {}
+
+PooledBuffer::PooledBuffer(const PooledBuffer& other) : block_(other.block_) {
+    if (block_) block_->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+PooledBuffer::~PooledBuffer() {
+    if (block_ && block_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        block_->~Block();
+        buffer_pool::release(block_);
+    }
+}
+
+size_t PooledBuffer::capacity() const {
+    return block_ ? buffer_pool::capacity(block_) - sizeof(Block) : 0;
+}
+
+void PooledBuffer::resize(size_t size) {
+    if (size <= capacity() && use_count() == 1) {
+        block_->size = size;
+        return;
+    }
+    PooledBuffer bigger(size);
+    if (block_) std::memcpy(bigger.data(), data(), std::min(size, block_->size));
+    *this = std::move(bigger);
+}
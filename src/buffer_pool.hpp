@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+// Size-classed pool for I/O buffers that are allocated on one thread and
+// freed on another (frames handed to a connection's owner, and the like).
+// Each thread keeps a cache of free blocks per class; a cache that grows
+// past a batch hands one to a shared depot, and an empty one takes a batch
+// back, so blocks flow between threads with one lock per batch rather than
+// a malloc and free per buffer. Free blocks are linked through their own
+// memory, so once warm nothing here touches the heap.
+namespace buffer_pool {
+
+// 256 B, 1 KB, 4 KB, one TLS record with frame headers, and 64 KB.
+constexpr size_t kClasses = 5;
+constexpr size_t kClassSize[kClasses] = {256, 1024, 4096, 16384 + 256, 65536};
+
+// At least size bytes, 16-byte aligned. Sizes past the largest class come
+// straight from the heap.
+void* allocate(size_t size);
+// Any thread; p from allocate().
+void release(void* p);
+// What allocate() gave p room for.
+size_t capacity(const void* p);
+
+struct Stats {
+    // Blocks that had to come from the heap: warm-up, growth, or sizes
+    // past the largest class. Flat once the process is warm.
+    uint64_t heap_allocations;
+    uint64_t heap_bytes;
+    // Free blocks in the depot, across classes.
+    uint64_t depot_bytes;
+};
+
+Stats stats();
+
+}  // namespace buffer_pool
+
+// Refcounted handle to a pooled byte buffer. Copies share the bytes; the
+// block goes back to the pool with the last handle, on whichever thread
+// drops it.
+class PooledBuffer {
+public:
+    PooledBuffer() = default;
+    // size bytes, uninitialised.
+    explicit PooledBuffer(size_t size);
+    PooledBuffer(const PooledBuffer& other);
+    PooledBuffer(PooledBuffer&& other) noexcept : block_(other.block_) { other.block_ = nullptr; }
+    PooledBuffer& operator=(PooledBuffer other) noexcept {
+        std::swap(block_, other.block_);
+        return *this;
+    }
+    ~PooledBuffer();
+
+    uint8_t* data() { return block_ ? reinterpret_cast<uint8_t*>(block_ + 1) : nullptr; }
+    const uint8_t* data() const { return block_ ? reinterpret_cast<const uint8_t*>(block_ + 1) : nullptr; }
+    size_t size() const { return block_ ? block_->size : 0; }
+    bool empty() const { return size() == 0; }
+    size_t capacity() const;
+    // Keeps the first min(size, size()) bytes. Past capacity(), or while
+    // shared, this moves to a block of its own.
+    void resize(size_t size);
+    // Handles sharing these bytes.
+    uint32_t use_count() const { return block_ ? block_->refs.load(std::memory_order_relaxed) : 0; }
+
+private:
+    struct alignas(16) Block {
+        std::atomic<uint32_t> refs;
+        size_t size;
+    };
+
+    Block* block_ = nullptr;
+};
@@ -0,0 +1,250 @@
+#include "channel_mux.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+
+// Receive window each channel starts with, and the most it grows to.
+static const size_t kInitialChannelWindow = 64 * 1024;
+static const size_t kMaxChannelWindow = 16 * 1024 * 1024;
+
+// Channel data is only handed to the connection while less than this is
+// waiting on the socket, so frames from other channels and the session's
+// own output get in behind at most this much.
+static const size_t kMaxMuxBacklog = 64 * 1024;
+
+// Compact a channel's send queue once this much of its front has been sent.
+static const size_t kCompactThreshold = 64 * 1024;
+
+ChannelMux::Stream::Stream() : recv_allowed(kInitialChannelWindow), recv(kInitialChannelWindow, kMaxChannelWindow) {}
+
+ChannelMux::ChannelMux(TLSChannel& channel, bool client) : channel_(channel), next_id_(client ? 1 : 2) {}
+
+ChannelMux::~ChannelMux() = default;
+
+uint32_t ChannelMux::open(uint8_t kind, const std::string& target, Handler handler) {
+    uint32_t id = next_id_;
+    next_id_ += 2;
+    Stream& stream = streams_[id];
+    stream.handler = std::move(handler);
+    stream.recv.set_rtt(rtt_);
+    uint8_t buf[control::kMaxOpenSize];
+    size_t n = control::encode_channel_open(id, kind, static_cast<uint32_t>(kInitialChannelWindow),
+                                            reinterpret_cast<const uint8_t*>(target.data()), target.size(), buf);
+    channel_.send_frame(framing::FrameType::CONTROL, buf, n);
+    return id;
+}
+
+void ChannelMux::send(uint32_t id, const uint8_t* data, size_t len) {
+    auto it = streams_.find(id);
+    if (it == streams_.end() || it->second.closing || len == 0) return;
+    Stream& stream = it->second;
+    if (stream.out_off >= kCompactThreshold) {
+        stream.out.erase(stream.out.begin(), stream.out.begin() + stream.out_off);
+        stream.out_off = 0;
+    }
+    stream.out.insert(stream.out.end(), data, data + len);
+    schedule(id, stream);
+    pump();
+}
+
+size_t ChannelMux::queued(uint32_t id) const {
+    auto it = streams_.find(id);
+    return it == streams_.end() ? 0 : it->second.pending();
+}
+
+void ChannelMux::consumed(uint32_t id, size_t n) {
+    auto it = streams_.find(id);
+    if (it == streams_.end() || it->second.closing) return;
+    Stream& stream = it->second;
+    size_t grant = stream.recv.consumed(n, CreditWindow::Clock::now());
+    if (grant == 0) return;
+    stream.recv_allowed += grant;
+    send_message(control::MsgType::CHANNEL_WINDOW, id, static_cast<uint32_t>(grant));
+}
+
+void ChannelMux::close(uint32_t id) {
+    auto it = streams_.find(id);
+    if (it == streams_.end() || it->second.closing) return;
+    Stream& stream = it->second;
+    stream.closing = true;
+    stream.handler = Handler();
+    // Not accepted yet: nothing queued can go out anyway.
+    if (stream.pending() == 0 || !stream.open) send_close(id, stream);
+}
+
+void ChannelMux::close_all() {
+    std::map<uint32_t, Stream> streams;
+    streams.swap(streams_);
+    ready_.clear();
+    for (auto& entry : streams) {
+        if (entry.second.handler.on_close) entry.second.handler.on_close();
+    }
+}
+
+void ChannelMux::pump() {
+    if (pumping_) return;
+    pumping_ = true;
+    // A channel frame's header is four bytes longer than a plain one.
+    size_t quantum = channel_.max_frame_payload() - (framing::CHANNEL_HEADER_SIZE - framing::HEADER_SIZE);
+    while (!ready_.empty() && !channel_.closed() && channel_.pending_bytes() < kMaxMuxBacklog) {
+        uint32_t id = ready_.front();
+        ready_.pop_front();
+        auto it = streams_.find(id);
+        if (it == streams_.end()) continue;
+        Stream& stream = it->second;
+        stream.scheduled = false;
+        size_t n = std::min({stream.pending(), stream.send_window, quantum});
+        if (n == 0) continue;
+        channel_.send_channel_frame(id, framing::FrameType::DATA, stream.out.data() + stream.out_off, n);
+        if (channel_.closed()) break;
+        stream.out_off += n;
+        stream.send_window -= n;
+        if (stream.pending() > 0) {
+            schedule(id, stream);
+            continue;
+        }
+        stream.out.clear();
+        stream.out_off = 0;
+        if (stream.closing) {
+            send_close(id, stream);
+        } else if (stream.handler.on_drained) {
+            // Copied: the callback may close the channel, which drops it.
+            auto on_drained = stream.handler.on_drained;
+            on_drained();
+        }
+    }
+    pumping_ = false;
+}
+
+void ChannelMux::set_rtt(std::chrono::microseconds rtt) {
+    rtt_ = rtt;
+    for (auto& entry : streams_) entry.second.recv.set_rtt(rtt);
+}
+
+bool ChannelMux::on_control(const control::Message& msg) {
+    switch (msg.type) {
+    case control::MsgType::CHANNEL_OPEN:
+        on_peer_open(msg.open);
+        return true;
+    case control::MsgType::CHANNEL_OPEN_OK: {
+        auto it = streams_.find(msg.channel.id);
+        if (it == streams_.end() || it->second.open) return true;
+        Stream& stream = it->second;
+        stream.open = true;
+        stream.send_window = msg.channel.bytes;
+        if (stream.closing) {
+            // Closed while the open was in flight.
+            if (stream.pending() == 0) send_close(msg.channel.id, stream);
+            return true;
+        }
+        if (stream.handler.on_open) {
+            auto on_open = stream.handler.on_open;
+            on_open();
+        }
+        it = streams_.find(msg.channel.id);
+        if (it == streams_.end()) return true;
+        schedule(msg.channel.id, it->second);
+        pump();
+        return true;
+    }
+    case control::MsgType::CHANNEL_WINDOW: {
+        auto it = streams_.find(msg.channel.id);
+        if (it == streams_.end()) return true;
+        it->second.send_window += msg.channel.bytes;
+        schedule(msg.channel.id, it->second);
+        pump();
+        return true;
+    }
+    case control::MsgType::CHANNEL_CLOSE:
+        on_peer_close(msg.channel.id);
+        return true;
+    default:
+        return false;
+    }
+}
+
+void ChannelMux::on_frame(uint32_t id, uint8_t type, const std::vector<uint8_t>& payload) {
+    if (type != (uint8_t)framing::FrameType::DATA) return;
+    auto it = streams_.find(id);
+    // Data still in flight when this side closed is dropped.
+    if (it == streams_.end() || it->second.closing) return;
+    Stream& stream = it->second;
+    if (payload.size() > stream.recv_allowed) {
+        LOG_WARN("Channel %u sent past its window; closing it", id);
+        Handler handler = std::move(stream.handler);
+        close(id);
+        if (handler.on_close) handler.on_close();
+        return;
+    }
+    stream.recv_allowed -= payload.size();
+    if (stream.handler.on_data) {
+        auto on_data = stream.handler.on_data;
+        on_data(payload.data(), payload.size());
+    }
+}
+
+void ChannelMux::schedule(uint32_t id, Stream& stream) {
+    if (stream.scheduled || !stream.open || stream.send_window == 0 || stream.pending() == 0) return;
+    stream.scheduled = true;
+    ready_.push_back(id);
+}
+
+void ChannelMux::send_message(control::MsgType type, uint32_t id, uint32_t bytes) {
+    uint8_t buf[control::kMaxEncodedSize];
+    size_t n = control::encode_channel(type, id, bytes, buf);
+    channel_.send_frame(framing::FrameType::CONTROL, buf, n);
+}
+
+void ChannelMux::send_close(uint32_t id, Stream& stream) {
+    if (stream.close_sent) return;
+    stream.close_sent = true;
+    stream.out.clear();
+    stream.out_off = 0;
+    send_bulk_close(id);
+}
+
+void ChannelMux::send_bulk_close(uint32_t id) {
+    // Bulk, unlike other CONTROL frames, so it can't overtake the channel's
+    // last DATA frames still queued in the connection.
+    uint8_t buf[framing::HEADER_SIZE + control::kMaxEncodedSize];
+    uint8_t* payload = buf + framing::HEADER_SIZE;
+    size_t n = control::encode_channel(control::MsgType::CHANNEL_CLOSE, id, 0, payload);
+    channel_.send_frame_in_place(framing::FrameType::CONTROL, payload, n, SendPriority::BULK);
+}
+
+void ChannelMux::on_peer_open(const control::ChannelOpen& open) {
+    // IDs from the peer's half only, and never one that is in use.
+    bool ours = (open.id & 1) == (next_id_ & 1);
+    Handler handler;
+    std::string target(reinterpret_cast<const char*>(open.target), open.target_len);
+    if (open.id == 0 || ours || streams_.count(open.id) || !on_open_request ||
+        !on_open_request(open.id, open.kind, target, handler)) {
+        send_message(control::MsgType::CHANNEL_CLOSE, open.id, 0);
+        return;
+    }
+    Stream& stream = streams_[open.id];
+    stream.handler = std::move(handler);
+    stream.open = true;
+    stream.send_window = open.window;
+    stream.recv.set_rtt(rtt_);
+    send_message(control::MsgType::CHANNEL_OPEN_OK, open.id, static_cast<uint32_t>(kInitialChannelWindow));
+    if (stream.handler.on_open) {
+        auto on_open = stream.handler.on_open;
+        on_open();
+    }
+}
+
+void ChannelMux::on_peer_close(uint32_t id) {
+    auto it = streams_.find(id);
+    if (it == streams_.end()) return;
+    Stream& stream = it->second;
+    // Either the answer to this side's close, or the peer closing (or
+    // refusing) first, which is answered before the stream goes.
+    bool answer = !stream.close_sent;
+    Handler handler = std::move(stream.handler);
+    streams_.erase(it);
+    if (answer) {
+        send_message(control::MsgType::CHANNEL_CLOSE, id, 0);
+        if (handler.on_close) handler.on_close();
+    }
+}
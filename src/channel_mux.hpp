@@ -0,0 +1,125 @@
+#pragma once
+
+#include "control_codec.hpp"
+#include "credit_window.hpp"
+#include "tls_channel.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+// What a channel carries, as named in its open.
+enum class ChannelKind : uint8_t {
+    // Client to server: relay to the TCP target "host:port".
+    TCP_CONNECT = 1,
+    // Client to server: listen on "bind:port" while the channel is open.
+    TCP_LISTEN = 2,
+    // Server to client: a connection accepted for the TCP_LISTEN channel
+    // whose ID is the target, in decimal.
+    TCP_FORWARDED = 3,
+    // Client to server: store a file at the target path.
+    FILE_PUT = 4,
+    // Client to server: send the file at the target path.
+    FILE_GET = 5
+};
+
+// Extra byte streams over one TLS connection, next to the session's own
+// stream on channel 0. Channels are opened, closed and paced with binary
+// CONTROL messages; their data travels in DATA frames carrying the channel
+// ID. Each direction of a channel has its own credit window, so a reader
+// that falls behind stalls only its channel.
+//
+// Outgoing data waits in per-channel queues and is moved onto the
+// connection one frame per channel in turn, and only while the connection's
+// backlog is short. A bulk channel therefore takes its share of the link
+// but never builds a queue that an interactive one would have to wait out.
+class ChannelMux {
+public:
+    struct Handler {
+        // Bytes the peer sent; report them through consumed() once they
+        // have been passed on.
+        std::function<void(const uint8_t* data, size_t len)> on_data;
+        // The channel is open: the peer accepted an open from this side, or
+        // this side accepted the peer's.
+        std::function<void()> on_open;
+        // The peer closed the channel, refused to open it, or the
+        // connection went away. Nothing is called after this.
+        std::function<void()> on_close;
+        // Everything queued with send() has been handed to the connection.
+        std::function<void()> on_drained;
+    };
+
+    // Each side numbers the channels it opens from its own half of the ID
+    // space: odd for the client, even for the server.
+    ChannelMux(TLSChannel& channel, bool client);
+    ~ChannelMux();
+
+    ChannelMux(const ChannelMux&) = delete;
+    ChannelMux& operator=(const ChannelMux&) = delete;
+
+    // Returns the new channel's ID. Data may be queued at once; it goes out
+    // after the peer accepts.
+    uint32_t open(uint8_t kind, const std::string& target, Handler handler);
+    void send(uint32_t id, const uint8_t* data, size_t len);
+    // Bytes queued on id and not yet handed to the connection.
+    size_t queued(uint32_t id) const;
+    // n bytes from on_data were passed on; the peer may send more.
+    void consumed(uint32_t id, size_t n);
+    // Sends what is queued, then closes. The handler is dropped right away.
+    void close(uint32_t id);
+    // The connection is gone: every open channel sees on_close.
+    void close_all();
+
+    // Moves queued data onto the connection while its backlog allows.
+    // Called by the owner whenever the connection drains.
+    void pump();
+    void set_rtt(std::chrono::microseconds rtt);
+
+    // Wiring for the owner's frame handlers. on_control returns false for
+    // messages that aren't about channels.
+    bool on_control(const control::Message& msg);
+    void on_frame(uint32_t id, uint8_t type, const std::vector<uint8_t>& payload);
+
+    // Decides on a peer's open: fill in handler and return true to accept.
+    // Unset, every open is refused.
+    std::function<bool(uint32_t id, uint8_t kind, const std::string& target, Handler& handler)> on_open_request;
+
+private:
+    struct Stream {
+        Handler handler;
+        bool open = false;
+        // close() was called; the stream lives on until the peer's close.
+        bool closing = false;
+        bool close_sent = false;
+        bool scheduled = false;
+        std::vector<uint8_t> out;
+        size_t out_off = 0;
+        // What the peer is ready to receive, and what it may still send.
+        size_t send_window = 0;
+        size_t recv_allowed = 0;
+        CreditWindow recv;
+
+        Stream();
+        size_t pending() const { return out.size() - out_off; }
+    };
+
+    void schedule(uint32_t id, Stream& stream);
+    void send_message(control::MsgType type, uint32_t id, uint32_t bytes);
+    void send_close(uint32_t id, Stream& stream);
+    void send_bulk_close(uint32_t id);
+    void on_peer_open(const control::ChannelOpen& open);
+    void on_peer_close(uint32_t id);
+
+    TLSChannel& channel_;
+    uint32_t next_id_;
+    // Node-based, so handlers can open channels while a Stream& is held.
+    std::map<uint32_t, Stream> streams_;
+    // Channels with data the peer has room for, served round robin.
+    std::deque<uint32_t> ready_;
+    std::chrono::microseconds rtt_{0};
+    bool pumping_ = false;
+};
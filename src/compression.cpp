@@ -0,0 +1,119 @@
+#include "compression.hpp"
+#include "framing.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+
+// Speed over ratio: the link, not the CPU, is the bottleneck we care about,
+// and level 1 already takes most of the win on terminal output.
+static const int kLevel = 1;
+// Frames below this size (keystroke echoes, prompts) are sent raw; the sync
+// flush marker alone would eat most of the saving.
+static const size_t kMinCompressBytes = 64;
+// After this many frames in a row shrink by less than 5%, send the next
+// kSkipBytes raw before trying again.
+static const int kPoorFrames = 4;
+static const size_t kSkipBytes = 1024 * 1024;
+static const size_t kInflateChunk = 16384;
+// Senders compress one frame's worth of output at a time, so an honest frame
+// inflates to well under this. Deflate expands up to ~1000x, though, and a
+// peer's frame must not turn into a gigabyte for write_pty to queue.
+static const size_t kMaxInflatedFrame = framing::MAX_PAYLOAD;
+
+FrameCompressor::~FrameCompressor() {
+    if (active_) deflateEnd(&zs_);
+}
+
+bool FrameCompressor::init(size_t headroom) {
+    if (active_) return true;
+    // Raw deflate: no zlib header or Adler-32, TLS already protects integrity.
+    if (deflateInit2(&zs_, kLevel, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        LOG_ERROR("deflateInit2 failed; compression disabled");
+        return false;
+    }
+    headroom_ = headroom;
+    active_ = true;
+    return true;
+}
+
+bool FrameCompressor::worth_compressing(size_t len) {
+    if (!active_ || len < kMinCompressBytes) return false;
+    if (skip_bytes_ > 0) {
+        skip_bytes_ -= std::min(skip_bytes_, len);
+        return false;
+    }
+    return true;
+}
+
+uint8_t* FrameCompressor::compress(const uint8_t* data, size_t len, size_t& out_len) {
+    // deflateBound() leaves out the sync flush marker, hence the slack.
+    size_t bound = headroom_ + deflateBound(&zs_, static_cast<uLong>(len)) + 16;
+    if (out_.size() < bound) out_.resize(bound);
+
+    zs_.next_in = const_cast<Bytef*>(data);
+    zs_.avail_in = static_cast<uInt>(len);
+    size_t produced = 0;
+    for (;;) {
+        zs_.next_out = out_.data() + headroom_ + produced;
+        zs_.avail_out = static_cast<uInt>(out_.size() - headroom_ - produced);
+        int ret = deflate(&zs_, Z_SYNC_FLUSH);
+        produced = out_.size() - headroom_ - zs_.avail_out;
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            LOG_ERROR("deflate failed (%d)", ret);
+            return nullptr;
+        }
+        if (zs_.avail_out > 0) break;
+        out_.resize(out_.size() * 2);
+    }
+
+    if (produced * 20 > len * 19) {
+        if (++poor_frames_ >= kPoorFrames) {
+            poor_frames_ = 0;
+            skip_bytes_ = kSkipBytes;
+        }
+    } else {
+        poor_frames_ = 0;
+    }
+    out_len = produced;
+    return out_.data() + headroom_;
+}
+
+FrameDecompressor::~FrameDecompressor() {
+    if (active_) inflateEnd(&zs_);
+}
+
+bool FrameDecompressor::init() {
+    if (active_) return true;
+    if (inflateInit2(&zs_, -15) != Z_OK) {
+        LOG_ERROR("inflateInit2 failed");
+        return false;
+    }
+    out_.resize(kInflateChunk);
+    active_ = true;
+    return true;
+}
+
+bool FrameDecompressor::decompress(const uint8_t* data, size_t len, const Sink& sink) {
+    if (!active_) return false;
+    zs_.next_in = const_cast<Bytef*>(data);
+    zs_.avail_in = static_cast<uInt>(len);
+    size_t total = 0;
+    do {
+        zs_.next_out = out_.data();
+        zs_.avail_out = static_cast<uInt>(out_.size());
+        int ret = inflate(&zs_, Z_SYNC_FLUSH);
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            LOG_ERROR("inflate failed (%d); corrupt compressed frame", ret);
+            return false;
+        }
+        size_t n = out_.size() - zs_.avail_out;
+        total += n;
+        if (total > kMaxInflatedFrame) {
+            LOG_ERROR("Compressed frame inflates past %zu bytes; dropping the connection", kMaxInflatedFrame);
+            return false;
+        }
+        if (n > 0) sink(out_.data(), n);
+        else if (ret == Z_BUF_ERROR) break;
+    } while (zs_.avail_in > 0 || zs_.avail_out == 0);
+    return true;
+}
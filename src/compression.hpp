@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <zlib.h>
+
+// Name both peers put in the hello / hello_ack CONTROL messages.
+constexpr const char* kCompressionDeflate = "deflate";
+
+// Outgoing half of a session's DATA compression. One raw-deflate stream
+// lives for the whole session, so later frames reuse the history of earlier
+// ones; every frame ends on a sync flush so the peer can decode it on arrival.
+class FrameCompressor {
+public:
+    FrameCompressor() = default;
+    ~FrameCompressor();
+
+    FrameCompressor(const FrameCompressor&) = delete;
+    FrameCompressor& operator=(const FrameCompressor&) = delete;
+
+    bool init(size_t headroom);
+    bool active() const { return active_; }
+
+    // False for tiny interactive frames, and for a while after output has
+    // proved incompressible. A skipped frame goes out as plain DATA, which
+    // leaves the stream untouched.
+    bool worth_compressing(size_t len);
+
+    // Compresses one frame. The result stays valid until the next call and
+    // has `headroom` writable bytes in front of it for a frame header.
+    uint8_t* compress(const uint8_t* data, size_t len, size_t& out_len);
+
+private:
+    z_stream zs_{};
+    bool active_ = false;
+    size_t headroom_ = 0;
+    std::vector<uint8_t> out_;
+    int poor_frames_ = 0;
+    size_t skip_bytes_ = 0;
+};
+
+// Incoming half: inflates DATA_COMPRESSED payloads with a stream that
+// mirrors the peer's FrameCompressor.
+class FrameDecompressor {
+public:
+    using Sink = std::function<void(const uint8_t* data, size_t len)>;
+
+    FrameDecompressor() = default;
+    ~FrameDecompressor();
+
+    FrameDecompressor(const FrameDecompressor&) = delete;
+    FrameDecompressor& operator=(const FrameDecompressor&) = delete;
+
+    bool init();
+    bool active() const { return active_; }
+
+    // Feeds one frame's payload; the output is handed to sink in chunks.
+    // Returns false if the stream is corrupt, or the frame inflates past
+    // framing::MAX_PAYLOAD.
+    bool decompress(const uint8_t* data, size_t len, const Sink& sink);
+
+private:
+    z_stream zs_{};
+    bool active_ = false;
+    std::vector<uint8_t> out_;
+};
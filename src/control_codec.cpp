@@ -0,0 +1,162 @@
+#include "control_codec.hpp"
+
+#include <algorithm>
+
+namespace control {
+
+static const size_t kPrefix = 2;
+static const size_t kWinchBody = 4;
+static const size_t kPingBody = 12;
+static const size_t kCreditBody = 4;
+static const size_t kOpenBody = 9;
+static const size_t kChannelBody = 8;
+static const size_t kMarkBody = 4;
+static const size_t kTraceBody = 12;
+
+static void put_be16(uint16_t v, uint8_t* out) {
+    out[0] = static_cast<uint8_t>(v >> 8);
+    out[1] = static_cast<uint8_t>(v);
+}
+
+static void put_be32(uint32_t v, uint8_t* out) {
+    put_be16(static_cast<uint16_t>(v >> 16), out);
+    put_be16(static_cast<uint16_t>(v), out + 2);
+}
+
+static void put_be64(uint64_t v, uint8_t* out) {
+    put_be32(static_cast<uint32_t>(v >> 32), out);
+    put_be32(static_cast<uint32_t>(v), out + 4);
+}
+
+static uint16_t get_be16(const uint8_t* in) {
+    return static_cast<uint16_t>((in[0] << 8) | in[1]);
+}
+
+static uint32_t get_be32(const uint8_t* in) {
+    return (static_cast<uint32_t>(get_be16(in)) << 16) | get_be16(in + 2);
+}
+
+static uint64_t get_be64(const uint8_t* in) {
+    return (static_cast<uint64_t>(get_be32(in)) << 32) | get_be32(in + 4);
+}
+
+size_t encode_winch(uint16_t rows, uint16_t cols, uint8_t* out) {
+    out[0] = kVersion;
+    out[1] = static_cast<uint8_t>(MsgType::WINCH);
+    put_be16(rows, out + 2);
+    put_be16(cols, out + 4);
+    return kPrefix + kWinchBody;
+}
+
+size_t encode_ping(MsgType type, uint32_t seq, uint64_t sent_us, uint8_t* out) {
+    out[0] = kVersion;
+    out[1] = static_cast<uint8_t>(type);
+    put_be32(seq, out + 2);
+    put_be64(sent_us, out + 6);
+    return kPrefix + kPingBody;
+}
+
+size_t encode_credit(uint32_t bytes, uint8_t* out) {
+    out[0] = kVersion;
+    out[1] = static_cast<uint8_t>(MsgType::CREDIT);
+    put_be32(bytes, out + 2);
+    return kPrefix + kCreditBody;
+}
+
+size_t encode_input_mark(uint32_t seq, uint8_t* out) {
+    out[0] = kVersion;
+    out[1] = static_cast<uint8_t>(MsgType::INPUT_MARK);
+    put_be32(seq, out + 2);
+    return kPrefix + kMarkBody;
+}
+
+size_t encode_input_trace(const InputTrace& trace, uint8_t* out) {
+    out[0] = kVersion;
+    out[1] = static_cast<uint8_t>(MsgType::INPUT_TRACE);
+    put_be32(trace.seq, out + 2);
+    put_be32(trace.pty_us, out + 6);
+    put_be32(trace.echo_us, out + 10);
+    return kPrefix + kTraceBody;
+}
+
+size_t encode_channel_open(uint32_t id, uint8_t kind, uint32_t window, const uint8_t* target, size_t target_len,
+                           uint8_t* out) {
+    if (target_len > kMaxChannelTarget) target_len = kMaxChannelTarget;
+    out[0] = kVersion;
+    out[1] = static_cast<uint8_t>(MsgType::CHANNEL_OPEN);
+    put_be32(id, out + 2);
+    out[6] = kind;
+    put_be32(window, out + 7);
+    for (size_t i = 0; i < target_len; ++i) out[kPrefix + kOpenBody + i] = target[i];
+    return kPrefix + kOpenBody + target_len;
+}
+
+size_t encode_channel(MsgType type, uint32_t id, uint32_t bytes, uint8_t* out) {
+    out[0] = kVersion;
+    out[1] = static_cast<uint8_t>(type);
+    put_be32(id, out + 2);
+    put_be32(bytes, out + 6);
+    return kPrefix + kChannelBody;
+}
+
+bool is_json(const uint8_t* data, size_t len) {
+    return len > 0 && data[0] == '{';
+}
+
+bool decode(const uint8_t* data, size_t len, Message& out) {
+    if (len < kPrefix || data[0] != kVersion) return false;
+    const uint8_t* body = data + kPrefix;
+    size_t body_len = len - kPrefix;
+    switch (static_cast<MsgType>(data[1])) {
+    case MsgType::WINCH:
+        if (body_len < kWinchBody) return false;
+        out.type = MsgType::WINCH;
+        out.winch.rows = get_be16(body);
+        out.winch.cols = get_be16(body + 2);
+        return true;
+    case MsgType::PING:
+    case MsgType::PONG:
+        if (body_len < kPingBody) return false;
+        out.type = static_cast<MsgType>(data[1]);
+        out.ping.seq = get_be32(body);
+        out.ping.sent_us = get_be64(body + 4);
+        return true;
+    case MsgType::CREDIT:
+        if (body_len < kCreditBody) return false;
+        out.type = MsgType::CREDIT;
+        out.credit.bytes = get_be32(body);
+        return true;
+    case MsgType::CHANNEL_OPEN:
+        if (body_len < kOpenBody) return false;
+        out.type = MsgType::CHANNEL_OPEN;
+        out.open.id = get_be32(body);
+        out.open.kind = body[4];
+        out.open.window = get_be32(body + 5);
+        out.open.target = body + kOpenBody;
+        out.open.target_len = static_cast<uint16_t>(std::min(body_len - kOpenBody, kMaxChannelTarget));
+        return true;
+    case MsgType::CHANNEL_OPEN_OK:
+    case MsgType::CHANNEL_CLOSE:
+    case MsgType::CHANNEL_WINDOW:
+        if (body_len < kChannelBody) return false;
+        out.type = static_cast<MsgType>(data[1]);
+        out.channel.id = get_be32(body);
+        out.channel.bytes = get_be32(body + 4);
+        return true;
+    case MsgType::INPUT_MARK:
+        if (body_len < kMarkBody) return false;
+        out.type = MsgType::INPUT_MARK;
+        out.trace = InputTrace{get_be32(body), 0, 0};
+        return true;
+    case MsgType::INPUT_TRACE:
+        if (body_len < kTraceBody) return false;
+        out.type = MsgType::INPUT_TRACE;
+        out.trace.seq = get_be32(body);
+        out.trace.pty_us = get_be32(body + 4);
+        out.trace.echo_us = get_be32(body + 8);
+        return true;
+    }
+    return false;
+}
+
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Binary encoding for frequent CONTROL messages. A payload is
+//   [version:1][type:1][fixed body, big-endian]
+// and JSON payloads always start with '{', so receivers tell the two apart
+// from the first byte. Rare or extensible messages (hello, ...) stay JSON.
+// Decoding never allocates or throws, so it is safe on the PTY input path.
+namespace control {
+
+constexpr uint8_t kVersion = 1;
+// Room for any binary message; encoders assume at least this much.
+constexpr size_t kMaxEncodedSize = 16;
+// A channel open carries a target (host:port, path, ...) of up to this many
+// bytes, so its encoding needs a buffer of kMaxOpenSize.
+constexpr size_t kMaxChannelTarget = 255;
+constexpr size_t kMaxOpenSize = 11 + kMaxChannelTarget;
+
+enum class MsgType : uint8_t {
+    WINCH = 1,
+    PING = 2,
+    PONG = 3,
+    CREDIT = 4,
+    CHANNEL_OPEN = 5,
+    CHANNEL_OPEN_OK = 6,
+    CHANNEL_CLOSE = 7,
+    CHANNEL_WINDOW = 8,
+    INPUT_MARK = 9,
+    INPUT_TRACE = 10
+};
+
+struct Winch {
+    uint16_t rows;
+    uint16_t cols;
+};
+
+// A pong echoes the ping's fields back unchanged.
+struct Ping {
+    uint32_t seq;
+    uint64_t sent_us;
+};
+
+// Latency tracing. The client sends INPUT_MARK (only seq is set) just
+// before a DATA frame of keystrokes; the server answers with INPUT_TRACE
+// once the shell has printed something after them: pty_us from the mark's
+// arrival until the keys were written to the PTY, echo_us from that write
+// until the first output read back.
+struct InputTrace {
+    uint32_t seq;
+    uint32_t pty_us;
+    uint32_t echo_us;
+};
+
+// Lets the server send this many more bytes of terminal output.
+struct Credit {
+    uint32_t bytes;
+};
+
+// Asks the peer for a new channel of some kind. window is how many bytes
+// the opener is ready to receive on it; target runs to the end of the
+// payload and points into it.
+struct ChannelOpen {
+    uint32_t id;
+    uint8_t kind;
+    uint32_t window;
+    const uint8_t* target;
+    uint16_t target_len;
+};
+
+// CHANNEL_OPEN_OK carries the accepting side's receive window, and
+// CHANNEL_WINDOW the bytes either side may send next. CHANNEL_CLOSE, as an
+// answer to an open, is a refusal.
+struct Channel {
+    uint32_t id;
+    uint32_t bytes;
+};
+
+struct Message {
+    MsgType type;
+    union {
+        Winch winch;
+        Ping ping;
+        Credit credit;
+        ChannelOpen open;
+        Channel channel;
+        InputTrace trace;
+    };
+};
+
+size_t encode_winch(uint16_t rows, uint16_t cols, uint8_t* out);
+size_t encode_ping(MsgType type, uint32_t seq, uint64_t sent_us, uint8_t* out);
+size_t encode_credit(uint32_t bytes, uint8_t* out);
+size_t encode_input_mark(uint32_t seq, uint8_t* out);
+size_t encode_input_trace(const InputTrace& trace, uint8_t* out);
+// target_len is capped at kMaxChannelTarget.
+size_t encode_channel_open(uint32_t id, uint8_t kind, uint32_t window, const uint8_t* target, size_t target_len,
+                           uint8_t* out);
+// OPEN_OK, WINDOW or CLOSE; bytes is ignored for CLOSE.
+size_t encode_channel(MsgType type, uint32_t id, uint32_t bytes, uint8_t* out);
+
+bool is_json(const uint8_t* data, size_t len);
+
+// False for JSON, unknown versions or types, and short bodies. Bytes past
+// a known body are ignored, so later versions can append fields.
+bool decode(const uint8_t* data, size_t len, Message& out);
+
+}
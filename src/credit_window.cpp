@@ -0,0 +1,44 @@
+#include "credit_window.hpp"
+
+#include <algorithm>
+
+// Until a round trip has been measured, the window adapts this often.
+static const std::chrono::microseconds kDefaultPeriod(100000);
+static const std::chrono::microseconds kMinPeriod(5000);
+
+CreditWindow::CreditWindow(size_t initial, size_t max) : initial_(initial), max_(std::max(max, initial)), window_(initial) {}
+
+size_t CreditWindow::consumed(size_t n, Clock::time_point now) {
+    owed_ += n;
+    period_bytes_ += n;
+    if (period_start_ == Clock::time_point{}) period_start_ = now;
+    auto period = rtt_.count() > 0 ? std::max(rtt_, kMinPeriod) : kDefaultPeriod;
+    if (now - period_start_ >= period) {
+        adapt();
+        period_bytes_ = 0;
+        period_start_ = now;
+    }
+    size_t settle = std::min(withheld_, owed_);
+    withheld_ -= settle;
+    owed_ -= settle;
+    // Grants are batched so bulk output costs one CONTROL frame per quarter
+    // window, not one per DATA frame.
+    if (owed_ < window_ / 4) return 0;
+    size_t grant = owed_;
+    owed_ = 0;
+    return grant;
+}
+
+void CreditWindow::adapt() {
+    if (period_bytes_ * 2 >= window_ && window_ < max_) {
+        // Window-limited: the sender could have used more.
+        size_t grown = std::min(max_, window_ * 2);
+        owed_ += grown - window_;
+        window_ = grown;
+    } else if (period_bytes_ * 8 < window_ && window_ > initial_) {
+        // Output has slowed down; stop covering a burst that is over.
+        size_t shrunk = std::max(initial_, window_ / 2);
+        withheld_ += window_ - shrunk;
+        window_ = shrunk;
+    }
+}
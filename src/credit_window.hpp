@@ -0,0 +1,40 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Receiver side of DATA flow control. The server may only have window()
+// bytes of terminal output on their way to the client; the client hands
+// bytes back as credit once it has written them to its console. The window
+// starts small and doubles while a round trip's worth of output fills half
+// of it, so it settles near twice the bandwidth-delay product: enough to
+// keep the link busy, little enough that Ctrl-C isn't stuck behind seconds
+// of buffered output.
+class CreditWindow {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    CreditWindow(size_t initial, size_t max);
+
+    size_t window() const { return window_; }
+    void set_rtt(std::chrono::microseconds rtt) { rtt_ = rtt; }
+
+    // n bytes of output were written out. Returns the credit to grant now,
+    // or zero to let it build up into a larger grant.
+    size_t consumed(size_t n, Clock::time_point now);
+
+private:
+    void adapt();
+
+    size_t initial_;
+    size_t max_;
+    size_t window_;
+    // Consumed but not granted back yet.
+    size_t owed_ = 0;
+    // Credit kept back to shrink a window already granted.
+    size_t withheld_ = 0;
+    size_t period_bytes_ = 0;
+    Clock::time_point period_start_{};
+    std::chrono::microseconds rtt_{0};
+};
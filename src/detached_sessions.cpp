@@ -0,0 +1,169 @@
+#include "detached_sessions.hpp"
+#include "utils.hpp"
+
+#include <cstring>
+
+#include "mbedtls/constant_time.h"
+
+// Reattach tokens carry this many random bytes (hex-encoded on the wire).
+static const size_t kTokenBytes = 16;
+
+DetachedSessions::DetachedSessions(size_t scrollback_bytes, std::chrono::seconds lifetime, size_t max_parked,
+                                   bool screen_model)
+    : scrollback_bytes_(scrollback_bytes), lifetime_(lifetime), max_parked_(max_parked), screen_model_(screen_model) {
+    mbedtls_entropy_init(&entropy_);
+    mbedtls_ctr_drbg_init(&ctr_drbg_);
+}
+
+DetachedSessions::~DetachedSessions() {
+    // Worker loops are gone by now; ending the shells is all that is left.
+    parked_.clear();
+    mbedtls_ctr_drbg_free(&ctr_drbg_);
+    mbedtls_entropy_free(&entropy_);
+}
+
+bool DetachedSessions::init() {
+    const char* pers = "secure-tunnel-detach";
+    if (mbedtls_ctr_drbg_seed(&ctr_drbg_, mbedtls_entropy_func, &entropy_, (const unsigned char*)pers,
+                              std::strlen(pers)) != 0) {
+        LOG_ERROR("mbedtls_ctr_drbg_seed failed for detach tokens");
+        return false;
+    }
+    LOG_INFO("Detachable sessions enabled: %zu KB scrollback%s, kept %lld s after disconnect",
+             scrollback_bytes_ / 1024, screen_model_ ? " and screen model" : "", (long long)lifetime_.count());
+    return true;
+}
+
+std::unique_ptr<DetachableShell> DetachedSessions::spawn(const std::string& owner) {
+    auto shell = std::make_unique<DetachableShell>(scrollback_bytes_);
+    if (!shell->pty.create_pty_and_fork_shell()) return nullptr;
+    if (screen_model_) shell->screen = std::make_unique<VtScreen>();
+    unsigned char secret[kTokenBytes];
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (mbedtls_ctr_drbg_random(&ctr_drbg_, secret, sizeof(secret)) != 0) return nullptr;
+        shell->id = next_id_++;
+    }
+    static const char* hex = "0123456789abcdef";
+    for (unsigned char b : secret) {
+        shell->token += hex[b >> 4];
+        shell->token += hex[b & 0x0F];
+    }
+    shell->owner = owner;
+    return shell;
+}
+
+void DetachedSessions::park(EventLoop& loop, std::unique_ptr<DetachableShell> shell) {
+    auto parked = std::make_shared<Parked>();
+    uint64_t id = shell->id;
+    parked->shell = std::move(shell);
+    parked->loop = &loop;
+    parked->since = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (parked_.size() >= max_parked_) {
+            LOG_WARN("Shell %llu not kept: %zu detached shells already", (unsigned long long)id, parked_.size());
+            return;
+        }
+        parked_[id] = parked;
+    }
+    int fd = parked->shell->pty.get_master_fd();
+    parked->registered = loop.add(fd, EventLoop::READABLE, [this, parked](uint32_t) { on_parked_events(parked); });
+    parked->timer = loop.add_timer(lifetime_, [this, parked]() {
+        parked->timer = 0;
+        release(parked, "idle lifetime expired");
+    });
+    LOG_INFO("Shell %llu detached: %zu bytes of scrollback, %zu KB held", (unsigned long long)id,
+             parked->shell->scrollback.size(), parked->shell->memory_bytes() / 1024);
+}
+
+void DetachedSessions::on_parked_events(const std::shared_ptr<Parked>& parked) {
+    uint8_t buf[4096];
+    for (;;) {
+        ssize_t r = parked->shell->pty.pty_read_nonblocking((char*)buf, sizeof(buf));
+        if (r < 0) {
+            unregister(*parked);
+            release(parked, "shell exited");
+            return;
+        }
+        if (r == 0) return;
+        // log_report() reads the shell from the manager thread.
+        std::lock_guard<std::mutex> lock(mutex_);
+        parked->shell->record(buf, static_cast<size_t>(r));
+    }
+}
+
+void DetachedSessions::release(const std::shared_ptr<Parked>& parked, const char* why) {
+    uint64_t id = parked->shell->id;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = parked_.find(id);
+        // Already claimed: the claimant's handover task cleans up.
+        if (it == parked_.end() || it->second != parked) return;
+        parked_.erase(it);
+    }
+    unregister(*parked);
+    if (parked->timer) {
+        parked->loop->cancel_timer(parked->timer);
+        parked->timer = 0;
+    }
+    LOG_INFO("Detached shell %llu ended: %s", (unsigned long long)id, why);
+    parked->shell.reset();
+}
+
+void DetachedSessions::unregister(Parked& parked) {
+    if (!parked.registered) return;
+    parked.loop->remove(parked.shell->pty.get_master_fd());
+    parked.registered = false;
+}
+
+void DetachedSessions::claim(uint64_t id, const std::string& token, const std::string& owner, EventLoop& loop,
+                             ClaimFn done) {
+    std::shared_ptr<Parked> parked;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = parked_.find(id);
+        if (it != parked_.end()) {
+            const DetachableShell& shell = *it->second->shell;
+            bool match = token.size() == shell.token.size() &&
+                         mbedtls_ct_memcmp(token.data(), shell.token.data(), token.size()) == 0 &&
+                         owner == shell.owner;
+            if (match) {
+                parked = it->second;
+                parked_.erase(it);
+            }
+        }
+    }
+    if (!parked) {
+        LOG_WARN("Reattach to shell %llu refused: no such detached shell for this client", (unsigned long long)id);
+        loop.post([done]() { done(nullptr); });
+        return;
+    }
+    // The PTY is registered on its old loop; hand it over from there.
+    EventLoop* target = &loop;
+    parked->loop->post([parked, target, done]() {
+        unregister(*parked);
+        if (parked->timer) {
+            parked->loop->cancel_timer(parked->timer);
+            parked->timer = 0;
+        }
+        target->post([parked, done]() { done(std::move(parked->shell)); });
+    });
+}
+
+void DetachedSessions::log_report() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (parked_.empty()) return;
+    auto now = std::chrono::steady_clock::now();
+    size_t total = 0;
+    for (const auto& entry : parked_) {
+        const Parked& parked = *entry.second;
+        const ScrollbackRing& ring = parked.shell->scrollback;
+        size_t held = parked.shell->memory_bytes();
+        double secs = std::chrono::duration<double>(now - parked.since).count();
+        LOG_INFO("  detached shell %llu idle %.0f s: scrollback %zu of %zu bytes, %zu KB allocated",
+                 (unsigned long long)entry.first, secs, ring.size(), ring.capacity(), held / 1024);
+        total += held;
+    }
+    LOG_INFO("%zu detached shells holding %zu KB", parked_.size(), total / 1024);
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "event_loop.hpp"
+#include "pty_handler.hpp"
+#include "scrollback_ring.hpp"
+#include "vt_screen.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+
+// A shell that can outlive the connection it was started for. While a
+// client is attached its ServerBridge owns it; in between, DetachedSessions
+// does and keeps recording output into the scrollback.
+struct DetachableShell {
+    explicit DetachableShell(size_t scrollback_bytes) : scrollback(scrollback_bytes) {}
+
+    // Output the client may need again after reattaching.
+    void record(const uint8_t* data, size_t len) {
+        scrollback.append(data, len);
+        if (screen) screen->feed(data, len);
+    }
+    void resize(int rows, int cols) {
+        pty.apply_window_size(rows, cols);
+        if (screen) screen->resize(rows, cols);
+    }
+    size_t memory_bytes() const { return scrollback.memory_bytes() + (screen ? screen->memory_bytes() : 0); }
+
+    PTYHandler pty;
+    ScrollbackRing scrollback;
+    // What the terminal shows, for a repaint on reattach; null unless enabled.
+    std::unique_ptr<VtScreen> screen;
+    uint64_t id = 0;
+    // Hex secret the client presents to reattach.
+    std::string token;
+    // Fingerprint of the client certificate that started the shell; only
+    // the same certificate may reattach.
+    std::string owner;
+};
+
+// Server-wide registry of shells whose client went away. Each parked shell
+// stays on the worker loop that last served it, which keeps draining its
+// PTY into the scrollback until the shell exits, the idle lifetime runs
+// out, or a client claims it.
+class DetachedSessions {
+public:
+    using ClaimFn = std::function<void(std::unique_ptr<DetachableShell>)>;
+
+    // max_parked: shells kept at once; a shell detached beyond that is ended.
+    // screen_model: track each shell's screen so reattaching can repaint it.
+    DetachedSessions(size_t scrollback_bytes, std::chrono::seconds lifetime, size_t max_parked,
+                     bool screen_model = false);
+    ~DetachedSessions();
+
+    DetachedSessions(const DetachedSessions&) = delete;
+    DetachedSessions& operator=(const DetachedSessions&) = delete;
+
+    bool init();
+
+    // Starts a shell with a fresh id and token. Null if the fork failed.
+    std::unique_ptr<DetachableShell> spawn(const std::string& owner);
+
+    // Takes over a shell whose client disconnected. Must be called on loop's
+    // thread, and the PTY must no longer be registered with loop.
+    void park(EventLoop& loop, std::unique_ptr<DetachableShell> shell);
+
+    // Hands a parked shell to done, run on loop's thread, if id, token and
+    // owner all match; otherwise done gets null. Callable from any thread.
+    void claim(uint64_t id, const std::string& token, const std::string& owner, EventLoop& loop, ClaimFn done);
+
+    // Logs one line per parked shell with its memory use, plus totals.
+    void log_report();
+
+private:
+    struct Parked {
+        std::unique_ptr<DetachableShell> shell;
+        EventLoop* loop = nullptr;
+        uint64_t timer = 0;
+        bool registered = false;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    void on_parked_events(const std::shared_ptr<Parked>& parked);
+    // Drops the entry if it is still parked; runs on the entry's loop.
+    void release(const std::shared_ptr<Parked>& parked, const char* why);
+    static void unregister(Parked& parked);
+
+    size_t scrollback_bytes_;
+    std::chrono::seconds lifetime_;
+    size_t max_parked_;
+    bool screen_model_;
+    std::mutex mutex_; // guards parked_, next_id_ and the DRBG
+    std::map<uint64_t, std::shared_ptr<Parked>> parked_;
+    uint64_t next_id_ = 1;
+    mbedtls_entropy_context entropy_;
+    mbedtls_ctr_drbg_context ctr_drbg_;
+};
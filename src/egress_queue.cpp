@@ -0,0 +1,102 @@
+#include "egress_queue.hpp"
+
+#include <cstring>
+#include <new>
+
+EgressQueue::EgressQueue() : head_(&stub_), tail_(&stub_) {}
+
+EgressQueue::~EgressQueue() {
+    while (Node* node = pop()) free_node(node);
+}
+
+EgressQueue::Node* EgressQueue::new_node() {
+    return new (buffer_pool::allocate(sizeof(Node))) Node;
+}
+
+void EgressQueue::free_node(Node* node) {
+    node->~Node();
+    buffer_pool::release(node);
+}
+
+void EgressQueue::push(framing::FrameType type, const uint8_t* data, size_t len, SendPriority priority) {
+    Node* node = new_node();
+    node->frame.priority = priority;
+    node->frame.bytes = PooledBuffer(framing::HEADER_SIZE + len);
+    framing::write_header(type, len, node->frame.bytes.data());
+    if (len > 0) std::memcpy(node->frame.bytes.data() + framing::HEADER_SIZE, data, len);
+    queued_bytes_.fetch_add(len, std::memory_order_relaxed);
+    link(node);
+    notify();
+}
+
+void EgressQueue::link(Node* node) {
+    node->next.store(nullptr, std::memory_order_relaxed);
+    Node* prev = head_.exchange(node, std::memory_order_acq_rel);
+    // Until this store the consumer sees the queue end at prev; the pusher
+    // notifies afterwards, so the frame is never stranded.
+    prev->next.store(node, std::memory_order_release);
+}
+
+EgressQueue::Node* EgressQueue::pop() {
+    Node* tail = tail_;
+    Node* next = tail->next.load(std::memory_order_acquire);
+    if (tail == &stub_) {
+        if (!next) return nullptr;
+        tail_ = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+        tail_ = next;
+        return tail;
+    }
+    // tail is the last node; a push may be half done.
+    if (tail != head_.load(std::memory_order_acquire)) return nullptr;
+    link(&stub_);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next) {
+        tail_ = next;
+        return tail;
+    }
+    return nullptr;
+}
+
+void EgressQueue::drain(const std::function<void(Frame&)>& fn) {
+    // Pushes from here on schedule another drain.
+    signalled_.store(false, std::memory_order_seq_cst);
+    Node* bulk = nullptr;
+    Node** bulk_end = &bulk;
+    while (Node* node = pop()) {
+        queued_bytes_.fetch_sub(node->frame.bytes.size() - framing::HEADER_SIZE, std::memory_order_relaxed);
+        if (node->frame.priority == SendPriority::URGENT) {
+            fn(node->frame);
+            free_node(node);
+        } else {
+            node->held = nullptr;
+            *bulk_end = node;
+            bulk_end = &node->held;
+        }
+    }
+    while (bulk) {
+        Node* node = bulk;
+        bulk = node->held;
+        fn(node->frame);
+        free_node(node);
+    }
+}
+
+void EgressQueue::set_notify(std::function<void()> fn) {
+    std::lock_guard<std::mutex> lock(notify_mutex_);
+    notify_ = std::move(fn);
+    // Frames pushed before there was anyone to tell.
+    if (notify_) {
+        signalled_.store(true, std::memory_order_seq_cst);
+        notify_();
+    }
+}
+
+void EgressQueue::notify() {
+    if (signalled_.exchange(true, std::memory_order_seq_cst)) return;
+    std::lock_guard<std::mutex> lock(notify_mutex_);
+    if (notify_) notify_();
+}
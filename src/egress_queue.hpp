@@ -0,0 +1,73 @@
+#pragma once
+
+#include "buffer_pool.hpp"
+#include "framing.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Urgent frames (control messages, keystrokes) may be sent ahead of bulk
+// output that is still queued, never ahead of each other. Frames of one
+// deflate stream must therefore all share a priority.
+enum class SendPriority : uint8_t { BULK, URGENT };
+
+// Frames headed for one connection from threads that don't own it. Any
+// thread may push without taking a lock (Vyukov's intrusive MPSC queue);
+// only the connection's I/O owner drains, on its own thread. The owner sets
+// a notify callback, run by the pusher that finds the queue idle.
+class EgressQueue {
+public:
+    struct Frame {
+        SendPriority priority;
+        // Header and payload, ready to write.
+        PooledBuffer bytes;
+    };
+
+    EgressQueue();
+    ~EgressQueue();
+
+    EgressQueue(const EgressQueue&) = delete;
+    EgressQueue& operator=(const EgressQueue&) = delete;
+
+    // Any thread. Copies the payload into a frame drawn from the buffer
+    // pool, so a warm queue doesn't touch the heap.
+    void push(framing::FrameType type, const uint8_t* data, size_t len, SendPriority priority);
+    // Payload bytes pushed and not yet drained, for producers that must not
+    // run ahead of the connection.
+    size_t queued_bytes() const { return queued_bytes_.load(std::memory_order_relaxed); }
+
+    // Owner only. Hands every queued frame to fn, urgent ones first and
+    // otherwise in push order.
+    void drain(const std::function<void(Frame&)>& fn);
+    // Owner only. Null stops notifications; frames pushed meanwhile wait
+    // for the next drain().
+    void set_notify(std::function<void()> fn);
+
+private:
+    struct Node {
+        std::atomic<Node*> next{nullptr};
+        // Chains bulk frames held back during a drain.
+        Node* held = nullptr;
+        Frame frame;
+    };
+
+    static Node* new_node();
+    static void free_node(Node* node);
+
+    void link(Node* node);
+    Node* pop();
+    void notify();
+
+    std::atomic<Node*> head_; // producers
+    Node* tail_;              // owner
+    Node stub_;
+    std::atomic<size_t> queued_bytes_{0};
+    // Set by the pusher that schedules a drain, cleared as the drain starts.
+    std::atomic<bool> signalled_{false};
+    std::mutex notify_mutex_;
+    std::function<void()> notify_;
+};
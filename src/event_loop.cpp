@@ -0,0 +1,187 @@
+#include "event_loop.hpp"
+#include "utils.hpp"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+
+static uint32_t to_epoll(uint32_t events) {
+    uint32_t ev = 0;
+    if (events & EventLoop::READABLE) ev |= EPOLLIN;
+    if (events & EventLoop::WRITABLE) ev |= EPOLLOUT;
+    return ev;
+}
+
+EventLoop::EventLoop() {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ < 0) {
+        LOG_ERROR("epoll_create1() failed: %s", error_to_string(errno).c_str());
+        return;
+    }
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd_ < 0) {
+        LOG_ERROR("eventfd() failed: %s", error_to_string(errno).c_str());
+        return;
+    }
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd_ < 0) {
+        LOG_ERROR("timerfd_create() failed: %s", error_to_string(errno).c_str());
+        return;
+    }
+    for (int fd : {wake_fd_, timer_fd_}) {
+        struct epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+EventLoop::~EventLoop() {
+    if (timer_fd_ >= 0) {
+        close(timer_fd_);
+    }
+    if (wake_fd_ >= 0) {
+        close(wake_fd_);
+    }
+    if (epoll_fd_ >= 0) {
+        close(epoll_fd_);
+    }
+}
+
+bool EventLoop::add(int fd, uint32_t events, Handler handler) {
+    struct epoll_event ev{};
+    ev.events = to_epoll(events);
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        LOG_ERROR("epoll_ctl(ADD, %d) failed: %s", fd, error_to_string(errno).c_str());
+        return false;
+    }
+    handlers_[fd] = std::make_shared<Handler>(std::move(handler));
+    return true;
+}
+
+bool EventLoop::modify(int fd, uint32_t events) {
+    struct epoll_event ev{};
+    ev.events = to_epoll(events);
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        LOG_ERROR("epoll_ctl(MOD, %d) failed: %s", fd, error_to_string(errno).c_str());
+        return false;
+    }
+    return true;
+}
+
+void EventLoop::remove(int fd) {
+    if (handlers_.erase(fd) == 0) return;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+uint64_t EventLoop::add_timer(Clock::duration delay, Task task) {
+    uint64_t id = next_timer_id_++;
+    Clock::time_point when = Clock::now() + delay;
+    timer_queue_.emplace(when, id);
+    timers_.emplace(id, std::make_pair(when, std::move(task)));
+    arm_timer_fd();
+    return id;
+}
+
+void EventLoop::cancel_timer(uint64_t id) {
+    auto it = timers_.find(id);
+    if (it == timers_.end()) return;
+    timer_queue_.erase(std::make_pair(it->second.first, id));
+    timers_.erase(it);
+    // Leaving the timerfd armed for a cancelled deadline only costs one
+    // spurious wakeup, which is cheaper than re-arming on every cancel.
+}
+
+void EventLoop::post(Task task) {
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex_);
+        posted_.push_back(std::move(task));
+    }
+    uint64_t one = 1;
+    ssize_t n = write(wake_fd_, &one, sizeof(one));
+    (void)n;
+}
+
+void EventLoop::stop() {
+    post([this]() { running_ = false; });
+}
+
+void EventLoop::arm_timer_fd() {
+    if (timer_queue_.empty()) return;
+    Clock::time_point when = timer_queue_.begin()->first;
+    if (armed_for_ != Clock::time_point{} && armed_for_ <= when) return;
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+    struct itimerspec spec{};
+    spec.it_value.tv_sec = static_cast<time_t>(ns / 1000000000);
+    spec.it_value.tv_nsec = static_cast<long>(ns % 1000000000);
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) spec.it_value.tv_nsec = 1;
+    timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr);
+    armed_for_ = when;
+}
+
+void EventLoop::run_timers() {
+    uint64_t expirations = 0;
+    ssize_t n = read(timer_fd_, &expirations, sizeof(expirations));
+    (void)n;
+    armed_for_ = Clock::time_point{};
+    Clock::time_point now = Clock::now();
+    while (running_ && !timer_queue_.empty() && timer_queue_.begin()->first <= now) {
+        uint64_t id = timer_queue_.begin()->second;
+        timer_queue_.erase(timer_queue_.begin());
+        auto it = timers_.find(id);
+        Task task = std::move(it->second.second);
+        timers_.erase(it);
+        task();
+    }
+    arm_timer_fd();
+}
+
+void EventLoop::run_posted() {
+    uint64_t count = 0;
+    ssize_t n = read(wake_fd_, &count, sizeof(count));
+    (void)n;
+    std::vector<Task> tasks;
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex_);
+        tasks.swap(posted_);
+    }
+    for (auto& task : tasks) {
+        task();
+    }
+}
+
+void EventLoop::run() {
+    running_ = true;
+    struct epoll_event events[64];
+    while (running_) {
+        int n = epoll_wait(epoll_fd_, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERROR("epoll_wait() failed: %s", error_to_string(errno).c_str());
+            break;
+        }
+        for (int i = 0; i < n && running_; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == wake_fd_) {
+                run_posted();
+                continue;
+            }
+            if (fd == timer_fd_) {
+                run_timers();
+                continue;
+            }
+            auto it = handlers_.find(fd);
+            if (it == handlers_.end()) continue; // removed by an earlier handler
+            uint32_t fired = 0;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) fired |= READABLE;
+            if (events[i].events & EPOLLOUT) fired |= WRITABLE;
+            // Hold a reference so the handler may remove itself safely.
+            std::shared_ptr<Handler> h = it->second;
+            (*h)(fired);
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Single-threaded epoll reactor. Handlers, timers and posted tasks all run on
+// the thread that calls run(); an idle loop blocks in epoll_wait with no
+// timeout, so it costs no CPU.
+class EventLoop {
+public:
+    enum : uint32_t {
+        READABLE = 1u << 0,
+        WRITABLE = 1u << 1
+    };
+
+    // Receives the READABLE/WRITABLE bits that fired. Hang-up and error
+    // conditions are reported as READABLE so the owner sees EOF on read.
+    using Handler = std::function<void(uint32_t events)>;
+    using Task = std::function<void()>;
+    using Clock = std::chrono::steady_clock;
+
+    EventLoop();
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    bool valid() const { return epoll_fd_ >= 0 && wake_fd_ >= 0 && timer_fd_ >= 0; }
+
+    bool add(int fd, uint32_t events, Handler handler);
+    bool modify(int fd, uint32_t events);
+    void remove(int fd);
+
+    // One-shot timer with sub-millisecond precision; returns an id for
+    // cancel_timer(). Ids are never 0.
+    uint64_t add_timer(Clock::duration delay, Task task);
+    void cancel_timer(uint64_t id);
+
+    // Safe to call from any thread; the task runs on the loop thread.
+    void post(Task task);
+
+    void run();
+    // Safe to call from any thread.
+    void stop();
+
+private:
+    void arm_timer_fd();
+    void run_timers();
+    void run_posted();
+
+    int epoll_fd_ = -1;
+    int wake_fd_ = -1;
+    int timer_fd_ = -1;
+    Clock::time_point armed_for_{};
+    bool running_ = false;
+    std::unordered_map<int, std::shared_ptr<Handler>> handlers_;
+
+    uint64_t next_timer_id_ = 1;
+    std::set<std::pair<Clock::time_point, uint64_t>> timer_queue_;
+    std::map<uint64_t, std::pair<Clock::time_point, Task>> timers_;
+
+    std::mutex posted_mutex_;
+    std::vector<Task> posted_;
+};
@@ -0,0 +1,434 @@
+#include "file_transfer.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A sender keeps this much queued on its channel, read from the file in
+// chunks of kSendChunk. Reading rather than mapping it means a file cut
+// short mid-transfer fails the transfer instead of raising SIGBUS.
+static const size_t kSendAhead = 256 * 1024;
+static const size_t kSendChunk = 64 * 1024;
+// A receiver gathers this much before writing, so a 16 KB frame isn't a
+// write() of its own.
+static const size_t kWriteBatch = 256 * 1024;
+static const size_t kHashSize = 32;
+static const size_t kHeaderSize = 16;
+
+static void put_u64(uint8_t* p, uint64_t v) {
+    for (int i = 7; i >= 0; --i) {
+        p[i] = static_cast<uint8_t>(v);
+        v >>= 8;
+    }
+}
+
+static uint64_t get_u64(const uint8_t* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v = (v << 8) | p[i];
+    return v;
+}
+
+static std::string base_name(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+static bool write_all(int fd, const uint8_t* data, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += w;
+        len -= static_cast<size_t>(w);
+    }
+    return true;
+}
+
+// Hashes the first len bytes of fd: what a resumed receiver already has.
+// On failure errno is set, or 0 if the file is shorter than len.
+static bool hash_prefix(int fd, uint64_t len, mbedtls_sha256_context& sha) {
+    std::vector<uint8_t> buf(kWriteBatch);
+    uint64_t off = 0;
+    while (off < len) {
+        size_t want = static_cast<size_t>(std::min<uint64_t>(buf.size(), len - off));
+        ssize_t r = pread(fd, buf.data(), want, static_cast<off_t>(off));
+        if (r < 0 && errno == EINTR) continue;
+        if (r == 0) errno = 0;
+        if (r <= 0) return false;
+        mbedtls_sha256_update(&sha, buf.data(), static_cast<size_t>(r));
+        off += static_cast<uint64_t>(r);
+    }
+    return true;
+}
+
+FileTransfers::Transfer::Transfer() {
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+}
+
+FileTransfers::Transfer::~Transfer() {
+    if (fd >= 0) close(fd);
+    mbedtls_sha256_free(&sha);
+}
+
+FileTransfers::FileTransfers(ChannelMux& mux, bool accept_requests) : mux_(mux), accept_requests_(accept_requests) {}
+
+FileTransfers::~FileTransfers() {
+    close_all();
+}
+
+bool FileTransfers::send(const std::string& path) {
+    std::string name = base_name(path);
+    if (name.empty()) {
+        LOG_ERROR("Can't send %s: not a file name", path.c_str());
+        failed_ = true;
+        return false;
+    }
+    Transfer* t = add(true, true, name, path);
+    if (!open_source(t)) {
+        drop(t);
+        failed_ = true;
+        return false;
+    }
+    t->phase = Phase::WANT_HAVE;
+    t->id = mux_.open(static_cast<uint8_t>(ChannelKind::FILE_PUT), name, handler(t));
+    ++pending_;
+    return true;
+}
+
+bool FileTransfers::receive(const std::string& path) {
+    std::string name = base_name(path);
+    if (name.empty()) {
+        LOG_ERROR("Can't receive %s: not a file name", path.c_str());
+        failed_ = true;
+        return false;
+    }
+    Transfer* t = add(false, true, name, name);
+    if (!open_part(t)) {
+        drop(t);
+        failed_ = true;
+        return false;
+    }
+    t->phase = Phase::WANT_HEADER;
+    t->id = mux_.open(static_cast<uint8_t>(ChannelKind::FILE_GET), path, handler(t));
+    ++pending_;
+    return true;
+}
+
+bool FileTransfers::accept(uint32_t id, uint8_t kind, const std::string& target, ChannelMux::Handler& handler_out) {
+    bool put = kind == static_cast<uint8_t>(ChannelKind::FILE_PUT);
+    if (!put && kind != static_cast<uint8_t>(ChannelKind::FILE_GET)) return false;
+    if (!accept_requests_ || target.empty()) return false;
+    Transfer* t = add(!put, false, target, target);
+    bool ok = put ? open_part(t) : open_source(t);
+    if (!ok) {
+        drop(t);
+        return false;
+    }
+    t->id = id;
+    t->phase = put ? Phase::WANT_HEADER : Phase::WANT_HAVE;
+    LOG_INFO("Channel %u: %s %s", id, put ? "receiving" : "sending", target.c_str());
+    handler_out = handler(t);
+    return true;
+}
+
+void FileTransfers::close_all() {
+    // Dropping a transfer closes its channel, which may call back in here.
+    std::unordered_map<Transfer*, std::unique_ptr<Transfer>> transfers;
+    transfers.swap(transfers_);
+    for (auto& entry : transfers) {
+        Transfer* t = entry.first;
+        if (!t->sending) flush(t);
+        if (t->ours && !t->done) {
+            std::printf("%s: interrupted\n", t->name.c_str());
+            failed_ = true;
+        }
+        mux_.close(t->id);
+    }
+    pending_ = 0;
+}
+
+FileTransfers::Transfer* FileTransfers::add(bool sending, bool ours, std::string name, std::string path) {
+    auto transfer = std::make_unique<Transfer>();
+    Transfer* t = transfer.get();
+    t->sending = sending;
+    t->ours = ours;
+    t->name = std::move(name);
+    t->path = std::move(path);
+    t->started = std::chrono::steady_clock::now();
+    transfers_[t] = std::move(transfer);
+    return t;
+}
+
+bool FileTransfers::open_source(Transfer* t) {
+    t->fd = open(t->path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st{};
+    if (t->fd < 0 || fstat(t->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        LOG_ERROR("Can't send %s: %s", t->path.c_str(), t->fd < 0 ? strerror(errno) : "not a regular file");
+        return false;
+    }
+    t->size = static_cast<uint64_t>(st.st_size);
+    // Read ahead aggressively.
+    posix_fadvise(t->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return true;
+}
+
+bool FileTransfers::open_part(Transfer* t) {
+    t->part = t->path + ".part";
+    t->fd = open(t->part.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (t->fd < 0) {
+        LOG_ERROR("Can't write %s: %s", t->part.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+ChannelMux::Handler FileTransfers::handler(Transfer* t) {
+    ChannelMux::Handler h;
+    h.on_open = [this, t]() {
+        if (transfers_.count(t)) on_open(t);
+    };
+    h.on_data = [this, t](const uint8_t* data, size_t len) {
+        if (transfers_.count(t)) on_data(t, data, len);
+    };
+    h.on_drained = [this, t]() {
+        if (transfers_.count(t)) fill(t);
+    };
+    h.on_close = [this, t]() {
+        if (!transfers_.count(t)) return;
+        if (!t->sending) flush(t);
+        fail(t, t->phase == (t->sending ? Phase::WANT_HAVE : Phase::WANT_HEADER) ? "refused" : "interrupted");
+    };
+    return h;
+}
+
+void FileTransfers::on_open(Transfer* t) {
+    // The receiver speaks first, with what it kept from an earlier try.
+    if (t->sending) return;
+    struct stat st{};
+    fstat(t->fd, &st);
+    send_u64(t, static_cast<uint64_t>(st.st_size));
+}
+
+void FileTransfers::on_data(Transfer* t, const uint8_t* data, size_t len) {
+    // Taken in full before returning: written, buffered, or a short message.
+    mux_.consumed(t->id, len);
+    while (len > 0) {
+        if (t->phase == Phase::DATA) {
+            if (t->sending) {
+                fail(t, "unexpected data");
+                return;
+            }
+            size_t n = static_cast<size_t>(std::min<uint64_t>(len, t->size - t->pos));
+            if (!write_data(t, data, n)) return;
+            data += n;
+            len -= n;
+            if (t->pos == t->size) t->phase = Phase::WANT_HASH;
+            continue;
+        }
+        size_t need = 0;
+        switch (t->phase) {
+        case Phase::WANT_HAVE: need = 8; break;
+        case Phase::WANT_HEADER: need = kHeaderSize; break;
+        case Phase::WANT_HASH: need = kHashSize; break;
+        case Phase::WANT_STATUS: need = 1; break;
+        case Phase::DATA: break;
+        }
+        size_t n = std::min(len, need - t->in.size());
+        t->in.insert(t->in.end(), data, data + n);
+        data += n;
+        len -= n;
+        if (t->in.size() < need) return;
+        if (!on_message(t)) return;
+        t->in.clear();
+    }
+}
+
+// A complete header or trailer is in t->in. False once t is gone.
+bool FileTransfers::on_message(Transfer* t) {
+    switch (t->phase) {
+    case Phase::WANT_HAVE: {
+        uint64_t have = get_u64(t->in.data());
+        // Anything past the end is from a different file; start over.
+        t->start = have <= t->size ? have : 0;
+        uint8_t header[kHeaderSize];
+        put_u64(header, t->size);
+        put_u64(header + 8, t->start);
+        mux_.send(t->id, header, sizeof(header));
+        if (!hash_prefix(t->fd, t->start, t->sha)) {
+            fail(t, errno ? strerror(errno) : "the file shrank");
+            return false;
+        }
+        t->pos = t->start;
+        t->phase = Phase::DATA;
+        fill(t);
+        return transfers_.count(t) != 0;
+    }
+    case Phase::WANT_HEADER:
+        return on_header(t);
+    case Phase::WANT_HASH:
+        return on_hash(t);
+    case Phase::WANT_STATUS:
+        if (t->in[0] == 0) {
+            end(t, true, nullptr);
+        } else {
+            fail(t, t->in[0] == 1 ? "hash mismatch" : "the receiver couldn't store it");
+        }
+        return false;
+    case Phase::DATA:
+        break;
+    }
+    return true;
+}
+
+bool FileTransfers::on_header(Transfer* t) {
+    t->size = get_u64(t->in.data());
+    t->start = get_u64(t->in.data() + 8);
+    struct stat st{};
+    if (t->start > t->size || fstat(t->fd, &st) != 0 || t->start > static_cast<uint64_t>(st.st_size)) {
+        fail(t, "bad header");
+        return false;
+    }
+    // Keep the agreed prefix, and hash it, since the sender's hash covers it.
+    if (ftruncate(t->fd, static_cast<off_t>(t->start)) != 0 || !hash_prefix(t->fd, t->start, t->sha) ||
+        lseek(t->fd, static_cast<off_t>(t->start), SEEK_SET) < 0) {
+        fail(t, errno ? strerror(errno) : "the partial file shrank");
+        return false;
+    }
+    if (t->start > 0) LOG_INFO("%s: resuming at byte %llu", t->name.c_str(), (unsigned long long)t->start);
+    t->pos = t->start;
+    t->out.reserve(kWriteBatch);
+    t->phase = t->pos == t->size ? Phase::WANT_HASH : Phase::DATA;
+    return true;
+}
+
+bool FileTransfers::on_hash(Transfer* t) {
+    uint8_t hash[kHashSize];
+    mbedtls_sha256_finish(&t->sha, hash);
+    uint8_t status = 0;
+    // Taken before mux_.send() can overwrite errno.
+    int err = 0;
+    if (!flush(t)) {
+        err = errno;
+        status = 2;
+    } else if (std::memcmp(hash, t->in.data(), kHashSize) != 0) {
+        // Likely a stale prefix; the next try starts from scratch.
+        unlink(t->part.c_str());
+        status = 1;
+    } else if (rename(t->part.c_str(), t->path.c_str()) != 0) {
+        err = errno;
+        status = 2;
+    }
+    mux_.send(t->id, &status, 1);
+    if (status == 0) {
+        end(t, true, nullptr);
+    } else {
+        fail(t, status == 1 ? "hash mismatch" : strerror(err));
+    }
+    return false;
+}
+
+bool FileTransfers::write_data(Transfer* t, const uint8_t* data, size_t len) {
+    mbedtls_sha256_update(&t->sha, data, len);
+    t->pos += len;
+    if (t->out.size() + len > kWriteBatch && !flush(t)) {
+        fail(t, strerror(errno));
+        return false;
+    }
+    if (len >= kWriteBatch) {
+        if (!write_all(t->fd, data, len)) {
+            fail(t, strerror(errno));
+            return false;
+        }
+        return true;
+    }
+    t->out.insert(t->out.end(), data, data + len);
+    return true;
+}
+
+bool FileTransfers::flush(Transfer* t) {
+    if (t->out.empty() || t->fd < 0) return true;
+    bool ok = write_all(t->fd, t->out.data(), t->out.size());
+    t->out.clear();
+    return ok;
+}
+
+void FileTransfers::fill(Transfer* t) {
+    // mux_.send() may drain the queue and call back in here.
+    if (!t->sending || t->phase != Phase::DATA || t->filling) return;
+    t->filling = true;
+    t->chunk.resize(kSendChunk);
+    while (t->pos < t->size && mux_.queued(t->id) < kSendAhead) {
+        size_t want = static_cast<size_t>(std::min<uint64_t>(kSendChunk, t->size - t->pos));
+        ssize_t r = pread(t->fd, t->chunk.data(), want, static_cast<off_t>(t->pos));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            // Cut short or unreadable since the size was sent.
+            fail(t, r < 0 ? strerror(errno) : "the file shrank");
+            return;
+        }
+        size_t n = static_cast<size_t>(r);
+        mbedtls_sha256_update(&t->sha, t->chunk.data(), n);
+        mux_.send(t->id, t->chunk.data(), n);
+        t->pos += n;
+    }
+    if (t->pos == t->size) {
+        uint8_t hash[kHashSize];
+        mbedtls_sha256_finish(&t->sha, hash);
+        mux_.send(t->id, hash, sizeof(hash));
+        t->phase = Phase::WANT_STATUS;
+    }
+    t->filling = false;
+}
+
+void FileTransfers::send_u64(Transfer* t, uint64_t v) {
+    uint8_t buf[8];
+    put_u64(buf, v);
+    mux_.send(t->id, buf, sizeof(buf));
+}
+
+void FileTransfers::fail(Transfer* t, const char* why) {
+    end(t, false, why);
+}
+
+void FileTransfers::end(Transfer* t, bool ok, const char* why) {
+    t->done = true;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t->started).count();
+    double mb = (t->pos - t->start) / (1024.0 * 1024.0);
+    if (t->ours) {
+        if (ok) {
+            std::printf("%s %s: %.1f MB in %.2f s (%.1f MB/s)\n", t->sending ? "Sent" : "Received", t->name.c_str(), mb,
+                        seconds, seconds > 0 ? mb / seconds : 0.0);
+        } else {
+            std::printf("%s: failed (%s)\n", t->name.c_str(), why);
+            failed_ = true;
+        }
+        std::fflush(stdout);
+    } else if (ok) {
+        LOG_INFO("Channel %u: %s %s, %.1f MB in %.2f s", t->id, t->sending ? "sent" : "stored", t->name.c_str(), mb,
+                 seconds);
+    } else {
+        LOG_WARN("Channel %u: transfer of %s failed (%s)", t->id, t->name.c_str(), why);
+    }
+    drop(t);
+}
+
+void FileTransfers::drop(Transfer* t) {
+    auto it = transfers_.find(t);
+    if (it == transfers_.end()) return;
+    std::unique_ptr<Transfer> owned = std::move(it->second);
+    transfers_.erase(it);
+    // Not counted or opened until its file was ready.
+    if (t->id == 0) return;
+    // A receiver's status is still queued; close() sends it first.
+    mux_.close(t->id);
+    if (t->ours && --pending_ == 0 && on_done) on_done();
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "channel_mux.hpp"
+
+#include "mbedtls/sha256.h"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// File transfers over a session's channels, next to the shell rather than
+// through it, so binary files arrive intact. Each file is one channel:
+//
+//   receiver -> sender    [have:8]            bytes kept from an earlier try
+//   sender   -> receiver  [size:8][start:8]   start is have, or 0 past the end
+//   sender   -> receiver  bytes [start, size), then SHA-256 of the whole file
+//   receiver -> sender    [status:1]          0 once the file is in place
+//
+// Integers are big-endian. The receiver writes to "<path>.part" and renames
+// it once the hash matches, so an interrupted transfer picks up where the
+// kept bytes end. Data streams under the channel's credit window, which
+// grows to cover the link, with no acknowledgement per chunk.
+class FileTransfers {
+public:
+    // accept_requests: let the peer store and fetch files on this host.
+    FileTransfers(ChannelMux& mux, bool accept_requests);
+    ~FileTransfers();
+
+    FileTransfers(const FileTransfers&) = delete;
+    FileTransfers& operator=(const FileTransfers&) = delete;
+
+    // Uploads path to the peer's working directory under its base name.
+    // False if the file can't be read.
+    bool send(const std::string& path);
+    // Downloads the peer's path to the working directory under its base name.
+    bool receive(const std::string& path);
+
+    // For the owner's ChannelMux::on_open_request; false for kinds that
+    // aren't file transfers.
+    bool accept(uint32_t id, uint8_t kind, const std::string& target, ChannelMux::Handler& handler);
+
+    // Transfers started here that haven't ended.
+    size_t pending() const { return pending_; }
+    // A transfer started here failed.
+    bool failed() const { return failed_; }
+    // Ends every transfer, keeping what receivers have so far for a resume.
+    void close_all();
+
+    // The last transfer started here has ended.
+    std::function<void()> on_done;
+
+private:
+    enum class Phase {
+        // Sender: waiting for the receiver's [have].
+        WANT_HAVE,
+        // Receiver: waiting for [size][start].
+        WANT_HEADER,
+        DATA,
+        // Receiver: waiting for the hash.
+        WANT_HASH,
+        // Sender: everything sent, waiting for [status].
+        WANT_STATUS
+    };
+
+    struct Transfer {
+        uint32_t id = 0;
+        bool sending = false;
+        // Started here: reported, and counted in pending().
+        bool ours = false;
+        bool done = false;
+        std::string name;
+        // Sender: the source. Receiver: the destination; data goes to part.
+        std::string path;
+        std::string part;
+        int fd = -1;
+        uint64_t size = 0;
+        uint64_t start = 0;
+        // Next byte to send or expected.
+        uint64_t pos = 0;
+        Phase phase = Phase::DATA;
+        // A header or trailer split across frames.
+        std::vector<uint8_t> in;
+        // Receiver: bytes not yet written to part.
+        std::vector<uint8_t> out;
+        // Sender: the chunk being sent, reused.
+        std::vector<uint8_t> chunk;
+        bool filling = false;
+        mbedtls_sha256_context sha;
+        std::chrono::steady_clock::time_point started;
+
+        Transfer();
+        ~Transfer();
+    };
+
+    Transfer* add(bool sending, bool ours, std::string name, std::string path);
+    bool open_source(Transfer* t);
+    bool open_part(Transfer* t);
+    ChannelMux::Handler handler(Transfer* t);
+    void on_open(Transfer* t);
+    void on_data(Transfer* t, const uint8_t* data, size_t len);
+    bool on_message(Transfer* t);
+    bool on_header(Transfer* t);
+    bool on_hash(Transfer* t);
+    bool write_data(Transfer* t, const uint8_t* data, size_t len);
+    bool flush(Transfer* t);
+    void fill(Transfer* t);
+    void send_u64(Transfer* t, uint64_t v);
+    void fail(Transfer* t, const char* why);
+    void end(Transfer* t, bool ok, const char* why);
+    void drop(Transfer* t);
+
+    ChannelMux& mux_;
+    bool accept_requests_;
+    std::unordered_map<Transfer*, std::unique_ptr<Transfer>> transfers_;
+    size_t pending_ = 0;
+    bool failed_ = false;
+};
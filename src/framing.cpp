@@ -1,5 +1,7 @@
 #include "framing.hpp"
 
+#include <algorithm>
+
 namespace framing {
 
 static void write_be32(uint32_t v, uint8_t out[4]) {
@@ -9,17 +11,86 @@ static void write_be32(uint32_t v, uint8_t out[4]) {
     out[3] = static_cast<uint8_t>(v & 0xFF);
 }
 
+static uint32_t read_be32(const uint8_t in[4]) {
+    return (static_cast<uint32_t>(in[0]) << 24) | (static_cast<uint32_t>(in[1]) << 16) |
+           (static_cast<uint32_t>(in[2]) << 8) | static_cast<uint32_t>(in[3]);
+}
+
 std::vector<uint8_t> build_frame(FrameType type, const std::vector<uint8_t>& payload) {
-    std::vector<uint8_t> frame;
-    frame.reserve(1 + 4 + payload.size());
+    std::vector<uint8_t> frame(HEADER_SIZE + payload.size());
+    write_header(type, payload.size(), frame.data());
+    std::copy(payload.begin(), payload.end(), frame.begin() + HEADER_SIZE);
+    return frame;
+}
 
-    frame.push_back(static_cast<uint8_t>(type));
-    uint8_t len[4];
-    write_be32(static_cast<uint32_t>(payload.size()), len);
-    frame.insert(frame.end(), len, len + 4);
-    frame.insert(frame.end(), payload.begin(), payload.end());
+void write_header(FrameType type, size_t len, uint8_t* out) {
+    out[0] = static_cast<uint8_t>(type);
+    write_be32(static_cast<uint32_t>(len), out + 1);
+}
+
+void write_channel_header(FrameType type, uint32_t channel, size_t len, uint8_t* out) {
+    out[0] = static_cast<uint8_t>(type) | CHANNEL_FLAG;
+    write_be32(static_cast<uint32_t>(len + 4), out + 1);
+    write_be32(channel, out + HEADER_SIZE);
+}
 
+uint8_t* frame_in_place(FrameType type, uint8_t* payload, size_t len) {
+    uint8_t* frame = payload - HEADER_SIZE;
+    write_header(type, len, frame);
     return frame;
 }
 
-}
\ No newline at end of file
+void FrameDecoder::reset() {
+    complete_ = false;
+    in_payload_ = false;
+    got_ = 0;
+    channel_ = 0;
+}
+
+size_t FrameDecoder::header_size() const {
+    // The flag is only known once the type byte is in.
+    if (got_ > 0 && (header_[0] & CHANNEL_FLAG)) return CHANNEL_HEADER_SIZE;
+    return HEADER_SIZE;
+}
+
+uint8_t* FrameDecoder::next_buffer() {
+    if (complete_) reset();
+    if (in_payload_) return payload_.data() + got_;
+    return header_ + got_;
+}
+
+size_t FrameDecoder::next_size() const {
+    if (error_) return 0;
+    if (complete_) return HEADER_SIZE;
+    if (in_payload_) return len_ - got_;
+    return header_size() - got_;
+}
+
+bool FrameDecoder::advance(size_t n) {
+    if (complete_) reset();
+    got_ += n;
+    if (!in_payload_) {
+        if (got_ < header_size()) return false;
+        len_ = read_be32(header_ + 1);
+        if (header_[0] & CHANNEL_FLAG) {
+            if (len_ < 4) {
+                error_ = true;
+                return false;
+            }
+            len_ -= 4;
+            channel_ = read_be32(header_ + HEADER_SIZE);
+        }
+        if (len_ > MAX_PAYLOAD) {
+            error_ = true;
+            return false;
+        }
+        payload_.resize(len_);
+        in_payload_ = true;
+        got_ = 0;
+    }
+    if (got_ < len_) return false;
+    complete_ = true;
+    return true;
+}
+
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <vector>
 
@@ -7,11 +8,69 @@ namespace framing {
 
 enum class FrameType : uint8_t {
     CONTROL = 1,
-    DATA = 2
+    DATA = 2,
+    // DATA payload from the sender's session-long deflate stream; only sent
+    // once compression has been agreed through hello / hello_ack.
+    DATA_COMPRESSED = 3
 };
 
 // Simple frame format:
 // [type:1][len:4 big-endian][payload:len]
+constexpr size_t HEADER_SIZE = 5;
+// Frames of a multiplexed channel set this bit in the type and put the
+// channel ID ahead of the payload, counted in len:
+// [type|CHANNEL_FLAG:1][len:4][channel:4 big-endian][payload:len-4]
+// The session's own stream is channel 0 and keeps the plain header, and a
+// peer that doesn't know the bit skips these frames as an unknown type.
+constexpr uint8_t CHANNEL_FLAG = 0x80;
+constexpr size_t CHANNEL_HEADER_SIZE = HEADER_SIZE + 4;
+// Frames larger than this are treated as a protocol error by the decoder.
+constexpr uint32_t MAX_PAYLOAD = 1u << 20;
+
 std::vector<uint8_t> build_frame(FrameType type, const std::vector<uint8_t>& payload);
 
-}
\ No newline at end of file
+// Writes the header for a len-byte payload into out[0..HEADER_SIZE).
+void write_header(FrameType type, size_t len, uint8_t* out);
+// Same for a frame on a non-zero channel, into out[0..CHANNEL_HEADER_SIZE).
+void write_channel_header(FrameType type, uint32_t channel, size_t len, uint8_t* out);
+
+// Zero-copy framing: the caller reads its payload HEADER_SIZE bytes into a
+// buffer it owns, and the header is written into that headroom. Returns the
+// start of the complete frame (payload - HEADER_SIZE).
+uint8_t* frame_in_place(FrameType type, uint8_t* payload, size_t len);
+
+// Incremental frame parser for non-blocking transports. The caller reads
+// directly into next_buffer() and reports the byte count via advance(), so
+// payloads land in their final buffer without an intermediate copy.
+class FrameDecoder {
+public:
+    uint8_t* next_buffer();
+    size_t next_size() const;
+
+    // Returns true once a complete frame is available through type()/payload().
+    // The frame stays valid until the following advance() call.
+    bool advance(size_t n);
+
+    bool error() const { return error_; }
+    // Includes CHANNEL_FLAG for channel frames, so code that only knows the
+    // plain types passes them over.
+    uint8_t type() const { return header_[0]; }
+    // 0 unless type() has CHANNEL_FLAG set.
+    uint32_t channel() const { return channel_; }
+    const std::vector<uint8_t>& payload() const { return payload_; }
+
+private:
+    void reset();
+    size_t header_size() const;
+
+    uint8_t header_[CHANNEL_HEADER_SIZE] = {0};
+    size_t got_ = 0;
+    uint32_t len_ = 0;
+    uint32_t channel_ = 0;
+    bool in_payload_ = false;
+    bool complete_ = false;
+    bool error_ = false;
+    std::vector<uint8_t> payload_;
+};
+
+}
@@ -1,156 +1,227 @@
 #include "io_bridge.hpp"
+#include "ansi_filter.hpp"
 #include "tls_wrapper.hpp"
 #include "pty_handler.hpp"
+#include "control_codec.hpp"
 #include "framing.hpp"
 #include "nlohmann/json.hpp"
+#include "peer_store.hpp"
+#include "egress_queue.hpp"
 #include "utils.hpp"
 
-#include <thread>
-#include <vector>
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
 
 #ifdef _WIN32
+#include <winsock2.h>
 #include <windows.h>
+#include <atomic>
+#include <functional>
+#include <thread>
 #else
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <signal.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #endif
 
-static std::vector<uint8_t> filter_ansi_for_cmd(const std::vector<uint8_t>& in);
-static std::vector<uint8_t> make_clean_cmd_out(const std::vector<uint8_t>& in) {
-    std::vector<uint8_t> out;
-    out.reserve(in.size());
-    size_t i = 0;
-    while (i < in.size()) {
-        uint8_t c = in[i];
-        if (c == 0x1B) {
-            if (i + 1 >= in.size()) break;
-            uint8_t n = in[i + 1];
-            if (n == '[') {
-                i += 2;
-                while (i < in.size()) { uint8_t ch = in[i++]; if (ch >= 0x40 && ch <= 0x7E) break; }
-                continue;
-            } else if (n == ']') {
-                i += 2; bool done = false;
-                while (i < in.size() && !done) { uint8_t ch = in[i++]; if (ch == 0x07) done = true; else if (ch == 0x1B && i < in.size() && in[i] == '\\') { i++; done = true; } }
-                continue;
-            } else if (n == 'P') {
-                i += 2; bool done = false;
-                while (i < in.size() && !done) { uint8_t ch = in[i++]; if (ch == 0x1B && i < in.size() && in[i] == '\\') { i++; done = true; } }
-                continue;
-            } else {
-                i += 2; while (i < in.size()) { uint8_t ch = in[i++]; if (ch >= 0x40 && ch <= 0x7E) break; }
-                continue;
-            }
+static void write_console(const uint8_t* data, size_t len) {
+    #ifdef _WIN32
+    DWORD written = 0; WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), data, (DWORD)len, &written, nullptr);
+    #else
+    while (len > 0) {
+        ssize_t w = write(STDOUT_FILENO, data, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return;
         }
-        if (c == 0x08) { out.push_back(0x08); out.push_back(0x20); out.push_back(0x08); i++; continue; }
-        if (c == 9 || c == 10 || c == 13 || (c >= 32 && c <= 126)) { out.push_back(c); }
-        i++;
+        data += w;
+        len -= static_cast<size_t>(w);
     }
-    return out;
+    #endif
 }
 
-static void pump_tls_to_stdout_framed(TLSWrapper& tls) {
-    std::vector<unsigned char> header(5);
-    std::vector<unsigned char> payload;
-    for (;;) {
-        int hr = tls.tls_read_exact(header.data(), header.size());
-        if (hr <= 0) break;
-        uint8_t type = header[0];
-        uint32_t len = (header[1] << 24) | (header[2] << 16) | (header[3] << 8) | header[4];
-        payload.resize(len);
-        int pr = tls.tls_read_exact(payload.data(), len);
-        if (pr <= 0) break;
-        if (type == (uint8_t)framing::FrameType::DATA) {
-            #ifdef _WIN32
-            DWORD written = 0; WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), payload.data(), (DWORD)payload.size(), &written, nullptr);
-            #else
-            write(STDOUT_FILENO, payload.data(), payload.size());
-            #endif
-        }
+#ifdef _WIN32
+
+// Hot control messages arrive in the binary format and are applied here
+// without allocating. Returns false if the payload isn't binary.
+static bool apply_binary_control(PTYHandler& pty, const std::vector<uint8_t>& payload, control::Message& msg) {
+    if (!control::decode(payload.data(), payload.size(), msg)) return false;
+    if (msg.type == control::MsgType::WINCH) {
+        pty.apply_window_size(msg.winch.rows, msg.winch.cols);
     }
+    return true;
 }
 
-static void pump_stdin_to_tls_framed(TLSWrapper& tls) {
-    std::vector<unsigned char> buf(4096);
-    for (;;) {
-        #ifdef _WIN32
-        DWORD readn = 0; if (!ReadFile(GetStdHandle(STD_INPUT_HANDLE), buf.data(), (DWORD)buf.size(), &readn, nullptr)) break; if (readn == 0) break;
-        #else
-        ssize_t readn = read(STDIN_FILENO, buf.data(), buf.size()); if (readn <= 0) break;
-        #endif
-        std::vector<uint8_t> payload(buf.begin(), buf.begin() + readn);
-        auto frame = framing::build_frame(framing::FrameType::DATA, payload);
-        int w = tls.tls_write((const void*)frame.data(), frame.size());
-        if (w <= 0) break;
-    }
+// JSON fallback: window resizes from older peers, plus the rare messages
+// that stay JSON. Returns the parsed message (null if malformed) so callers
+// can act on the types they understand.
+static nlohmann::json apply_control_frame(PTYHandler& pty, const std::vector<uint8_t>& payload) {
+    try {
+        auto j = nlohmann::json::parse(std::string((const char*)payload.data(), payload.size()));
+        if (j.contains("type") && j["type"] == "winch") {
+            int rows = j.value("rows", 24);
+            int cols = j.value("cols", 80);
+            pty.apply_window_size(rows, cols);
+        }
+        return j;
+    } catch (...) {}
+    return nlohmann::json();
 }
 
-static void pump_tls_to_pty_framed(TLSWrapper& tls, PTYHandler& pty) {
-    std::vector<unsigned char> header(5);
-    std::vector<unsigned char> payload;
-    for (;;) {
-        int hr = tls.tls_read_exact(header.data(), header.size());
-        if (hr <= 0) break;
-        uint8_t type = header[0];
-        uint32_t len = (header[1] << 24) | (header[2] << 16) | (header[3] << 8) | header[4];
-        payload.resize(len);
-        int pr = tls.tls_read_exact(payload.data(), len);
-        if (pr <= 0) break;
-        if (type == (uint8_t)framing::FrameType::DATA) {
-            pty.pty_write((const char*)payload.data(), payload.size());
-        } else if (type == (uint8_t)framing::FrameType::CONTROL) {
-            try {
-                auto j = nlohmann::json::parse(std::string((char*)payload.data(), payload.size()));
-                if (j.contains("type") && j["type"] == "winch") {
-                    int rows = j.value("rows", 24);
-                    int cols = j.value("cols", 80);
-                    pty.apply_window_size(rows, cols);
-                }
-            } catch (...) {}
+// Cap on PTY output queued for the I/O thread; the pump waits beyond it.
+static const size_t kMaxQueuedOutput = 256 * 1024;
+
+// Wakes the I/O thread out of select() when another thread queues a frame
+// or ends the session. Windows has no eventfd; a loopback datagram socket
+// stands in.
+class SocketWaker {
+public:
+    ~SocketWaker() {
+        if (rx_ != INVALID_SOCKET) closesocket(rx_);
+        if (tx_ != INVALID_SOCKET) closesocket(tx_);
+    }
+
+    bool open() {
+        rx_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        tx_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (rx_ == INVALID_SOCKET || tx_ == INVALID_SOCKET) return false;
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int addr_len = sizeof(addr);
+        if (bind(rx_, (sockaddr*)&addr, sizeof(addr)) != 0) return false;
+        if (getsockname(rx_, (sockaddr*)&addr, &addr_len) != 0) return false;
+        if (connect(tx_, (sockaddr*)&addr, sizeof(addr)) != 0) return false;
+        u_long nonblocking = 1;
+        return ioctlsocket(rx_, FIONBIO, &nonblocking) == 0;
+    }
+    SOCKET fd() const { return rx_; }
+    void wake() {
+        char c = 1;
+        send(tx_, &c, 1, 0);
+    }
+    void clear() {
+        char buf[64];
+        while (recv(rx_, buf, sizeof(buf), 0) > 0) {}
+    }
+
+private:
+    SOCKET rx_ = INVALID_SOCKET;
+    SOCKET tx_ = INVALID_SOCKET;
+};
+
+using FrameHandler = std::function<void(uint8_t type, const std::vector<uint8_t>& payload)>;
+
+// The one thread that touches the TLS context, since mbedTLS can't read and
+// write it from two threads at once. Writes whatever the pumps queue, urgent
+// frames first, and hands frames from the peer to on_frame, until the peer
+// goes away or a pump sets stop.
+static void run_tls_io(TLSWrapper& tls, EgressQueue& egress, SocketWaker& waker, const std::atomic<bool>& stop,
+                       const FrameHandler& on_frame) {
+    egress.set_notify([&waker]() { waker.wake(); });
+    SOCKET sock = static_cast<SOCKET>(tls.socket_fd());
+    framing::FrameDecoder decoder;
+    bool ok = true;
+    while (ok) {
+        // A pump queues its last frames before it sets stop, so seeing stop
+        // before draining means this drain still writes them.
+        bool stopping = stop.load();
+        egress.drain([&](EgressQueue::Frame& frame) {
+            if (ok && tls.tls_write_all(frame.bytes.data(), frame.bytes.size()) < 0) ok = false;
+        });
+        if (!ok || stopping) break;
+        // Records mbedTLS has already buffered won't show up in select().
+        if (!tls.read_pending()) {
+            fd_set readable;
+            FD_ZERO(&readable);
+            FD_SET(sock, &readable);
+            FD_SET(waker.fd(), &readable);
+            if (select(0, &readable, nullptr, nullptr, nullptr) == SOCKET_ERROR) break;
+            if (FD_ISSET(waker.fd(), &readable)) waker.clear();
+            if (!FD_ISSET(sock, &readable)) continue;
+        }
+        int r = tls.tls_read(decoder.next_buffer(), decoder.next_size());
+        if (r > 0) {
+            if (decoder.advance(static_cast<size_t>(r))) {
+                on_frame(decoder.type(), decoder.payload());
+            } else if (decoder.error()) {
+                LOG_ERROR("Oversized frame from peer; closing connection");
+                break;
+            }
+            continue;
         }
+        if (r == MBEDTLS_ERR_SSL_WANT_READ || r == MBEDTLS_ERR_SSL_WANT_WRITE) continue;
+#ifdef MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET
+        if (r == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET) continue;
+#endif
+        break;
     }
+    egress.set_notify(nullptr);
+}
+
+static void answer_ping(EgressQueue& egress, const control::Ping& ping) {
+    uint8_t buf[control::kMaxEncodedSize];
+    size_t len = control::encode_ping(control::MsgType::PONG, ping.seq, ping.sent_us, buf);
+    egress.push(framing::FrameType::CONTROL, buf, len, SendPriority::URGENT);
 }
 
-static void pump_pty_to_tls_framed(PTYHandler& pty, TLSWrapper& tls, bool mirror_output, bool mirror_clean) {
+static void pump_stdin_to_egress(EgressQueue& egress, std::atomic<bool>& stop, SocketWaker& waker) {
     std::vector<unsigned char> buf(4096);
-    for (;;) {
+    while (!stop.load()) {
+        DWORD readn = 0; if (!ReadFile(GetStdHandle(STD_INPUT_HANDLE), buf.data(), (DWORD)buf.size(), &readn, nullptr)) break; if (readn == 0) break;
+        egress.push(framing::FrameType::DATA, buf.data(), readn, SendPriority::URGENT);
+    }
+    stop = true;
+    waker.wake();
+}
+
+static void pump_pty_to_egress(PTYHandler& pty, EgressQueue& egress, std::atomic<bool>& stop, SocketWaker& waker,
+                               bool mirror_output, bool mirror_clean) {
+    std::vector<unsigned char> buf(4096);
+    AnsiFilter filter;
+    std::vector<uint8_t> clean;
+    while (!stop.load()) {
+        // Don't run ahead of the connection.
+        if (egress.queued_bytes() >= kMaxQueuedOutput) { Sleep(1); continue; }
         long r = pty.pty_read_nonblocking((char*)buf.data(), buf.size());
         if (r < 0) break;
-        if (r == 0) { std::this_thread::sleep_for(std::chrono::milliseconds(10)); continue; }
-        std::vector<uint8_t> payload(buf.begin(), buf.begin() + r);
+        if (r == 0) { Sleep(10); continue; }
         if (mirror_output) {
-            auto outbuf = mirror_clean ? make_clean_cmd_out(payload) : payload;
-            if (!outbuf.empty()) {
-                #ifdef _WIN32
-                DWORD written = 0; WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), outbuf.data(), (DWORD)outbuf.size(), &written, nullptr);
-                #else
-                write(STDOUT_FILENO, outbuf.data(), outbuf.size());
-                #endif
+            if (mirror_clean) {
+                clean.clear();
+                filter.filter(buf.data(), static_cast<size_t>(r), clean);
+                if (!clean.empty()) write_console(clean.data(), clean.size());
+            } else {
+                write_console(buf.data(), static_cast<size_t>(r));
             }
         }
-        auto frame = framing::build_frame(framing::FrameType::DATA, payload);
-        int w = tls.tls_write((const void*)frame.data(), frame.size());
-        if (w <= 0) break;
+        egress.push(framing::FrameType::DATA, buf.data(), static_cast<size_t>(r), SendPriority::BULK);
     }
+    stop = true;
+    waker.wake();
 }
 
 static void pump_stdin_to_pty(PTYHandler& pty) {
     std::vector<unsigned char> buf(4096);
     for (;;) {
-        #ifdef _WIN32
         DWORD readn = 0; if (!ReadFile(GetStdHandle(STD_INPUT_HANDLE), buf.data(), (DWORD)buf.size(), &readn, nullptr)) break; if (readn == 0) break;
-        #else
-        ssize_t readn = read(STDIN_FILENO, buf.data(), buf.size()); if (readn <= 0) break;
-        #endif
         pty.pty_write((const char*)buf.data(), (size_t)readn);
     }
 }
 
-void run_client_console(TLSWrapper& tls) {
-    #ifdef _WIN32
+bool run_client_console(TLSWrapper& tls, EgressQueue& egress, const ClientOptions& options) {
+    if (options.transfer_only()) {
+        LOG_ERROR("File transfer needs a Linux client");
+        return false;
+    }
     DWORD inMode = 0, outMode = 0;
     HANDLE hIn = GetStdHandle(STD_INPUT_HANDLE);
     HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
@@ -161,27 +232,38 @@ void run_client_console(TLSWrapper& tls) {
         SetConsoleMode(hIn, newIn);
     }
     if (hOut) SetConsoleMode(hOut, outMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING | ENABLE_PROCESSED_OUTPUT);
-    #else
-    struct termios orig_in{}; struct termios raw_in{};
-    struct termios orig_out{}; struct termios raw_out{};
-    if (tcgetattr(STDIN_FILENO, &orig_in) == 0) { raw_in = orig_in; cfmakeraw(&raw_in); tcsetattr(STDIN_FILENO, TCSANOW, &raw_in); }
-    if (tcgetattr(STDOUT_FILENO, &orig_out) == 0) { raw_out = orig_out; cfmakeraw(&raw_out); tcsetattr(STDOUT_FILENO, TCSANOW, &raw_out); }
-    #endif
 
-    std::thread t1(pump_stdin_to_tls_framed, std::ref(tls));
-    std::thread t2(pump_tls_to_stdout_framed, std::ref(tls));
-    t1.join();
+    SocketWaker waker;
+    if (!waker.open()) {
+        LOG_ERROR("Could not create the I/O thread's wakeup socket");
+        return true;
+    }
+    std::atomic<bool> stop{false};
+    std::thread t1(pump_stdin_to_egress, std::ref(egress), std::ref(stop), std::ref(waker));
+    run_tls_io(tls, egress, waker, stop, [&egress](uint8_t type, const std::vector<uint8_t>& payload) {
+        if (type == (uint8_t)framing::FrameType::DATA) {
+            write_console(payload.data(), payload.size());
+        } else if (type == (uint8_t)framing::FrameType::CONTROL) {
+            control::Message msg;
+            if (control::decode(payload.data(), payload.size(), msg) && msg.type == control::MsgType::PING) {
+                answer_ping(egress, msg.ping);
+            }
+        }
+    });
+    bool stdin_ended = stop.exchange(true);
     tls.close_notify();
-    t2.join();
-
-    #ifndef _WIN32
-    tcsetattr(STDIN_FILENO, TCSANOW, &orig_in);
-    tcsetattr(STDOUT_FILENO, TCSANOW, &orig_out);
-    #endif
+    // The server went away first: get the stdin pump out of ReadFile.
+    if (!stdin_ended) CancelIoEx(GetStdHandle(STD_INPUT_HANDLE), nullptr);
+    t1.join();
+    return true;
 }
 
-void run_server_shell(TLSWrapper& tls, bool mirror_output, bool mirror_input, bool mirror_clean) {
-    #ifdef _WIN32
+void run_server_shell(TLSWrapper& tls, EgressQueue& egress, bool mirror_output, bool mirror_input, bool mirror_clean,
+                      bool compress, bool flow_control, bool forwarding, bool file_transfer,
+                      const std::string& record_dir) {
+    if (!record_dir.empty()) {
+        LOG_WARN("Session recording is not supported on Windows");
+    }
     if (mirror_output) {
         DWORD outMode = 0; HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
         if (hOut && GetConsoleMode(hOut, &outMode)) {
@@ -195,93 +277,982 @@ void run_server_shell(TLSWrapper& tls, bool mirror_output, bool mirror_input, bo
             SetConsoleMode(hIn, newMode);
         }
     }
-    #endif
-    #ifndef _WIN32
-    struct termios orig_in{}; bool have_orig = false;
-    if (mirror_input) {
-        struct termios raw_in{};
-        if (tcgetattr(STDIN_FILENO, &orig_in) == 0) {
-            have_orig = true;
-            raw_in = orig_in;
-            cfmakeraw(&raw_in);
-            raw_in.c_lflag &= ~(ECHO);
-            tcsetattr(STDIN_FILENO, TCSANOW, &raw_in);
-        }
+    SocketWaker waker;
+    if (!waker.open()) {
+        LOG_ERROR("Could not create the I/O thread's wakeup socket");
+        return;
     }
-    #endif
     PTYHandler pty;
     if (!pty.create_pty_and_fork_shell()) return;
     std::thread t0;
     if (mirror_input) {
         t0 = std::thread(pump_stdin_to_pty, std::ref(pty));
     }
-    std::thread t1(pump_tls_to_pty_framed, std::ref(tls), std::ref(pty));
-    std::thread t2(pump_pty_to_tls_framed, std::ref(pty), std::ref(tls), mirror_output, mirror_clean);
+    std::atomic<bool> stop{false};
+    std::thread t2(pump_pty_to_egress, std::ref(pty), std::ref(egress), std::ref(stop), std::ref(waker), mirror_output,
+                   mirror_clean);
     LOG_INFO("Session active; forwarding PTY output to client%s%s%s",
              mirror_output ? " (mirrored to server console)" : "",
              mirror_input ? "; server console input enabled" : "",
              mirror_clean ? "; server mirror cleaned" : "");
-    t1.join();
+    run_tls_io(tls, egress, waker, stop, [&pty, &egress](uint8_t type, const std::vector<uint8_t>& payload) {
+        if (type == (uint8_t)framing::FrameType::DATA) {
+            pty.pty_write((const char*)payload.data(), payload.size());
+        } else if (type == (uint8_t)framing::FrameType::CONTROL) {
+            control::Message msg;
+            if (apply_binary_control(pty, payload, msg)) {
+                if (msg.type == control::MsgType::PING) answer_ping(egress, msg.ping);
+            } else if (control::is_json(payload.data(), payload.size())) {
+                apply_control_frame(pty, payload);
+            }
+        }
+    });
+    stop = true;
     tls.close_notify();
     t2.join();
     pty.terminate_child();
-    #ifndef _WIN32
-    if (mirror_input && have_orig) {
-        tcsetattr(STDIN_FILENO, TCSANOW, &orig_in);
-    }
-    #endif
     if (mirror_input && t0.joinable()) {
         t0.detach();
     }
     LOG_INFO("Session ended");
 }
-static std::vector<uint8_t> filter_ansi_for_cmd(const std::vector<uint8_t>& in) {
-    std::vector<uint8_t> out;
-    out.reserve(in.size());
-    size_t i = 0;
-    while (i < in.size()) {
-        uint8_t c = in[i];
-        if (c == 0x1B) {
-            if (i + 1 >= in.size()) break;
-            uint8_t n = in[i + 1];
-            if (n == '[') {
-                i += 2;
-                while (i < in.size()) {
-                    uint8_t ch = in[i++];
-                    if (ch >= 0x40 && ch <= 0x7E) break;
+
+#else
+
+// Stop reading the PTY while this much output is still waiting on the socket.
+static const size_t kMaxPendingOutput = 256 * 1024;
+static void send_pong(TLSChannel& channel, const control::Ping& ping) {
+    uint8_t buf[control::kMaxEncodedSize];
+    size_t len = control::encode_ping(control::MsgType::PONG, ping.seq, ping.sent_us, buf);
+    channel.send_frame(framing::FrameType::CONTROL, buf, len);
+}
+
+static void send_control_json(TLSChannel& channel, const nlohmann::json& msg) {
+    std::string text = msg.dump();
+    channel.send_frame(framing::FrameType::CONTROL, (const uint8_t*)text.data(), text.size());
+}
+
+// Sends a DATA payload that has framing::HEADER_SIZE bytes of headroom,
+// deflated when compression was agreed and the frame is worth it. False if
+// the compressor failed and the session can't continue. A session's DATA
+// frames share one priority, so the deflate stream stays in order.
+static bool send_data(TLSChannel& channel, FrameCompressor& compressor, uint8_t* payload, size_t len,
+                      SendPriority priority = SendPriority::BULK) {
+    if (!compressor.worth_compressing(len)) {
+        channel.send_frame_in_place(framing::FrameType::DATA, payload, len, priority);
+        return true;
+    }
+    size_t zlen = 0;
+    uint8_t* z = compressor.compress(payload, len, zlen);
+    if (!z) return false;
+    channel.send_frame_in_place(framing::FrameType::DATA_COMPRESSED, z, zlen, priority);
+    const auto& stats = channel.stats();
+    stats_add(stats->compressed_in, len);
+    stats_add(stats->compressed_out, zlen);
+    return true;
+}
+
+// Cap on PTY bytes drained per readiness event, so one busy session cannot
+// monopolise a worker loop shared with others.
+static const size_t kMaxReadPerEvent = 64 * 1024;
+
+// With detach enabled the shell waits for the client's hello, which says
+// whether to reattach; a client that sends none gets a new shell after this.
+static const std::chrono::milliseconds kHelloTimeout(2000);
+
+// How often each side measures the round trip while the session is busy,
+// and how many pings in a row with nothing else moving before it stops:
+// an idle session shouldn't wake both ends every second.
+static const std::chrono::seconds kPingInterval(1);
+static const unsigned kQuietPings = 3;
+
+// PING and PONG don't count as traffic, or pings would never stop.
+static bool is_ping_frame(uint8_t type, const std::vector<uint8_t>& payload) {
+    if (type != (uint8_t)framing::FrameType::CONTROL) return false;
+    control::Message msg;
+    return control::decode(payload.data(), payload.size(), msg) &&
+           (msg.type == control::MsgType::PING || msg.type == control::MsgType::PONG);
+}
+
+// Steady-clock microseconds, as carried in PING and echoed in PONG. Only
+// the side that sent the ping reads them back.
+static uint64_t ping_clock_us() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch())
+                                     .count());
+}
+
+static std::chrono::microseconds rtt_since(uint64_t sent_us) {
+    return std::chrono::microseconds(static_cast<int64_t>(ping_clock_us() - sent_us));
+}
+
+// Output credit a client offers at the start, and the most it grows to.
+static const size_t kInitialCreditWindow = 64 * 1024;
+static const size_t kMaxCreditWindow = 16 * 1024 * 1024;
+
+// Replay of truncated scrollback starts at the first line break within
+// this many bytes, so it does not open mid-line or mid-escape.
+static const size_t kReplayResyncWindow = 4096;
+
+ServerBridge::ServerBridge(EventLoop& loop, TLSWrapper& tls, bool mirror_output, bool mirror_input, bool mirror_clean,
+                           bool compress, bool flow_control, bool forwarding, bool file_transfer,
+                           std::shared_ptr<TrafficStats> stats)
+    : loop_(loop), channel_(loop, tls, std::move(stats)), mirror_output_(mirror_output), mirror_input_(mirror_input),
+      mirror_clean_(mirror_clean), compress_(compress), flow_control_(flow_control), forwarding_(forwarding),
+      file_transfer_(file_transfer), resumed_(tls.session_resumed()),
+      read_buf_(4096),
+      coalescer_(16384 - framing::HEADER_SIZE, framing::HEADER_SIZE) {}
+
+ServerBridge::~ServerBridge() {
+    if (flush_timer_) loop_.cancel_timer(flush_timer_);
+    if (ping_timer_) loop_.cancel_timer(ping_timer_);
+    if (hello_timer_) loop_.cancel_timer(hello_timer_);
+    if (pty_fd_ >= 0) loop_.remove(pty_fd_);
+    if (stdin_registered_) loop_.remove(STDIN_FILENO);
+}
+
+void ServerBridge::enable_detach(DetachedSessions* sessions, std::string owner) {
+    detached_ = sessions;
+    owner_ = std::move(owner);
+}
+
+bool ServerBridge::start() {
+    if (!detached_) {
+        auto shell = std::make_unique<DetachableShell>(0);
+        if (!shell->pty.create_pty_and_fork_shell()) return false;
+        shell_ = std::move(shell);
+    }
+
+    channel_.on_frame = [this](uint8_t type, const std::vector<uint8_t>& payload) { on_frame(type, payload); };
+    channel_.on_channel_frame = [this](uint32_t id, uint8_t type, const std::vector<uint8_t>& payload) {
+        note_traffic();
+        if (mux_) mux_->on_frame(id, type, payload);
+    };
+    channel_.on_drained = [this]() {
+        if (pty_eof_) {
+            finish();
+            return;
+        }
+        if (mux_) mux_->pump();
+        update_pty_interest();
+    };
+    channel_.on_closed = [this]() { finish(); };
+    if (!channel_.start()) return false;
+    coalescer_.set_max_payload(channel_.max_frame_payload());
+    send_ping();
+
+    if (shell_) {
+        if (!adopt_shell(std::move(shell_))) return false;
+    } else {
+        hello_timer_ = loop_.add_timer(kHelloTimeout, [this]() {
+            hello_timer_ = 0;
+            if (!adopt_shell(detached_->spawn(owner_))) channel_.close();
+        });
+    }
+    if (mirror_input_) {
+        stdin_registered_ = loop_.add(STDIN_FILENO, EventLoop::READABLE, [this](uint32_t events) { on_stdin_events(events); });
+        if (!stdin_registered_) {
+            LOG_WARN("Server console input cannot be polled; --mirror-input disabled");
+        }
+    }
+    return true;
+}
+
+void ServerBridge::on_frame(uint8_t type, const std::vector<uint8_t>& payload) {
+    if (!is_ping_frame(type, payload)) note_traffic();
+    if (type == (uint8_t)framing::FrameType::DATA) {
+        write_pty(payload.data(), payload.size());
+    } else if (type == (uint8_t)framing::FrameType::DATA_COMPRESSED) {
+        bool ok = decompressor_.decompress(payload.data(), payload.size(),
+                                           [this](const uint8_t* data, size_t len) { write_pty(data, len); });
+        if (!ok) channel_.close();
+    } else if (type == (uint8_t)framing::FrameType::CONTROL) {
+        control::Message binary;
+        if (control::decode(payload.data(), payload.size(), binary)) {
+            if (binary.type == control::MsgType::WINCH) {
+                LOG_DEBUG("Window resized to %ux%u", (unsigned)binary.winch.cols, (unsigned)binary.winch.rows);
+                resize(binary.winch.rows, binary.winch.cols);
+            } else if (binary.type == control::MsgType::PING) {
+                send_pong(channel_, binary.ping);
+            } else if (binary.type == control::MsgType::PONG) {
+                on_pong(binary.ping);
+            } else if (binary.type == control::MsgType::INPUT_MARK) {
+                trace_seq_ = binary.trace.seq;
+                trace_written_ = false;
+                trace_arrived_ = EventLoop::Clock::now();
+            } else if (binary.type == control::MsgType::CREDIT && flow_) {
+                credit_ += binary.credit.bytes;
+                update_pty_interest();
+            } else if (mux_) {
+                mux_->on_control(binary);
+            }
+            return;
+        }
+        if (!control::is_json(payload.data(), payload.size())) return;
+        try {
+            auto msg = nlohmann::json::parse(std::string((const char*)payload.data(), payload.size()));
+            if (!msg.is_object()) return;
+            std::string kind = msg.value("type", "");
+            if (kind == "winch") {
+                // Window resizes from older peers.
+                resize(msg.value("rows", 24), msg.value("cols", 80));
+            } else if (kind == "hello") {
+                bool deflate = false;
+                if (msg.contains("compress") && msg["compress"].is_array()) {
+                    for (const auto& name : msg["compress"]) {
+                        if (name == kCompressionDeflate) deflate = true;
+                    }
                 }
-                continue;
-            } else if (n == ']') {
-                i += 2;
-                bool done = false;
-                while (i < in.size() && !done) {
-                    uint8_t ch = in[i++];
-                    if (ch == 0x07) done = true;
-                    else if (ch == 0x1B && i < in.size() && in[i] == '\\') { i++; done = true; }
+                if (msg.contains("credit") && msg["credit"].is_number_unsigned()) {
+                    peer_window_ = msg["credit"].get<size_t>();
                 }
-                continue;
-            } else if (n == 'P') {
-                i += 2;
-                bool done = false;
-                while (i < in.size() && !done) {
-                    uint8_t ch = in[i++];
-                    if (ch == 0x1B && i < in.size() && in[i] == '\\') { i++; done = true; }
+                peer_channels_ = msg.contains("channels") && msg["channels"] == true;
+                peer_wants_shell_ = !(msg.contains("shell") && msg["shell"] == false);
+                uint64_t attach_id = 0;
+                std::string attach_token;
+                if (msg.contains("attach") && msg["attach"].is_object()) {
+                    attach_id = msg["attach"].value("id", uint64_t(0));
+                    attach_token = msg["attach"].value("token", "");
                 }
-                continue;
+                on_hello(deflate, attach_id, attach_token);
+            }
+        } catch (...) {}
+    }
+}
+
+void ServerBridge::on_hello(bool peer_offers_deflate, uint64_t attach_id, const std::string& attach_token) {
+    if (!detached_ || shell_) {
+        accept_hello(peer_offers_deflate, false);
+        return;
+    }
+    if (hello_timer_) {
+        loop_.cancel_timer(hello_timer_);
+        hello_timer_ = 0;
+    }
+    if (!peer_wants_shell_) {
+        // A file transfer: no shell to spawn, or to park afterwards.
+        accept_hello(peer_offers_deflate, false);
+        return;
+    }
+    if (attach_id == 0) {
+        attach_shell(detached_->spawn(owner_), peer_offers_deflate, false);
+        return;
+    }
+    // Input waits until the shell it is meant for arrives.
+    channel_.pause_reading(true);
+    std::weak_ptr<bool> alive = alive_;
+    DetachedSessions* sessions = detached_;
+    EventLoop* loop = &loop_;
+    detached_->claim(attach_id, attach_token, owner_, loop_,
+                     [this, alive, sessions, loop, peer_offers_deflate](std::unique_ptr<DetachableShell> shell) {
+                         if (alive.expired() || finished_) {
+                             // Dropped again while the shell was in transit.
+                             if (shell) sessions->park(*loop, std::move(shell));
+                             return;
+                         }
+                         bool reattached = shell != nullptr;
+                         if (!shell) shell = sessions->spawn(owner_);
+                         attach_shell(std::move(shell), peer_offers_deflate, reattached);
+                     });
+}
+
+void ServerBridge::attach_shell(std::unique_ptr<DetachableShell> shell, bool peer_offers_deflate, bool reattached) {
+    if (!adopt_shell(std::move(shell))) {
+        channel_.close();
+        return;
+    }
+    accept_hello(peer_offers_deflate, reattached);
+    if (reattached) {
+        VtScreen* screen = shell_->screen.get();
+        // On the alternate screen the scrollback is a full-screen program's
+        // redraws, which the repaint makes redundant.
+        bool history = !screen || !screen->alt_screen();
+        LOG_INFO("Shell %llu reattached; replaying %zu bytes of scrollback%s", (unsigned long long)shell_->id,
+                 history ? shell_->scrollback.size() : 0, screen ? " and a screen repaint" : "");
+        if (history) replay_scrollback();
+        if (screen) {
+            std::vector<uint8_t> snapshot;
+            screen->repaint(snapshot);
+            send_replay(snapshot);
+        } else {
+            // Full-screen programs redraw on SIGWINCH, even at an unchanged size.
+            pid_t group = tcgetpgrp(pty_fd_);
+            if (group > 0) kill(-group, SIGWINCH);
+        }
+    }
+}
+
+bool ServerBridge::adopt_shell(std::unique_ptr<DetachableShell> shell) {
+    if (!shell) return false;
+    int fd = shell->pty.get_master_fd();
+    if (!loop_.add(fd, EventLoop::READABLE, [this](uint32_t events) { on_pty_events(events); })) {
+        return false;
+    }
+    shell_ = std::move(shell);
+    pty_fd_ = fd;
+    if (rows_ > 0 && cols_ > 0) shell_->resize(rows_, cols_);
+    if (pty_pending_.empty()) {
+        channel_.pause_reading(false);
+    } else {
+        // Keystrokes typed before the shell existed; released by on_pty_events.
+        update_pty_interest();
+    }
+    return true;
+}
+
+void ServerBridge::accept_hello(bool peer_offers_deflate, bool reattached) {
+    bool deflate = compress_ && peer_offers_deflate && decompressor_.init() &&
+                   compressor_.init(framing::HEADER_SIZE);
+    // Output sent before the ack doesn't count against the credit; the
+    // client starts counting once it has the ack.
+    flow_ = flow_control_ && peer_window_ > 0;
+    credit_ = flow_ ? static_cast<int64_t>(peer_window_) : 0;
+    if (peer_channels_ && !mux_) {
+        mux_ = std::make_unique<ChannelMux>(channel_, false);
+        if (forwarding_) forwarder_ = std::make_unique<PortForwarder>(loop_, *mux_, true);
+        if (file_transfer_) transfers_ = std::make_unique<FileTransfers>(*mux_, true);
+        mux_->on_open_request = [this](uint32_t id, uint8_t kind, const std::string& target,
+                                       ChannelMux::Handler& handler) {
+            return (forwarder_ && forwarder_->accept(id, kind, target, handler)) ||
+                   (transfers_ && transfers_->accept(id, kind, target, handler));
+        };
+    }
+    nlohmann::json ack = {{"type", "hello_ack"},
+                          {"compress", deflate ? kCompressionDeflate : "none"},
+                          {"resumed", resumed_},
+                          {"credit", flow_},
+                          {"channels", mux_ != nullptr}};
+    if (detached_ && shell_) {
+        ack["session"] = {{"id", shell_->id}, {"token", shell_->token}, {"attached", reattached}};
+    }
+    // Everything after the ack may be compressed, and the peer reads it in order.
+    send_control_json(channel_, ack);
+    if (deflate) {
+        LOG_INFO("DATA compression negotiated (%s)", kCompressionDeflate);
+    }
+    if (flow_) {
+        LOG_INFO("Output flow control negotiated, %zu KB initial window", peer_window_ / 1024);
+    }
+}
+
+void ServerBridge::replay_scrollback() {
+    const ScrollbackRing& ring = shell_->scrollback;
+    if (ring.size() == 0) return;
+    static const char kClearScreen[] = "\x1b[0m\x1b[H\x1b[2J";
+    std::vector<uint8_t> history(kClearScreen, kClearScreen + sizeof(kClearScreen) - 1);
+    size_t start = history.size();
+    history.reserve(start + ring.size());
+    ring.for_each([&history](const uint8_t* data, size_t len) { history.insert(history.end(), data, data + len); });
+    if (ring.truncated()) {
+        auto window_end = history.begin() + start + std::min(ring.size(), kReplayResyncWindow);
+        auto nl = std::find(history.begin() + start, window_end, '\n');
+        if (nl != window_end) history.erase(history.begin() + start, nl + 1);
+    }
+    send_replay(history);
+}
+
+void ServerBridge::send_replay(const std::vector<uint8_t>& bytes) {
+    if (channel_.closed()) return;
+    if (recorder_) recorder_->output(bytes.data(), bytes.size());
+    size_t max_payload = channel_.max_frame_payload();
+    PooledBuffer frame(framing::HEADER_SIZE + max_payload);
+    for (size_t off = 0; off < bytes.size();) {
+        size_t n = std::min(max_payload, bytes.size() - off);
+        std::memcpy(frame.data() + framing::HEADER_SIZE, bytes.data() + off, n);
+        if (flow_) credit_ -= static_cast<int64_t>(n);
+        if (!send_data(channel_, compressor_, frame.data() + framing::HEADER_SIZE, n)) {
+            channel_.close();
+            return;
+        }
+        off += n;
+    }
+}
+
+void ServerBridge::resize(int rows, int cols) {
+    // The one place a peer's size enters: the PTY, screen model and
+    // recorder all see the clamped value.
+    if (rows < 1 || cols < 1) return;
+    rows = std::min(rows, VtScreen::kMaxRows);
+    cols = std::min(cols, VtScreen::kMaxCols);
+    rows_ = rows;
+    cols_ = cols;
+    if (shell_) shell_->resize(rows, cols);
+    if (recorder_) recorder_->resize(static_cast<uint16_t>(rows), static_cast<uint16_t>(cols));
+}
+
+void ServerBridge::on_pty_events(uint32_t events) {
+    if (events & EventLoop::WRITABLE) {
+        size_t off = 0;
+        while (off < pty_pending_.size()) {
+            ssize_t w = shell_->pty.pty_write((const char*)pty_pending_.data() + off, pty_pending_.size() - off);
+            if (w <= 0) break;
+            off += static_cast<size_t>(w);
+        }
+        pty_pending_.erase(pty_pending_.begin(), pty_pending_.begin() + off);
+        channel_.stats()->pty_queued_bytes.store(pty_pending_.size(), std::memory_order_relaxed);
+        if (pty_pending_.empty()) {
+            if (trace_seq_ && !trace_written_) input_written();
+            update_pty_interest();
+            channel_.pause_reading(false);
+        }
+    }
+    if ((events & EventLoop::READABLE) && pty_fd_ >= 0) {
+        read_pty();
+    }
+}
+
+void ServerBridge::read_pty() {
+    auto started = std::chrono::steady_clock::now();
+    TrafficStats& stats = *channel_.stats();
+    size_t budget = kMaxReadPerEvent;
+    while (budget > 0 && channel_.pending_bytes() < kMaxPendingOutput && (!flow_ || credit_ > 0)) {
+        if (coalescer_.room() == 0) flush_output();
+        uint8_t* dst = coalescer_.tail();
+        size_t want = coalescer_.room();
+        if (flow_) want = std::min(want, static_cast<size_t>(credit_));
+        ssize_t r = shell_->pty.pty_read_nonblocking((char*)dst, want);
+        if (r < 0) {
+            // EIO: the shell exited and closed the slave side.
+            flush_output();
+            loop_.remove(pty_fd_);
+            pty_fd_ = -1;
+            pty_eof_ = true;
+            // Tells the client to forget its reattach token.
+            if (detached_) send_control_json(channel_, {{"type", "session_end"}});
+            channel_.shutdown();
+            return;
+        }
+        if (r == 0) break;
+        stats_add(stats.pty_reads, 1);
+        note_traffic();
+        if (trace_written_) {
+            // The shell's first output since the traced keys went in.
+            auto echo = std::chrono::duration_cast<std::chrono::microseconds>(EventLoop::Clock::now() - trace_write_);
+            auto in_server = std::chrono::duration_cast<std::chrono::microseconds>(trace_write_ - trace_arrived_);
+            uint8_t buf[control::kMaxEncodedSize];
+            control::InputTrace trace{trace_seq_, static_cast<uint32_t>(in_server.count()),
+                                      static_cast<uint32_t>(echo.count())};
+            channel_.send_frame(framing::FrameType::CONTROL, buf, control::encode_input_trace(trace, buf));
+            trace_seq_ = 0;
+            trace_written_ = false;
+        }
+        if (flow_) credit_ -= r;
+        if (detached_) shell_->record(dst, static_cast<size_t>(r));
+        if (recorder_) recorder_->output(dst, static_cast<size_t>(r));
+        if (mirror_output_) {
+            if (mirror_clean_) {
+                mirror_buf_.clear();
+                mirror_filter_.filter(dst, static_cast<size_t>(r), mirror_buf_);
+                if (!mirror_buf_.empty()) write_console(mirror_buf_.data(), mirror_buf_.size());
             } else {
-                i += 2;
-                while (i < in.size()) {
-                    uint8_t ch = in[i++];
-                    if (ch >= 0x40 && ch <= 0x7E) break;
+                write_console(dst, static_cast<size_t>(r));
+            }
+        }
+        coalescer_.commit(static_cast<size_t>(r));
+        budget -= std::min(budget, static_cast<size_t>(r));
+    }
+
+    auto delay = coalescer_.flush_delay(OutputCoalescer::Clock::now());
+    if (delay.count() == 0) {
+        flush_output();
+    } else if (!flush_timer_) {
+        size_at_arm_ = coalescer_.size();
+        flush_timer_ = loop_.add_timer(delay, [this]() {
+            flush_timer_ = 0;
+            bool idle = coalescer_.size() == size_at_arm_;
+            flush_output();
+            if (idle) coalescer_.idle();
+        });
+    }
+    update_pty_interest();
+    stats.pump_ns.record(static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count()));
+}
+
+void ServerBridge::flush_output() {
+    if (flush_timer_) {
+        loop_.cancel_timer(flush_timer_);
+        flush_timer_ = 0;
+    }
+    if (coalescer_.empty()) return;
+    if (!send_data(channel_, compressor_, coalescer_.data(), coalescer_.size())) {
+        channel_.close();
+        return;
+    }
+    coalescer_.flushed();
+    uint64_t merged = coalescer_.reads_coalesced() - coalesced_reported_;
+    if (merged > 0) {
+        coalesced_reported_ = coalescer_.reads_coalesced();
+        const auto& stats = channel_.stats();
+        stats_add(stats->reads_coalesced, merged);
+        stats_add(stats->overhead_saved, merged * channel_.frame_overhead());
+    }
+}
+
+void ServerBridge::on_stdin_events(uint32_t events) {
+    ssize_t r = read(STDIN_FILENO, read_buf_.data(), read_buf_.size());
+    if (r <= 0) {
+        loop_.remove(STDIN_FILENO);
+        stdin_registered_ = false;
+        return;
+    }
+    write_pty(read_buf_.data(), static_cast<size_t>(r));
+}
+
+void ServerBridge::write_pty(const uint8_t* data, size_t len) {
+    if (recorder_) recorder_->input(data, len);
+    if (!shell_ && !pty_eof_) {
+        // Still waiting for the shell: hold the input and stop reading more.
+        pty_pending_.insert(pty_pending_.end(), data, data + len);
+        channel_.stats()->pty_queued_bytes.store(pty_pending_.size(), std::memory_order_relaxed);
+        channel_.pause_reading(true);
+        return;
+    }
+    if (pty_fd_ < 0) return;
+    if (!pty_pending_.empty()) {
+        pty_pending_.insert(pty_pending_.end(), data, data + len);
+        channel_.stats()->pty_queued_bytes.store(pty_pending_.size(), std::memory_order_relaxed);
+        return;
+    }
+    ssize_t w = shell_->pty.pty_write((const char*)data, len);
+    if (w < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return;
+        w = 0;
+    }
+    if (static_cast<size_t>(w) == len && trace_seq_ && !trace_written_) input_written();
+    if (static_cast<size_t>(w) < len) {
+        // The shell isn't keeping up; hold the rest and stop reading the peer.
+        pty_pending_.assign(data + w, data + len);
+        const auto& stats = channel_.stats();
+        stats_add(stats->pty_short_writes, 1);
+        stats->pty_queued_bytes.store(pty_pending_.size(), std::memory_order_relaxed);
+        channel_.pause_reading(true);
+        update_pty_interest();
+    }
+}
+
+void ServerBridge::update_pty_interest() {
+    if (pty_fd_ < 0) return;
+    uint32_t events = 0;
+    // Out of credit: the client hasn't shown what is already on its way.
+    if (channel_.pending_bytes() < kMaxPendingOutput && (!flow_ || credit_ > 0)) events |= EventLoop::READABLE;
+    if (!pty_pending_.empty()) events |= EventLoop::WRITABLE;
+    loop_.modify(pty_fd_, events);
+}
+
+void ServerBridge::note_traffic() {
+    traffic_since_ping_ = true;
+    if (!ping_timer_ && !finished_) send_ping();
+}
+
+void ServerBridge::send_ping() {
+    ping_timer_ = 0;
+    quiet_pings_ = traffic_since_ping_ ? 0 : quiet_pings_ + 1;
+    traffic_since_ping_ = false;
+    if (quiet_pings_ > kQuietPings) return;
+    uint8_t buf[control::kMaxEncodedSize];
+    size_t len = control::encode_ping(control::MsgType::PING, ping_seq_++, ping_clock_us(), buf);
+    channel_.send_frame(framing::FrameType::CONTROL, buf, len);
+    ping_timer_ = loop_.add_timer(kPingInterval, [this]() { send_ping(); });
+}
+
+void ServerBridge::on_pong(const control::Ping& pong) {
+    rtt_.add_sample(rtt_since(pong.sent_us));
+    const auto& stats = channel_.stats();
+    stats->srtt_us.store(static_cast<uint64_t>(rtt_.srtt().count()), std::memory_order_relaxed);
+    stats->rttvar_us.store(static_cast<uint64_t>(rtt_.rttvar().count()), std::memory_order_relaxed);
+    coalescer_.set_rtt(rtt_.srtt());
+}
+
+void ServerBridge::input_written() {
+    trace_written_ = true;
+    trace_write_ = EventLoop::Clock::now();
+    channel_.stats()->input_ns.record(static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(trace_write_ - trace_arrived_).count()));
+}
+
+std::vector<std::string> ServerBridge::latency_report() const {
+    std::vector<std::string> lines;
+    std::string rtt = rtt_.describe();
+    if (!rtt.empty()) lines.push_back(rtt);
+    const Histogram& input = channel_.stats()->input_ns;
+    uint64_t traced = 0;
+    for (size_t i = 0; i < Histogram::kBuckets; ++i) traced += input.count(i);
+    if (traced > 0) {
+        char line[160];
+        std::snprintf(line, sizeof(line),
+                      "Traced keystrokes reached the shell %.3f ms p50, %.3f ms p99 after arrival (%llu)",
+                      input.quantile(0.5) / 1e6, input.quantile(0.99) / 1e6, (unsigned long long)traced);
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+void ServerBridge::detach() {
+    if (flush_timer_) {
+        loop_.cancel_timer(flush_timer_);
+        flush_timer_ = 0;
+    }
+    loop_.remove(pty_fd_);
+    pty_fd_ = -1;
+    // Output read but not yet sent is already in the scrollback.
+    detached_->park(loop_, std::move(shell_));
+}
+
+void ServerBridge::finish() {
+    if (finished_) return;
+    finished_ = true;
+    if (mux_) mux_->close_all();
+    if (forwarder_) forwarder_->close_all();
+    if (transfers_) transfers_->close_all();
+    if (detached_ && shell_ && !pty_eof_) detach();
+    if (on_finished) on_finished();
+}
+
+ClientBridge::ClientBridge(EventLoop& loop, TLSWrapper& tls, const ClientOptions& options)
+    : loop_(loop), channel_(loop, tls), options_(options), read_buf_(framing::HEADER_SIZE + 4096) {}
+
+ClientBridge::~ClientBridge() {
+    if (ping_timer_) loop_.cancel_timer(ping_timer_);
+    if (expiry_timer_) loop_.cancel_timer(expiry_timer_);
+    if (stdin_open_) loop_.remove(STDIN_FILENO);
+}
+
+bool ClientBridge::start() {
+    channel_.on_frame = [this](uint8_t type, const std::vector<uint8_t>& payload) { on_frame(type, payload); };
+    channel_.on_channel_frame = [this](uint32_t id, uint8_t type, const std::vector<uint8_t>& payload) {
+        note_traffic();
+        if (mux_) mux_->on_frame(id, type, payload);
+    };
+    channel_.on_drained = [this]() {
+        if (mux_) mux_->pump();
+        update_stdin_interest();
+    };
+    channel_.on_closed = [this]() { finish(); };
+    if (!channel_.start()) return false;
+    // Sent even with nothing to offer: the ack also says whether the TLS
+    // session was resumed, which only the server can tell.
+    auto offer = options_.compress ? nlohmann::json::array({kCompressionDeflate}) : nlohmann::json::array();
+    nlohmann::json hello = {{"type", "hello"}, {"compress", offer}, {"channels", true}};
+    if (options_.flow_control) hello["credit"] = kInitialCreditWindow;
+    if (options_.transfer_only()) {
+        // Files only: the channels start once the server acks.
+        hello["shell"] = false;
+        send_control_json(channel_, hello);
+        send_ping();
+        return true;
+    }
+    if (options_.sessions && options_.reattach) {
+        std::vector<uint8_t> saved = options_.sessions->load(options_.peer);
+        auto session = nlohmann::json::parse(saved.begin(), saved.end(), nullptr, false);
+        if (session.is_object() && session.contains("id") && session.contains("token")) {
+            hello["attach"] = {{"id", session["id"]}, {"token", session["token"]}};
+        }
+    }
+    send_control_json(channel_, hello);
+    if (options_.trace_latency) tracer_ = std::make_unique<KeystrokeTracer>();
+    if (options_.predict_echo_ms >= 0) {
+        echo_ = std::make_unique<PredictiveEcho>(std::chrono::milliseconds(options_.predict_echo_ms));
+        // Start from a screen the model knows: blank, cursor home.
+        static const char kClear[] = "\x1b[H\x1b[2J";
+        show_output(reinterpret_cast<const uint8_t*>(kClear), sizeof(kClear) - 1);
+    }
+    send_ping();
+    stdin_open_ = loop_.add(STDIN_FILENO, EventLoop::READABLE, [this](uint32_t events) { on_stdin_events(events); });
+    return stdin_open_;
+}
+
+void ClientBridge::on_frame(uint8_t type, const std::vector<uint8_t>& payload) {
+    if (!is_ping_frame(type, payload)) note_traffic();
+    bool data = type == (uint8_t)framing::FrameType::DATA || type == (uint8_t)framing::FrameType::DATA_COMPRESSED;
+    if (data && tracer_) tracer_->on_output(KeystrokeTracer::Clock::now());
+    if (type == (uint8_t)framing::FrameType::DATA) {
+        show_output(payload.data(), payload.size());
+        grant_credit(payload.size());
+    } else if (type == (uint8_t)framing::FrameType::DATA_COMPRESSED) {
+        auto sink = [this](const uint8_t* data, size_t len) {
+            show_output(data, len);
+            grant_credit(len);
+        };
+        if (!decompressor_.decompress(payload.data(), payload.size(), sink)) channel_.close();
+    } else if (type == (uint8_t)framing::FrameType::CONTROL) {
+        control::Message binary;
+        if (control::decode(payload.data(), payload.size(), binary)) {
+            if (binary.type == control::MsgType::PING) {
+                send_pong(channel_, binary.ping);
+            } else if (binary.type == control::MsgType::PONG) {
+                auto rtt = rtt_since(binary.ping.sent_us);
+                LOG_DEBUG("Ping answered in %lld us", (long long)rtt.count());
+                rtt_.add_sample(rtt);
+                if (echo_) echo_->add_rtt_sample(rtt);
+                if (credit_) credit_->set_rtt(rtt);
+                if (mux_) mux_->set_rtt(rtt);
+            } else if (binary.type == control::MsgType::INPUT_TRACE) {
+                if (tracer_) tracer_->on_trace(binary.trace, KeystrokeTracer::Clock::now());
+            } else if (mux_) {
+                mux_->on_control(binary);
+            }
+            return;
+        }
+        if (!control::is_json(payload.data(), payload.size())) return;
+        try {
+            auto j = nlohmann::json::parse(std::string((const char*)payload.data(), payload.size()));
+            if (j.contains("type") && j["type"] == "hello_ack") {
+                if (j.value("compress", "") == kCompressionDeflate) {
+                    if (!decompressor_.init() || !compressor_.init(framing::HEADER_SIZE)) channel_.close();
+                }
+                if (options_.flow_control && j.contains("credit") && j["credit"] == true) {
+                    credit_ = std::make_unique<CreditWindow>(kInitialCreditWindow, kMaxCreditWindow);
                 }
-                continue;
+                if (j.contains("channels") && j["channels"] == true && !mux_) {
+                    mux_ = std::make_unique<ChannelMux>(channel_, true);
+                    start_forwarding();
+                    start_transfers();
+                } else if (!mux_ && options_.transfer_only()) {
+                    LOG_ERROR("The server doesn't support file transfer");
+                    transfers_failed_ = true;
+                    channel_.shutdown();
+                } else if (!mux_ && !(options_.local_forwards.empty() && options_.remote_forwards.empty())) {
+                    LOG_WARN("The server doesn't support channels; port forwarding is off");
+                }
+                if (options_.report_resumption && j.contains("resumed")) {
+                    std::string line = std::string("Session resumed: ") + (j.value("resumed", false) ? "yes" : "no");
+                    line += "\r\n"; // the console is in raw mode by now
+                    show_output(reinterpret_cast<const uint8_t*>(line.data()), line.size());
+                }
+                if (options_.sessions && j.contains("session") && j["session"].is_object()) {
+                    const auto& session = j["session"];
+                    std::string saved = nlohmann::json{{"id", session.value("id", uint64_t(0))},
+                                                       {"token", session.value("token", "")}}.dump();
+                    options_.sessions->store(options_.peer, std::vector<uint8_t>(saved.begin(), saved.end()));
+                }
+            } else if (j.contains("type") && j["type"] == "session_end") {
+                if (options_.sessions) options_.sessions->erase(options_.peer);
             }
+        } catch (...) {}
+    }
+}
+
+void ClientBridge::on_stdin_events(uint32_t events) {
+    // Read behind room for the frame header so keystrokes go out without a copy.
+    uint8_t* payload = read_buf_.data() + framing::HEADER_SIZE;
+    ssize_t r = read(STDIN_FILENO, payload, read_buf_.size() - framing::HEADER_SIZE);
+    if (r <= 0) {
+        loop_.remove(STDIN_FILENO);
+        stdin_open_ = false;
+        channel_.shutdown();
+        return;
+    }
+    note_traffic();
+    if (echo_) {
+        echo_buf_.clear();
+        echo_->on_input(payload, static_cast<size_t>(r), PredictiveEcho::Clock::now(), echo_buf_);
+        write_console(echo_buf_.data(), echo_buf_.size());
+        arm_expiry();
+    }
+    if (tracer_) {
+        uint8_t mark[control::kMaxEncodedSize];
+        uint32_t seq = tracer_->on_input(KeystrokeTracer::Clock::now());
+        channel_.send_frame(framing::FrameType::CONTROL, mark, control::encode_input_mark(seq, mark));
+    }
+    // Keystrokes are urgent: they go out ahead of anything bulk still queued.
+    if (!send_data(channel_, compressor_, payload, static_cast<size_t>(r), SendPriority::URGENT)) {
+        channel_.close();
+        return;
+    }
+    update_stdin_interest();
+}
+
+void ClientBridge::show_output(const uint8_t* data, size_t len) {
+    // The server's shell, if it started one anyway, isn't ours to show.
+    if (options_.transfer_only()) return;
+    if (!echo_) {
+        write_console(data, len);
+        return;
+    }
+    echo_buf_.clear();
+    echo_->on_output(data, len, PredictiveEcho::Clock::now(), echo_buf_);
+    write_console(echo_buf_.data(), echo_buf_.size());
+}
+
+void ClientBridge::grant_credit(size_t len) {
+    if (!credit_) return;
+    size_t grant = credit_->consumed(len, CreditWindow::Clock::now());
+    if (grant == 0) return;
+    uint8_t buf[control::kMaxEncodedSize];
+    size_t n = control::encode_credit(static_cast<uint32_t>(grant), buf);
+    channel_.send_frame(framing::FrameType::CONTROL, buf, n);
+}
+
+void ClientBridge::start_forwarding() {
+    if (options_.local_forwards.empty() && options_.remote_forwards.empty()) return;
+    forwarder_ = std::make_unique<PortForwarder>(loop_, *mux_, false);
+    mux_->on_open_request = [this](uint32_t id, uint8_t kind, const std::string& target, ChannelMux::Handler& handler) {
+        return forwarder_->accept(id, kind, target, handler);
+    };
+    for (const auto& spec : options_.local_forwards) forwarder_->add_local(spec);
+    for (const auto& spec : options_.remote_forwards) forwarder_->add_remote(spec);
+}
+
+void ClientBridge::start_transfers() {
+    if (!options_.transfer_only()) return;
+    transfers_ = std::make_unique<FileTransfers>(*mux_, false);
+    transfers_->on_done = [this]() {
+        transfers_failed_ = transfers_->failed();
+        channel_.shutdown();
+    };
+    for (const auto& path : options_.send_files) transfers_->send(path);
+    for (const auto& path : options_.recv_files) transfers_->receive(path);
+    if (transfers_->pending() == 0) transfers_->on_done();
+}
+
+void ClientBridge::note_traffic() {
+    traffic_since_ping_ = true;
+    if (!ping_timer_ && !finished_) send_ping();
+}
+
+void ClientBridge::send_ping() {
+    ping_timer_ = 0;
+    quiet_pings_ = traffic_since_ping_ ? 0 : quiet_pings_ + 1;
+    traffic_since_ping_ = false;
+    if (quiet_pings_ > kQuietPings) return;
+    // Checked here too: nothing forwards SIGWINCH to the client loop.
+    struct winsize ws;
+    if (echo_ && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 && ws.ws_col > 0) {
+        echo_->resize(ws.ws_row, ws.ws_col);
+    }
+    uint8_t buf[control::kMaxEncodedSize];
+    size_t len = control::encode_ping(control::MsgType::PING, ping_seq_++, ping_clock_us(), buf);
+    channel_.send_frame(framing::FrameType::CONTROL, buf, len);
+    ping_timer_ = loop_.add_timer(kPingInterval, [this]() { send_ping(); });
+}
+
+std::vector<std::string> ClientBridge::latency_report() const {
+    std::vector<std::string> lines;
+    std::string rtt = rtt_.describe();
+    if (!rtt.empty()) lines.push_back(rtt);
+    if (tracer_) {
+        for (auto& line : tracer_->describe()) lines.push_back(std::move(line));
+    }
+    return lines;
+}
+
+void ClientBridge::arm_expiry() {
+    if (expiry_timer_) return;
+    auto when = echo_->next_expiry();
+    if (when == PredictiveEcho::Clock::time_point::max()) return;
+    auto delay = std::max<EventLoop::Clock::duration>(when - PredictiveEcho::Clock::now(), EventLoop::Clock::duration(0));
+    expiry_timer_ = loop_.add_timer(delay, [this]() {
+        expiry_timer_ = 0;
+        echo_buf_.clear();
+        echo_->expire(PredictiveEcho::Clock::now(), echo_buf_);
+        write_console(echo_buf_.data(), echo_buf_.size());
+        arm_expiry();
+    });
+}
+
+void ClientBridge::update_stdin_interest() {
+    if (!stdin_open_) return;
+    uint32_t events = 0;
+    if (channel_.pending_bytes() < kMaxPendingOutput) events |= EventLoop::READABLE;
+    loop_.modify(STDIN_FILENO, events);
+}
+
+void ClientBridge::finish() {
+    if (finished_) return;
+    finished_ = true;
+    if (mux_) mux_->close_all();
+    if (forwarder_) forwarder_->close_all();
+    if (transfers_) {
+        transfers_->close_all();
+        transfers_failed_ = transfers_->failed();
+    }
+    if (on_finished) on_finished();
+}
+
+bool run_client_console(TLSWrapper& tls, EgressQueue& egress, const ClientOptions& options) {
+    // A transfer leaves the terminal alone: it prints progress, not a shell.
+    bool console = !options.transfer_only();
+    struct termios orig_in{}; struct termios raw_in{};
+    struct termios orig_out{}; struct termios raw_out{};
+    if (console && tcgetattr(STDIN_FILENO, &orig_in) == 0) { raw_in = orig_in; cfmakeraw(&raw_in); tcsetattr(STDIN_FILENO, TCSANOW, &raw_in); }
+    if (console && tcgetattr(STDOUT_FILENO, &orig_out) == 0) { raw_out = orig_out; cfmakeraw(&raw_out); tcsetattr(STDOUT_FILENO, TCSANOW, &raw_out); }
+
+    bool transferred = false;
+    std::vector<std::string> latency;
+    EventLoop loop;
+    if (loop.valid()) {
+        ClientBridge bridge(loop, tls, options);
+        bridge.attach_egress(egress);
+        bridge.on_finished = [&loop]() { loop.stop(); };
+        if (bridge.start()) {
+            loop.run();
+            transferred = !bridge.transfers_failed();
         }
-        if (c == 9 || c == 10 || c == 13 || (c >= 32 && c <= 126)) {
-            out.push_back(c);
+        latency = bridge.latency_report();
+    }
+
+    if (console) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &orig_in);
+        tcsetattr(STDOUT_FILENO, TCSANOW, &orig_out);
+    }
+    for (const auto& line : latency) {
+        LOG_INFO("%s", line.c_str());
+        if (options.report_latency) std::printf("%s\n", line.c_str());
+    }
+    return console || transferred;
+}
+
+void run_server_shell(TLSWrapper& tls, EgressQueue& egress, bool mirror_output, bool mirror_input, bool mirror_clean,
+                      bool compress, bool flow_control, bool forwarding, bool file_transfer,
+                      const std::string& record_dir) {
+    struct termios orig_in{}; bool have_orig = false;
+    if (mirror_input) {
+        struct termios raw_in{};
+        if (tcgetattr(STDIN_FILENO, &orig_in) == 0) {
+            have_orig = true;
+            raw_in = orig_in;
+            cfmakeraw(&raw_in);
+            raw_in.c_lflag &= ~(ECHO);
+            tcsetattr(STDIN_FILENO, TCSANOW, &raw_in);
         }
-        i++;
     }
-    return out;
+    EventLoop loop;
+    if (loop.valid()) {
+        ServerBridge bridge(loop, tls, mirror_output, mirror_input, mirror_clean, compress, flow_control, forwarding,
+                            file_transfer);
+        bridge.attach_egress(egress);
+        if (!record_dir.empty()) {
+            std::string path = recording_path(record_dir, 1);
+            auto recorder = SessionRecorder::create(path, "peer " + tls.get_peer_fingerprint(), 24, 80);
+            if (recorder) LOG_INFO("Recording the session to %s", path.c_str());
+            bridge.record_to(std::move(recorder));
+        }
+        bridge.on_finished = [&loop]() { loop.stop(); };
+        if (bridge.start()) {
+            LOG_INFO("Session active; forwarding PTY output to client%s%s%s",
+                     mirror_output ? " (mirrored to server console)" : "",
+                     mirror_input ? "; server console input enabled" : "",
+                     mirror_clean ? "; server mirror cleaned" : "");
+            loop.run();
+        }
+        for (const auto& line : bridge.latency_report()) LOG_INFO("%s", line.c_str());
+        const auto& stats = bridge.channel().stats();
+        LOG_INFO("Output: %llu frames, %llu PTY reads coalesced, %llu bytes of record overhead saved",
+                 (unsigned long long)stats->frames_out.load(std::memory_order_relaxed),
+                 (unsigned long long)stats->reads_coalesced.load(std::memory_order_relaxed),
+                 (unsigned long long)stats->overhead_saved.load(std::memory_order_relaxed));
+        uint64_t raw = stats->compressed_in.load(std::memory_order_relaxed);
+        if (raw > 0) {
+            uint64_t packed = stats->compressed_out.load(std::memory_order_relaxed);
+            LOG_INFO("Compression: %llu bytes of output sent as %llu (%.1f%%)", (unsigned long long)raw,
+                     (unsigned long long)packed, 100.0 * packed / raw);
+        }
+    }
+    if (mirror_input && have_orig) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &orig_in);
+    }
+    LOG_INFO("Session ended");
 }
-static std::vector<uint8_t> filter_ansi_for_cmd(const std::vector<uint8_t>& in);
+
+#endif
@@ -1,8 +1,252 @@
 #pragma once
 
+#include "port_forward.hpp"
+
 #include <string>
+#include <vector>
 
+class EgressQueue;
+class PeerStore;
 class TLSWrapper;
 
-void run_server_shell(TLSWrapper& tls, bool mirror_output, bool mirror_input, bool mirror_clean);
-void run_client_console(TLSWrapper& tls);
+struct ClientOptions {
+    // Offer to deflate DATA frames in both directions.
+    bool compress = true;
+    // Print the server's answer on TLS resumption.
+    bool report_resumption = false;
+    // Print round-trip and keystroke latency when the session ends.
+    bool report_latency = false;
+    // Mark keystrokes so the server reports when they reached the shell,
+    // and time each one to its echo.
+    bool trace_latency = false;
+    // Where reattach tokens for detachable server shells are kept, keyed by
+    // peer. Null to neither store nor present one.
+    PeerStore* sessions = nullptr;
+    std::string peer;
+    // Present a stored token and ask for the old shell back.
+    bool reattach = true;
+    // Echo keystrokes locally before the server does once the smoothed RTT
+    // exceeds this many milliseconds; 0 always, negative never.
+    int predict_echo_ms = -1;
+    // Grant the server output credit as the console takes it, so only about
+    // a round trip's worth of output is ever on its way.
+    bool flow_control = true;
+    // -L and -R: ports to relay through the server's channels.
+    std::vector<ForwardSpec> local_forwards;
+    std::vector<ForwardSpec> remote_forwards;
+    // --send and --recv: move these files over the connection and exit,
+    // with no console or shell.
+    std::vector<std::string> send_files;
+    std::vector<std::string> recv_files;
+
+    bool transfer_only() const { return !send_files.empty() || !recv_files.empty(); }
+};
+
+// Both run the session on the calling thread, which becomes the only one to
+// touch tls; egress carries frames from the caller's other threads.
+// record_dir: record the session there (Linux), empty for none.
+void run_server_shell(TLSWrapper& tls, EgressQueue& egress, bool mirror_output, bool mirror_input, bool mirror_clean,
+                      bool compress, bool flow_control, bool forwarding, bool file_transfer,
+                      const std::string& record_dir);
+// False if a file transfer in options didn't complete.
+bool run_client_console(TLSWrapper& tls, EgressQueue& egress, const ClientOptions& options);
+
+#ifndef _WIN32
+
+#include "ansi_filter.hpp"
+#include "channel_mux.hpp"
+#include "compression.hpp"
+#include "credit_window.hpp"
+#include "detached_sessions.hpp"
+#include "event_loop.hpp"
+#include "file_transfer.hpp"
+#include "latency_probe.hpp"
+#include "output_coalescer.hpp"
+#include "predictive_echo.hpp"
+#include "session_recording.hpp"
+#include "tls_channel.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Server side of a session: one PTY bridged to one TLS connection, with
+// optional mirroring to and from the server's own console.
+class ServerBridge {
+public:
+    // compress: accept a client's offer to deflate DATA frames.
+    // flow_control: accept a client's offer to pace output with credit.
+    // forwarding: let the client forward ports through this host.
+    // file_transfer: let the client store and fetch files on this host.
+    ServerBridge(EventLoop& loop, TLSWrapper& tls, bool mirror_output, bool mirror_input, bool mirror_clean,
+                 bool compress, bool flow_control, bool forwarding, bool file_transfer,
+                 std::shared_ptr<TrafficStats> stats = nullptr);
+    ~ServerBridge();
+
+    // Lets the shell outlive the connection. Before start(); the shell is
+    // then created, or reattached, once the client's hello arrives, and
+    // parked in sessions if the connection drops first. owner is the client
+    // certificate fingerprint.
+    void enable_detach(DetachedSessions* sessions, std::string owner);
+
+    // Also sends frames other threads push to egress. Before start().
+    void attach_egress(EgressQueue& egress) { channel_.attach(egress); }
+    // Records the shell's output, the client's input and resizes. Before
+    // start().
+    void record_to(std::unique_ptr<SessionRecorder> recorder) { recorder_ = std::move(recorder); }
+    bool start();
+    bool finished() const { return finished_; }
+    const TLSChannel& channel() const { return channel_; }
+    // Null until the client's hello agrees to extra channels.
+    ChannelMux* mux() { return mux_.get(); }
+    // Round trip to the client, and traced keystrokes' time to the shell,
+    // as lines for the log.
+    std::vector<std::string> latency_report() const;
+
+    // Invoked once, on the loop thread, when the session is over.
+    std::function<void()> on_finished;
+
+private:
+    void on_frame(uint8_t type, const std::vector<uint8_t>& payload);
+    void on_hello(bool peer_offers_deflate, uint64_t attach_id, const std::string& attach_token);
+    void attach_shell(std::unique_ptr<DetachableShell> shell, bool peer_offers_deflate, bool reattached);
+    bool adopt_shell(std::unique_ptr<DetachableShell> shell);
+    void accept_hello(bool peer_offers_deflate, bool reattached);
+    void replay_scrollback();
+    void send_replay(const std::vector<uint8_t>& bytes);
+    void resize(int rows, int cols);
+    void on_pty_events(uint32_t events);
+    void read_pty();
+    void flush_output();
+    void on_stdin_events(uint32_t events);
+    void write_pty(const uint8_t* data, size_t len);
+    void update_pty_interest();
+    // Restarts the pings if they stopped while the session was idle.
+    void note_traffic();
+    void send_ping();
+    void on_pong(const control::Ping& pong);
+    void input_written();
+    void detach();
+    void finish();
+
+    EventLoop& loop_;
+    TLSChannel channel_;
+    std::unique_ptr<DetachableShell> shell_;
+    int pty_fd_ = -1;
+    DetachedSessions* detached_ = nullptr;
+    std::string owner_;
+    uint64_t hello_timer_ = 0;
+    int rows_ = 0;
+    int cols_ = 0;
+    // Lets an in-flight reattach tell that this bridge is gone.
+    std::shared_ptr<bool> alive_ = std::make_shared<bool>(true);
+    bool mirror_output_;
+    bool mirror_input_;
+    bool mirror_clean_;
+    bool compress_;
+    bool flow_control_;
+    bool forwarding_;
+    bool file_transfer_;
+    bool resumed_;
+    // Output credit: the window the client's hello offers, and once it is
+    // accepted, how many more bytes may be read from the PTY and sent.
+    // Negative after a replay larger than the credit left.
+    size_t peer_window_ = 0;
+    bool flow_ = false;
+    int64_t credit_ = 0;
+    // The client's hello offers extra channels; they are on once acked.
+    bool peer_channels_ = false;
+    // False when the client only came to transfer files.
+    bool peer_wants_shell_ = true;
+    std::unique_ptr<ChannelMux> mux_;
+    // Declared after mux_: they close their channels as they go.
+    std::unique_ptr<PortForwarder> forwarder_;
+    std::unique_ptr<FileTransfers> transfers_;
+    std::vector<uint8_t> read_buf_;
+    AnsiFilter mirror_filter_;
+    std::vector<uint8_t> mirror_buf_;
+    OutputCoalescer coalescer_;
+    FrameCompressor compressor_;
+    FrameDecompressor decompressor_;
+    uint64_t flush_timer_ = 0;
+    size_t size_at_arm_ = 0;
+    uint64_t coalesced_reported_ = 0;
+    std::vector<uint8_t> pty_pending_;
+    std::unique_ptr<SessionRecorder> recorder_;
+    RttEstimator rtt_;
+    uint64_t ping_timer_ = 0;
+    uint32_t ping_seq_ = 0;
+    unsigned quiet_pings_ = 0;
+    bool traffic_since_ping_ = false;
+    // The client's latest INPUT_MARK (0: none): when it arrived and, once
+    // its keys are in the PTY, when they were written.
+    uint32_t trace_seq_ = 0;
+    bool trace_written_ = false;
+    EventLoop::Clock::time_point trace_arrived_{};
+    EventLoop::Clock::time_point trace_write_{};
+    bool stdin_registered_ = false;
+    bool pty_eof_ = false;
+    bool finished_ = false;
+};
+
+// Client side of a session: the local console bridged to one TLS connection.
+class ClientBridge {
+public:
+    ClientBridge(EventLoop& loop, TLSWrapper& tls, const ClientOptions& options);
+    ~ClientBridge();
+
+    void attach_egress(EgressQueue& egress) { channel_.attach(egress); }
+    bool start();
+    bool finished() const { return finished_; }
+    // A file transfer asked for in the options didn't complete.
+    bool transfers_failed() const { return transfers_failed_; }
+    // Null until the server agrees to extra channels.
+    ChannelMux* mux() { return mux_.get(); }
+    // Round trip and, when traced, keystroke latency, as lines to print.
+    std::vector<std::string> latency_report() const;
+
+    std::function<void()> on_finished;
+
+private:
+    void on_frame(uint8_t type, const std::vector<uint8_t>& payload);
+    void show_output(const uint8_t* data, size_t len);
+    void grant_credit(size_t len);
+    void start_forwarding();
+    void start_transfers();
+    void on_stdin_events(uint32_t events);
+    void update_stdin_interest();
+    void note_traffic();
+    void send_ping();
+    void arm_expiry();
+    void finish();
+
+    EventLoop& loop_;
+    TLSChannel channel_;
+    ClientOptions options_;
+    std::vector<uint8_t> read_buf_;
+    FrameCompressor compressor_;
+    FrameDecompressor decompressor_;
+    // Null unless predictive echo was asked for.
+    std::unique_ptr<PredictiveEcho> echo_;
+    std::vector<uint8_t> echo_buf_;
+    // Null unless the server agreed to flow control.
+    std::unique_ptr<CreditWindow> credit_;
+    RttEstimator rtt_;
+    // Null unless keystrokes are traced.
+    std::unique_ptr<KeystrokeTracer> tracer_;
+    std::unique_ptr<ChannelMux> mux_;
+    std::unique_ptr<PortForwarder> forwarder_;
+    std::unique_ptr<FileTransfers> transfers_;
+    uint64_t ping_timer_ = 0;
+    uint64_t expiry_timer_ = 0;
+    uint32_t ping_seq_ = 0;
+    unsigned quiet_pings_ = 0;
+    bool traffic_since_ping_ = false;
+    bool stdin_open_ = false;
+    bool transfers_failed_ = false;
+    bool finished_ = false;
+};
+
+#endif
@@ -0,0 +1,95 @@
+#include "latency_probe.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+// Keys with no echo or trace after this long (a password prompt, a peer
+// that doesn't trace) are forgotten rather than counted.
+static const std::chrono::seconds kMaxWait(5);
+// At most this many batches are remembered while waiting.
+static const size_t kMaxOutstanding = 256;
+
+static double ms(std::chrono::microseconds us) {
+    return static_cast<double>(us.count()) / 1000.0;
+}
+
+static double ms(uint64_t us) {
+    return static_cast<double>(us) / 1000.0;
+}
+
+void RttEstimator::add_sample(std::chrono::microseconds rtt) {
+    if (rtt.count() < 0) return;
+    if (samples_++ == 0) {
+        srtt_ = rtt;
+        rttvar_ = rtt / 2;
+        min_ = rtt;
+        return;
+    }
+    auto error = rtt > srtt_ ? rtt - srtt_ : srtt_ - rtt;
+    rttvar_ += (error - rttvar_) / 4;
+    srtt_ += (rtt - srtt_) / 8;
+    min_ = std::min(min_, rtt);
+}
+
+std::string RttEstimator::describe() const {
+    if (samples_ == 0) return "";
+    char line[128];
+    std::snprintf(line, sizeof(line), "Round trip: %.1f ms smoothed, %.1f ms jitter, %.1f ms min (%llu pings)",
+                  ms(srtt_), ms(rttvar_), ms(min_), (unsigned long long)samples_);
+    return line;
+}
+
+uint32_t KeystrokeTracer::on_input(Clock::time_point now) {
+    while (!unechoed_.empty() && (now - unechoed_.front() > kMaxWait || unechoed_.size() >= kMaxOutstanding)) {
+        unechoed_.pop_front();
+    }
+    while (!untraced_.empty() && (now - untraced_.front().at > kMaxWait || untraced_.size() >= kMaxOutstanding)) {
+        untraced_.pop_front();
+    }
+    uint32_t seq = next_seq_++;
+    unechoed_.push_back(now);
+    untraced_.push_back(Sent{seq, now});
+    return seq;
+}
+
+void KeystrokeTracer::on_output(Clock::time_point now) {
+    if (unechoed_.empty()) return;
+    auto waited = std::chrono::duration_cast<std::chrono::microseconds>(now - unechoed_.front());
+    unechoed_.pop_front();
+    echo_us_.record(static_cast<uint64_t>(waited.count()));
+}
+
+void KeystrokeTracer::on_trace(const control::InputTrace& trace, Clock::time_point now) {
+    // Batches the server had no output for are skipped over.
+    while (!untraced_.empty() && untraced_.front().seq != trace.seq) untraced_.pop_front();
+    if (untraced_.empty()) return;
+    auto total = std::chrono::duration_cast<std::chrono::microseconds>(now - untraced_.front().at).count();
+    untraced_.pop_front();
+    int64_t server = static_cast<int64_t>(trace.pty_us) + trace.echo_us;
+    int64_t network = std::max<int64_t>(total - server, 0);
+    pty_us_.record(static_cast<uint64_t>(network / 2 + trace.pty_us));
+    shell_us_.record(trace.echo_us);
+}
+
+std::vector<std::string> KeystrokeTracer::describe() const {
+    uint64_t echoed = 0;
+    uint64_t traced = 0;
+    for (size_t i = 0; i < Histogram::kBuckets; ++i) {
+        echoed += echo_us_.count(i);
+        traced += pty_us_.count(i);
+    }
+    std::vector<std::string> lines;
+    char line[160];
+    if (echoed > 0) {
+        std::snprintf(line, sizeof(line), "Keystroke to echo: %.1f ms p50, %.1f ms p99 (%llu keystrokes)",
+                      ms(echo_us_.quantile(0.5)), ms(echo_us_.quantile(0.99)), (unsigned long long)echoed);
+        lines.push_back(line);
+    }
+    if (traced > 0) {
+        std::snprintf(line, sizeof(line),
+                      "Keystroke to server PTY write: about %.1f ms p50, %.1f ms p99; shell echo %.2f ms p50",
+                      ms(pty_us_.quantile(0.5)), ms(pty_us_.quantile(0.99)), ms(shell_us_.quantile(0.5)));
+        lines.push_back(line);
+    }
+    return lines;
+}
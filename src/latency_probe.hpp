@@ -0,0 +1,73 @@
+#pragma once
+
+#include "control_codec.hpp"
+#include "metrics.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+// Smoothed round-trip time and its variation (jitter) from ping samples,
+// kept the way TCP keeps them (RFC 6298): srtt moves an eighth and rttvar
+// a quarter of the way towards each new sample.
+class RttEstimator {
+public:
+    void add_sample(std::chrono::microseconds rtt);
+
+    std::chrono::microseconds srtt() const { return srtt_; }
+    std::chrono::microseconds rttvar() const { return rttvar_; }
+    std::chrono::microseconds min() const { return min_; }
+    uint64_t samples() const { return samples_; }
+
+    // "Round trip: 23.1 ms smoothed, 1.2 ms jitter, 21.0 ms min (58 pings)";
+    // empty before the first sample.
+    std::string describe() const;
+
+private:
+    std::chrono::microseconds srtt_{0};
+    std::chrono::microseconds rttvar_{0};
+    std::chrono::microseconds min_{0};
+    uint64_t samples_ = 0;
+};
+
+// Client side of keystroke latency tracing. Each batch of keys read from
+// the console gets a sequence number, sent ahead of it as INPUT_MARK. The
+// first terminal output after a batch is taken as its echo, which gives
+// keystroke-to-echo time on the client's clock alone. The server's
+// INPUT_TRACE for the batch splits that time: what is left after its
+// time in the server and in the shell is the network, half of which is
+// assumed to be the way there.
+class KeystrokeTracer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // A batch of keys is about to be sent; returns the seq to mark it with.
+    uint32_t on_input(Clock::time_point now);
+    void on_output(Clock::time_point now);
+    void on_trace(const control::InputTrace& trace, Clock::time_point now);
+
+    // Keystroke to echo, keystroke to the server's PTY write (estimated),
+    // and the shell's own echo time, all in microseconds.
+    const Histogram& echo_us() const { return echo_us_; }
+    const Histogram& pty_us() const { return pty_us_; }
+    const Histogram& shell_us() const { return shell_us_; }
+
+    // One line per measurement; none before any keystroke was traced.
+    std::vector<std::string> describe() const;
+
+private:
+    struct Sent {
+        uint32_t seq;
+        Clock::time_point at;
+    };
+
+    uint32_t next_seq_ = 1;
+    // Batches waiting for their echo, and for their INPUT_TRACE.
+    std::deque<Clock::time_point> unechoed_;
+    std::deque<Sent> untraced_;
+    Histogram echo_us_;
+    Histogram pty_us_;
+    Histogram shell_us_;
+};
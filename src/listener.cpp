@@ -3,7 +3,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
+#include <errno.h>
 #include <cstring>
 
 Listener::Listener(int port) : port_(port) {}
@@ -39,7 +41,7 @@ bool Listener::start() {
         return false;
     }
 
-    if (listen(listen_fd_, 5) < 0) {
+    if (listen(listen_fd_, SOMAXCONN) < 0) {
         LOG_ERROR("listen() failed: %s", error_to_string(errno).c_str());
         return false;
     }
@@ -47,13 +49,20 @@ bool Listener::start() {
     return true;
 }
 
-intptr_t Listener::accept_connection() {
+intptr_t Listener::accept_connection(std::string* peer) {
     struct sockaddr_in cli_addr;
     socklen_t clilen = sizeof(cli_addr);
     intptr_t new_fd = accept(listen_fd_, (struct sockaddr*)&cli_addr, &clilen);
     if (new_fd < 0) {
-        LOG_ERROR("accept() failed: %s", error_to_string(errno).c_str());
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            LOG_ERROR("accept() failed: %s", error_to_string(errno).c_str());
+        }
         return -1;
     }
+    if (peer) {
+        char addr[INET_ADDRSTRLEN] = {0};
+        inet_ntop(AF_INET, &cli_addr.sin_addr, addr, sizeof(addr));
+        *peer = std::string(addr) + ":" + std::to_string(ntohs(cli_addr.sin_port));
+    }
     return new_fd;
 }
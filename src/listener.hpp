@@ -10,7 +10,9 @@ public:
     ~Listener();
 
     bool start();
-    intptr_t accept_connection();
+    // Returns -1 on failure. When peer is given it receives "address:port".
+    intptr_t accept_connection(std::string* peer = nullptr);
+    intptr_t fd() const { return listen_fd_; }
 
 private:
     int port_;
@@ -67,7 +67,7 @@ bool Listener::start() {
     return true;
 }
 
-intptr_t Listener::accept_connection() {
+intptr_t Listener::accept_connection(std::string* peer) {
     SOCKET s = static_cast<SOCKET>(listen_fd_);
     sockaddr_in cli_addr;
     int addrlen = sizeof(cli_addr);
@@ -76,5 +76,10 @@ intptr_t Listener::accept_connection() {
         LOG_ERROR("accept() failed: %d", WSAGetLastError());
         return -1;
     }
+    if (peer) {
+        char addr[INET_ADDRSTRLEN] = {0};
+        inet_ntop(AF_INET, &cli_addr.sin_addr, addr, sizeof(addr));
+        *peer = std::string(addr) + ":" + std::to_string(ntohs(cli_addr.sin_port));
+    }
     return static_cast<intptr_t>(client);
 }
\ No newline at end of file
@@ -34,6 +34,10 @@ int main(int argc, char* argv[]) {
             config.key_type = argv[++i];
         } else if (arg == "--debug") {
             config.debug = true;
+        } else if (arg == "--log-file" && i + 1 < argc) {
+            config.log_file = argv[++i];
+        } else if (arg == "--log-max-mb" && i + 1 < argc) {
+            config.log_max_mb = std::stoi(argv[++i]);
         } else if (arg == "--mirror-output") {
             config.mirror_output = true;
         } else if (arg == "--mirror-input") {
@@ -43,6 +47,56 @@ int main(int argc, char* argv[]) {
             config.mirror_input = true;
         } else if (arg == "--mirror-clean") {
             config.mirror_clean = true;
+        } else if (arg == "--max-sessions" && i + 1 < argc) {
+            config.max_sessions = std::stoi(argv[++i]);
+        } else if (arg == "--workers" && i + 1 < argc) {
+            config.workers = std::stoi(argv[++i]);
+        } else if (arg == "--stats-interval" && i + 1 < argc) {
+            config.stats_interval = std::stoi(argv[++i]);
+        } else if (arg == "--metrics-file" && i + 1 < argc) {
+            config.metrics_file = argv[++i];
+        } else if (arg == "--metrics-socket" && i + 1 < argc) {
+            config.metrics_socket = argv[++i];
+        } else if (arg == "--record-dir" && i + 1 < argc) {
+            config.record_dir = argv[++i];
+        } else if (arg == "--no-compress") {
+            config.compress = false;
+        } else if (arg == "--no-flow-control") {
+            config.flow_control = false;
+        } else if (arg == "--ticket-lifetime" && i + 1 < argc) {
+            config.ticket_lifetime = std::stoi(argv[++i]);
+        } else if (arg == "--ticket-cache" && i + 1 < argc) {
+            config.ticket_cache = argv[++i];
+        } else if (arg == "--no-ticket-cache") {
+            config.use_ticket_cache = false;
+        } else if (arg == "--early-data") {
+            config.early_data = true;
+        } else if (arg == "--kernel-tls") {
+            config.kernel_tls = true;
+        } else if (arg == "--detach" && i + 1 < argc) {
+            config.detach_lifetime = std::stoi(argv[++i]);
+        } else if (arg == "--scrollback" && i + 1 < argc) {
+            config.scrollback_kb = std::stoi(argv[++i]);
+        } else if (arg == "--new-session") {
+            config.new_session = true;
+        } else if (arg == "--screen-model") {
+            config.screen_model = true;
+        } else if (arg == "--predict-echo" && i + 1 < argc) {
+            config.predict_echo_ms = std::stoi(argv[++i]);
+        } else if (arg == "--trace-latency") {
+            config.trace_latency = true;
+        } else if (arg == "--no-forwarding") {
+            config.forwarding = false;
+        } else if (arg == "-L" && i + 1 < argc) {
+            config.local_forwards.push_back(argv[++i]);
+        } else if (arg == "-R" && i + 1 < argc) {
+            config.remote_forwards.push_back(argv[++i]);
+        } else if (arg == "--no-file-transfer") {
+            config.file_transfer = false;
+        } else if (arg == "--send" && i + 1 < argc) {
+            config.send_files.push_back(argv[++i]);
+        } else if (arg == "--recv" && i + 1 < argc) {
+            config.recv_files.push_back(argv[++i]);
         }
     }
 
@@ -50,7 +104,7 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    initialize_logging("secure_tunnel.log", config.debug);
+    initialize_logging(config.log_file, config.debug, static_cast<size_t>(config.log_max_mb) << 20);
     setup_signal_handlers();
 
     auto file_exists = [](const std::string& p) { return !p.empty() && std::filesystem::exists(std::filesystem::path(p)); };
@@ -79,11 +133,15 @@ int main(int argc, char* argv[]) {
 
     if (config.mode == "listen") {
         if (session_manager.start_listening()) {
-            session_manager.wait_for_session();
+            if (config.serving()) {
+                session_manager.serve_sessions();
+            } else {
+                session_manager.wait_for_session();
+            }
         }
     } else if (config.mode == "connect") {
-        if (session_manager.connect_to_peer(config.connect_ip)) {
-            // Session logic for client
+        if (!session_manager.connect_to_peer(config.connect_ip)) {
+            return 1;
         }
     }
 
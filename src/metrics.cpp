@@ -0,0 +1,417 @@
+#include "metrics.hpp"
+#include "buffer_pool.hpp"
+#include "event_loop.hpp"
+#include "utils.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Bucket edges exported for each histogram, as powers of two: frame
+// payloads of 1 byte to the 1 MB frame limit, and pump passes of 1 us to
+// about 17 s.
+static const int kFrameLowEdge = 0;
+static const int kFrameHighEdge = 20;
+static const int kPumpLowEdge = 10;
+static const int kPumpHighEdge = 34;
+
+// A client that sends nothing for this long is answered with bare text.
+static const std::chrono::milliseconds kRequestWait(100);
+static const size_t kMaxRequest = 8192;
+
+void HistogramTotals::add(const Histogram& h) {
+    for (size_t i = 0; i < counts.size(); ++i) counts[i] += h.count(i);
+    sum += h.sum();
+}
+
+void HistogramTotals::add(const HistogramTotals& other) {
+    for (size_t i = 0; i < counts.size(); ++i) counts[i] += other.counts[i];
+    sum += other.sum;
+}
+
+void TrafficTotals::add(const TrafficStats& s) {
+    auto get = [](const std::atomic<uint64_t>& counter) { return counter.load(std::memory_order_relaxed); };
+    bytes_in += get(s.bytes_in);
+    bytes_out += get(s.bytes_out);
+    frames_in += get(s.frames_in);
+    frames_out += get(s.frames_out);
+    records_in += get(s.records_in);
+    records_out += get(s.records_out);
+    short_writes += get(s.short_writes);
+    pty_short_writes += get(s.pty_short_writes);
+    pty_reads += get(s.pty_reads);
+    reads_coalesced += get(s.reads_coalesced);
+    compressed_in += get(s.compressed_in);
+    compressed_out += get(s.compressed_out);
+    frame_bytes_in.add(s.frame_bytes_in);
+    frame_bytes_out.add(s.frame_bytes_out);
+    pump_ns.add(s.pump_ns);
+    input_ns.add(s.input_ns);
+}
+
+void TrafficTotals::add(const TrafficTotals& other) {
+    bytes_in += other.bytes_in;
+    bytes_out += other.bytes_out;
+    frames_in += other.frames_in;
+    frames_out += other.frames_out;
+    records_in += other.records_in;
+    records_out += other.records_out;
+    short_writes += other.short_writes;
+    pty_short_writes += other.pty_short_writes;
+    pty_reads += other.pty_reads;
+    reads_coalesced += other.reads_coalesced;
+    compressed_in += other.compressed_in;
+    compressed_out += other.compressed_out;
+    frame_bytes_in.add(other.frame_bytes_in);
+    frame_bytes_out.add(other.frame_bytes_out);
+    pump_ns.add(other.pump_ns);
+    input_ns.add(other.input_ns);
+}
+
+static void family(std::string& out, const char* name, const char* type, const char* help) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+static void sample(std::string& out, const char* name, const std::string& labels, uint64_t value) {
+    out += name;
+    if (!labels.empty()) {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += ' ';
+    out += std::to_string(value);
+    out += '\n';
+}
+
+static std::string label_value(const std::string& value) {
+    std::string escaped;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+static std::string join(const std::string& a, const std::string& b) {
+    if (a.empty()) return b;
+    if (b.empty()) return a;
+    return a + "," + b;
+}
+
+static std::string number(double value) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.9g", value);
+    return buf;
+}
+
+// Cumulative buckets at powers of two from 2^low to 2^high, scaled into the
+// exported unit.
+static void histogram(std::string& out, const std::string& name, const std::string& labels,
+                      const HistogramTotals& h, int low, int high, double scale) {
+    std::string bucket = name + "_bucket";
+    size_t b = 0;
+    uint64_t below = 0;
+    for (int k = low; k <= high; ++k) {
+        uint64_t edge = uint64_t(1) << k;
+        while (b + 1 < Histogram::kBuckets && Histogram::bucket_limit(b) <= edge) below += h.counts[b++];
+        sample(out, bucket.c_str(), join(labels, "le=\"" + number(static_cast<double>(edge) * scale) + "\""), below);
+    }
+    uint64_t total = 0;
+    for (uint64_t count : h.counts) total += count;
+    sample(out, bucket.c_str(), join(labels, "le=\"+Inf\""), total);
+    std::string sum_line = name + "_sum";
+    if (!labels.empty()) sum_line += "{" + labels + "}";
+    out += sum_line + " " + number(static_cast<double>(h.sum) * scale) + "\n";
+    sample(out, (name + "_count").c_str(), labels, total);
+}
+
+std::string format_metrics(const std::vector<SessionMetrics>& sessions, const TrafficTotals& retired,
+                           uint64_t accepted, uint64_t rejected) {
+    TrafficTotals all = retired;
+    uint64_t queued = 0;
+    uint64_t pty_queued = 0;
+    for (const auto& s : sessions) {
+        all.add(*s.stats);
+        queued += s.stats->queued_bytes.load(std::memory_order_relaxed);
+        pty_queued += s.stats->pty_queued_bytes.load(std::memory_order_relaxed);
+    }
+
+    std::string out;
+    out.reserve(4096 + sessions.size() * 1536);
+    const std::string in = "direction=\"in\"";
+    const std::string outward = "direction=\"out\"";
+
+    family(out, "secure_tunnel_sessions", "gauge", "Sessions connected now.");
+    sample(out, "secure_tunnel_sessions", "", sessions.size());
+    family(out, "secure_tunnel_sessions_accepted_total", "counter", "Connections given a session.");
+    sample(out, "secure_tunnel_sessions_accepted_total", "", accepted);
+    family(out, "secure_tunnel_sessions_rejected_total", "counter", "Connections refused at the session limit.");
+    sample(out, "secure_tunnel_sessions_rejected_total", "", rejected);
+
+    family(out, "secure_tunnel_bytes_total", "counter", "Frame payload bytes.");
+    sample(out, "secure_tunnel_bytes_total", in, all.bytes_in);
+    sample(out, "secure_tunnel_bytes_total", outward, all.bytes_out);
+    family(out, "secure_tunnel_frames_total", "counter", "Frames.");
+    sample(out, "secure_tunnel_frames_total", in, all.frames_in);
+    sample(out, "secure_tunnel_frames_total", outward, all.frames_out);
+    family(out, "secure_tunnel_tls_records_total", "counter", "TLS records.");
+    sample(out, "secure_tunnel_tls_records_total", in, all.records_in);
+    sample(out, "secure_tunnel_tls_records_total", outward, all.records_out);
+    family(out, "secure_tunnel_pty_reads_total", "counter", "Reads of shell output.");
+    sample(out, "secure_tunnel_pty_reads_total", "", all.pty_reads);
+    family(out, "secure_tunnel_pty_reads_coalesced_total", "counter",
+           "Shell output reads merged into a frame another read had started.");
+    sample(out, "secure_tunnel_pty_reads_coalesced_total", "", all.reads_coalesced);
+    family(out, "secure_tunnel_short_writes_total", "counter", "Writes that found the socket or the shell's input full.");
+    sample(out, "secure_tunnel_short_writes_total", "target=\"socket\"", all.short_writes);
+    sample(out, "secure_tunnel_short_writes_total", "target=\"pty\"", all.pty_short_writes);
+    family(out, "secure_tunnel_compression_bytes_total", "counter",
+           "DATA bytes given to the compressor, and what they compressed to.");
+    sample(out, "secure_tunnel_compression_bytes_total", "stage=\"raw\"", all.compressed_in);
+    sample(out, "secure_tunnel_compression_bytes_total", "stage=\"deflated\"", all.compressed_out);
+    family(out, "secure_tunnel_queued_bytes", "gauge", "Bytes waiting for the socket or for the shell to read.");
+    sample(out, "secure_tunnel_queued_bytes", "queue=\"socket\"", queued);
+    sample(out, "secure_tunnel_queued_bytes", "queue=\"pty\"", pty_queued);
+
+    family(out, "secure_tunnel_frame_size_bytes", "histogram", "Frame payload sizes.");
+    histogram(out, "secure_tunnel_frame_size_bytes", in, all.frame_bytes_in, kFrameLowEdge, kFrameHighEdge, 1);
+    histogram(out, "secure_tunnel_frame_size_bytes", outward, all.frame_bytes_out, kFrameLowEdge, kFrameHighEdge, 1);
+    family(out, "secure_tunnel_pty_pump_seconds", "histogram",
+           "Time to read, frame, encrypt and send one batch of shell output.");
+    histogram(out, "secure_tunnel_pty_pump_seconds", "", all.pump_ns, kPumpLowEdge, kPumpHighEdge, 1e-9);
+    family(out, "secure_tunnel_input_to_pty_seconds", "histogram",
+           "Time from a traced keystroke's arrival to its write to the shell.");
+    histogram(out, "secure_tunnel_input_to_pty_seconds", "", all.input_ns, kPumpLowEdge, kPumpHighEdge, 1e-9);
+
+    buffer_pool::Stats pool = buffer_pool::stats();
+    family(out, "secure_tunnel_buffer_pool_heap_allocations_total", "counter",
+           "I/O buffers the pool had to take from the heap; flat once warm.");
+    sample(out, "secure_tunnel_buffer_pool_heap_allocations_total", "", pool.heap_allocations);
+    family(out, "secure_tunnel_buffer_pool_heap_bytes_total", "counter", "Bytes of those buffers.");
+    sample(out, "secure_tunnel_buffer_pool_heap_bytes_total", "", pool.heap_bytes);
+    family(out, "secure_tunnel_buffer_pool_depot_bytes", "gauge", "Free buffers shared between threads.");
+    sample(out, "secure_tunnel_buffer_pool_depot_bytes", "", pool.depot_bytes);
+
+    if (sessions.empty()) return out;
+
+    // Per-session series, one family at a time as the format requires.
+    std::vector<std::string> labels;
+    labels.reserve(sessions.size());
+    for (const auto& s : sessions) {
+        labels.push_back("session=\"" + std::to_string(s.id) + "\",peer=\"" + label_value(s.peer) +
+                         "\",worker=\"" + std::to_string(s.worker) + "\"");
+    }
+    auto per_session = [&](const char* name, const char* type, const char* help, const char* label,
+                           std::atomic<uint64_t> TrafficStats::*field) {
+        family(out, name, type, help);
+        for (size_t i = 0; i < sessions.size(); ++i) {
+            sample(out, name, join(labels[i], label), ((*sessions[i].stats).*field).load(std::memory_order_relaxed));
+        }
+    };
+    auto per_session_pair = [&](const char* name, const char* type, const char* help, const char* label_a,
+                                std::atomic<uint64_t> TrafficStats::*a, const char* label_b,
+                                std::atomic<uint64_t> TrafficStats::*b) {
+        family(out, name, type, help);
+        for (size_t i = 0; i < sessions.size(); ++i) {
+            const TrafficStats& stats = *sessions[i].stats;
+            sample(out, name, join(labels[i], label_a), (stats.*a).load(std::memory_order_relaxed));
+            sample(out, name, join(labels[i], label_b), (stats.*b).load(std::memory_order_relaxed));
+        }
+    };
+    per_session_pair("secure_tunnel_session_bytes_total", "counter", "Frame payload bytes of a session.",
+                     "direction=\"in\"", &TrafficStats::bytes_in, "direction=\"out\"", &TrafficStats::bytes_out);
+    per_session_pair("secure_tunnel_session_frames_total", "counter", "Frames of a session.", "direction=\"in\"",
+                     &TrafficStats::frames_in, "direction=\"out\"", &TrafficStats::frames_out);
+    per_session_pair("secure_tunnel_session_tls_records_total", "counter", "TLS records of a session.",
+                     "direction=\"in\"", &TrafficStats::records_in, "direction=\"out\"", &TrafficStats::records_out);
+    per_session("secure_tunnel_session_pty_reads_total", "counter", "Reads of a session's shell output.", "",
+                &TrafficStats::pty_reads);
+    per_session_pair("secure_tunnel_session_short_writes_total", "counter",
+                     "Writes that found a session's socket or shell input full.", "target=\"socket\"",
+                     &TrafficStats::short_writes, "target=\"pty\"", &TrafficStats::pty_short_writes);
+    per_session_pair("secure_tunnel_session_rtt_microseconds", "gauge",
+                     "Smoothed round trip to a session's client, and its variation.", "stat=\"smoothed\"",
+                     &TrafficStats::srtt_us, "stat=\"variation\"", &TrafficStats::rttvar_us);
+    per_session_pair("secure_tunnel_session_queued_bytes", "gauge",
+                     "Bytes of a session waiting for the socket or for the shell to read.", "queue=\"socket\"",
+                     &TrafficStats::queued_bytes, "queue=\"pty\"", &TrafficStats::pty_queued_bytes);
+    return out;
+}
+
+bool write_metrics_file(const std::string& path, const std::string& text) {
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOG_WARN("Cannot write %s: %s", tmp.c_str(), error_to_string(errno).c_str());
+        return false;
+    }
+    size_t off = 0;
+    while (off < text.size()) {
+        ssize_t w = ::write(fd, text.data() + off, text.size() - off);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        off += static_cast<size_t>(w);
+    }
+    ::close(fd);
+    if (off != text.size() || ::rename(tmp.c_str(), path.c_str()) != 0) {
+        LOG_WARN("Cannot save %s: %s", path.c_str(), error_to_string(errno).c_str());
+        ::unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+MetricsEndpoint::MetricsEndpoint(EventLoop& loop, std::function<std::string()> render)
+    : loop_(loop), render_(std::move(render)) {}
+
+MetricsEndpoint::~MetricsEndpoint() {
+    while (!clients_.empty()) drop(clients_.begin()->first);
+    if (listen_fd_ >= 0) {
+        loop_.remove(listen_fd_);
+        ::close(listen_fd_);
+        ::unlink(path_.c_str());
+    }
+}
+
+bool MetricsEndpoint::start(const std::string& path) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        LOG_ERROR("Metrics socket path too long: %s", path.c_str());
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_ERROR("socket() failed: %s", error_to_string(errno).c_str());
+        return false;
+    }
+    ::unlink(path.c_str());
+    // Peer addresses are in the output: only the server's user may connect.
+    mode_t old_mask = ::umask(0077);
+    int bound = ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    ::umask(old_mask);
+    if (bound < 0 || ::listen(fd, 16) < 0) {
+        LOG_ERROR("Cannot listen on %s: %s", path.c_str(), error_to_string(errno).c_str());
+        ::close(fd);
+        return false;
+    }
+    if (!loop_.add(fd, EventLoop::READABLE, [this](uint32_t) { accept_pending(); })) {
+        ::close(fd);
+        ::unlink(path.c_str());
+        return false;
+    }
+    listen_fd_ = fd;
+    path_ = path;
+    LOG_INFO("Serving metrics on %s", path.c_str());
+    return true;
+}
+
+void MetricsEndpoint::accept_pending() {
+    for (;;) {
+        int fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+        if (!loop_.add(fd, EventLoop::READABLE, [this, fd](uint32_t events) { on_client(fd, events); })) {
+            ::close(fd);
+            continue;
+        }
+        Client& client = clients_[fd];
+        client.timer = loop_.add_timer(kRequestWait, [this, fd]() {
+            auto it = clients_.find(fd);
+            if (it == clients_.end()) return;
+            it->second.timer = 0;
+            respond(fd, false);
+        });
+    }
+}
+
+void MetricsEndpoint::on_client(int fd, uint32_t) {
+    auto it = clients_.find(fd);
+    if (it == clients_.end()) return;
+    Client& client = it->second;
+    if (!client.reply.empty()) {
+        send_reply(fd);
+        return;
+    }
+    char buf[1024];
+    ssize_t r = ::read(fd, buf, sizeof(buf));
+    if (r < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) drop(fd);
+        return;
+    }
+    if (r == 0) {
+        // Shut its side without a request: it just wants the text.
+        respond(fd, false);
+        return;
+    }
+    client.request.append(buf, static_cast<size_t>(r));
+    if (client.request.find("\r\n\r\n") != std::string::npos || client.request.find("\n\n") != std::string::npos) {
+        respond(fd, true);
+    } else if (client.request.size() > kMaxRequest) {
+        drop(fd);
+    }
+}
+
+void MetricsEndpoint::respond(int fd, bool http) {
+    Client& client = clients_[fd];
+    if (client.timer) {
+        loop_.cancel_timer(client.timer);
+        client.timer = 0;
+    }
+    std::string body = render_();
+    if (http) {
+        client.reply = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                       std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    } else {
+        client.reply = std::move(body);
+    }
+    loop_.modify(fd, EventLoop::WRITABLE);
+    send_reply(fd);
+}
+
+void MetricsEndpoint::send_reply(int fd) {
+    Client& client = clients_[fd];
+    while (client.sent < client.reply.size()) {
+        ssize_t w = ::send(fd, client.reply.data() + client.sent, client.reply.size() - client.sent, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            break;
+        }
+        client.sent += static_cast<size_t>(w);
+    }
+    drop(fd);
+}
+
+void MetricsEndpoint::drop(int fd) {
+    auto it = clients_.find(fd);
+    if (it == clients_.end()) return;
+    if (it->second.timer) loop_.cancel_timer(it->second.timer);
+    clients_.erase(it);
+    loop_.remove(fd);
+    ::close(fd);
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Single-writer counter bump: cheaper than fetch_add, still safe to sample.
+inline void stats_add(std::atomic<uint64_t>& counter, uint64_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Log-linear histogram in the style of HdrHistogram: every power of two is
+// split into four buckets, so a recorded value lands in a bucket at most 25%
+// wider than itself, across the whole range up to 2^41. Recording is a bit
+// scan and two counter bumps; like stats_add, one thread writes and any
+// thread may read.
+//
+// Buckets hold (lower, upper]: group 0 holds 0..4 one value per bucket, and
+// group g > 0 holds (2^(g+1), 2^(g+2)] in quarters, so every power of two
+// is a bucket edge. Values past the last group count in its last bucket.
+class Histogram {
+public:
+    static constexpr int kSubBits = 2;
+    static constexpr size_t kGroups = 40;
+    static constexpr size_t kBuckets = kGroups << kSubBits;
+
+    void record(uint64_t value) {
+        stats_add(counts_[bucket_of(value)], 1);
+        stats_add(sum_, value);
+    }
+
+    uint64_t count(size_t bucket) const { return counts_[bucket].load(std::memory_order_relaxed); }
+    uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+    // Estimate of the q-quantile (0..1), interpolated within its bucket;
+    // 0 with nothing recorded.
+    uint64_t quantile(double q) const {
+        uint64_t total = 0;
+        for (size_t i = 0; i < kBuckets; ++i) total += count(i);
+        if (total == 0) return 0;
+        double rank = q * static_cast<double>(total);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; ++i) {
+            uint64_t n = count(i);
+            if (n > 0 && static_cast<double>(seen + n) >= rank) {
+                uint64_t lower = i > 0 ? bucket_limit(i - 1) : 0;
+                double within = rank > static_cast<double>(seen) ? (rank - static_cast<double>(seen)) / n : 0.0;
+                return lower + static_cast<uint64_t>(static_cast<double>(bucket_limit(i) - lower) * within);
+            }
+            seen += n;
+        }
+        return bucket_limit(kBuckets - 1);
+    }
+
+    static size_t bucket_of(uint64_t value) {
+        uint64_t x = value > 0 ? value - 1 : 0;
+        if (x < (1u << kSubBits)) return static_cast<size_t>(x);
+        int top = msb(x);
+        size_t group = static_cast<size_t>(top - kSubBits + 1);
+        size_t sub = static_cast<size_t>(x >> (top - kSubBits)) & ((1u << kSubBits) - 1);
+        size_t bucket = group << kSubBits | sub;
+        return bucket < kBuckets ? bucket : kBuckets - 1;
+    }
+
+    // Largest value bucket holds.
+    static uint64_t bucket_limit(size_t bucket) {
+        size_t group = bucket >> kSubBits;
+        uint64_t sub = bucket & ((1u << kSubBits) - 1);
+        if (group == 0) return sub + 1;
+        return ((1u << kSubBits) + sub + 1) << (group - 1);
+    }
+
+private:
+    static int msb(uint64_t x) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, x);
+        return static_cast<int>(index);
+#else
+        return 63 - __builtin_clzll(x);
+#endif
+    }
+
+    std::atomic<uint64_t> counts_[kBuckets] = {};
+    std::atomic<uint64_t> sum_{0};
+};
+
+// What one session's connection has done, written only by the loop thread
+// that runs it and shared so other threads can sample it: for the session
+// table in the log and for the metrics export.
+struct TrafficStats {
+    // Application payload bytes and frames moved by the channel.
+    std::atomic<uint64_t> bytes_in{0};
+    std::atomic<uint64_t> bytes_out{0};
+    std::atomic<uint64_t> frames_in{0};
+    std::atomic<uint64_t> frames_out{0};
+    // TLS records sent, and received records read to their end.
+    std::atomic<uint64_t> records_in{0};
+    std::atomic<uint64_t> records_out{0};
+    // Writes that found the socket, or the shell's input, full.
+    std::atomic<uint64_t> short_writes{0};
+    std::atomic<uint64_t> pty_short_writes{0};
+    std::atomic<uint64_t> pty_reads{0};
+    // PTY reads merged into a frame another read had started, and the
+    // framing plus TLS record overhead that merging avoided.
+    std::atomic<uint64_t> reads_coalesced{0};
+    std::atomic<uint64_t> overhead_saved{0};
+    // DATA bytes that went through the compressor, and what they shrank to.
+    std::atomic<uint64_t> compressed_in{0};
+    std::atomic<uint64_t> compressed_out{0};
+    // Gauges: bytes waiting for the socket, and for the shell to read.
+    std::atomic<uint64_t> queued_bytes{0};
+    std::atomic<uint64_t> pty_queued_bytes{0};
+    // Gauges: smoothed round trip to the peer and its variation, from pings.
+    std::atomic<uint64_t> srtt_us{0};
+    std::atomic<uint64_t> rttvar_us{0};
+    // Payload size of each frame, and how long each pass over the shell's
+    // output (read, frame, encrypt, write) took in nanoseconds.
+    Histogram frame_bytes_in;
+    Histogram frame_bytes_out;
+    Histogram pump_ns;
+    // Keystrokes the client traces, from arrival to their write to the PTY.
+    Histogram input_ns;
+};
+
+// Plain copy of a Histogram, for adding sessions together.
+struct HistogramTotals {
+    std::array<uint64_t, Histogram::kBuckets> counts{};
+    uint64_t sum = 0;
+
+    void add(const Histogram& h);
+    void add(const HistogramTotals& other);
+};
+
+// Counters of any number of sessions added together; gauges are left out,
+// since they only mean something for sessions still connected.
+struct TrafficTotals {
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint64_t frames_in = 0;
+    uint64_t frames_out = 0;
+    uint64_t records_in = 0;
+    uint64_t records_out = 0;
+    uint64_t short_writes = 0;
+    uint64_t pty_short_writes = 0;
+    uint64_t pty_reads = 0;
+    uint64_t reads_coalesced = 0;
+    uint64_t compressed_in = 0;
+    uint64_t compressed_out = 0;
+    HistogramTotals frame_bytes_in;
+    HistogramTotals frame_bytes_out;
+    HistogramTotals pump_ns;
+    HistogramTotals input_ns;
+
+    void add(const TrafficStats& s);
+    void add(const TrafficTotals& other);
+};
+
+// A connected session as the metrics export sees it.
+struct SessionMetrics {
+    uint64_t id;
+    std::string peer;
+    int worker;
+    std::shared_ptr<TrafficStats> stats;
+};
+
+// Prometheus text exposition (format 0.0.4) of a server: process-wide
+// totals, with the sessions that have ended folded in from retired, plus
+// the counters and queue depths of each connected session labelled by id
+// and peer.
+std::string format_metrics(const std::vector<SessionMetrics>& sessions, const TrafficTotals& retired,
+                           uint64_t accepted, uint64_t rejected);
+
+// Replaces path with text in one rename, so readers such as node_exporter's
+// textfile collector never see half a file.
+bool write_metrics_file(const std::string& path, const std::string& text);
+
+#ifndef _WIN32
+class EventLoop;
+
+// Serves metrics on a Unix socket from an event loop. A client that sends an
+// HTTP request (curl --unix-socket) gets an HTTP response; one that sends
+// nothing (nc -U) gets the bare text. Either way the connection closes after
+// one answer.
+class MetricsEndpoint {
+public:
+    MetricsEndpoint(EventLoop& loop, std::function<std::string()> render);
+    ~MetricsEndpoint();
+
+    MetricsEndpoint(const MetricsEndpoint&) = delete;
+    MetricsEndpoint& operator=(const MetricsEndpoint&) = delete;
+
+    // Replaces a stale socket left at path by an earlier run.
+    bool start(const std::string& path);
+
+private:
+    struct Client {
+        std::string request;
+        std::string reply;
+        size_t sent = 0;
+        uint64_t timer = 0;
+    };
+
+    void accept_pending();
+    void on_client(int fd, uint32_t events);
+    void respond(int fd, bool http);
+    void send_reply(int fd);
+    void drop(int fd);
+
+    EventLoop& loop_;
+    std::function<std::string()> render_;
+    std::string path_;
+    int listen_fd_ = -1;
+    std::map<int, Client> clients_;
+};
+#endif
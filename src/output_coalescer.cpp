@@ -0,0 +1,76 @@
+#include "output_coalescer.hpp"
+
+#include <algorithm>
+
+// Bursts at or below this size after a quiet period are treated as
+// interactive and never delayed.
+static const size_t kInteractiveBytes = 256;
+// Bounds on how long streaming output may wait to fill a record.
+static const std::chrono::microseconds kMinWindow(500);
+static const std::chrono::microseconds kMaxWindow(2000);
+// With a round trip known, the longest wait is this fraction of it, within
+// kMaxWindow and kMaxRttWindow.
+static const int kRttWindowDivisor = 16;
+static const std::chrono::microseconds kMaxRttWindow(8000);
+// A gap this long between bursts ends a stream.
+static const std::chrono::microseconds kStreamGap(20000);
+
+OutputCoalescer::OutputCoalescer(size_t max_payload, size_t headroom)
+    : buf_(headroom + max_payload), max_payload_(max_payload), headroom_(headroom), max_window_(kMaxWindow) {}
+
+void OutputCoalescer::set_max_payload(size_t max_payload) {
+    if (max_payload < size_) max_payload = size_;
+    max_payload_ = max_payload;
+    buf_.resize(headroom_ + max_payload);
+}
+
+void OutputCoalescer::set_rtt(std::chrono::microseconds rtt) {
+    max_window_ = std::clamp(rtt / kRttWindowDivisor, kMaxWindow, kMaxRttWindow);
+}
+
+void OutputCoalescer::commit(size_t n) {
+    if (n == 0) return;
+    if (reads_in_frame_ > 0) ++reads_coalesced_;
+    ++reads_in_frame_;
+    size_ += n;
+    burst_bytes_ += n;
+}
+
+std::chrono::microseconds OutputCoalescer::flush_delay(Clock::time_point now) {
+    size_t burst = burst_bytes_;
+    burst_bytes_ = 0;
+    if (size_ == 0) return std::chrono::microseconds(0);
+
+    auto gap = std::chrono::duration_cast<std::chrono::microseconds>(now - last_burst_);
+    bool recent = last_burst_ != Clock::time_point{} && gap < kStreamGap;
+    if (recent && gap.count() > 0) {
+        double rate = static_cast<double>(burst) / static_cast<double>(gap.count());
+        bytes_per_us_ = bytes_per_us_ == 0.0 ? rate : 0.75 * bytes_per_us_ + 0.25 * rate;
+    }
+    last_burst_ = now;
+
+    if (!recent) streaming_ = false;
+    if (!streaming_ && burst <= kInteractiveBytes) {
+        return std::chrono::microseconds(0);
+    }
+    streaming_ = true;
+    if (size_ >= max_payload_) return std::chrono::microseconds(0);
+
+    // Wait roughly as long as the current rate needs to fill the record.
+    std::chrono::microseconds window = max_window_;
+    if (bytes_per_us_ > 0.0) {
+        window = std::chrono::microseconds(static_cast<int64_t>((max_payload_ - size_) / bytes_per_us_));
+    }
+    return std::clamp(window, kMinWindow, max_window_);
+}
+
+void OutputCoalescer::flushed() {
+    if (size_ > 0) ++frames_flushed_;
+    size_ = 0;
+    reads_in_frame_ = 0;
+}
+
+void OutputCoalescer::idle() {
+    streaming_ = false;
+    bytes_per_us_ = 0.0;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "buffer_pool.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Packs consecutive PTY reads into one DATA frame so bulk output travels in
+// full-size TLS records. A lone small read after a quiet period (a keystroke
+// echo) is flushed at once; while output is streaming, the flush is held for
+// a short window sized from the observed output rate.
+class OutputCoalescer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // headroom bytes are reserved in front of the payload so a frame header
+    // can be written there without moving it.
+    explicit OutputCoalescer(size_t max_payload, size_t headroom = 0);
+
+    void set_max_payload(size_t max_payload);
+    // Over a slow link, streaming output may wait longer to fill a record:
+    // a few milliseconds more are lost in the round trip.
+    void set_rtt(std::chrono::microseconds rtt);
+
+    // Read straight into the pending frame, then report the count via commit().
+    uint8_t* tail() { return buf_.data() + headroom_ + size_; }
+    size_t room() const { return max_payload_ - size_; }
+    void commit(size_t n);
+
+    // After a read burst ends (PTY drained): zero means flush now, otherwise
+    // how long the pending bytes may wait for more output.
+    std::chrono::microseconds flush_delay(Clock::time_point now);
+
+    uint8_t* data() { return buf_.data() + headroom_; }
+    const uint8_t* data() const { return buf_.data() + headroom_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    // The pending bytes were sent as one frame.
+    void flushed();
+    // A flush timer fired without any new output since it was armed.
+    void idle();
+
+    // Reads merged into a frame that an earlier read already started.
+    uint64_t reads_coalesced() const { return reads_coalesced_; }
+    uint64_t frames_flushed() const { return frames_flushed_; }
+
+private:
+    // A pool block: sessions come and go, a record-sized buffer each.
+    PooledBuffer buf_;
+    size_t max_payload_;
+    size_t headroom_;
+    size_t size_ = 0;
+    size_t reads_in_frame_ = 0;
+    size_t burst_bytes_ = 0;
+    bool streaming_ = false;
+    Clock::time_point last_burst_{};
+    double bytes_per_us_ = 0.0;
+    std::chrono::microseconds max_window_;
+    uint64_t reads_coalesced_ = 0;
+    uint64_t frames_flushed_ = 0;
+};
@@ -0,0 +1,100 @@
+#include "peer_store.hpp"
+#include "utils.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+PeerStore::PeerStore(std::string dir) : dir_(std::move(dir)) {}
+
+std::string PeerStore::default_dir(const char* name) {
+#ifdef _WIN32
+    const char* home = std::getenv("USERPROFILE");
+#else
+    const char* home = std::getenv("HOME");
+#endif
+    if (!home || !*home) return std::string();
+    return (std::filesystem::path(home) / ".secure-tunnel" / name).string();
+}
+
+std::string PeerStore::path_for(const std::string& peer) const {
+    // host:port, with anything that isn't safe in a file name replaced.
+    std::string name = peer;
+    for (char& c : name) {
+        bool safe = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.' || c == '-';
+        if (!safe) c = '_';
+    }
+    return (std::filesystem::path(dir_) / name).string();
+}
+
+std::vector<uint8_t> PeerStore::load(const std::string& peer) const {
+    std::vector<uint8_t> value;
+    std::ifstream in(path_for(peer), std::ios::binary);
+    if (in) value.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return value;
+}
+
+std::vector<uint8_t> PeerStore::take(const std::string& peer) {
+    std::vector<uint8_t> value = load(peer);
+    if (!value.empty()) erase(peer);
+    return value;
+}
+
+void PeerStore::erase(const std::string& peer) {
+    std::error_code ec;
+    std::filesystem::remove(path_for(peer), ec);
+}
+
+void PeerStore::store(const std::string& peer, const std::vector<uint8_t>& value) {
+    std::error_code ec;
+    std::filesystem::create_directories(dir_, ec);
+    if (ec) {
+        LOG_WARN("Cannot create %s: %s", dir_.c_str(), ec.message().c_str());
+        return;
+    }
+    std::filesystem::permissions(dir_, std::filesystem::perms::owner_all, ec);
+
+    std::string path = path_for(peer);
+    std::string tmp = path + ".tmp";
+#ifdef _WIN32
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out.write(reinterpret_cast<const char*>(value.data()), static_cast<std::streamsize>(value.size()))) {
+            LOG_WARN("Cannot write %s", tmp.c_str());
+            return;
+        }
+    }
+#else
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOG_WARN("Cannot write %s: %s", tmp.c_str(), error_to_string(errno).c_str());
+        return;
+    }
+    size_t off = 0;
+    while (off < value.size()) {
+        ssize_t w = ::write(fd, value.data() + off, value.size() - off);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        off += static_cast<size_t>(w);
+    }
+    ::close(fd);
+    if (off != value.size()) {
+        std::filesystem::remove(tmp, ec);
+        return;
+    }
+#endif
+    // Rename so a concurrent client never reads half a file.
+    std::filesystem::rename(tmp, path, ec);
+    if (ec) {
+        LOG_WARN("Cannot save %s: %s", path.c_str(), ec.message().c_str());
+        std::filesystem::remove(tmp, ec);
+    }
+}
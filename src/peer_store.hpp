@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Small per-peer client state kept between runs: one file per peer in a
+// directory under the user's home. The files hold secrets (resumable TLS
+// sessions, reattach tokens), so they are created readable by the owner only.
+class PeerStore {
+public:
+    explicit PeerStore(std::string dir);
+
+    // $HOME/.secure-tunnel/<name> (%USERPROFILE% on Windows), or empty if
+    // there is no home directory.
+    static std::string default_dir(const char* name);
+
+    std::vector<uint8_t> load(const std::string& peer) const;
+    // Removes and returns the entry for peer, for values that are used once.
+    std::vector<uint8_t> take(const std::string& peer);
+    void store(const std::string& peer, const std::vector<uint8_t>& value);
+    void erase(const std::string& peer);
+
+private:
+    std::string path_for(const std::string& peer) const;
+
+    std::string dir_;
+};
@@ -0,0 +1,591 @@
+#include "port_forward.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <vector>
+
+// Splits on ':' outside brackets and strips the brackets.
+static std::vector<std::string> split_fields(const std::string& text) {
+    std::vector<std::string> fields(1);
+    bool bracket = false;
+    for (char c : text) {
+        if (c == '[' && !bracket) bracket = true;
+        else if (c == ']' && bracket) bracket = false;
+        else if (c == ':' && !bracket) fields.emplace_back();
+        else fields.back() += c;
+    }
+    return fields;
+}
+
+static bool parse_port(const std::string& text, bool allow_zero, uint16_t& out) {
+    if (text.empty() || text.size() > 5 || !std::all_of(text.begin(), text.end(), ::isdigit)) return false;
+    long v = std::strtol(text.c_str(), nullptr, 10);
+    if (v > 65535 || (v == 0 && !allow_zero)) return false;
+    out = static_cast<uint16_t>(v);
+    return true;
+}
+
+bool parse_forward_spec(const std::string& text, ForwardSpec& out) {
+    std::vector<std::string> fields = split_fields(text);
+    if (fields.size() == 4) {
+        out.bind_host = fields[0];
+        fields.erase(fields.begin());
+    } else if (fields.size() != 3) {
+        return false;
+    }
+    out.host = fields[1];
+    return !out.bind_host.empty() && !out.host.empty() && parse_port(fields[0], true, out.bind_port) &&
+           parse_port(fields[2], false, out.port);
+}
+
+#ifndef _WIN32
+
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+// A relay stops reading its socket while this much is queued on its channel.
+static const size_t kMaxRelayQueued = 64 * 1024;
+static const size_t kRelayReadSize = 16 * 1024;
+// Name lookups each get a thread; past this many a request is refused.
+static const size_t kMaxLookupThreads = 8;
+static const size_t kMaxCachedNames = 32;
+static const std::chrono::seconds kCachedNameTtl(60);
+static const size_t kMaxAddresses = 8;
+
+static bool split_target(const std::string& target, std::string& host, uint16_t& port) {
+    std::vector<std::string> fields = split_fields(target);
+    if (fields.size() != 2 || fields[0].empty()) return false;
+    host = fields[0];
+    return parse_port(fields[1], false, port);
+}
+
+static std::string join_target(const std::string& host, uint16_t port) {
+    bool v6 = host.find(':') != std::string::npos;
+    return (v6 ? "[" + host + "]" : host) + ":" + std::to_string(port);
+}
+
+// Resolver threads post their answers through this, so it outlives the
+// forwarder. The destructor clears loop under the mutex and owner on the loop.
+struct PortForwarder::LookupSink {
+    std::mutex mutex;
+    EventLoop* loop;
+    PortForwarder* owner;
+};
+
+PortForwarder::PortForwarder(EventLoop& loop, ChannelMux& mux, bool accept_requests)
+    : loop_(loop), mux_(mux), accept_requests_(accept_requests), sink_(std::make_shared<LookupSink>()),
+      read_buf_(kRelayReadSize) {
+    sink_->loop = &loop;
+    sink_->owner = this;
+}
+
+PortForwarder::~PortForwarder() {
+    close_all();
+    std::lock_guard<std::mutex> lock(sink_->mutex);
+    sink_->loop = nullptr;
+    sink_->owner = nullptr;
+}
+
+uint16_t PortForwarder::add_local(const ForwardSpec& spec) {
+    int fd = listen_on(spec.bind_host, spec.bind_port);
+    if (fd < 0) return 0;
+    sockaddr_storage addr{};
+    socklen_t len = sizeof(addr);
+    getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len);
+    uint16_t port = ntohs(addr.ss_family == AF_INET6 ? reinterpret_cast<sockaddr_in6*>(&addr)->sin6_port
+                                                     : reinterpret_cast<sockaddr_in*>(&addr)->sin_port);
+    auto listener = std::make_unique<Listener>();
+    listener->fd = fd;
+    listener->spec = spec;
+    Listener* l = listener.get();
+    if (!loop_.add(fd, EventLoop::READABLE, [this, l](uint32_t) { on_accept(l); })) {
+        close(fd);
+        return 0;
+    }
+    listeners_.push_back(std::move(listener));
+    LOG_INFO("Forwarding %s to %s through the server", join_target(spec.bind_host, port).c_str(),
+             join_target(spec.host, spec.port).c_str());
+    return port;
+}
+
+void PortForwarder::add_remote(const ForwardSpec& spec) {
+    std::string bind = join_target(spec.bind_host, spec.bind_port);
+    std::string target = join_target(spec.host, spec.port);
+    // The handler needs the channel's ID, which open() only returns.
+    auto id = std::make_shared<uint32_t>(0);
+    ChannelMux::Handler handler;
+    handler.on_open = [bind, target]() {
+        LOG_INFO("Server listening on %s, forwarding to %s", bind.c_str(), target.c_str());
+    };
+    handler.on_close = [this, id, bind]() {
+        LOG_WARN("Server refused or ended the forward from %s", bind.c_str());
+        remote_.erase(*id);
+    };
+    *id = mux_.open(static_cast<uint8_t>(ChannelKind::TCP_LISTEN), bind, std::move(handler));
+    remote_[*id] = spec;
+}
+
+bool PortForwarder::accept(uint32_t id, uint8_t kind, const std::string& target, ChannelMux::Handler& handler) {
+    switch (static_cast<ChannelKind>(kind)) {
+    case ChannelKind::TCP_CONNECT: {
+        std::string host;
+        uint16_t port = 0;
+        if (!accept_requests_) {
+            LOG_WARN("Refused to forward to %s: forwarding is disabled", target.c_str());
+            return false;
+        }
+        if (!split_target(target, host, port)) return false;
+        Relay* relay = add_relay(id);
+        relay->target = target;
+        relay->lookup = resolve(host, port, [this, relay](std::vector<Address> addrs) {
+            relay->lookup = 0;
+            relay->addrs = std::move(addrs);
+            connect_next(relay, 0);
+        });
+        if (relay->lookup == 0) {
+            relays_.erase(relay);
+            return false;
+        }
+        handler = relay_handler(relay);
+        return true;
+    }
+    case ChannelKind::TCP_LISTEN: {
+        std::string host;
+        uint16_t port = 0;
+        if (!accept_requests_) {
+            LOG_WARN("Refused to listen on %s: forwarding is disabled", target.c_str());
+            return false;
+        }
+        if (!split_target(target, host, port)) return false;
+        auto listener = std::make_unique<Listener>();
+        listener->channel = id;
+        Listener* l = listener.get();
+        l->lookup = resolve(host, port, [this, l, target](std::vector<Address> addrs) {
+            l->lookup = 0;
+            int fd = addrs.empty() ? -1 : bind_listener(addrs, target);
+            if (fd >= 0 && loop_.add(fd, EventLoop::READABLE, [this, l](uint32_t) { on_accept(l); })) {
+                l->fd = fd;
+                LOG_INFO("Listening on %s for the client", target.c_str());
+                return;
+            }
+            if (fd >= 0) close(fd);
+            uint32_t channel = l->channel;
+            close_listener(channel);
+            mux_.close(channel);
+        });
+        if (l->lookup == 0) return false;
+        listeners_.push_back(std::move(listener));
+        handler.on_close = [this, id]() { close_listener(id); };
+        return true;
+    }
+    case ChannelKind::TCP_FORWARDED: {
+        auto it = remote_.find(static_cast<uint32_t>(std::strtoul(target.c_str(), nullptr, 10)));
+        if (it == remote_.end()) return false;
+        Relay* relay = add_relay(id);
+        relay->target = join_target(it->second.host, it->second.port);
+        relay->lookup = resolve(it->second.host, it->second.port, [this, relay](std::vector<Address> addrs) {
+            relay->lookup = 0;
+            relay->addrs = std::move(addrs);
+            connect_next(relay, 0);
+        });
+        if (relay->lookup == 0) {
+            relays_.erase(relay);
+            return false;
+        }
+        handler = relay_handler(relay);
+        return true;
+    }
+    case ChannelKind::FILE_PUT:
+    case ChannelKind::FILE_GET:
+        // FileTransfer takes these.
+        break;
+    }
+    return false;
+}
+
+void PortForwarder::close_all() {
+    // Closing a channel can end the connection and call back in here.
+    auto relays = std::move(relays_);
+    relays_.clear();
+    auto listeners = std::move(listeners_);
+    listeners_.clear();
+    auto remote = std::move(remote_);
+    remote_.clear();
+    lookups_.clear();
+    for (auto& entry : relays) {
+        Relay* relay = entry.first;
+        if (!relay->channel_closed && !relay->peer_closed) {
+            relay->channel_closed = true;
+            mux_.close(relay->id);
+        }
+        if (relay->fd < 0) continue;
+        loop_.remove(relay->fd);
+        close(relay->fd);
+    }
+    for (auto& listener : listeners) {
+        if (listener->channel != 0) mux_.close(listener->channel);
+        if (listener->fd < 0) continue;
+        loop_.remove(listener->fd);
+        close(listener->fd);
+    }
+    for (auto& entry : remote) mux_.close(entry.first);
+}
+
+int PortForwarder::listen_on(const std::string& host, uint16_t port) {
+    int error = 0;
+    std::vector<Address> addrs = lookup(host, port, 0, &error);
+    if (addrs.empty()) {
+        LOG_WARN("Cannot resolve %s: %s", host.c_str(), gai_strerror(error));
+        return -1;
+    }
+    return bind_listener(addrs, join_target(host, port));
+}
+
+int PortForwarder::bind_listener(const std::vector<Address>& addrs, const std::string& target) {
+    int error = 0;
+    for (const Address& a : addrs) {
+        int fd = socket(a.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            error = errno;
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, reinterpret_cast<const sockaddr*>(&a.addr), a.len) == 0 && listen(fd, SOMAXCONN) == 0) return fd;
+        error = errno;
+        close(fd);
+    }
+    LOG_ERROR("Cannot listen on %s: %s", target.c_str(), error_to_string(error).c_str());
+    return -1;
+}
+
+void PortForwarder::on_accept(Listener* listener) {
+    for (;;) {
+        int fd = accept4(listener->fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_WARN("accept() on a forwarded port failed: %s", error_to_string(errno).c_str());
+            }
+            return;
+        }
+        Relay* relay = add_relay(0);
+        if (!attach(relay, fd, false)) {
+            relays_.erase(relay);
+            continue;
+        }
+        if (listener->channel == 0) {
+            relay->id = mux_.open(static_cast<uint8_t>(ChannelKind::TCP_CONNECT),
+                                  join_target(listener->spec.host, listener->spec.port), relay_handler(relay));
+        } else {
+            relay->id = mux_.open(static_cast<uint8_t>(ChannelKind::TCP_FORWARDED), std::to_string(listener->channel),
+                                  relay_handler(relay));
+        }
+        update_interest(relay);
+    }
+}
+
+uint64_t PortForwarder::resolve(const std::string& host, uint16_t port, Resolved done) {
+    std::string key = join_target(host, port);
+    std::vector<Address> addrs = lookup(host, port, AI_NUMERICHOST, nullptr);
+    auto it = resolved_.find(key);
+    if (addrs.empty() && it != resolved_.end() && it->second.expires > std::chrono::steady_clock::now()) {
+        addrs = it->second.addrs;
+    }
+    if (addrs.empty() && lookup_threads_ >= kMaxLookupThreads) {
+        LOG_WARN("Refused to resolve %s: %zu lookups already running", host.c_str(), lookup_threads_);
+        return 0;
+    }
+    uint64_t id = next_lookup_++;
+    lookups_[id] = std::move(done);
+    std::shared_ptr<LookupSink> sink = sink_;
+    if (!addrs.empty()) {
+        // Answered from the loop all the same, after the caller has set up.
+        loop_.post([sink, id, addrs]() {
+            if (sink->owner) sink->owner->finish_lookup(id, addrs);
+        });
+        return id;
+    }
+    ++lookup_threads_;
+    std::thread([sink, host, port, id, key]() {
+        int error = 0;
+        std::vector<Address> found = lookup(host, port, 0, &error);
+        if (found.empty()) LOG_WARN("Cannot resolve %s: %s", host.c_str(), gai_strerror(error));
+        std::lock_guard<std::mutex> lock(sink->mutex);
+        if (!sink->loop) return;
+        sink->loop->post([sink, id, key, found]() {
+            PortForwarder* self = sink->owner;
+            if (!self) return;
+            --self->lookup_threads_;
+            if (!found.empty()) self->remember(key, found);
+            self->finish_lookup(id, found);
+        });
+    }).detach();
+    return id;
+}
+
+void PortForwarder::cancel_lookup(uint64_t id) {
+    // A thread still running finds nothing to call when it answers.
+    lookups_.erase(id);
+}
+
+void PortForwarder::finish_lookup(uint64_t id, std::vector<Address> addrs) {
+    auto it = lookups_.find(id);
+    if (it == lookups_.end()) return;
+    Resolved done = std::move(it->second);
+    lookups_.erase(it);
+    done(std::move(addrs));
+}
+
+void PortForwarder::remember(const std::string& key, const std::vector<Address>& addrs) {
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = resolved_.begin(); it != resolved_.end();) {
+        if (it->second.expires <= now) it = resolved_.erase(it);
+        else ++it;
+    }
+    if (resolved_.size() >= kMaxCachedNames && !resolved_.count(key)) {
+        resolved_.erase(std::min_element(resolved_.begin(), resolved_.end(), [](const auto& a, const auto& b) {
+            return a.second.expires < b.second.expires;
+        }));
+    }
+    resolved_[key] = Cached{addrs, now + kCachedNameTtl};
+}
+
+std::vector<PortForwarder::Address> PortForwarder::lookup(const std::string& host, uint16_t port, int flags,
+                                                          int* error) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = flags;
+    addrinfo* res = nullptr;
+    std::vector<Address> addrs;
+    int rc = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res);
+    if (error) *error = rc;
+    if (rc != 0) return addrs;
+    for (addrinfo* ai = res; ai && addrs.size() < kMaxAddresses; ai = ai->ai_next) {
+        Address a{};
+        std::memcpy(&a.addr, ai->ai_addr, ai->ai_addrlen);
+        a.len = static_cast<socklen_t>(ai->ai_addrlen);
+        addrs.push_back(a);
+    }
+    freeaddrinfo(res);
+    return addrs;
+}
+
+void PortForwarder::connect_next(Relay* relay, int error) {
+    while (relay->next_addr < relay->addrs.size()) {
+        const Address& a = relay->addrs[relay->next_addr++];
+        int fd = socket(a.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            error = errno;
+            continue;
+        }
+        bool in_progress = false;
+        if (connect(fd, reinterpret_cast<const sockaddr*>(&a.addr), a.len) < 0) {
+            error = errno;
+            if (error != EINPROGRESS) {
+                close(fd);
+                continue;
+            }
+            in_progress = true;
+        }
+        if (!attach(relay, fd, in_progress)) break;
+        update_interest(relay);
+        return;
+    }
+    // Resolution failures were logged by the lookup.
+    if (!relay->addrs.empty()) {
+        LOG_WARN("Cannot connect to %s: %s", relay->target.c_str(), error_to_string(error).c_str());
+    }
+    drop(relay);
+}
+
+PortForwarder::Relay* PortForwarder::add_relay(uint32_t id) {
+    auto relay = std::make_unique<Relay>();
+    Relay* r = relay.get();
+    r->id = id;
+    relays_[r] = std::move(relay);
+    return r;
+}
+
+bool PortForwarder::attach(Relay* relay, int fd, bool connecting) {
+    // Forwarded protocols are often interactive.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    // Interest is set once the caller knows the channel.
+    if (!loop_.add(fd, 0, [this, relay](uint32_t events) { on_relay_events(relay, events); })) {
+        close(fd);
+        return false;
+    }
+    relay->fd = fd;
+    relay->connecting = connecting;
+    relay->events = 0;
+    return true;
+}
+
+ChannelMux::Handler PortForwarder::relay_handler(Relay* relay) {
+    // The channel is always closed before its relay goes, so these never
+    // outlive it.
+    ChannelMux::Handler handler;
+    handler.on_data = [this, relay](const uint8_t* data, size_t len) { on_relay_data(relay, data, len); };
+    handler.on_drained = [this, relay]() { update_interest(relay); };
+    handler.on_close = [this, relay]() {
+        relay->peer_closed = true;
+        if (relay->pending_off == relay->pending.size()) drop(relay);
+        else update_interest(relay);
+    };
+    return handler;
+}
+
+void PortForwarder::on_relay_events(Relay* relay, uint32_t events) {
+    if (relay->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(relay->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            // Try the target's next address, if it has one.
+            loop_.remove(relay->fd);
+            close(relay->fd);
+            relay->fd = -1;
+            connect_next(relay, err);
+            return;
+        }
+        relay->connecting = false;
+        events |= EventLoop::WRITABLE;
+    }
+    if ((events & EventLoop::WRITABLE) && !write_pending(relay)) return;
+    if (events & EventLoop::READABLE) {
+        if (!relay->reading) {
+            // Hang-up or error while not asked to read: the socket is dead.
+            if (relay->pending_off == relay->pending.size() || !write_pending(relay)) {
+                drop(relay);
+                return;
+            }
+        } else if (!read_socket(relay)) {
+            return;
+        }
+    }
+    update_interest(relay);
+}
+
+void PortForwarder::on_relay_data(Relay* relay, const uint8_t* data, size_t len) {
+    if (relay->fd >= 0 && !relay->connecting && relay->pending_off == relay->pending.size()) {
+        ssize_t w = send(relay->fd, data, len, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                drop(relay);
+                return;
+            }
+            w = 0;
+        }
+        if (w > 0) mux_.consumed(relay->id, static_cast<size_t>(w));
+        data += w;
+        len -= static_cast<size_t>(w);
+        if (len == 0) return;
+    }
+    // Bounded by the channel window: credit only comes back once written.
+    relay->pending.insert(relay->pending.end(), data, data + len);
+    update_interest(relay);
+}
+
+bool PortForwarder::read_socket(Relay* relay) {
+    while (!relay->channel_closed && !relay->peer_closed && mux_.queued(relay->id) < kMaxRelayQueued) {
+        ssize_t r = recv(relay->fd, read_buf_.data(), read_buf_.size(), 0);
+        if (r > 0) {
+            mux_.send(relay->id, read_buf_.data(), static_cast<size_t>(r));
+            continue;
+        }
+        if (r == 0) {
+            end_relay(relay);
+            return relays_.count(relay) > 0;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        drop(relay);
+        return false;
+    }
+    return true;
+}
+
+bool PortForwarder::write_pending(Relay* relay) {
+    while (relay->pending_off < relay->pending.size()) {
+        ssize_t w = send(relay->fd, relay->pending.data() + relay->pending_off, relay->pending.size() - relay->pending_off,
+                         MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            drop(relay);
+            return false;
+        }
+        relay->pending_off += static_cast<size_t>(w);
+        mux_.consumed(relay->id, static_cast<size_t>(w));
+    }
+    relay->pending.clear();
+    relay->pending_off = 0;
+    if (relay->peer_closed || relay->channel_closed) {
+        drop(relay);
+        return false;
+    }
+    return true;
+}
+
+void PortForwarder::update_interest(Relay* relay) {
+    // Still resolving: connect_next() sets interest once there is a socket.
+    if (relay->fd < 0) return;
+    uint32_t events = 0;
+    relay->reading = false;
+    if (relay->connecting) {
+        events = EventLoop::WRITABLE;
+    } else {
+        relay->reading = !relay->channel_closed && !relay->peer_closed && mux_.queued(relay->id) < kMaxRelayQueued;
+        if (relay->reading) events |= EventLoop::READABLE;
+        if (relay->pending_off < relay->pending.size()) events |= EventLoop::WRITABLE;
+    }
+    if (events == relay->events) return;
+    relay->events = events;
+    loop_.modify(relay->fd, events);
+}
+
+void PortForwarder::end_relay(Relay* relay) {
+    // The socket hit EOF: what is queued still goes out, then the channel
+    // closes. Data the peer already sent is written before the socket goes.
+    relay->channel_closed = true;
+    mux_.close(relay->id);
+    if (relay->pending_off == relay->pending.size()) drop(relay);
+}
+
+void PortForwarder::drop(Relay* relay) {
+    // Already taken over by close_all().
+    if (!relays_.count(relay)) return;
+    if (!relay->channel_closed && !relay->peer_closed) mux_.close(relay->id);
+    if (relay->lookup != 0) cancel_lookup(relay->lookup);
+    if (relay->fd >= 0) {
+        loop_.remove(relay->fd);
+        close(relay->fd);
+    }
+    relays_.erase(relay);
+}
+
+void PortForwarder::close_listener(uint32_t channel) {
+    for (auto it = listeners_.begin(); it != listeners_.end(); ++it) {
+        if ((*it)->channel != channel) continue;
+        if ((*it)->lookup != 0) cancel_lookup((*it)->lookup);
+        if ((*it)->fd >= 0) {
+            loop_.remove((*it)->fd);
+            close((*it)->fd);
+        }
+        listeners_.erase(it);
+        return;
+    }
+}
+
+#endif
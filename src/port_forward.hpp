@@ -0,0 +1,154 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// "[bind_address:]port:host:hostport"; IPv6 addresses go in brackets. The
+// bind address defaults to the loopback interface.
+struct ForwardSpec {
+    std::string bind_host = "127.0.0.1";
+    uint16_t bind_port = 0;
+    std::string host;
+    uint16_t port = 0;
+};
+
+bool parse_forward_spec(const std::string& text, ForwardSpec& out);
+
+#ifndef _WIN32
+
+#include "channel_mux.hpp"
+#include "event_loop.hpp"
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/socket.h>
+
+// TCP port forwarding over a session's channels, on the session's loop.
+// Each relayed connection is a non-blocking socket in the loop and one
+// channel. A relay stops reading its socket while 64 KB wait on its
+// channel, and grants the peer credit only as bytes reach the socket, so
+// neither direction buffers more than that or the channel window, however
+// many connections are open.
+//
+// Names the peer asks for are looked up on a thread of their own and the
+// answer posted back, so a slow resolver holds up that one channel rather
+// than every session on the worker. Until then the channel is open and what
+// the peer sends waits on the relay, within its window.
+class PortForwarder {
+public:
+    // accept_requests: let the peer connect out and listen from this host.
+    PortForwarder(EventLoop& loop, ChannelMux& mux, bool accept_requests);
+    ~PortForwarder();
+
+    PortForwarder(const PortForwarder&) = delete;
+    PortForwarder& operator=(const PortForwarder&) = delete;
+
+    // -L: listens here and relays each connection to spec.host:port as the
+    // peer sees it. Returns the port bound (useful with port 0), 0 on failure.
+    uint16_t add_local(const ForwardSpec& spec);
+    // -R: has the peer listen on spec.bind_host:bind_port and relays its
+    // connections to spec.host:port as seen from here.
+    void add_remote(const ForwardSpec& spec);
+
+    // For the owner's ChannelMux::on_open_request; false for kinds that
+    // aren't about forwarding.
+    bool accept(uint32_t id, uint8_t kind, const std::string& target, ChannelMux::Handler& handler);
+
+    size_t connections() const { return relays_.size(); }
+    // Closes every socket. The channels must already be gone (mux closed).
+    void close_all();
+
+private:
+    struct Address {
+        sockaddr_storage addr;
+        socklen_t len;
+    };
+    using Resolved = std::function<void(std::vector<Address> addrs)>;
+
+    struct Relay {
+        // -1 until the target is resolved.
+        int fd = -1;
+        uint32_t id = 0;
+        // Non-zero while the target is being looked up.
+        uint64_t lookup = 0;
+        std::string target;
+        // Addresses to connect to, in the resolver's order, and the next one
+        // to try if this one fails.
+        std::vector<Address> addrs;
+        size_t next_addr = 0;
+        bool connecting = false;
+        // This side closed the channel (socket EOF or error).
+        bool channel_closed = false;
+        // The peer closed the channel; only pending writes are left.
+        bool peer_closed = false;
+        bool reading = false;
+        // Interest last registered with the loop.
+        uint32_t events = 0;
+        std::vector<uint8_t> pending;
+        size_t pending_off = 0;
+    };
+
+    struct Listener {
+        // -1 while the peer's bind address is being looked up.
+        int fd = -1;
+        uint64_t lookup = 0;
+        // Local forwards keep the spec; a peer's TCP_LISTEN keeps its channel.
+        ForwardSpec spec;
+        uint32_t channel = 0;
+    };
+
+    struct LookupSink;
+    struct Cached {
+        std::vector<Address> addrs;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    // Blocking; for this side's own -L bind address only.
+    int listen_on(const std::string& host, uint16_t port);
+    int bind_listener(const std::vector<Address>& addrs, const std::string& target);
+    void on_accept(Listener* listener);
+    // Calls done on the loop with host's addresses, none if it can't be
+    // resolved. Numeric hosts and cached names don't leave the loop thread.
+    // Returns the lookup's ID for cancel_lookup(), 0 if too many are running.
+    uint64_t resolve(const std::string& host, uint16_t port, Resolved done);
+    void cancel_lookup(uint64_t id);
+    void finish_lookup(uint64_t id, std::vector<Address> addrs);
+    void remember(const std::string& key, const std::vector<Address>& addrs);
+    static std::vector<Address> lookup(const std::string& host, uint16_t port, int flags, int* error);
+    // Tries the relay's remaining addresses; drops it when none is left.
+    void connect_next(Relay* relay, int error);
+    Relay* add_relay(uint32_t id);
+    bool attach(Relay* relay, int fd, bool connecting);
+    ChannelMux::Handler relay_handler(Relay* relay);
+    void on_relay_events(Relay* relay, uint32_t events);
+    void on_relay_data(Relay* relay, const uint8_t* data, size_t len);
+    bool read_socket(Relay* relay);
+    bool write_pending(Relay* relay);
+    void update_interest(Relay* relay);
+    void end_relay(Relay* relay);
+    void drop(Relay* relay);
+    void close_listener(uint32_t channel);
+
+    EventLoop& loop_;
+    ChannelMux& mux_;
+    bool accept_requests_;
+    std::unordered_map<Relay*, std::unique_ptr<Relay>> relays_;
+    std::vector<std::unique_ptr<Listener>> listeners_;
+    // -R forwards by the ID of their TCP_LISTEN channel.
+    std::map<uint32_t, ForwardSpec> remote_;
+    // Lookups waiting for an answer, by ID.
+    std::map<uint64_t, Resolved> lookups_;
+    uint64_t next_lookup_ = 1;
+    size_t lookup_threads_ = 0;
+    std::shared_ptr<LookupSink> sink_;
+    // Names resolved lately, by "host:port"; bounded, and entries expire.
+    std::map<std::string, Cached> resolved_;
+    std::vector<uint8_t> read_buf_;
+};
+
+#endif
@@ -0,0 +1,165 @@
+#include "predictive_echo.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+// A prediction not confirmed within two smoothed RTTs plus this is taken
+// back: the shell is not echoing, or not where we thought.
+static const std::chrono::milliseconds kTimeoutSlack(250);
+
+static void append_cup(std::vector<uint8_t>& out, int row, int col) {
+    char buf[32];
+    int n = std::snprintf(buf, sizeof(buf), "\x1b[%d;%dH", row + 1, col + 1);
+    out.insert(out.end(), buf, buf + n);
+}
+
+PredictiveEcho::PredictiveEcho(std::chrono::milliseconds threshold)
+    : threshold_(threshold), active_(threshold.count() == 0) {}
+
+void PredictiveEcho::resize(int rows, int cols) {
+    if (rows == screen_.rows() && cols == screen_.cols()) return;
+    // The terminal has reflowed; whatever was drawn over is gone or moved.
+    drawn_.clear();
+    shown_ = false;
+    discard();
+    screen_.resize(rows, cols);
+}
+
+void PredictiveEcho::add_rtt_sample(std::chrono::microseconds rtt) {
+    srtt_ = srtt_.count() == 0 ? rtt : srtt_ + (rtt - srtt_) / 8;
+    if (threshold_.count() == 0) return;
+    if (!active_ && srtt_ > threshold_) {
+        active_ = true;
+        // Guesses start out hidden until the server confirms one.
+        ++epoch_;
+        next_valid_ = false;
+    } else if (active_ && srtt_ * 3 < threshold_ * 2) {
+        active_ = false;
+    }
+}
+
+void PredictiveEcho::on_input(const uint8_t* data, size_t len, Clock::time_point now, std::vector<uint8_t>& out) {
+    if (!active_ || screen_.alt_screen() || screen_.insert_mode() || screen_.origin_mode()) {
+        // Whatever these keys do, the next guess can't build on the last.
+        ++epoch_;
+        next_valid_ = false;
+        return;
+    }
+    bool changed = false;
+    for (size_t i = 0; i < len; ++i) {
+        uint8_t c = data[i];
+        if (c >= 0x20 && c < 0x7F) {
+            if (!next_valid_) {
+                next_row_ = screen_.cursor_row();
+                next_col_ = screen_.cursor_col();
+                next_valid_ = true;
+            }
+            // Only into blank cells short of the last column, so the shell
+            // has nothing to shift or wrap.
+            if (next_col_ >= screen_.cols() - 1 || screen_.cell_char(next_row_, next_col_) != ' ') {
+                ++epoch_;
+                next_valid_ = false;
+                break;
+            }
+            predictions_.push_back({next_row_, next_col_, c, epoch_, now});
+            ++next_col_;
+            ++predicted_;
+            changed = true;
+        } else if ((c == 0x7F || c == 0x08) && next_valid_ && !predictions_.empty() &&
+                   predictions_.back().epoch == epoch_ && predictions_.back().row == next_row_ &&
+                   predictions_.back().col == next_col_ - 1) {
+            predictions_.pop_back();
+            --next_col_;
+            changed = true;
+        } else {
+            ++epoch_;
+            next_valid_ = false;
+            break;
+        }
+    }
+    if (changed) {
+        erase(out);
+        draw(out);
+    }
+}
+
+void PredictiveEcho::on_output(const uint8_t* data, size_t len, Clock::time_point now, std::vector<uint8_t>& out) {
+    erase(out);
+    out.insert(out.end(), data, data + len);
+    screen_.feed(data, len);
+    if (!predictions_.empty()) check(now);
+    draw(out);
+}
+
+void PredictiveEcho::expire(Clock::time_point now, std::vector<uint8_t>& out) {
+    if (predictions_.empty() || now < next_expiry()) return;
+    erase(out);
+    check(now);
+    draw(out);
+}
+
+PredictiveEcho::Clock::time_point PredictiveEcho::next_expiry() const {
+    if (predictions_.empty()) return Clock::time_point::max();
+    return predictions_.front().sent + timeout();
+}
+
+PredictiveEcho::Clock::duration PredictiveEcho::timeout() const {
+    return std::chrono::duration_cast<Clock::duration>(srtt_ * 2 + kTimeoutSlack);
+}
+
+void PredictiveEcho::check(Clock::time_point now) {
+    auto keep = predictions_.begin();
+    for (auto it = predictions_.begin(); it != predictions_.end(); ++it) {
+        const Prediction& p = *it;
+        bool on_screen = p.row < screen_.rows() && p.col < screen_.cols();
+        bool passed = screen_.cursor_row() != p.row || screen_.cursor_col() > p.col;
+        // A space over a blank proves nothing until the cursor moves on.
+        if (on_screen && screen_.cell_char(p.row, p.col) == p.ch && (p.ch != ' ' || passed)) {
+            ++confirmed_;
+            if (p.ch != ' ') confirmed_epoch_ = std::max(confirmed_epoch_, p.epoch);
+            continue;
+        }
+        if (passed || now - p.sent > timeout()) {
+            ++mispredicted_;
+            discard();
+            return;
+        }
+        *keep++ = p;
+    }
+    predictions_.erase(keep, predictions_.end());
+}
+
+void PredictiveEcho::discard() {
+    predictions_.clear();
+    ++epoch_;
+    next_valid_ = false;
+}
+
+void PredictiveEcho::erase(std::vector<uint8_t>& out) {
+    if (!shown_) return;
+    for (const auto& cell : drawn_) screen_.repaint_cell(cell.first, cell.second, out);
+    screen_.repaint_cursor(out);
+    drawn_.clear();
+    shown_ = false;
+}
+
+void PredictiveEcho::draw(std::vector<uint8_t>& out) {
+    if (screen_.alt_screen() || screen_.origin_mode()) return;
+    static const char kUnderline[] = "\x1b[0;4m";
+    int row = -1;
+    int col = -1;
+    for (const Prediction& p : predictions_) {
+        if (p.epoch > confirmed_epoch_) continue;
+        if (p.row != row || p.col != col) append_cup(out, p.row, p.col);
+        if (drawn_.empty()) out.insert(out.end(), kUnderline, kUnderline + std::strlen(kUnderline));
+        out.push_back(p.ch);
+        drawn_.emplace_back(p.row, p.col);
+        row = p.row;
+        col = p.col + 1;
+    }
+    if (drawn_.empty()) return;
+    // The terminal's cursor is left after the last shown guess; erase()
+    // puts it, and the attributes, back.
+    shown_ = true;
+}
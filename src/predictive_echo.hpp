@@ -0,0 +1,85 @@
+#pragma once
+
+#include "vt_screen.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Speculative local echo for the client console, after mosh. Printable
+// keystrokes are drawn underlined where the shell is expected to echo them,
+// and removed again once the server's output either shows them (confirmed)
+// or moves on without them (mispredicted). The console output is tracked in
+// a VtScreen, so taking a prediction off the screen means redrawing what the
+// server put there.
+//
+// Only typing at the end of a line is predicted, plus backspace over a
+// still-unconfirmed prediction. Enter, escape sequences and other controls
+// start a new epoch: predictions made after them stay hidden until the
+// server confirms one, so a password prompt or a full-screen program never
+// shows guessed text.
+class PredictiveEcho {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // threshold: smoothed RTT above which predictions are shown; zero to
+    // show them always.
+    explicit PredictiveEcho(std::chrono::milliseconds threshold);
+
+    // Size of the terminal the output is shown on.
+    void resize(int rows, int cols);
+
+    // Round-trip samples turn prediction on above the threshold and off
+    // again below two thirds of it.
+    void add_rtt_sample(std::chrono::microseconds rtt);
+    std::chrono::microseconds srtt() const { return srtt_; }
+    bool active() const { return active_; }
+
+    // Keystrokes about to be sent. Appends any drawing to out.
+    void on_input(const uint8_t* data, size_t len, Clock::time_point now, std::vector<uint8_t>& out);
+    // Appends server output to out, with predictions taken off the screen
+    // first and those still pending put back after.
+    void on_output(const uint8_t* data, size_t len, Clock::time_point now, std::vector<uint8_t>& out);
+    // Treats predictions the server should have echoed by now as wrong.
+    void expire(Clock::time_point now, std::vector<uint8_t>& out);
+    // When expire() next has work; Clock::time_point::max() if never.
+    Clock::time_point next_expiry() const;
+
+    uint64_t predicted() const { return predicted_; }
+    uint64_t confirmed() const { return confirmed_; }
+    uint64_t mispredicted() const { return mispredicted_; }
+
+private:
+    struct Prediction {
+        int row;
+        int col;
+        uint8_t ch;
+        uint64_t epoch;
+        Clock::time_point sent;
+    };
+
+    Clock::duration timeout() const;
+    void check(Clock::time_point now);
+    void discard();
+    void erase(std::vector<uint8_t>& out);
+    void draw(std::vector<uint8_t>& out);
+
+    VtScreen screen_;
+    std::chrono::microseconds threshold_;
+    std::chrono::microseconds srtt_{0};
+    bool active_;
+    std::vector<Prediction> predictions_;
+    // Where the next keystroke goes; valid only within the current epoch.
+    int next_row_ = 0;
+    int next_col_ = 0;
+    bool next_valid_ = false;
+    uint64_t epoch_ = 1;
+    uint64_t confirmed_epoch_ = 0;
+    // Cells currently drawn over, and whether the cursor was moved.
+    std::vector<std::pair<int, int>> drawn_;
+    bool shown_ = false;
+    uint64_t predicted_ = 0;
+    uint64_t confirmed_ = 0;
+    uint64_t mispredicted_ = 0;
+};
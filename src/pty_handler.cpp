@@ -69,7 +69,13 @@ void PTYHandler::wait_for_child() {
 }
 
 void PTYHandler::terminate_child() {
+    if (master_fd_ >= 0) {
+        close(master_fd_);
+        master_fd_ = -1;
+    }
     if (child_pid_ > 0) {
+        // Interactive shells ignore SIGTERM; a hangup is what ends them.
+        kill(child_pid_, SIGHUP);
         kill(child_pid_, SIGTERM);
         wait_for_child();
         child_pid_ = -1;
@@ -96,5 +102,7 @@ void PTYHandler::execute_shell() {
     }
     execlp(shell, shell, nullptr);
     LOG_ERROR("execlp() failed: %s", error_to_string(errno).c_str());
-    exit(1);
+    // Not exit(): the parent's atexit handlers and background threads
+    // (logging, recordings) aren't this process's to finish.
+    _exit(1);
 }
@@ -1,13 +1,11 @@
 #include "resize_coalescer.hpp"
 #include "utils.hpp"
 #include "framing.hpp"
-#include "nlohmann/json.hpp"
+#include "control_codec.hpp"
 #include <sys/ioctl.h>
 #include <unistd.h>
 
-using json = nlohmann::json;
-
-ResizeCoalescer::ResizeCoalescer(TLSWrapper& tls) : tls_(tls) {}
+ResizeCoalescer::ResizeCoalescer(EgressQueue& egress) : egress_(egress) {}
 
 ResizeCoalescer::~ResizeCoalescer() {
     stop();
@@ -56,13 +54,7 @@ void ResizeCoalescer::coalescer_loop() {
 }
 
 void ResizeCoalescer::send_winch_frame(int rows, int cols) {
-    json winch_msg = {
-        {"type", "winch"},
-        {"rows", rows},
-        {"cols", cols}
-    };
-    std::string msg_str = winch_msg.dump();
-    std::vector<uint8_t> payload(msg_str.begin(), msg_str.end());
-    auto frame = framing::build_frame(framing::FrameType::CONTROL, payload);
-    tls_.tls_write(frame.data(), frame.size());
+    uint8_t buf[control::kMaxEncodedSize];
+    size_t len = control::encode_winch(static_cast<uint16_t>(rows), static_cast<uint16_t>(cols), buf);
+    egress_.push(framing::FrameType::CONTROL, buf, len, SendPriority::URGENT);
 }
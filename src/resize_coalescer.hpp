@@ -1,14 +1,17 @@
 #ifndef RESIZE_COALESCER_HPP
 #define RESIZE_COALESCER_HPP
 
-#include "tls_wrapper.hpp"
+#include "egress_queue.hpp"
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 
+// Sends the console size whenever signal_resize() is called, from a thread
+// of its own; frames go through the connection's egress queue, since only
+// its I/O owner may touch the TLS context.
 class ResizeCoalescer {
 public:
-    ResizeCoalescer(TLSWrapper& tls);
+    ResizeCoalescer(EgressQueue& egress);
     ~ResizeCoalescer();
 
     void start();
@@ -19,7 +22,7 @@ private:
     void coalescer_loop();
     void send_winch_frame(int rows, int cols);
 
-    TLSWrapper& tls_;
+    EgressQueue& egress_;
     std::thread thread_;
     bool running_ = false;
     std::mutex mutex_;
@@ -0,0 +1,61 @@
+#include "scrollback_ring.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+ScrollbackRing::ScrollbackRing(size_t capacity) : capacity_(capacity) {}
+
+void ScrollbackRing::append(const uint8_t* data, size_t len) {
+    if (capacity_ == 0 || len == 0) return;
+    if (len > capacity_) {
+        // Only the tail of an oversized write can survive.
+        data += len - capacity_;
+        len = capacity_;
+        clear();
+        truncated_ = true;
+    }
+    while (len > 0) {
+        size_t used = (head_ + size_) % kChunkSize;
+        if (used == 0 && head_ + size_ == chunks_.size() * kChunkSize) {
+            chunks_.push_back(spare_ ? std::move(spare_) : std::unique_ptr<uint8_t[]>(new uint8_t[kChunkSize]));
+        }
+        size_t n = std::min(len, kChunkSize - used);
+        std::memcpy(chunks_.back().get() + used, data, n);
+        data += n;
+        len -= n;
+        size_ += n;
+    }
+    if (size_ <= capacity_) return;
+    truncated_ = true;
+    head_ += size_ - capacity_;
+    size_ = capacity_;
+    while (head_ >= kChunkSize) {
+        spare_ = std::move(chunks_.front());
+        chunks_.pop_front();
+        head_ -= kChunkSize;
+    }
+}
+
+void ScrollbackRing::clear() {
+    chunks_.clear();
+    spare_.reset();
+    head_ = 0;
+    size_ = 0;
+    truncated_ = false;
+}
+
+size_t ScrollbackRing::memory_bytes() const {
+    return (chunks_.size() + (spare_ ? 1 : 0)) * kChunkSize;
+}
+
+void ScrollbackRing::for_each(const std::function<void(const uint8_t*, size_t)>& fn) const {
+    size_t off = head_;
+    size_t left = size_;
+    for (const auto& chunk : chunks_) {
+        if (left == 0) break;
+        size_t n = std::min(left, kChunkSize - off);
+        fn(chunk.get() + off, n);
+        left -= n;
+        off = 0;
+    }
+}
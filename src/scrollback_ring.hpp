@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+
+// Bounded byte history of a shell's output, kept while no client is
+// attached. Storage is a queue of fixed-size chunks allocated on demand, so
+// a quiet shell costs a chunk or two rather than the full capacity, and
+// dropping old output is a pointer pop rather than a memmove.
+class ScrollbackRing {
+public:
+    static constexpr size_t kChunkSize = 16 * 1024;
+
+    // capacity 0 keeps nothing.
+    explicit ScrollbackRing(size_t capacity);
+
+    void append(const uint8_t* data, size_t len);
+    void clear();
+
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_; }
+    // True once older output has been dropped to stay within capacity.
+    bool truncated() const { return truncated_; }
+    // Heap held by the buffered chunks, including the spare.
+    size_t memory_bytes() const;
+
+    // Calls fn on the buffered bytes, oldest first, in contiguous spans.
+    void for_each(const std::function<void(const uint8_t*, size_t)>& fn) const;
+
+private:
+    size_t capacity_;
+    std::deque<std::unique_ptr<uint8_t[]>> chunks_;
+    // Offset of the oldest byte within chunks_.front().
+    size_t head_ = 0;
+    size_t size_ = 0;
+    bool truncated_ = false;
+    // Last chunk released from the front, reused by the next allocation.
+    std::unique_ptr<uint8_t[]> spare_;
+};
@@ -1,6 +1,9 @@
 #include "session_manager.hpp"
+#include "signal_handler.hpp"
 #include "utils.hpp"
 #include "io_bridge.hpp"
+#include "framing.hpp"
+#include <algorithm>
 #include <iostream>
 #ifdef _WIN32
 #include <winsock2.h>
@@ -10,6 +13,9 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
 #include <unistd.h>
 #endif
 
@@ -22,6 +28,16 @@ bool SessionManager::start_listening() {
     if (!listener->start()) {
         return false;
     }
+    // A single-session listener exits after one client, taking its ticket
+    // keys with it, so tickets are only worth issuing in serving mode.
+    if (config.serving() && config.ticket_lifetime > 0) {
+        auto keys = std::make_shared<TicketKeys>(static_cast<uint32_t>(config.ticket_lifetime));
+        if (keys->init()) {
+            ticket_keys = std::move(keys);
+        } else {
+            LOG_WARN("Session tickets unavailable; every connection will do a full handshake");
+        }
+    }
     return true;
 }
 
@@ -72,7 +88,7 @@ bool SessionManager::connect_to_peer(const std::string& ip) {
     // Close after session (TLSWrapper handles close_notify if used)
     closesocket(s);
     WSACleanup();
-    return true;
+    return !client_failed;
 #else
     int s = socket(AF_INET, SOCK_STREAM, 0);
     if (s < 0) {
@@ -97,7 +113,7 @@ bool SessionManager::connect_to_peer(const std::string& ip) {
 
     run_session(static_cast<intptr_t>(s));
     close(s);
-    return true;
+    return !client_failed;
 #endif
 }
 
@@ -108,33 +124,323 @@ void SessionManager::wait_for_session() {
     }
 }
 
+#ifdef _WIN32
+
+void SessionManager::serve_sessions() {
+    // ConPTY sessions still use blocking pumps, so serve clients one at a time.
+    if (config.max_sessions > 1) {
+        LOG_WARN("Concurrent sessions are not supported on Windows; serving clients sequentially");
+    }
+    if (config.detach_lifetime > 0) {
+        LOG_WARN("Detachable sessions are not supported on Windows; shells end with their connection");
+    }
+    if (!config.metrics_file.empty() || !config.metrics_socket.empty()) {
+        LOG_WARN("Metrics export is not supported on Windows");
+    }
+    while (!shutdown_requested()) {
+        wait_for_session();
+    }
+}
+
+#else
+
+// How often --metrics-file is rewritten.
+static const std::chrono::seconds kMetricsFileInterval(10);
+
+void SessionManager::serve_sessions() {
+    if (config.mirror_output || config.mirror_input) {
+        LOG_WARN("Console mirroring is ignored when serving multiple sessions");
+    }
+    if (config.detach_lifetime > 0) {
+        // Detached shells don't count against --max-sessions, but are capped
+        // at the same number.
+        auto registry = std::make_unique<DetachedSessions>(static_cast<size_t>(config.scrollback_kb) * 1024,
+                                                           std::chrono::seconds(config.detach_lifetime),
+                                                           static_cast<size_t>(config.max_sessions),
+                                                           config.screen_model);
+        if (registry->init()) {
+            detached = std::move(registry);
+        } else {
+            LOG_WARN("Detachable sessions unavailable; shells end with their connection");
+        }
+    }
+    int nworkers = config.workers > 0 ? config.workers : static_cast<int>(std::thread::hardware_concurrency());
+    if (nworkers < 1) nworkers = 1;
+    for (int i = 0; i < nworkers; ++i) {
+        auto worker = std::make_unique<SessionWorker>(i, config, ticket_keys, detached.get());
+        if (!worker->start()) {
+            LOG_ERROR("Failed to start session worker %d", i);
+            return;
+        }
+        workers.push_back(std::move(worker));
+    }
+
+    EventLoop loop;
+    int listen_fd = static_cast<int>(listener->fd());
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
+    loop.add(listen_fd, EventLoop::READABLE, [this](uint32_t) { accept_pending(); });
+    if (signal_wakeup_fd() >= 0) {
+        loop.add(signal_wakeup_fd(), EventLoop::READABLE, [&loop](uint32_t) { loop.stop(); });
+    }
+    std::function<void()> report;
+    if (config.stats_interval > 0) {
+        report = [this, &loop, &report]() {
+            log_session_table();
+            if (detached) detached->log_report();
+            loop.add_timer(std::chrono::seconds(config.stats_interval), report);
+        };
+        loop.add_timer(std::chrono::seconds(config.stats_interval), report);
+    }
+    std::unique_ptr<MetricsEndpoint> metrics_endpoint;
+    if (!config.metrics_socket.empty()) {
+        metrics_endpoint = std::make_unique<MetricsEndpoint>(loop, [this]() { return render_metrics(); });
+        if (!metrics_endpoint->start(config.metrics_socket)) metrics_endpoint.reset();
+    }
+    std::function<void()> export_metrics;
+    if (!config.metrics_file.empty()) {
+        export_metrics = [this, &loop, &export_metrics]() {
+            write_metrics_file(config.metrics_file, render_metrics());
+            loop.add_timer(kMetricsFileInterval, export_metrics);
+        };
+        export_metrics();
+    }
+    LOG_INFO("Serving up to %d concurrent sessions on port %d with %d workers",
+             config.max_sessions, config.port, nworkers);
+    loop.run();
+
+    LOG_INFO("Shutting down; closing %zu active sessions", sessions.size());
+    for (auto& worker : workers) {
+        worker->stop();
+    }
+    workers.clear();
+    // The final totals, with every session retired.
+    if (!config.metrics_file.empty()) write_metrics_file(config.metrics_file, render_metrics());
+}
+
+void SessionManager::accept_pending() {
+    for (;;) {
+        std::string peer;
+        intptr_t fd = listener->accept_connection(&peer);
+        if (fd < 0) return;
+
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        if (sessions.size() >= static_cast<size_t>(config.max_sessions)) {
+            LOG_WARN("Rejecting %s: session limit of %d reached", peer.c_str(), config.max_sessions);
+            sessions_rejected++;
+            close(static_cast<int>(fd));
+            continue;
+        }
+        auto least_loaded = std::min_element(workers.begin(), workers.end(), [](const auto& a, const auto& b) {
+            return a->active_sessions() < b->active_sessions();
+        });
+        SessionWorker& worker = **least_loaded;
+        uint64_t id = next_session_id++;
+        auto stats = std::make_shared<TrafficStats>();
+        sessions[id] = SessionRecord{peer, worker.index(), std::chrono::steady_clock::now(), stats};
+        LOG_INFO("Session %llu (%s) accepted on worker %d; %zu active",
+                 (unsigned long long)id, peer.c_str(), worker.index(), sessions.size());
+        worker.adopt(id, fd, peer, stats, [this](uint64_t done_id) {
+            std::lock_guard<std::mutex> done_lock(sessions_mutex);
+            auto it = sessions.find(done_id);
+            if (it == sessions.end()) return;
+            retired.add(*it->second.stats);
+            sessions.erase(it);
+        });
+    }
+}
+
+std::string SessionManager::render_metrics() {
+    std::vector<SessionMetrics> live;
+    TrafficTotals ended;
+    uint64_t accepted;
+    uint64_t rejected;
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        live.reserve(sessions.size());
+        for (const auto& entry : sessions) {
+            live.push_back(SessionMetrics{entry.first, entry.second.peer, entry.second.worker, entry.second.stats});
+        }
+        ended = retired;
+        accepted = next_session_id - 1;
+        rejected = sessions_rejected;
+    }
+    // The counters are sampled outside the lock; the stats stay alive
+    // through the shared pointers even if their sessions end meanwhile.
+    return format_metrics(live, ended, accepted, rejected);
+}
+
+void SessionManager::log_session_table() {
+    std::lock_guard<std::mutex> lock(sessions_mutex);
+    if (sessions.empty()) return;
+    auto now = std::chrono::steady_clock::now();
+    LOG_INFO("%zu active sessions", sessions.size());
+    for (const auto& entry : sessions) {
+        const SessionRecord& rec = entry.second;
+        double secs = std::chrono::duration<double>(now - rec.started).count();
+        uint64_t out = rec.stats->bytes_out.load(std::memory_order_relaxed);
+        uint64_t in = rec.stats->bytes_in.load(std::memory_order_relaxed);
+        LOG_INFO("  session %llu %s worker %d up %.0f s: out %llu bytes (%.1f KB/s), in %llu bytes (%.1f KB/s)",
+                 (unsigned long long)entry.first, rec.peer.c_str(), rec.worker, secs,
+                 (unsigned long long)out, secs > 0 ? out / 1024.0 / secs : 0.0,
+                 (unsigned long long)in, secs > 0 ? in / 1024.0 / secs : 0.0);
+    }
+}
+
+#endif
+
+// Keystrokes already typed while the connection was being set up, as one
+// DATA frame that can ride along with the ClientHello as 0-RTT data.
+static std::vector<uint8_t> read_typeahead() {
+#ifdef _WIN32
+    return {};
+#else
+    pollfd p{STDIN_FILENO, POLLIN, 0};
+    if (poll(&p, 1, 0) != 1 || !(p.revents & POLLIN)) return {};
+    std::vector<uint8_t> keys(1024);
+    ssize_t n = read(STDIN_FILENO, keys.data(), keys.size());
+    if (n <= 0) return {};
+    keys.resize(static_cast<size_t>(n));
+    return framing::build_frame(framing::FrameType::DATA, keys);
+#endif
+}
+
+// A canonical terminal holds keystrokes back until Enter and echoes them
+// locally, so while typeahead is wanted stdin is switched to non-canonical,
+// no-echo mode. Restored when done or on any way out before the console
+// takes the terminal over.
+class TypeaheadMode {
+public:
+    explicit TypeaheadMode(bool enable) {
+#ifndef _WIN32
+        if (!enable || !isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved_) != 0) return;
+        struct termios quiet = saved_;
+        quiet.c_lflag &= ~(ICANON | ECHO);
+        quiet.c_cc[VMIN] = 1;
+        quiet.c_cc[VTIME] = 0;
+        active_ = tcsetattr(STDIN_FILENO, TCSANOW, &quiet) == 0;
+#else
+        (void)enable;
+#endif
+    }
+    ~TypeaheadMode() { restore(); }
+    void restore() {
+#ifndef _WIN32
+        if (active_) tcsetattr(STDIN_FILENO, TCSANOW, &saved_);
+        active_ = false;
+#endif
+    }
+
+private:
+#ifndef _WIN32
+    struct termios saved_{};
+    bool active_ = false;
+#endif
+};
+
 void SessionManager::run_session(intptr_t fd) {
+    bool is_server = config.mode == "listen";
     tls_wrapper = std::make_unique<TLSWrapper>();
     tls_wrapper->set_verify_required(config.verify_required);
-    if (!tls_wrapper->configure_ssl(config.mode == "listen", config.cert_path, config.key_path, config.ca_path)) {
+    tls_wrapper->set_ticket_keys(ticket_keys);
+    tls_wrapper->set_early_data(config.early_data);
+    tls_wrapper->set_kernel_tls(config.kernel_tls);
+    if (!tls_wrapper->configure_ssl(is_server, config.cert_path, config.key_path, config.ca_path)) {
         return;
     }
 
+    bool resuming = false;
+    std::string peer = config.connect_ip + ":" + std::to_string(config.port);
+    if (!is_server && config.use_ticket_cache) {
+        if (!ticket_cache) {
+            std::string dir = config.ticket_cache.empty() ? PeerStore::default_dir("tickets") : config.ticket_cache;
+            if (!dir.empty()) ticket_cache = std::make_unique<PeerStore>(dir);
+        }
+        if (ticket_cache) {
+            PeerStore* cache = ticket_cache.get();
+            tls_wrapper->on_session_ticket = [cache, peer](const std::vector<uint8_t>& session) {
+                cache->store(peer, session);
+            };
+            // Tickets are used once: the server hands out a fresh one on
+            // every connection.
+            std::vector<uint8_t> saved = cache->take(peer);
+            resuming = !saved.empty() && tls_wrapper->resume_session(saved);
+        }
+    }
+
     if (!tls_wrapper->attach_socket(fd)) {
         return;
     }
 
+    std::vector<uint8_t> typeahead;
+    size_t sent_early = 0;
+    TypeaheadMode typeahead_mode(resuming && config.early_data);
+    if (resuming && config.early_data) {
+        typeahead = read_typeahead();
+        if (!typeahead.empty()) sent_early = tls_wrapper->write_early_data(typeahead.data(), typeahead.size());
+    }
+
     if (!tls_wrapper->perform_handshake()) {
         return;
     }
 
+    if (!typeahead.empty()) {
+        // Whatever the server turned down goes out again as ordinary data.
+        size_t from = tls_wrapper->early_data_accepted() ? sent_early : 0;
+        if (from > 0) LOG_INFO("%zu bytes of input sent as 0-RTT early data", from);
+        if (from < typeahead.size() && tls_wrapper->tls_write_all(typeahead.data() + from, typeahead.size() - from) < 0) {
+            return;
+        }
+    }
+    // The console saves the terminal's modes before going raw.
+    typeahead_mode.restore();
+
     std::cout << "TLS handshake successful" << std::endl;
     std::cout << "Peer fingerprint: " << tls_wrapper->get_peer_fingerprint() << std::endl;
     if (config.tls_info) {
         std::cout << "TLS version: " << tls_wrapper->get_tls_version() << std::endl;
         std::cout << "Cipher suite: " << tls_wrapper->get_ciphersuite() << std::endl;
+        if (config.kernel_tls) {
+            std::string offload = tls_wrapper->get_kernel_offload();
+            std::cout << "Kernel TLS: " << (offload.empty() ? "off" : offload) << std::endl;
+        }
+        // The client hears whether it resumed from the server's hello_ack.
+        if (is_server) {
+            std::cout << "Session resumed: " << (tls_wrapper->session_resumed() ? "yes" : "no") << std::endl;
+        }
     }
-    resize_coalescer = std::make_unique<ResizeCoalescer>(*tls_wrapper);
+    resize_coalescer.reset();
+    egress = std::make_unique<EgressQueue>();
+    resize_coalescer = std::make_unique<ResizeCoalescer>(*egress);
     resize_coalescer->start();
     resize_coalescer->signal_resize();
     if (config.mode == "listen") {
-        run_server_shell(*tls_wrapper, config.mirror_output, config.mirror_input, config.mirror_clean);
+        run_server_shell(*tls_wrapper, *egress, config.mirror_output, config.mirror_input, config.mirror_clean, config.compress,
+                         config.flow_control, config.forwarding, config.file_transfer, config.record_dir);
     } else {
-        run_client_console(*tls_wrapper);
+        if (!session_store) {
+            std::string dir = PeerStore::default_dir("sessions");
+            if (!dir.empty()) session_store = std::make_unique<PeerStore>(dir);
+        }
+        ClientOptions options;
+        options.compress = config.compress;
+        options.flow_control = config.flow_control;
+        options.report_resumption = config.tls_info;
+        options.report_latency = config.tls_info;
+        options.trace_latency = config.trace_latency;
+        options.sessions = session_store.get();
+        options.peer = peer;
+        options.reattach = !config.new_session;
+        options.predict_echo_ms = config.predict_echo_ms;
+        for (const auto& text : config.local_forwards) {
+            ForwardSpec spec;
+            if (parse_forward_spec(text, spec)) options.local_forwards.push_back(spec);
+        }
+        for (const auto& text : config.remote_forwards) {
+            ForwardSpec spec;
+            if (parse_forward_spec(text, spec)) options.remote_forwards.push_back(spec);
+        }
+        options.send_files = config.send_files;
+        options.recv_files = config.recv_files;
+        if (!run_client_console(*tls_wrapper, *egress, options)) client_failed = true;
     }
 }
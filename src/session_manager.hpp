@@ -3,14 +3,26 @@
 #include "app_config.hpp"
 #include "control_protocol.hpp"
 #include "listener.hpp"
+#include "peer_store.hpp"
 #include "pty_handler.hpp"
 #include "resize_coalescer.hpp"
+#include "session_tickets.hpp"
 #include "tls_wrapper.hpp"
 
 #include <atomic>
+#include <chrono>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include "detached_sessions.hpp"
+#include "metrics.hpp"
+#include "session_worker.hpp"
+#endif
 
 enum class SessionState {
     INITIAL,
@@ -31,6 +43,10 @@ public:
     bool start();
     void stop();
     void wait_for_session();
+    // Long-running accept loop used when --max-sessions is above one or
+    // shells are detachable: each connection gets its own PTY and TLS
+    // context on a worker event loop.
+    void serve_sessions();
     bool start_listening();
     bool connect_to_peer(const std::string& ip);
 
@@ -48,15 +64,48 @@ private:
 
     void set_state(SessionState new_state);
 
+#ifndef _WIN32
+    struct SessionRecord {
+        std::string peer;
+        int worker;
+        std::chrono::steady_clock::time_point started;
+        std::shared_ptr<TrafficStats> stats;
+    };
+
+    void accept_pending();
+    void log_session_table();
+    std::string render_metrics();
+
+    // Outlives the workers, whose loops hold the parked shells' handlers.
+    std::unique_ptr<DetachedSessions> detached;
+    std::vector<std::unique_ptr<SessionWorker>> workers;
+    std::map<uint64_t, SessionRecord> sessions;
+    std::mutex sessions_mutex;
+    uint64_t next_session_id = 1;
+    // Counters of the sessions that have ended, kept for the metrics totals.
+    TrafficTotals retired;
+    uint64_t sessions_rejected = 0;
+#endif
+
     AppConfig config;
     SessionState state;
     std::mutex state_mutex;
 
     std::unique_ptr<Listener> listener;
     std::unique_ptr<TLSWrapper> tls_wrapper;
+    // Server: shared by every session this process serves.
+    std::shared_ptr<TicketKeys> ticket_keys;
+    // Client: TLS sessions saved for resuming the next connection.
+    std::unique_ptr<PeerStore> ticket_cache;
+    // Client: tokens for reattaching to detached server shells.
+    std::unique_ptr<PeerStore> session_store;
+    // Client: a file transfer it was asked for didn't complete.
+    bool client_failed = false;
     std::unique_ptr<ControlProtocol> control_protocol;
     PTYHandler pty_handler;
     intptr_t pty_fd_ = -1;
+    // Frames for the single session from threads other than its I/O owner.
+    std::unique_ptr<EgressQueue> egress;
     std::unique_ptr<ResizeCoalescer> resize_coalescer;
 
     ControlProtocol::Role role;
@@ -0,0 +1,516 @@
+#include "session_recording.hpp"
+
+#include "utils.hpp"
+#include "vt_screen.hpp"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char kMagic[8] = {'S', 'T', 'R', 'E', 'C', '0', '0', '1'};
+static const char kEndMagic[8] = {'S', 'T', 'R', 'E', 'C', 'E', 'N', 'D'};
+static const uint8_t kChunkTag = 'C';
+// A chunk that follows chunks the writer had to drop.
+static const uint8_t kGapChunkTag = 'G';
+static const uint8_t kIndexTag = 'X';
+static const size_t kChunkHeaderSize = 1 + 8 + 4 + 4;
+
+// A chunk is handed to the writer once it holds this much, or once its
+// first event is this old when the next one comes.
+static const size_t kChunkBytes = 64 * 1024;
+static const std::chrono::seconds kChunkAge(10);
+// Chunks waiting for the writer across all sessions. Past this the disk is
+// not keeping up, and chunks are dropped rather than held or waited for.
+static const size_t kMaxQueued = 64u << 20;
+// Larger chunks are taken as damage rather than allocated.
+static const uint32_t kMaxChunkRaw = 16u << 20;
+
+static void put_be(std::vector<uint8_t>& out, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; --i) out.push_back(static_cast<uint8_t>(v >> (8 * i)));
+}
+
+static uint64_t get_be(const uint8_t* p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; ++i) v = v << 8 | p[i];
+    return v;
+}
+
+// Clients that don't know their window size report 0x0.
+static void resize_screen(VtScreen& screen, const std::vector<uint8_t>& size) {
+    if (size.size() != 4) return;
+    int rows = static_cast<int>(get_be(size.data(), 2));
+    int cols = static_cast<int>(get_be(size.data() + 2, 2));
+    if (rows > 0 && cols > 0) screen.resize(rows, cols);
+}
+
+struct SessionRecorder::File {
+    File(std::FILE* f, std::string p, uint16_t rows, uint16_t cols)
+        : file(f), path(std::move(p)), screen(rows, cols) {}
+
+    // From here on only the writer thread touches these.
+    std::FILE* file;
+    std::string path;
+    // What the terminal shows at the end of the chunks written so far.
+    VtScreen screen;
+    uint64_t offset = 0;
+    std::vector<std::pair<int64_t, uint64_t>> index;
+    int64_t end_us = 0;
+    bool ok = true;
+    bool dropped = false;
+};
+
+// One thread for all recordings: deflates chunks and appends them, keeping
+// the work and the disk off the sessions' loop threads.
+struct SessionRecorder::Writer {
+    struct Job {
+        std::shared_ptr<File> file;
+        std::vector<uint8_t> events;
+        int64_t start_us;
+        int64_t end_us;
+        bool last;
+        // Chunks before this one were dropped.
+        bool gap;
+    };
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Job> jobs;
+    size_t queued = 0;
+    bool stopping = false;
+    std::thread thread;
+
+    Writer() : thread([this] { run(); }) {}
+
+    // Finishes every recording still queued.
+    ~Writer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        thread.join();
+    }
+
+    static Writer& get() {
+        static Writer instance;
+        return instance;
+    }
+
+    // False if the chunk was dropped; the recorder then marks the next one.
+    bool submit(Job job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!job.last && queued + job.events.size() > kMaxQueued) return false;
+            queued += job.events.size();
+            jobs.push_back(std::move(job));
+        }
+        wake.notify_one();
+        return true;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) return;
+            Job job = std::move(jobs.front());
+            jobs.pop_front();
+            queued -= job.events.size();
+            lock.unlock();
+            write(job);
+            lock.lock();
+        }
+    }
+
+    static void write(Job& job);
+    static bool put(File& f, const std::vector<uint8_t>& bytes);
+};
+
+bool SessionRecorder::Writer::put(File& f, const std::vector<uint8_t>& bytes) {
+    if (!f.ok) return false;
+    if (std::fwrite(bytes.data(), 1, bytes.size(), f.file) != bytes.size()) {
+        LOG_WARN("Recording %s: write failed; the rest of the session is not recorded", f.path.c_str());
+        f.ok = false;
+        return false;
+    }
+    f.offset += bytes.size();
+    return true;
+}
+
+void SessionRecorder::Writer::write(Job& job) {
+    File& f = *job.file;
+    if (job.gap) f.dropped = true;
+    if (!job.events.empty() && f.ok) {
+        std::vector<uint8_t> raw;
+        std::vector<uint8_t> repaint;
+        f.screen.repaint(repaint);
+        raw.reserve(8 + repaint.size() + job.events.size());
+        put_be(raw, static_cast<uint64_t>(f.screen.rows()), 2);
+        put_be(raw, static_cast<uint64_t>(f.screen.cols()), 2);
+        put_be(raw, repaint.size(), 4);
+        raw.insert(raw.end(), repaint.begin(), repaint.end());
+        raw.insert(raw.end(), job.events.begin(), job.events.end());
+
+        const uint8_t* p = job.events.data();
+        const uint8_t* end = p + job.events.size();
+        TraceEvent event;
+        while (parse_trace_event(p, end, event)) {
+            if (event.type == TraceEvent::Type::OUTPUT) {
+                f.screen.feed(event.data.data(), event.data.size());
+            } else if (event.type == TraceEvent::Type::RESIZE) {
+                resize_screen(f.screen, event.data);
+            }
+        }
+
+        uLongf packed_len = compressBound(static_cast<uLong>(raw.size()));
+        std::vector<uint8_t> chunk(kChunkHeaderSize + packed_len);
+        if (compress2(chunk.data() + kChunkHeaderSize, &packed_len, raw.data(), static_cast<uLong>(raw.size()),
+                      Z_DEFAULT_COMPRESSION) == Z_OK) {
+            chunk.resize(kChunkHeaderSize + packed_len);
+            std::vector<uint8_t> head;
+            // The screen model missed the dropped output, so this chunk's
+            // repaint and the screen a player built by playing up to here
+            // differ; the tag tells the player to repaint.
+            head.push_back(job.gap ? kGapChunkTag : kChunkTag);
+            put_be(head, static_cast<uint64_t>(job.start_us), 8);
+            put_be(head, raw.size(), 4);
+            put_be(head, packed_len, 4);
+            std::copy(head.begin(), head.end(), chunk.begin());
+            uint64_t offset = f.offset;
+            // Flushed per chunk, so a crash loses at most what was in memory.
+            if (put(f, chunk) && std::fflush(f.file) == 0) f.index.emplace_back(job.start_us, offset);
+        }
+    }
+    f.end_us = std::max(f.end_us, job.end_us);
+    if (!job.last) return;
+
+    if (f.dropped) LOG_WARN("Recording %s: the disk fell behind and parts were dropped", f.path.c_str());
+    std::vector<uint8_t> tail;
+    uint64_t index_offset = f.offset;
+    tail.push_back(kIndexTag);
+    put_be(tail, f.index.size(), 4);
+    for (const auto& entry : f.index) {
+        put_be(tail, static_cast<uint64_t>(entry.first), 8);
+        put_be(tail, entry.second, 8);
+    }
+    put_be(tail, static_cast<uint64_t>(f.end_us), 8);
+    put_be(tail, index_offset, 8);
+    tail.insert(tail.end(), kEndMagic, kEndMagic + sizeof(kEndMagic));
+    put(f, tail);
+    if (std::fclose(f.file) != 0 && f.ok) {
+        LOG_WARN("Recording %s: close failed", f.path.c_str());
+    }
+    f.file = nullptr;
+}
+
+std::unique_ptr<SessionRecorder> SessionRecorder::create(const std::string& path, const std::string& label,
+                                                         uint16_t rows, uint16_t cols) {
+    std::error_code ec;
+    auto parent = std::filesystem::path(path).parent_path();
+    if (!parent.empty()) std::filesystem::create_directories(parent, ec);
+#ifdef _WIN32
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+#else
+    // What was typed includes passwords: readable by the server's user only.
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    std::FILE* f = fd >= 0 ? fdopen(fd, "wb") : nullptr;
+    if (fd >= 0 && !f) ::close(fd);
+#endif
+    if (!f) {
+        LOG_WARN("Cannot create recording %s: %s", path.c_str(), error_to_string(errno).c_str());
+        return nullptr;
+    }
+    auto file = std::make_shared<File>(f, path, rows, cols);
+    std::vector<uint8_t> head(kMagic, kMagic + sizeof(kMagic));
+    put_be(head, rows, 2);
+    put_be(head, cols, 2);
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    put_be(head, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now).count()), 8);
+    size_t label_len = std::min<size_t>(label.size(), 0xffff);
+    put_be(head, label_len, 2);
+    head.insert(head.end(), label.begin(), label.begin() + label_len);
+    if (!Writer::put(*file, head)) {
+        std::fclose(f);
+        return nullptr;
+    }
+    return std::unique_ptr<SessionRecorder>(new SessionRecorder(std::move(file)));
+}
+
+SessionRecorder::SessionRecorder(std::shared_ptr<File> file) : file_(std::move(file)), started_(Clock::now()) {}
+
+SessionRecorder::~SessionRecorder() {
+    last_us_ = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - started_).count();
+    hand_off(true);
+}
+
+void SessionRecorder::resize(uint16_t rows, uint16_t cols) {
+    uint8_t size[4] = {static_cast<uint8_t>(rows >> 8), static_cast<uint8_t>(rows), static_cast<uint8_t>(cols >> 8),
+                       static_cast<uint8_t>(cols)};
+    append(TraceEvent::Type::RESIZE, size, sizeof(size));
+}
+
+void SessionRecorder::append(TraceEvent::Type type, const uint8_t* data, size_t len) {
+    // Delays come from whole microseconds since the start, so rounding
+    // doesn't add up over a long session.
+    int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - started_).count();
+    if (!chunk_.empty() && now - chunk_start_us_ >= std::chrono::microseconds(kChunkAge).count()) hand_off(false);
+    if (chunk_.empty()) {
+        chunk_.reserve(kChunkBytes + 1024);
+        chunk_start_us_ = now;
+        last_us_ = now;
+    }
+    append_trace_event(chunk_, type, std::chrono::microseconds(now - last_us_), data, len);
+    last_us_ = now;
+    if (chunk_.size() >= kChunkBytes) hand_off(false);
+}
+
+void SessionRecorder::hand_off(bool last) {
+    if (chunk_.empty() && !last) return;
+    // The last chunk is never dropped, so a gap before it is still marked.
+    if (Writer::get().submit(Writer::Job{file_, std::move(chunk_), chunk_start_us_, last_us_, last, gap_})) {
+        gap_ = false;
+    } else {
+        gap_ = true;
+    }
+    chunk_.clear();
+}
+
+std::string recording_path(const std::string& dir, uint64_t session_id) {
+    std::time_t now = std::time(nullptr);
+    std::tm tm{};
+#ifdef _WIN32
+    localtime_s(&tm, &now);
+#else
+    localtime_r(&now, &tm);
+#endif
+    char name[64];
+    size_t n = std::strftime(name, sizeof(name), "%Y%m%d-%H%M%S", &tm);
+    std::snprintf(name + n, sizeof(name) - n, "-s%llu.strec", (unsigned long long)session_id);
+    return (std::filesystem::path(dir) / name).string();
+}
+
+RecordingReader::~RecordingReader() {
+    if (file_) std::fclose(file_);
+}
+
+bool RecordingReader::open(const std::string& path) {
+    if (file_) std::fclose(file_);
+    chunks_.clear();
+    indexed_ = false;
+    end_ = std::chrono::microseconds(-1);
+    loaded_ = false;
+    current_ = 0;
+    error_ = false;
+    file_ = std::fopen(path.c_str(), "rb");
+    if (!file_) return false;
+    uint8_t head[sizeof(kMagic) + 2 + 2 + 8 + 2];
+    if (std::fread(head, 1, sizeof(head), file_) != sizeof(head) || std::memcmp(head, kMagic, sizeof(kMagic)) != 0) {
+        std::fclose(file_);
+        file_ = nullptr;
+        return false;
+    }
+    const uint8_t* p = head + sizeof(kMagic);
+    rows_ = static_cast<uint16_t>(get_be(p, 2));
+    cols_ = static_cast<uint16_t>(get_be(p + 2, 2));
+    started_us_ = static_cast<int64_t>(get_be(p + 4, 8));
+    label_.resize(static_cast<size_t>(get_be(p + 12, 2)));
+    if (!label_.empty() && std::fread(&label_[0], 1, label_.size(), file_) != label_.size()) {
+        std::fclose(file_);
+        file_ = nullptr;
+        return false;
+    }
+    if (!read_index()) walk_chunks();
+    return true;
+}
+
+bool RecordingReader::read_index() {
+    long data_start = std::ftell(file_);
+    uint8_t tail[16];
+    if (std::fseek(file_, -16, SEEK_END) != 0 || std::fread(tail, 1, sizeof(tail), file_) != sizeof(tail) ||
+        std::memcmp(tail + 8, kEndMagic, sizeof(kEndMagic)) != 0) {
+        std::fseek(file_, data_start, SEEK_SET);
+        return false;
+    }
+    long index_end = std::ftell(file_) - 16;
+    uint64_t index_offset = get_be(tail, 8);
+    uint8_t head[5];
+    if (index_offset < static_cast<uint64_t>(data_start) || index_offset >= static_cast<uint64_t>(index_end) ||
+        std::fseek(file_, static_cast<long>(index_offset), SEEK_SET) != 0 ||
+        std::fread(head, 1, sizeof(head), file_) != sizeof(head) || head[0] != kIndexTag) {
+        std::fseek(file_, data_start, SEEK_SET);
+        return false;
+    }
+    uint64_t count = get_be(head + 1, 4);
+    if (index_offset + sizeof(head) + count * 16 + 8 != static_cast<uint64_t>(index_end)) {
+        std::fseek(file_, data_start, SEEK_SET);
+        return false;
+    }
+    std::vector<uint8_t> entries(static_cast<size_t>(count * 16 + 8));
+    if (std::fread(entries.data(), 1, entries.size(), file_) != entries.size()) {
+        std::fseek(file_, data_start, SEEK_SET);
+        return false;
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+        const uint8_t* e = entries.data() + i * 16;
+        chunks_.push_back(Chunk{std::chrono::microseconds(static_cast<int64_t>(get_be(e, 8))), get_be(e + 8, 8)});
+    }
+    end_ = std::chrono::microseconds(static_cast<int64_t>(get_be(entries.data() + count * 16, 8)));
+    indexed_ = true;
+    return true;
+}
+
+void RecordingReader::walk_chunks() {
+    long offset = std::ftell(file_);
+    std::fseek(file_, 0, SEEK_END);
+    long size = std::ftell(file_);
+    uint8_t head[kChunkHeaderSize];
+    while (offset + static_cast<long>(kChunkHeaderSize) <= size) {
+        std::fseek(file_, offset, SEEK_SET);
+        if (std::fread(head, 1, sizeof(head), file_) != sizeof(head) ||
+            (head[0] != kChunkTag && head[0] != kGapChunkTag)) {
+            break;
+        }
+        long next = offset + static_cast<long>(kChunkHeaderSize) + static_cast<long>(get_be(head + 13, 4));
+        // The last chunk may have been cut off mid-write.
+        if (next > size) break;
+        chunks_.push_back(Chunk{std::chrono::microseconds(static_cast<int64_t>(get_be(head + 1, 8))),
+                                static_cast<uint64_t>(offset)});
+        offset = next;
+    }
+}
+
+bool RecordingReader::read_chunk(size_t i, std::vector<uint8_t>& raw, bool* gap) {
+    uint8_t head[kChunkHeaderSize];
+    if (std::fseek(file_, static_cast<long>(chunks_[i].offset), SEEK_SET) != 0 ||
+        std::fread(head, 1, sizeof(head), file_) != sizeof(head) ||
+        (head[0] != kChunkTag && head[0] != kGapChunkTag)) {
+        return false;
+    }
+    if (gap) *gap = head[0] == kGapChunkTag;
+    uint32_t raw_len = static_cast<uint32_t>(get_be(head + 9, 4));
+    uint32_t packed_len = static_cast<uint32_t>(get_be(head + 13, 4));
+    if (raw_len > kMaxChunkRaw || packed_len > kMaxChunkRaw) return false;
+    std::vector<uint8_t> packed(packed_len);
+    if (std::fread(packed.data(), 1, packed.size(), file_) != packed.size()) return false;
+    raw.resize(raw_len);
+    uLongf out_len = raw_len;
+    return uncompress(raw.data(), &out_len, packed.data(), packed_len) == Z_OK && out_len == raw_len;
+}
+
+bool RecordingReader::load(size_t i) {
+    loaded_ = false;
+    if (!read_chunk(i, raw_, &chunk_gap_) || raw_.size() < 8) return false;
+    chunk_rows_ = static_cast<uint16_t>(get_be(raw_.data(), 2));
+    chunk_cols_ = static_cast<uint16_t>(get_be(raw_.data() + 2, 2));
+    uint64_t repaint_len = get_be(raw_.data() + 4, 4);
+    if (repaint_len > raw_.size() - 8) return false;
+    repaint_.assign(raw_.begin() + 8, raw_.begin() + 8 + static_cast<size_t>(repaint_len));
+    pos_ = 8 + static_cast<size_t>(repaint_len);
+    clock_ = chunks_[i].start;
+    current_ = i;
+    loaded_ = true;
+    return true;
+}
+
+std::chrono::microseconds RecordingReader::duration() {
+    if (end_.count() >= 0) return end_;
+    end_ = std::chrono::microseconds(0);
+    // Not closed: the last event of the last whole chunk is as far as it goes.
+    std::vector<uint8_t> raw;
+    if (chunks_.empty() || !read_chunk(chunks_.size() - 1, raw) || raw.size() < 8) return end_;
+    size_t skip = 8 + static_cast<size_t>(get_be(raw.data() + 4, 4));
+    if (skip > raw.size()) return end_;
+    const uint8_t* p = raw.data() + skip;
+    const uint8_t* end = raw.data() + raw.size();
+    end_ = chunks_.back().start;
+    TraceEvent event;
+    while (parse_trace_event(p, end, event)) end_ += event.delay;
+    return end_;
+}
+
+bool RecordingReader::seek(std::chrono::microseconds at, std::vector<uint8_t>& screen) {
+    screen.clear();
+    error_ = false;
+    if (chunks_.empty()) return true;
+    auto after = std::upper_bound(chunks_.begin(), chunks_.end(), at,
+                                  [](std::chrono::microseconds t, const Chunk& c) { return t < c.start; });
+    size_t i = after == chunks_.begin() ? 0 : static_cast<size_t>(after - chunks_.begin()) - 1;
+    if (!load(i)) {
+        error_ = true;
+        return false;
+    }
+    VtScreen vt(chunk_rows_ > 0 ? chunk_rows_ : 24, chunk_cols_ > 0 ? chunk_cols_ : 80);
+    vt.feed(repaint_.data(), repaint_.size());
+    const uint8_t* end = raw_.data() + raw_.size();
+    TraceEvent event;
+    for (;;) {
+        const uint8_t* p = raw_.data() + pos_;
+        if (!parse_trace_event(p, end, event) || clock_ + event.delay > at) break;
+        clock_ += event.delay;
+        pos_ = static_cast<size_t>(p - raw_.data());
+        if (event.type == TraceEvent::Type::OUTPUT) {
+            vt.feed(event.data.data(), event.data.size());
+        } else if (event.type == TraceEvent::Type::RESIZE) {
+            resize_screen(vt, event.data);
+        }
+    }
+    vt.repaint(screen);
+    return true;
+}
+
+bool RecordingReader::next(RecordedEvent& event) {
+    if (!file_ || error_) return false;
+    for (;;) {
+        if (!loaded_) {
+            if (current_ >= chunks_.size()) return false;
+            if (!load(current_)) {
+                error_ = true;
+                return false;
+            }
+            if (chunk_gap_) {
+                // Output is missing before this chunk: redraw the screen as
+                // the recorder last knew it, as a seek here would.
+                static const char kClearScreen[] = "\x1b[0m\x1b[H\x1b[2J";
+                event.type = TraceEvent::Type::OUTPUT;
+                event.at = clock_;
+                event.gap = true;
+                event.data.assign(kClearScreen, kClearScreen + sizeof(kClearScreen) - 1);
+                event.data.insert(event.data.end(), repaint_.begin(), repaint_.end());
+                return true;
+            }
+        }
+        const uint8_t* p = raw_.data() + pos_;
+        const uint8_t* end = raw_.data() + raw_.size();
+        if (p == end) {
+            loaded_ = false;
+            ++current_;
+            continue;
+        }
+        TraceEvent decoded;
+        if (!parse_trace_event(p, end, decoded)) {
+            error_ = true;
+            return false;
+        }
+        pos_ = static_cast<size_t>(p - raw_.data());
+        clock_ += decoded.delay;
+        event.type = decoded.type;
+        event.at = clock_;
+        event.gap = false;
+        event.data = std::move(decoded.data);
+        return true;
+    }
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "terminal_trace.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+// A server session recorded for audit and for reproducing bugs: the shell's
+// output, what the client typed and window resizes, with their timing.
+//
+// Events are encoded as in terminal traces and collected into chunks of up
+// to 64 KB or 10 s. A background thread deflates each chunk and appends it
+// to the file, so the session's loop thread only copies bytes. Each chunk
+// opens with a repaint of the screen as it stood when the chunk began,
+// which lets a player start anywhere without replaying what came before.
+// Closing the recording adds an index of chunk start times; a recording
+// that was never closed (the server died) is still read by walking the
+// chunks.
+//
+//   "STREC001" [rows:2][cols:2][started:8][label_len:2][label]
+//   chunk: 'C' [start:8][raw_len:4][packed_len:4][deflated raw]
+//          'G' for the first chunk after some were dropped
+//     raw: [rows:2][cols:2][repaint_len:4][repaint][events...]
+//   index: 'X' [count:4] ([start:8][offset:8]) * count [end:8]
+//   [index_offset:8] "STRECEND"
+//
+// started is the wall clock in microseconds since the epoch; start and end
+// are microseconds since then. Integers are big-endian.
+class SessionRecorder {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Null if path can't be created. label says whose session it is.
+    static std::unique_ptr<SessionRecorder> create(const std::string& path, const std::string& label,
+                                                   uint16_t rows, uint16_t cols);
+    // Hands the last chunk over; the background thread finishes the file.
+    ~SessionRecorder();
+
+    SessionRecorder(const SessionRecorder&) = delete;
+    SessionRecorder& operator=(const SessionRecorder&) = delete;
+
+    void output(const uint8_t* data, size_t len) { append(TraceEvent::Type::OUTPUT, data, len); }
+    void input(const uint8_t* data, size_t len) { append(TraceEvent::Type::INPUT, data, len); }
+    void resize(uint16_t rows, uint16_t cols);
+
+private:
+    struct File;
+    struct Writer;
+
+    explicit SessionRecorder(std::shared_ptr<File> file);
+    void append(TraceEvent::Type type, const uint8_t* data, size_t len);
+    void hand_off(bool last);
+
+    std::shared_ptr<File> file_;
+    Clock::time_point started_;
+    // The chunk being filled, and when its first and latest events were,
+    // in microseconds since started_.
+    std::vector<uint8_t> chunk_;
+    int64_t chunk_start_us_ = 0;
+    int64_t last_us_ = 0;
+    // The writer fell behind and dropped a chunk since the last one it took.
+    bool gap_ = false;
+};
+
+// "<dir>/20240131-142501-s42.strec" for session id, started now.
+std::string recording_path(const std::string& dir, uint64_t session_id);
+
+struct RecordedEvent {
+    TraceEvent::Type type = TraceEvent::Type::OUTPUT;
+    // Since the recording started.
+    std::chrono::microseconds at{0};
+    std::vector<uint8_t> data;
+    // OUTPUT that isn't the shell's: a repaint where the recorder dropped
+    // chunks because the disk fell behind.
+    bool gap = false;
+};
+
+class RecordingReader {
+public:
+    struct Chunk {
+        std::chrono::microseconds start{0};
+        uint64_t offset = 0;
+    };
+
+    RecordingReader() = default;
+    ~RecordingReader();
+
+    RecordingReader(const RecordingReader&) = delete;
+    RecordingReader& operator=(const RecordingReader&) = delete;
+
+    // False if the file is missing or isn't a recording.
+    bool open(const std::string& path);
+    uint16_t rows() const { return rows_; }
+    uint16_t cols() const { return cols_; }
+    const std::string& label() const { return label_; }
+    // Wall clock, microseconds since the epoch.
+    int64_t started_us() const { return started_us_; }
+    // False when the recording was never closed and had to be walked.
+    bool indexed() const { return indexed_; }
+    const std::vector<Chunk>& chunks() const { return chunks_; }
+    std::chrono::microseconds duration();
+
+    // Moves playback to at. screen gets what reproduces the terminal as it
+    // was then on a fresh one; next() continues with the first event after.
+    bool seek(std::chrono::microseconds at, std::vector<uint8_t>& screen);
+    // False at the end, or on a damaged chunk; see error().
+    bool next(RecordedEvent& event);
+    bool error() const { return error_; }
+
+private:
+    bool read_index();
+    void walk_chunks();
+    bool read_chunk(size_t i, std::vector<uint8_t>& raw, bool* gap = nullptr);
+    // Inflates chunk i into raw_ and points pos_ at its first event.
+    bool load(size_t i);
+
+    std::FILE* file_ = nullptr;
+    uint16_t rows_ = 0;
+    uint16_t cols_ = 0;
+    std::string label_;
+    int64_t started_us_ = 0;
+    bool indexed_ = false;
+    std::vector<Chunk> chunks_;
+    std::chrono::microseconds end_{-1};
+    // The loaded chunk, the next event in it, and that event's base time.
+    size_t current_ = 0;
+    bool loaded_ = false;
+    std::vector<uint8_t> raw_;
+    size_t pos_ = 0;
+    std::chrono::microseconds clock_{0};
+    uint16_t chunk_rows_ = 0;
+    uint16_t chunk_cols_ = 0;
+    bool chunk_gap_ = false;
+    std::vector<uint8_t> repaint_;
+    bool error_ = false;
+};
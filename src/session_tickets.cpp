@@ -0,0 +1,81 @@
+#include "session_tickets.hpp"
+#include "utils.hpp"
+
+#include <cstring>
+
+// Upper bound on remembered 0-RTT nonces. When it is reached, early data
+// is refused rather than the oldest nonces forgotten early.
+static const size_t kMaxNonces = 100000;
+
+static thread_local bool t_ticket_accepted = false;
+
+TicketKeys::TicketKeys(uint32_t lifetime_s) : lifetime_(lifetime_s) {
+    mbedtls_entropy_init(&entropy_);
+    mbedtls_ctr_drbg_init(&ctr_drbg_);
+    mbedtls_ssl_ticket_init(&ticket_);
+}
+
+TicketKeys::~TicketKeys() {
+    mbedtls_ssl_ticket_free(&ticket_);
+    mbedtls_ctr_drbg_free(&ctr_drbg_);
+    mbedtls_entropy_free(&entropy_);
+}
+
+bool TicketKeys::init() {
+    const char* pers = "secure-tunnel-tickets";
+    if (mbedtls_ctr_drbg_seed(&ctr_drbg_, mbedtls_entropy_func, &entropy_, (const unsigned char*)pers,
+                              std::strlen(pers)) != 0) {
+        LOG_ERROR("mbedtls_ctr_drbg_seed failed for ticket keys");
+        return false;
+    }
+    int ret = mbedtls_ssl_ticket_setup(&ticket_, mbedtls_ctr_drbg_random, &ctr_drbg_, MBEDTLS_CIPHER_AES_256_GCM,
+                                       lifetime_);
+    if (ret != 0) {
+        LOG_ERROR("mbedtls_ssl_ticket_setup returned -0x%x", -ret);
+        return false;
+    }
+    ready_ = true;
+    LOG_INFO("Session tickets enabled; keys rotate every %u s", lifetime_);
+    return true;
+}
+
+void TicketKeys::attach(mbedtls_ssl_config* conf) {
+    if (!ready_) return;
+    mbedtls_ssl_conf_session_tickets_cb(conf, write_ticket, parse_ticket, this);
+}
+
+int TicketKeys::write_ticket(void* p_ticket, const mbedtls_ssl_session* session, unsigned char* start,
+                             const unsigned char* end, size_t* tlen, uint32_t* lifetime) {
+    TicketKeys* self = static_cast<TicketKeys*>(p_ticket);
+    std::lock_guard<std::mutex> lock(self->mutex_);
+    return mbedtls_ssl_ticket_write(&self->ticket_, session, start, end, tlen, lifetime);
+}
+
+int TicketKeys::parse_ticket(void* p_ticket, mbedtls_ssl_session* session, unsigned char* buf, size_t len) {
+    TicketKeys* self = static_cast<TicketKeys*>(p_ticket);
+    std::lock_guard<std::mutex> lock(self->mutex_);
+    int ret = mbedtls_ssl_ticket_parse(&self->ticket_, session, buf, len);
+    if (ret == 0) t_ticket_accepted = true;
+    return ret;
+}
+
+bool TicketKeys::take_ticket_accepted() {
+    bool accepted = t_ticket_accepted;
+    t_ticket_accepted = false;
+    return accepted;
+}
+
+bool TicketKeys::first_use(const uint8_t* nonce, size_t len) {
+    auto now = std::chrono::steady_clock::now();
+    // A ticket sealed just before a rotation stays usable for two periods.
+    auto horizon = std::chrono::seconds(2 * static_cast<uint64_t>(lifetime_));
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (nonces_.size() >= kMaxNonces) {
+        for (auto it = nonces_.begin(); it != nonces_.end();) {
+            if (now - it->second > horizon) it = nonces_.erase(it);
+            else ++it;
+        }
+        if (nonces_.size() >= kMaxNonces) return false;
+    }
+    return nonces_.emplace(std::string(reinterpret_cast<const char*>(nonce), len), now).second;
+}
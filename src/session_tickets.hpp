@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/ssl_ticket.h"
+
+// Server-side session ticket keys, shared by every TLS session in the
+// process so a client can resume on any worker. mbedTLS generates the AEAD
+// keys itself and rotates them every `lifetime` seconds; tickets sealed
+// with the previous key are still honoured until they expire.
+class TicketKeys {
+public:
+    // Random prefix the client puts in front of 0-RTT data. A replayed
+    // ClientHello carries the same nonce, which first_use() catches.
+    static constexpr size_t kNonceSize = 16;
+
+    explicit TicketKeys(uint32_t lifetime_s);
+    ~TicketKeys();
+
+    TicketKeys(const TicketKeys&) = delete;
+    TicketKeys& operator=(const TicketKeys&) = delete;
+
+    bool init();
+    uint32_t lifetime() const { return lifetime_; }
+
+    // Installs the ticket callbacks on a server configuration.
+    void attach(mbedtls_ssl_config* conf);
+
+    // True the first time a 0-RTT nonce is presented. Nonces are remembered
+    // for as long as a ticket that could carry them stays valid.
+    bool first_use(const uint8_t* nonce, size_t len);
+
+    // True if a ticket was accepted on the calling thread since the last
+    // call. mbedTLS gives the parse callback no handle on the connection,
+    // so TLSWrapper brackets each handshake step with this.
+    static bool take_ticket_accepted();
+
+private:
+    static int write_ticket(void* p_ticket, const mbedtls_ssl_session* session, unsigned char* start,
+                            const unsigned char* end, size_t* tlen, uint32_t* lifetime);
+    static int parse_ticket(void* p_ticket, mbedtls_ssl_session* session, unsigned char* buf, size_t len);
+
+    uint32_t lifetime_;
+    bool ready_ = false;
+    mbedtls_entropy_context entropy_;
+    mbedtls_ctr_drbg_context ctr_drbg_;
+    mbedtls_ssl_ticket_context ticket_;
+    // Sessions on different workers seal and open tickets concurrently.
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> nonces_;
+};
@@ -0,0 +1,169 @@
+#include "session_worker.hpp"
+#include "utils.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// A client that has not finished the handshake by then is dropped, so
+// half-open connections cannot pin worker slots.
+static const std::chrono::milliseconds kHandshakeTimeout(10000);
+
+ServerSession::ServerSession(EventLoop& loop, uint64_t id, intptr_t fd, std::string peer, const AppConfig& config,
+                             std::shared_ptr<TrafficStats> stats, std::shared_ptr<TicketKeys> ticket_keys,
+                             DetachedSessions* detached)
+    : loop_(loop), id_(id), fd_(fd), peer_(std::move(peer)), config_(config), stats_(std::move(stats)),
+      ticket_keys_(std::move(ticket_keys)), detached_(detached), started_(std::chrono::steady_clock::now()) {}
+
+ServerSession::~ServerSession() {
+    if (handshake_timer_) loop_.cancel_timer(handshake_timer_);
+    if (handshaking_) loop_.remove(static_cast<int>(fd_));
+    bridge_.reset();
+    tls_.reset();
+    if (fd_ >= 0) close(static_cast<int>(fd_));
+}
+
+bool ServerSession::start() {
+    tls_ = std::make_unique<TLSWrapper>();
+    tls_->set_verify_required(config_.verify_required);
+    tls_->set_ticket_keys(ticket_keys_);
+    tls_->set_early_data(config_.early_data);
+    tls_->set_kernel_tls(config_.kernel_tls);
+    if (!tls_->configure_ssl(true, config_.cert_path, config_.key_path, config_.ca_path)) {
+        return false;
+    }
+    tls_->attach_socket(fd_);
+
+    int fd = static_cast<int>(fd_);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if (!loop_.add(fd, EventLoop::READABLE, [this](uint32_t events) { on_handshake_events(events); })) {
+        return false;
+    }
+    LOG_DEBUG("Session %llu (%s): starting TLS handshake", (unsigned long long)id_, peer_.c_str());
+    handshaking_ = true;
+    handshake_timer_ = loop_.add_timer(kHandshakeTimeout, [this]() {
+        handshake_timer_ = 0;
+        LOG_WARN("Session %llu (%s): handshake timed out", (unsigned long long)id_, peer_.c_str());
+        finish();
+    });
+    return true;
+}
+
+void ServerSession::on_handshake_events(uint32_t) {
+    int ret = tls_->continue_handshake();
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        uint32_t events = ret == MBEDTLS_ERR_SSL_WANT_WRITE ? EventLoop::WRITABLE : EventLoop::READABLE;
+        loop_.modify(static_cast<int>(fd_), events);
+        return;
+    }
+    loop_.remove(static_cast<int>(fd_));
+    handshaking_ = false;
+    loop_.cancel_timer(handshake_timer_);
+    handshake_timer_ = 0;
+    if (ret != 0) {
+        LOG_WARN("Session %llu (%s): handshake failed", (unsigned long long)id_, peer_.c_str());
+        finish();
+        return;
+    }
+    begin_bridge();
+}
+
+void ServerSession::begin_bridge() {
+    std::string offload = tls_->get_kernel_offload();
+    LOG_INFO("Session %llu (%s): TLS established%s, %s %s%s%s, peer fingerprint %s", (unsigned long long)id_,
+             peer_.c_str(), tls_->session_resumed() ? " (resumed)" : "", tls_->get_tls_version().c_str(),
+             tls_->get_ciphersuite().c_str(), offload.empty() ? "" : " in the kernel for ", offload.c_str(),
+             tls_->get_peer_fingerprint().c_str());
+    bridge_ = std::make_unique<ServerBridge>(loop_, *tls_, false, false, false, config_.compress,
+                                           config_.flow_control, config_.forwarding, config_.file_transfer,
+                                           stats_);
+    bridge_->on_finished = [this]() { finish(); };
+    if (detached_) bridge_->enable_detach(detached_, tls_->get_peer_fingerprint());
+    if (!config_.record_dir.empty()) {
+        std::string path = recording_path(config_.record_dir, id_);
+        auto recorder = SessionRecorder::create(path, "session " + std::to_string(id_) + " from " + peer_ + ", peer " +
+                                                          tls_->get_peer_fingerprint(), 24, 80);
+        if (recorder) LOG_INFO("Session %llu (%s): recording to %s", (unsigned long long)id_, peer_.c_str(), path.c_str());
+        bridge_->record_to(std::move(recorder));
+    }
+    if (!bridge_->start()) {
+        finish();
+        return;
+    }
+    started_ = std::chrono::steady_clock::now();
+}
+
+void ServerSession::finish() {
+    if (finished_) return;
+    finished_ = true;
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - started_).count();
+    uint64_t out = stats_->bytes_out.load(std::memory_order_relaxed);
+    uint64_t in = stats_->bytes_in.load(std::memory_order_relaxed);
+    LOG_INFO("Session %llu (%s) closed after %.1f s: %llu bytes out (%.1f KB/s), %llu bytes in (%.1f KB/s)",
+             (unsigned long long)id_, peer_.c_str(), secs,
+             (unsigned long long)out, secs > 0 ? out / 1024.0 / secs : 0.0,
+             (unsigned long long)in, secs > 0 ? in / 1024.0 / secs : 0.0);
+    LOG_INFO("Session %llu (%s): %llu frames sent, %llu PTY reads coalesced, %llu bytes of record overhead saved",
+             (unsigned long long)id_, peer_.c_str(),
+             (unsigned long long)stats_->frames_out.load(std::memory_order_relaxed),
+             (unsigned long long)stats_->reads_coalesced.load(std::memory_order_relaxed),
+             (unsigned long long)stats_->overhead_saved.load(std::memory_order_relaxed));
+    uint64_t raw = stats_->compressed_in.load(std::memory_order_relaxed);
+    if (raw > 0) {
+        uint64_t packed = stats_->compressed_out.load(std::memory_order_relaxed);
+        LOG_INFO("Session %llu (%s): compression sent %llu bytes as %llu (%.1f%%)", (unsigned long long)id_,
+                 peer_.c_str(), (unsigned long long)raw, (unsigned long long)packed, 100.0 * packed / raw);
+    }
+    if (bridge_) {
+        for (const auto& line : bridge_->latency_report()) {
+            LOG_INFO("Session %llu (%s): %s", (unsigned long long)id_, peer_.c_str(), line.c_str());
+        }
+    }
+    if (on_finished) on_finished();
+}
+
+SessionWorker::SessionWorker(int index, const AppConfig& config, std::shared_ptr<TicketKeys> ticket_keys,
+                             DetachedSessions* detached)
+    : index_(index), config_(config), ticket_keys_(std::move(ticket_keys)), detached_(detached) {}
+
+SessionWorker::~SessionWorker() {
+    stop();
+}
+
+bool SessionWorker::start() {
+    if (!loop_.valid()) return false;
+    thread_ = std::thread([this]() {
+        loop_.run();
+        // Tear sessions down on the loop thread that owns them.
+        sessions_.clear();
+    });
+    return true;
+}
+
+void SessionWorker::stop() {
+    if (thread_.joinable()) {
+        loop_.stop();
+        thread_.join();
+    }
+}
+
+void SessionWorker::adopt(uint64_t id, intptr_t fd, std::string peer, std::shared_ptr<TrafficStats> stats,
+                          std::function<void(uint64_t)> on_done) {
+    active_.fetch_add(1, std::memory_order_relaxed);
+    loop_.post([this, id, fd, peer = std::move(peer), stats = std::move(stats), on_done = std::move(on_done)]() mutable {
+        auto session = std::make_unique<ServerSession>(loop_, id, fd, std::move(peer), config_, std::move(stats),
+                                                       ticket_keys_, detached_);
+        ServerSession* raw = session.get();
+        raw->on_finished = [this, id, on_done]() {
+            // Defer destruction until the current handler has unwound.
+            loop_.post([this, id, on_done]() {
+                sessions_.erase(id);
+                active_.fetch_sub(1, std::memory_order_relaxed);
+                if (on_done) on_done(id);
+            });
+        };
+        sessions_.emplace(id, std::move(session));
+        if (!raw->start()) {
+            raw->on_finished();
+        }
+    });
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "app_config.hpp"
+#include "detached_sessions.hpp"
+#include "event_loop.hpp"
+#include "io_bridge.hpp"
+#include "session_tickets.hpp"
+#include "tls_channel.hpp"
+#include "tls_wrapper.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+// One accepted connection on a worker loop: non-blocking TLS handshake,
+// then a ServerBridge until either side hangs up. Owns the socket.
+class ServerSession {
+public:
+    ServerSession(EventLoop& loop, uint64_t id, intptr_t fd, std::string peer, const AppConfig& config,
+                  std::shared_ptr<TrafficStats> stats, std::shared_ptr<TicketKeys> ticket_keys = nullptr,
+                  DetachedSessions* detached = nullptr);
+    ~ServerSession();
+
+    bool start();
+    uint64_t id() const { return id_; }
+
+    // Invoked once, on the loop thread, when the session is over.
+    std::function<void()> on_finished;
+
+private:
+    void on_handshake_events(uint32_t events);
+    void begin_bridge();
+    void finish();
+
+    EventLoop& loop_;
+    uint64_t id_;
+    intptr_t fd_;
+    std::string peer_;
+    const AppConfig& config_;
+    std::unique_ptr<TLSWrapper> tls_;
+    std::unique_ptr<ServerBridge> bridge_;
+    std::shared_ptr<TrafficStats> stats_;
+    std::shared_ptr<TicketKeys> ticket_keys_;
+    DetachedSessions* detached_;
+    uint64_t handshake_timer_ = 0;
+    bool handshaking_ = false;
+    bool finished_ = false;
+    std::chrono::steady_clock::time_point started_;
+};
+
+// A thread running one EventLoop that multiplexes many ServerSessions.
+class SessionWorker {
+public:
+    // ticket_keys: shared by all workers so clients can resume on any of them.
+    // detached: where shells go when their client drops; null if they end.
+    SessionWorker(int index, const AppConfig& config, std::shared_ptr<TicketKeys> ticket_keys = nullptr,
+                  DetachedSessions* detached = nullptr);
+    ~SessionWorker();
+
+    bool start();
+    void stop();
+
+    int index() const { return index_; }
+    size_t active_sessions() const { return active_.load(std::memory_order_relaxed); }
+
+    // Hands an accepted socket to this worker. on_done runs on the worker
+    // thread after the session is torn down. Callable from any thread.
+    void adopt(uint64_t id, intptr_t fd, std::string peer, std::shared_ptr<TrafficStats> stats,
+               std::function<void(uint64_t)> on_done);
+
+private:
+    int index_;
+    const AppConfig& config_;
+    std::shared_ptr<TicketKeys> ticket_keys_;
+    DetachedSessions* detached_;
+    EventLoop loop_;
+    std::thread thread_;
+    std::atomic<size_t> active_{0};
+    std::unordered_map<uint64_t, std::unique_ptr<ServerSession>> sessions_;
+};
@@ -2,16 +2,46 @@
 #include "utils.hpp"
 #include <csignal>
 #include <cstdlib>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace {
     volatile std::sig_atomic_t g_signal_status;
+    int g_wakeup_pipe[2] = {-1, -1};
 }
 
 void signal_handler(int signal) {
     g_signal_status = signal;
+#ifndef _WIN32
+    if (g_wakeup_pipe[1] >= 0) {
+        char c = 1;
+        ssize_t n = write(g_wakeup_pipe[1], &c, 1);
+        (void)n;
+    }
+#endif
 }
 
 void setup_signal_handlers() {
+#ifndef _WIN32
+    if (pipe(g_wakeup_pipe) == 0) {
+        for (int fd : g_wakeup_pipe) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+    // A peer vanishing mid-write must not take down every other session.
+    std::signal(SIGPIPE, SIG_IGN);
+#endif
     std::signal(SIGINT, signal_handler);
     std::signal(SIGTERM, signal_handler);
-}
\ No newline at end of file
+}
+
+bool shutdown_requested() {
+    return g_signal_status == SIGINT || g_signal_status == SIGTERM;
+}
+
+int signal_wakeup_fd() {
+    return g_wakeup_pipe[0];
+}
@@ -3,4 +3,11 @@
 
 void setup_signal_handlers();
 
-#endif // SIGNAL_HANDLER_HPP
\ No newline at end of file
+// True once SIGINT or SIGTERM has been received.
+bool shutdown_requested();
+
+// Read end of a pipe that becomes readable when a shutdown signal arrives,
+// so event loops can wait on it. -1 where unsupported.
+int signal_wakeup_fd();
+
+#endif // SIGNAL_HANDLER_HPP
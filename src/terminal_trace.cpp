@@ -0,0 +1,148 @@
+#include "terminal_trace.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+static const char kMagic[8] = {'S', 'T', 'T', 'R', 'A', 'C', 'E', '1'};
+
+// Larger records are taken as damage rather than allocated.
+static const uint64_t kMaxEventSize = 64 * 1024 * 1024;
+
+static size_t put_varint(uint64_t v, uint8_t* out) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = static_cast<uint8_t>(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = static_cast<uint8_t>(v);
+    return n;
+}
+
+static bool get_varint(const uint8_t*& p, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t c = *p++;
+        value |= static_cast<uint64_t>(c & 0x7f) << shift;
+        if (!(c & 0x80)) return true;
+    }
+    return false;
+}
+
+void append_trace_event(std::vector<uint8_t>& out, TraceEvent::Type type, std::chrono::microseconds delay,
+                        const uint8_t* data, size_t len) {
+    uint8_t head[1 + 10 + 10];
+    head[0] = static_cast<uint8_t>(type);
+    size_t n = 1;
+    n += put_varint(static_cast<uint64_t>(std::max<int64_t>(delay.count(), 0)), head + n);
+    n += put_varint(len, head + n);
+    out.insert(out.end(), head, head + n);
+    out.insert(out.end(), data, data + len);
+}
+
+bool parse_trace_event(const uint8_t*& p, const uint8_t* end, TraceEvent& event) {
+    const uint8_t* at = p;
+    if (at >= end) return false;
+    uint8_t type = *at++;
+    uint64_t delay = 0;
+    uint64_t len = 0;
+    if (!get_varint(at, end, delay) || !get_varint(at, end, len) || len > static_cast<uint64_t>(end - at)) {
+        return false;
+    }
+    event.type = static_cast<TraceEvent::Type>(type);
+    event.delay = std::chrono::microseconds(delay);
+    event.data.assign(at, at + len);
+    p = at + len;
+    return true;
+}
+
+TraceWriter::~TraceWriter() {
+    close();
+}
+
+bool TraceWriter::open(const std::string& path, uint16_t rows, uint16_t cols) {
+    close();
+    file_ = std::fopen(path.c_str(), "wb");
+    if (!file_) return false;
+    uint8_t size[4] = {static_cast<uint8_t>(rows >> 8), static_cast<uint8_t>(rows), static_cast<uint8_t>(cols >> 8),
+                       static_cast<uint8_t>(cols)};
+    ok_ = std::fwrite(kMagic, 1, sizeof(kMagic), file_) == sizeof(kMagic) &&
+          std::fwrite(size, 1, sizeof(size), file_) == sizeof(size);
+    return ok_;
+}
+
+bool TraceWriter::write(TraceEvent::Type type, std::chrono::microseconds delay, const uint8_t* data, size_t len) {
+    if (!file_ || !ok_) return false;
+    uint8_t head[1 + 10 + 10];
+    head[0] = static_cast<uint8_t>(type);
+    size_t n = 1;
+    n += put_varint(static_cast<uint64_t>(std::max<int64_t>(delay.count(), 0)), head + n);
+    n += put_varint(len, head + n);
+    ok_ = std::fwrite(head, 1, n, file_) == n && (len == 0 || std::fwrite(data, 1, len, file_) == len);
+    return ok_;
+}
+
+bool TraceWriter::write_resize(std::chrono::microseconds delay, uint16_t rows, uint16_t cols) {
+    uint8_t size[4] = {static_cast<uint8_t>(rows >> 8), static_cast<uint8_t>(rows), static_cast<uint8_t>(cols >> 8),
+                       static_cast<uint8_t>(cols)};
+    return write(TraceEvent::Type::RESIZE, delay, size, sizeof(size));
+}
+
+bool TraceWriter::close() {
+    if (!file_) return ok_;
+    if (std::fclose(file_) != 0) ok_ = false;
+    file_ = nullptr;
+    return ok_;
+}
+
+TraceReader::~TraceReader() {
+    if (file_) std::fclose(file_);
+}
+
+bool TraceReader::open(const std::string& path) {
+    if (file_) std::fclose(file_);
+    error_ = false;
+    file_ = std::fopen(path.c_str(), "rb");
+    if (!file_) return false;
+    char magic[sizeof(kMagic)];
+    uint8_t size[4];
+    if (std::fread(magic, 1, sizeof(magic), file_) != sizeof(magic) || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0 ||
+        std::fread(size, 1, sizeof(size), file_) != sizeof(size)) {
+        std::fclose(file_);
+        file_ = nullptr;
+        return false;
+    }
+    rows_ = static_cast<uint16_t>(size[0] << 8 | size[1]);
+    cols_ = static_cast<uint16_t>(size[2] << 8 | size[3]);
+    return true;
+}
+
+bool TraceReader::next(TraceEvent& event) {
+    if (!file_ || error_) return false;
+    int type = std::fgetc(file_);
+    if (type == EOF) return false;
+    uint64_t delay = 0;
+    uint64_t len = 0;
+    if (!read_varint(delay) || !read_varint(len) || len > kMaxEventSize) {
+        error_ = true;
+        return false;
+    }
+    event.type = static_cast<TraceEvent::Type>(type);
+    event.delay = std::chrono::microseconds(delay);
+    event.data.resize(static_cast<size_t>(len));
+    if (len > 0 && std::fread(event.data.data(), 1, event.data.size(), file_) != event.data.size()) {
+        error_ = true;
+        return false;
+    }
+    return true;
+}
+
+bool TraceReader::read_varint(uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = std::fgetc(file_);
+        if (c == EOF) return false;
+        value |= static_cast<uint64_t>(c & 0x7f) << shift;
+        if (!(c & 0x80)) return true;
+    }
+    return false;
+}
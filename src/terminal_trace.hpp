@@ -0,0 +1,85 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Terminal output captured with its timing, for replaying real workloads
+// (an editor scrolling, top, a build log) through the session pipeline.
+// The file is an 8-byte magic, the terminal size, then one record per event:
+//
+//   "STTRACE1" [rows:2][cols:2]
+//   [type:1][delay:varint][len:varint][bytes:len] ...
+//
+// delay is microseconds since the previous event, and varints are LEB128,
+// so a keystroke echo costs three bytes on top of itself. Integers in the
+// header are big-endian.
+struct TraceEvent {
+    enum class Type : uint8_t {
+        OUTPUT = 1,
+        // bytes: [rows:2][cols:2]
+        RESIZE = 2,
+        // What was typed; session recordings only.
+        INPUT = 3
+    };
+
+    Type type = Type::OUTPUT;
+    std::chrono::microseconds delay{0};
+    std::vector<uint8_t> data;
+};
+
+// The record encoding on its own, for containers that frame records
+// themselves (session recordings). append_trace_event adds one record to
+// out; parse_trace_event reads the record at p and advances p past it,
+// false if it is cut short or damaged.
+void append_trace_event(std::vector<uint8_t>& out, TraceEvent::Type type, std::chrono::microseconds delay,
+                        const uint8_t* data, size_t len);
+bool parse_trace_event(const uint8_t*& p, const uint8_t* end, TraceEvent& event);
+
+class TraceWriter {
+public:
+    TraceWriter() = default;
+    ~TraceWriter();
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    bool open(const std::string& path, uint16_t rows, uint16_t cols);
+    // delay: time since the previous event (or since open()).
+    bool write(TraceEvent::Type type, std::chrono::microseconds delay, const uint8_t* data, size_t len);
+    bool write_resize(std::chrono::microseconds delay, uint16_t rows, uint16_t cols);
+    // False if anything failed to reach the file.
+    bool close();
+
+private:
+    std::FILE* file_ = nullptr;
+    bool ok_ = true;
+};
+
+class TraceReader {
+public:
+    TraceReader() = default;
+    ~TraceReader();
+
+    TraceReader(const TraceReader&) = delete;
+    TraceReader& operator=(const TraceReader&) = delete;
+
+    // False if the file is missing or isn't a trace.
+    bool open(const std::string& path);
+    uint16_t rows() const { return rows_; }
+    uint16_t cols() const { return cols_; }
+
+    // False at the end of the trace, or on a damaged record; see error().
+    bool next(TraceEvent& event);
+    bool error() const { return error_; }
+
+private:
+    bool read_varint(uint64_t& value);
+
+    std::FILE* file_ = nullptr;
+    uint16_t rows_ = 0;
+    uint16_t cols_ = 0;
+    bool error_ = false;
+};
@@ -0,0 +1,329 @@
+#include "tls_channel.hpp"
+#include "tls_wrapper.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+// Drop spent entries from the front of a queue once this many pile up.
+static const size_t kCompactFrames = 64;
+// Queued frames handed to one write, so small ones still share a record.
+static const size_t kMaxGather = 16;
+
+TLSChannel::TLSChannel(EventLoop& loop, TLSWrapper& tls, std::shared_ptr<TrafficStats> stats)
+    : loop_(loop), tls_(tls), stats_(stats ? std::move(stats) : std::make_shared<TrafficStats>()) {}
+
+TLSChannel::~TLSChannel() {
+    *alive_ = false;
+    if (egress_) egress_->set_notify(nullptr);
+    if (fd_ >= 0) {
+        loop_.remove(fd_);
+    }
+}
+
+bool TLSChannel::start() {
+    fd_ = static_cast<int>(tls_.socket_fd());
+    int flags = fcntl(fd_, F_GETFL, 0);
+    fcntl(fd_, F_SETFL, flags | O_NONBLOCK);
+    // Keystrokes are tiny writes; don't let Nagle hold them back for an ACK.
+    int one = 1;
+    setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (!loop_.add(fd_, EventLoop::READABLE, [this](uint32_t events) { handle_events(events); })) {
+        return false;
+    }
+    // 0-RTT data already sits in the wrapper; the socket won't signal it.
+    if (tls_.early_data_pending() > 0) {
+        loop_.post([this]() {
+            if (!closed_) read_records();
+        });
+    }
+    if (egress_) {
+        EventLoop* loop = &loop_;
+        std::shared_ptr<bool> alive = alive_;
+        egress_->set_notify([this, loop, alive]() {
+            loop->post([this, alive]() {
+                if (*alive) drain_egress();
+            });
+        });
+    }
+    return true;
+}
+
+void TLSChannel::send_frame(framing::FrameType type, const uint8_t* data, size_t len) {
+    uint8_t header[framing::HEADER_SIZE];
+    framing::write_header(type, len, header);
+    SendPriority priority = type == framing::FrameType::CONTROL ? SendPriority::URGENT : SendPriority::BULK;
+    write_frame(header, sizeof(header), data, len, priority);
+}
+
+void TLSChannel::send_frame_in_place(framing::FrameType type, uint8_t* payload, size_t len, SendPriority priority) {
+    uint8_t* frame = framing::frame_in_place(type, payload, len);
+    write_frame(frame, framing::HEADER_SIZE + len, nullptr, 0, priority);
+}
+
+void TLSChannel::send_channel_frame(uint32_t id, framing::FrameType type, const uint8_t* data, size_t len) {
+    uint8_t header[framing::CHANNEL_HEADER_SIZE];
+    framing::write_channel_header(type, id, len, header);
+    write_frame(header, sizeof(header), data, len, SendPriority::BULK);
+}
+
+void TLSChannel::drain_egress() {
+    if (closed_) return;
+    egress_->drain([this](EgressQueue::Frame& frame) {
+        write_frame(frame.bytes.data(), frame.bytes.size(), nullptr, 0, frame.priority, &frame.bytes);
+    });
+}
+
+void TLSChannel::write_frame(const uint8_t* head, size_t head_len, const uint8_t* body, size_t body_len,
+                             SendPriority priority, const PooledBuffer* owner) {
+    if (closed_) return;
+    size_t header = (head[0] & framing::CHANNEL_FLAG) ? framing::CHANNEL_HEADER_SIZE : framing::HEADER_SIZE;
+    size_t payload = head_len + body_len - header;
+    stats_add(stats_->bytes_out, payload);
+    stats_add(stats_->frames_out, 1);
+    stats_->frame_bytes_out.record(payload);
+
+    bool partial = false;
+    // Nothing queued: write straight from the caller's buffers.
+    if (!want_write_ && out_.empty() && urgent_.empty()) {
+        TLSWrapper::IoSlice slices[2] = {{head, head_len}, {body, body_len}};
+        while (slices[0].len + slices[1].len > 0) {
+            int w = tls_.tls_writev(slices, 2);
+            if (w == MBEDTLS_ERR_SSL_WANT_WRITE || w == MBEDTLS_ERR_SSL_WANT_READ) {
+                // The retry must repeat these bytes, so they are queued below.
+                stats_add(stats_->short_writes, 1);
+                retry_len_ = tls_.last_write_len();
+                want_write_ = true;
+                update_interest();
+                break;
+            }
+            if (w < 0) {
+                LOG_ERROR("mbedtls_ssl_write returned -0x%x", -w);
+                close();
+                return;
+            }
+            stats_add(stats_->records_out, 1);
+            size_t n = static_cast<size_t>(w);
+            for (auto& slice : slices) {
+                size_t take = std::min(n, slice.len);
+                slice.data = static_cast<const uint8_t*>(slice.data) + take;
+                slice.len -= take;
+                n -= take;
+            }
+        }
+        partial = head_len + body_len != slices[0].len + slices[1].len;
+        head = static_cast<const uint8_t*>(slices[0].data);
+        head_len = slices[0].len;
+        body = static_cast<const uint8_t*>(slices[1].data);
+        body_len = slices[1].len;
+        if (head_len + body_len == 0) return;
+        // Whatever is left of this frame goes next, urgent or not.
+        priority = SendPriority::BULK;
+    }
+
+    if (priority == SendPriority::URGENT) {
+        urgent_.push(head, head_len, body, body_len, owner);
+    } else {
+        if (out_.empty()) mid_frame_ = partial;
+        out_.push(head, head_len, body, body_len, owner);
+    }
+    stats_->queued_bytes.store(pending_bytes(), std::memory_order_relaxed);
+}
+
+void TLSChannel::FrameQueue::push(const uint8_t* head, size_t head_len, const uint8_t* body, size_t body_len,
+                                  const PooledBuffer* owner) {
+    if (owner && body_len == 0) {
+        frames.push_back(Entry{*owner, static_cast<size_t>(head - owner->data())});
+    } else {
+        PooledBuffer copy(head_len + body_len);
+        std::memcpy(copy.data(), head, head_len);
+        if (body_len > 0) std::memcpy(copy.data() + head_len, body, body_len);
+        frames.push_back(Entry{std::move(copy), 0});
+    }
+    bytes += head_len + body_len;
+}
+
+bool TLSChannel::FrameQueue::consume(size_t n) {
+    bytes -= n;
+    while (n > 0) {
+        Entry& entry = frames[first];
+        size_t left = entry.bytes.size() - entry.off;
+        if (n < left) {
+            entry.off += n;
+            return false;
+        }
+        n -= left;
+        entry.bytes = PooledBuffer();
+        ++first;
+    }
+    if (first == frames.size()) {
+        frames.clear();
+        first = 0;
+    } else if (first >= kCompactFrames) {
+        frames.erase(frames.begin(), frames.begin() + static_cast<std::ptrdiff_t>(first));
+        first = 0;
+    }
+    return true;
+}
+
+size_t TLSChannel::max_frame_payload() const {
+    return tls_.max_record_payload() - framing::HEADER_SIZE;
+}
+
+size_t TLSChannel::frame_overhead() const {
+    return framing::HEADER_SIZE + tls_.record_expansion();
+}
+
+void TLSChannel::pause_reading(bool paused) {
+    if (closed_ || read_paused_ == paused) return;
+    read_paused_ = paused;
+    update_interest();
+    if (!paused) {
+        read_records();
+    }
+}
+
+void TLSChannel::shutdown() {
+    if (closed_ || shutdown_pending_) return;
+    shutdown_pending_ = true;
+    if (!want_write_) {
+        flush();
+    }
+}
+
+void TLSChannel::close() {
+    if (closed_) return;
+    closed_ = true;
+    if (egress_) egress_->set_notify(nullptr);
+    if (fd_ >= 0) {
+        loop_.remove(fd_);
+        fd_ = -1;
+    }
+    if (on_closed) on_closed();
+}
+
+void TLSChannel::handle_events(uint32_t events) {
+    if ((events & EventLoop::WRITABLE) && want_write_) {
+        if (!flush()) return;
+    }
+    if ((events & EventLoop::READABLE) && !read_paused_) {
+        read_records();
+    }
+}
+
+void TLSChannel::read_records() {
+    while (!closed_ && !read_paused_) {
+        int r = tls_.tls_read(decoder_.next_buffer(), decoder_.next_size());
+        if (r > 0) {
+            if (tls_.record_bytes_left() == 0) stats_add(stats_->records_in, 1);
+            if (decoder_.advance(static_cast<size_t>(r))) {
+                stats_add(stats_->bytes_in, decoder_.payload().size());
+                stats_add(stats_->frames_in, 1);
+                stats_->frame_bytes_in.record(decoder_.payload().size());
+                if (decoder_.type() & framing::CHANNEL_FLAG) {
+                    uint8_t type = decoder_.type() & ~framing::CHANNEL_FLAG;
+                    if (on_channel_frame) on_channel_frame(decoder_.channel(), type, decoder_.payload());
+                } else if (on_frame) {
+                    on_frame(decoder_.type(), decoder_.payload());
+                }
+            } else if (decoder_.error()) {
+                LOG_ERROR("Oversized frame from peer; closing connection");
+                close();
+                return;
+            }
+            continue;
+        }
+        if (r == MBEDTLS_ERR_SSL_WANT_READ) return;
+        if (r == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            want_write_ = true;
+            update_interest();
+            return;
+        }
+#ifdef MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET
+        if (r == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET) continue;
+#endif
+        if (r < 0 && r != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+            LOG_ERROR("mbedtls_ssl_read returned -0x%x", -r);
+        }
+        close();
+        return;
+    }
+}
+
+bool TLSChannel::flush() {
+    TLSWrapper::IoSlice slices[kMaxGather];
+    for (;;) {
+        // Urgent frames cut in wherever the bulk backlog is between frames,
+        // and once started are written out in full.
+        bool urgent = !urgent_.empty() && (writing_urgent_ || (retry_len_ == 0 && !mid_frame_));
+        FrameQueue* queue;
+        if (urgent) {
+            writing_urgent_ = true;
+            queue = &urgent_;
+        } else if (!out_.empty()) {
+            queue = &out_;
+        } else {
+            break;
+        }
+        // A retry hands over exactly the bytes the failed write had.
+        size_t limit = retry_len_ ? retry_len_ : SIZE_MAX;
+        size_t count = 0;
+        size_t n = 0;
+        for (size_t i = queue->first; i < queue->frames.size() && count < kMaxGather && n < limit; ++i) {
+            const auto& entry = queue->frames[i];
+            size_t take = std::min(entry.bytes.size() - entry.off, limit - n);
+            slices[count++] = {entry.bytes.data() + entry.off, take};
+            n += take;
+        }
+        int w = tls_.tls_writev(slices, count);
+        if (w == MBEDTLS_ERR_SSL_WANT_WRITE || w == MBEDTLS_ERR_SSL_WANT_READ) {
+            stats_add(stats_->short_writes, 1);
+            stats_->queued_bytes.store(pending_bytes(), std::memory_order_relaxed);
+            retry_len_ = tls_.last_write_len();
+            if (!want_write_) {
+                want_write_ = true;
+                update_interest();
+            }
+            return true;
+        }
+        if (w < 0) {
+            LOG_ERROR("mbedtls_ssl_write returned -0x%x", -w);
+            close();
+            return false;
+        }
+        retry_len_ = 0;
+        stats_add(stats_->records_out, 1);
+        bool ended = queue->consume(static_cast<size_t>(w));
+        if (!urgent) {
+            mid_frame_ = !ended;
+        } else if (urgent_.empty()) {
+            writing_urgent_ = false;
+        }
+    }
+    mid_frame_ = false;
+    stats_->queued_bytes.store(0, std::memory_order_relaxed);
+    if (want_write_) {
+        want_write_ = false;
+        update_interest();
+    }
+    if (shutdown_pending_ && !close_notify_sent_) {
+        close_notify_sent_ = true;
+        tls_.close_notify();
+    }
+    if (on_drained) on_drained();
+    return !closed_;
+}
+
+void TLSChannel::update_interest() {
+    if (fd_ < 0) return;
+    uint32_t events = 0;
+    if (!read_paused_) events |= EventLoop::READABLE;
+    if (want_write_) events |= EventLoop::WRITABLE;
+    loop_.modify(fd_, events);
+}
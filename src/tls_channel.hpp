@@ -0,0 +1,116 @@
+#pragma once
+
+#include "buffer_pool.hpp"
+#include "egress_queue.hpp"
+#include "event_loop.hpp"
+#include "framing.hpp"
+#include "metrics.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+class TLSWrapper;
+
+// Buffered, non-blocking TLS transport driven by an EventLoop. Owns the
+// socket's registration in the loop and calls back into the session when
+// complete frames arrive or the connection goes away. The loop thread is the
+// only one that touches the TLS context; other threads hand it frames
+// through an EgressQueue.
+//
+// While the socket is backed up, urgent frames wait in a queue of their own
+// and go out at the next frame boundary of the bulk backlog. Queued frames
+// sit in pooled buffers; one drained from an EgressQueue keeps its own.
+class TLSChannel {
+public:
+    TLSChannel(EventLoop& loop, TLSWrapper& tls, std::shared_ptr<TrafficStats> stats = nullptr);
+    ~TLSChannel();
+
+    // Also sends what other threads push to queue. Before start().
+    void attach(EgressQueue& queue) { egress_ = &queue; }
+    bool start();
+    // Small payloads share one TLS record with the header. CONTROL frames
+    // are urgent, others bulk.
+    void send_frame(framing::FrameType type, const uint8_t* data, size_t len);
+    // Zero-copy send: payload must sit framing::HEADER_SIZE bytes into a
+    // buffer the caller owns. The header goes into that headroom and the frame
+    // is handed to mbedTLS as is; bytes are only copied into the channel's
+    // queue when the socket is backed up.
+    void send_frame_in_place(framing::FrameType type, uint8_t* payload, size_t len,
+                             SendPriority priority = SendPriority::BULK);
+    // A bulk frame on multiplexed channel id (not 0).
+    void send_channel_frame(uint32_t id, framing::FrameType type, const uint8_t* data, size_t len);
+    size_t pending_bytes() const { return out_.bytes + urgent_.bytes; }
+    // Largest frame payload that still fits in a single TLS record.
+    size_t max_frame_payload() const;
+    // Bytes one extra frame costs on the wire beyond its payload.
+    size_t frame_overhead() const;
+
+    // Stops pulling records from TLS while the consumer is backed up; resuming
+    // drains whatever mbedTLS has already buffered before waiting on the socket.
+    void pause_reading(bool paused);
+
+    // Sends close_notify once pending output is flushed.
+    void shutdown();
+    void close();
+    bool closed() const { return closed_; }
+    const std::shared_ptr<TrafficStats>& stats() const { return stats_; }
+
+    std::function<void(uint8_t type, const std::vector<uint8_t>& payload)> on_frame;
+    // Frames on channels other than 0, with CHANNEL_FLAG cleared from type.
+    std::function<void(uint32_t id, uint8_t type, const std::vector<uint8_t>& payload)> on_channel_frame;
+    std::function<void()> on_drained;
+    std::function<void()> on_closed;
+
+private:
+    // Frames waiting for the socket, oldest at first. Each is written from
+    // off on; entries before first are spent.
+    struct FrameQueue {
+        struct Entry {
+            PooledBuffer bytes;
+            size_t off;
+        };
+        std::vector<Entry> frames;
+        size_t first = 0;
+        size_t bytes = 0;
+
+        bool empty() const { return first == frames.size(); }
+        // owner, if given, holds head and there is no body: it is queued
+        // as is rather than copied.
+        void push(const uint8_t* head, size_t head_len, const uint8_t* body, size_t body_len,
+                  const PooledBuffer* owner);
+        // n bytes were written from the front; true if they ended a frame.
+        bool consume(size_t n);
+    };
+
+    void handle_events(uint32_t events);
+    void read_records();
+    void write_frame(const uint8_t* head, size_t head_len, const uint8_t* body, size_t body_len,
+                     SendPriority priority, const PooledBuffer* owner = nullptr);
+    void drain_egress();
+    bool flush();
+    void update_interest();
+
+    EventLoop& loop_;
+    TLSWrapper& tls_;
+    int fd_ = -1;
+    framing::FrameDecoder decoder_;
+    FrameQueue out_;
+    // The front bulk frame is partly written.
+    bool mid_frame_ = false;
+    FrameQueue urgent_;
+    bool writing_urgent_ = false;
+    // mbedTLS requires a retried write to repeat the exact length it was given.
+    size_t retry_len_ = 0;
+    EgressQueue* egress_ = nullptr;
+    // Lets a drain posted by another thread tell the channel is gone.
+    std::shared_ptr<bool> alive_ = std::make_shared<bool>(true);
+    bool want_write_ = false;
+    bool read_paused_ = false;
+    bool shutdown_pending_ = false;
+    bool close_notify_sent_ = false;
+    bool closed_ = false;
+    std::shared_ptr<TrafficStats> stats_;
+};
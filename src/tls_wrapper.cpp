@@ -1,6 +1,12 @@
 #include "tls_wrapper.hpp"
+#include "session_tickets.hpp"
 #include "utils.hpp"
+#include "mbedtls/md.h"
+#include "mbedtls/platform_util.h"
 #include "mbedtls/sha256.h"
+#include "mbedtls/ssl_ciphersuites.h"
+#include "mbedtls/version.h"
+#include <algorithm>
 #include <cstring>
 #ifdef _WIN32
 #include <winsock2.h>
@@ -10,6 +16,41 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #endif
+#ifdef __linux__
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#endif
+
+#ifdef MBEDTLS_SSL_EARLY_DATA
+// 0-RTT budget per connection, nonce included. Enough for keystrokes typed
+// while connecting, small enough to bound what a replay could carry.
+static const uint32_t kMaxEarlyData = 4096;
+#endif
+
+// What the key export callback hands over during the handshake, kept
+// until the kernel has the traffic keys: the TLS 1.2 master secret with the
+// hello randoms, or the TLS 1.3 application traffic secrets.
+struct KernelTlsSecrets {
+    mbedtls_tls_prf_types prf = MBEDTLS_SSL_TLS_PRF_NONE;
+    unsigned char master[48] = {};
+    bool have_master = false;
+    // Server random first, as key expansion takes them.
+    unsigned char randoms[64] = {};
+    unsigned char client[MBEDTLS_MD_MAX_SIZE] = {};
+    size_t client_len = 0;
+    unsigned char server[MBEDTLS_MD_MAX_SIZE] = {};
+    size_t server_len = 0;
+
+    ~KernelTlsSecrets() { mbedtls_platform_zeroize(this, sizeof(*this)); }
+};
 
 TLSWrapper::TLSWrapper() {
     mbedtls_ssl_init(&ssl);
@@ -86,30 +127,160 @@ namespace {
     }
 }
 
+// TLS 1.3 tickets come in as post-handshake messages and surface as this
+// read result on mbedTLS versions that report them.
+static bool is_new_ticket(int ret) {
+#ifdef MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET
+    return ret == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET;
+#else
+    (void)ret;
+    return false;
+#endif
+}
+
 bool TLSWrapper::attach_socket(intptr_t fd) {
     socket_fd_ = fd;
     mbedtls_ssl_set_bio(&ssl, this, send_cb, recv_cb, nullptr);
     return true;
 }
 
+bool TLSWrapper::attach_bio(void* ctx, mbedtls_ssl_send_t* send, mbedtls_ssl_recv_t* recv) {
+    socket_fd_ = -1;
+    mbedtls_ssl_set_bio(&ssl, ctx, send, recv, nullptr);
+    return true;
+}
+
 bool TLSWrapper::perform_handshake() {
     int ret;
-    while ((ret = mbedtls_ssl_handshake(&ssl)) != 0) {
+    while ((ret = continue_handshake()) != 0) {
         if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
-            LOG_ERROR("mbedtls_ssl_handshake returned -0x%x", -ret);
             return false;
         }
     }
     return true;
 }
 
+int TLSWrapper::continue_handshake() {
+    TicketKeys::take_ticket_accepted();
+    int ret = mbedtls_ssl_handshake(&ssl);
+#ifdef MBEDTLS_SSL_EARLY_DATA
+    while (ret == MBEDTLS_ERR_SSL_RECEIVED_EARLY_DATA) {
+        read_early_data();
+        ret = mbedtls_ssl_handshake(&ssl);
+    }
+#endif
+    if (TicketKeys::take_ticket_accepted()) resumed_ = true;
+    if (ret == 0) {
+        if (is_server_) {
+            check_early_data();
+        } else if (mbedtls_ssl_get_version_number(&ssl) == MBEDTLS_SSL_VERSION_TLS1_2) {
+            // TLS 1.3 tickets arrive after the handshake; see tls_read().
+            save_session();
+        }
+        if (kernel_secrets_) enable_kernel_tls();
+    } else if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+        LOG_ERROR("mbedtls_ssl_handshake returned -0x%x", -ret);
+    }
+    return ret;
+}
+
+void TLSWrapper::read_early_data() {
+#ifdef MBEDTLS_SSL_EARLY_DATA
+    unsigned char buf[1024];
+    int n;
+    while ((n = mbedtls_ssl_read_early_data(&ssl, buf, sizeof(buf))) > 0) {
+        early_data_.insert(early_data_.end(), buf, buf + n);
+    }
+#endif
+}
+
+// Anyone who captured a ClientHello can replay it along with its 0-RTT
+// data, so the data is only passed on if its nonce is new to this process.
+// Ticket keys never leave the process, so no other process can accept it.
+void TLSWrapper::check_early_data() {
+    if (early_data_.empty()) return;
+    if (!ticket_keys_ || early_data_.size() < TicketKeys::kNonceSize ||
+        !ticket_keys_->first_use(early_data_.data(), TicketKeys::kNonceSize)) {
+        LOG_WARN("Dropping %zu bytes of replayed or malformed early data", early_data_.size());
+        early_data_.clear();
+        return;
+    }
+    early_off_ = TicketKeys::kNonceSize;
+}
+
+size_t TLSWrapper::write_early_data(const void* buf, size_t len) {
+#ifdef MBEDTLS_SSL_EARLY_DATA
+    if (!allow_early_data_ || len == 0) return 0;
+    std::vector<unsigned char> msg(TicketKeys::kNonceSize + len);
+    if (mbedtls_ctr_drbg_random(&ctr_drbg, msg.data(), TicketKeys::kNonceSize) != 0) return 0;
+    std::memcpy(msg.data() + TicketKeys::kNonceSize, buf, len);
+    size_t off = 0;
+    while (off < msg.size()) {
+        int ret = mbedtls_ssl_write_early_data(&ssl, msg.data() + off, msg.size() - off);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) continue;
+        if (ret <= 0) break; // no early data on this session, or budget spent
+        off += static_cast<size_t>(ret);
+    }
+    return off > TicketKeys::kNonceSize ? off - TicketKeys::kNonceSize : 0;
+#else
+    (void)buf;
+    (void)len;
+    return 0;
+#endif
+}
+
+bool TLSWrapper::early_data_accepted() {
+#ifdef MBEDTLS_SSL_EARLY_DATA
+    return mbedtls_ssl_get_early_data_status(&ssl) == MBEDTLS_SSL_EARLY_DATA_STATUS_ACCEPTED;
+#else
+    return false;
+#endif
+}
+
+bool TLSWrapper::resume_session(const std::vector<uint8_t>& saved) {
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    int ret = mbedtls_ssl_session_load(&session, saved.data(), saved.size());
+    if (ret == 0) {
+        ret = mbedtls_ssl_set_session(&ssl, &session);
+    }
+    mbedtls_ssl_session_free(&session);
+    if (ret != 0) {
+        LOG_WARN("Saved TLS session is unusable (-0x%x); doing a full handshake", -ret);
+        return false;
+    }
+    return true;
+}
+
+void TLSWrapper::save_session() {
+    if (!on_session_ticket) return;
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    std::vector<uint8_t> saved;
+    int ret = mbedtls_ssl_get_session(&ssl, &session);
+    if (ret == 0) {
+        size_t len = 0;
+        ret = mbedtls_ssl_session_save(&session, nullptr, 0, &len);
+        if (ret == MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL) {
+            saved.resize(len);
+            ret = mbedtls_ssl_session_save(&session, saved.data(), saved.size(), &len);
+        }
+    }
+    mbedtls_ssl_session_free(&session);
+    if (ret != 0) {
+        LOG_WARN("Cannot save TLS session for resumption (-0x%x)", -ret);
+        return;
+    }
+    on_session_ticket(saved);
+}
+
 int TLSWrapper::tls_write_all(const void* buf, size_t len) {
     int ret;
     const unsigned char* p = (const unsigned char*)buf;
     size_t remaining = len;
 
     while (remaining > 0) {
-        ret = mbedtls_ssl_write(&ssl, p, remaining);
+        ret = tls_write(p, remaining);
         if (ret > 0) {
             p += ret;
             remaining -= ret;
@@ -127,14 +298,15 @@ int TLSWrapper::tls_read_exact(void* buf, size_t len) {
     size_t remaining = len;
 
     while (remaining > 0) {
-        ret = mbedtls_ssl_read(&ssl, p, remaining);
+        ret = tls_read(p, remaining);
         if (ret > 0) {
             p += ret;
             remaining -= ret;
         } else if (ret == 0) {
             // Connection closed
             return 0;
-        } else if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+        } else if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE &&
+                   !is_new_ticket(ret)) {
             LOG_ERROR("mbedtls_ssl_read returned -0x%x", -ret);
             return ret;
         }
@@ -143,17 +315,377 @@ int TLSWrapper::tls_read_exact(void* buf, size_t len) {
 }
 
 void TLSWrapper::close_notify() {
+    if (kernel_tx_) {
+        kernel_close_notify();
+        return;
+    }
     mbedtls_ssl_close_notify(&ssl);
 }
 
 int TLSWrapper::tls_write(const void* buf, size_t len) {
+    if (kernel_tx_) {
+        IoSlice slice = {buf, len};
+        return kernel_send(&slice, 1);
+    }
+    last_write_len_ = len;
     return mbedtls_ssl_write(&ssl, static_cast<const unsigned char*>(buf), static_cast<int>(len));
 }
 
+int TLSWrapper::tls_writev(const IoSlice* slices, size_t count) {
+    size_t first = 0;
+    while (first < count && slices[first].len == 0) ++first;
+    if (first == count) return 0;
+    // The kernel takes the slices as they are.
+    if (kernel_tx_) return kernel_send(slices + first, count - first);
+    size_t rest = 0;
+    for (size_t i = first + 1; i < count; ++i) rest += slices[i].len;
+
+    // mbedTLS copies plaintext into its record buffer regardless, so a slice
+    // that is last or fills a whole record is passed through untouched.
+    size_t record = max_record_payload();
+    if (rest == 0 || slices[first].len >= record) {
+        return tls_write(slices[first].data, slices[first].len);
+    }
+    // Otherwise join the front slices so a frame header does not cost a
+    // record of its own.
+    if (gather_buf_.size() < record) gather_buf_.resize(record);
+    size_t n = 0;
+    for (size_t i = first; i < count && n < record; ++i) {
+        size_t take = std::min(slices[i].len, record - n);
+        std::memcpy(gather_buf_.data() + n, slices[i].data, take);
+        n += take;
+    }
+    return tls_write(gather_buf_.data(), n);
+}
+
 int TLSWrapper::tls_read(void* buf, size_t len) {
-    return mbedtls_ssl_read(&ssl, static_cast<unsigned char*>(buf), static_cast<int>(len));
+    // Early data was taken in during the handshake and comes out first.
+    if (early_off_ < early_data_.size()) {
+        size_t n = std::min(len, early_data_.size() - early_off_);
+        std::memcpy(buf, early_data_.data() + early_off_, n);
+        early_off_ += n;
+        if (early_off_ == early_data_.size()) {
+            early_data_.clear();
+            early_data_.shrink_to_fit();
+            early_off_ = 0;
+        }
+        return static_cast<int>(n);
+    }
+    if (kernel_rx_) return kernel_recv(buf, len);
+    int ret = mbedtls_ssl_read(&ssl, static_cast<unsigned char*>(buf), static_cast<int>(len));
+    if (is_new_ticket(ret)) {
+        save_session();
+    }
+    return ret;
+}
+
+bool TLSWrapper::read_pending() {
+    return early_data_pending() > 0 || mbedtls_ssl_check_pending(&ssl) != 0;
+}
+
+size_t TLSWrapper::record_bytes_left() {
+    return mbedtls_ssl_get_bytes_avail(&ssl);
+}
+
+size_t TLSWrapper::max_record_payload() {
+    int n = mbedtls_ssl_get_max_out_record_payload(&ssl);
+    return n > 0 ? static_cast<size_t>(n) : 16384;
+}
+
+size_t TLSWrapper::record_expansion() {
+    int n = mbedtls_ssl_get_record_expansion(&ssl);
+    return n > 0 ? static_cast<size_t>(n) : 0;
 }
 
+std::string TLSWrapper::get_kernel_offload() const {
+    if (kernel_tx_ && kernel_rx_) return "send and receive";
+    if (kernel_tx_) return "send";
+    if (kernel_rx_) return "receive";
+    return std::string();
+}
+
+#ifdef __linux__
+
+namespace {
+    void export_kernel_secrets(void* ctx, mbedtls_ssl_key_export_type type, const unsigned char* secret,
+                               size_t secret_len, const unsigned char client_random[32],
+                               const unsigned char server_random[32], mbedtls_tls_prf_types prf) {
+        KernelTlsSecrets* s = static_cast<KernelTlsSecrets*>(ctx);
+        switch (type) {
+        case MBEDTLS_SSL_KEY_EXPORT_TLS12_MASTER_SECRET:
+            if (secret_len != sizeof(s->master)) return;
+            std::memcpy(s->master, secret, secret_len);
+            std::memcpy(s->randoms, server_random, 32);
+            std::memcpy(s->randoms + 32, client_random, 32);
+            s->prf = prf;
+            s->have_master = true;
+            break;
+#ifdef MBEDTLS_SSL_PROTO_TLS1_3
+        case MBEDTLS_SSL_KEY_EXPORT_TLS1_3_CLIENT_APPLICATION_TRAFFIC_SECRET:
+            if (secret_len > sizeof(s->client)) return;
+            std::memcpy(s->client, secret, secret_len);
+            s->client_len = secret_len;
+            break;
+        case MBEDTLS_SSL_KEY_EXPORT_TLS1_3_SERVER_APPLICATION_TRAFFIC_SECRET:
+            if (secret_len > sizeof(s->server)) return;
+            std::memcpy(s->server, secret, secret_len);
+            s->server_len = secret_len;
+            break;
+#endif
+        default:
+            break;
+        }
+    }
+
+    // HKDF-Expand-Label (RFC 8446) with an empty context, for outputs no
+    // longer than one hash, which traffic keys and IVs never are.
+    bool expand_label(mbedtls_md_type_t md, const unsigned char* secret, size_t secret_len, const char* label,
+                      unsigned char* out, size_t out_len) {
+        const mbedtls_md_info_t* info = mbedtls_md_info_from_type(md);
+        size_t label_len = std::strlen(label);
+        if (!info || out_len > mbedtls_md_get_size(info) || label_len > 16) return false;
+        unsigned char hkdf_label[2 + 1 + 6 + 16 + 1 + 1];
+        size_t n = 0;
+        hkdf_label[n++] = static_cast<unsigned char>(out_len >> 8);
+        hkdf_label[n++] = static_cast<unsigned char>(out_len);
+        hkdf_label[n++] = static_cast<unsigned char>(6 + label_len);
+        std::memcpy(hkdf_label + n, "tls13 ", 6);
+        n += 6;
+        std::memcpy(hkdf_label + n, label, label_len);
+        n += label_len;
+        hkdf_label[n++] = 0; // context
+        hkdf_label[n++] = 1; // first HKDF-Expand block
+        unsigned char block[MBEDTLS_MD_MAX_SIZE];
+        bool ok = mbedtls_md_hmac(info, secret, secret_len, hkdf_label, n, block) == 0;
+        if (ok) std::memcpy(out, block, out_len);
+        mbedtls_platform_zeroize(block, sizeof(block));
+        return ok;
+    }
+
+    // One direction's keys for the kernel. iv is the TLS 1.2 implicit
+    // nonce (4 bytes) or the TLS 1.3 IV (12); seq is the next record's
+    // sequence number.
+    struct KernelKeys {
+        unsigned char key[32];
+        unsigned char iv[12];
+        unsigned char seq[8];
+    };
+
+    template <typename CryptoInfo>
+    bool install_keys(int fd, int direction, CryptoInfo& info, uint16_t version, uint16_t cipher,
+                      const KernelKeys& keys) {
+        info.info.version = version;
+        info.info.cipher_type = cipher;
+        std::memcpy(info.key, keys.key, sizeof(info.key));
+        std::memcpy(info.salt, keys.iv, sizeof(info.salt));
+        if (version == TLS_1_2_VERSION) {
+            // mbedTLS uses the sequence number as the explicit nonce.
+            std::memcpy(info.iv, keys.seq, sizeof(info.iv));
+        } else {
+            std::memcpy(info.iv, keys.iv + sizeof(info.salt), sizeof(info.iv));
+        }
+        std::memcpy(info.rec_seq, keys.seq, sizeof(info.rec_seq));
+        bool ok = setsockopt(fd, SOL_TLS, direction, &info, sizeof(info)) == 0;
+        mbedtls_platform_zeroize(&info, sizeof(info));
+        return ok;
+    }
+
+    bool install_keys(int fd, int direction, bool tls13, size_t key_len, const KernelKeys& keys) {
+        uint16_t version = TLS_1_2_VERSION;
+        if (tls13) {
+#ifdef TLS_1_3_VERSION
+            version = TLS_1_3_VERSION;
+#else
+            return false;
+#endif
+        }
+        if (key_len == 16) {
+            tls12_crypto_info_aes_gcm_128 info{};
+            return install_keys(fd, direction, info, version, TLS_CIPHER_AES_GCM_128, keys);
+        }
+        tls12_crypto_info_aes_gcm_256 info{};
+        return install_keys(fd, direction, info, version, TLS_CIPHER_AES_GCM_256, keys);
+    }
+}
+
+// The record counters the kernel must continue from have no public accessor
+// in mbedTLS 3.x, so enable_kernel_tls() reads them from the context. That
+// layout has been checked for 3.2 up to 3.6 only.
+#if MBEDTLS_VERSION_NUMBER < 0x03020000 || MBEDTLS_VERSION_NUMBER >= 0x03070000
+#error "kernel TLS reads mbedTLS record counters: check mbedtls_ssl_context for this release"
+#endif
+
+// Past this point mbedTLS no longer sees the directions the kernel took
+// over, so its record counters are read once, here, and never advance.
+void TLSWrapper::enable_kernel_tls() {
+    std::unique_ptr<KernelTlsSecrets> secrets = std::move(kernel_secrets_);
+    if (!secrets || socket_fd_ < 0) return;
+    int fd = static_cast<int>(socket_fd_);
+
+    const mbedtls_ssl_ciphersuite_t* suite =
+        mbedtls_ssl_ciphersuite_from_id(mbedtls_ssl_get_ciphersuite_id_from_ssl(&ssl));
+    // The suite's name tells AES-GCM from the rest; its key length which.
+    const char* name = suite ? mbedtls_ssl_ciphersuite_get_name(suite) : nullptr;
+    size_t key_len = 0;
+    if (name && std::strstr(name, "-AES-") && std::strstr(name, "-GCM-")) {
+        key_len = mbedtls_ssl_ciphersuite_get_cipher_key_bitlen(suite) / 8;
+    }
+    if (key_len != 16 && key_len != 32) {
+        LOG_INFO("Kernel TLS needs an AES-GCM cipher suite, not %s; records stay with mbedTLS",
+                 get_ciphersuite().c_str());
+        return;
+    }
+
+    bool tls13 = mbedtls_ssl_get_version_number(&ssl) == MBEDTLS_SSL_VERSION_TLS1_3;
+    KernelKeys client{};
+    KernelKeys server{};
+    bool derived = false;
+    if (tls13) {
+        // TLS 1.3 suites are named for their hash.
+        mbedtls_md_type_t md = std::strstr(name, "-SHA384") ? MBEDTLS_MD_SHA384 : MBEDTLS_MD_SHA256;
+        derived = secrets->client_len > 0 && secrets->server_len > 0 &&
+                  expand_label(md, secrets->client, secrets->client_len, "key", client.key, key_len) &&
+                  expand_label(md, secrets->client, secrets->client_len, "iv", client.iv, 12) &&
+                  expand_label(md, secrets->server, secrets->server_len, "key", server.key, key_len) &&
+                  expand_label(md, secrets->server, secrets->server_len, "iv", server.iv, 12);
+    } else if (secrets->have_master) {
+        // Key block for AEAD suites: both write keys, then both 4-byte
+        // implicit nonces.
+        unsigned char block[2 * 32 + 2 * 4];
+        derived = mbedtls_ssl_tls_prf(secrets->prf, secrets->master, sizeof(secrets->master), "key expansion",
+                                      secrets->randoms, sizeof(secrets->randoms), block, 2 * key_len + 8) == 0;
+        if (derived) {
+            std::memcpy(client.key, block, key_len);
+            std::memcpy(server.key, block + key_len, key_len);
+            std::memcpy(client.iv, block + 2 * key_len, 4);
+            std::memcpy(server.iv, block + 2 * key_len + 4, 4);
+        }
+        mbedtls_platform_zeroize(block, sizeof(block));
+    }
+    KernelKeys& tx = is_server_ ? server : client;
+    KernelKeys& rx = is_server_ ? client : server;
+    if (!derived) {
+        LOG_WARN("Could not derive traffic keys for kernel TLS; records stay with mbedTLS");
+    } else if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0) {
+        LOG_INFO("Kernel TLS unavailable (%s); records stay with mbedTLS", error_to_string(errno).c_str());
+    } else {
+        // A TLS 1.3 server may still owe the client its session tickets,
+        // which mbedTLS sends after the handshake proper. They go out first;
+        // if mbedTLS can't flush them right away, it keeps the sending side.
+        int step = 0;
+        while (step == 0 && !mbedtls_ssl_is_handshake_over(&ssl)) {
+            step = mbedtls_ssl_handshake_step(&ssl);
+        }
+        static_assert(sizeof(ssl.MBEDTLS_PRIVATE(cur_out_ctr)) == sizeof(tx.seq), "mbedTLS record counter size");
+        if (step == 0 && ssl.MBEDTLS_PRIVATE(out_left) == 0) {
+            std::memcpy(tx.seq, ssl.MBEDTLS_PRIVATE(cur_out_ctr), sizeof(tx.seq));
+            kernel_tx_ = install_keys(fd, TLS_TX, tls13, key_len, tx);
+            if (!kernel_tx_) LOG_INFO("Kernel TLS refused the send keys (%s)", error_to_string(errno).c_str());
+        }
+        // Input mbedTLS has already taken off the socket can only be read
+        // through it. So can a TLS 1.3 server's tickets, which the client
+        // wants to keep.
+        bool rx_ok = mbedtls_ssl_check_pending(&ssl) == 0 && ssl.MBEDTLS_PRIVATE(in_left) == 0 &&
+                     (is_server_ || !tls13);
+        if (rx_ok) {
+            std::memcpy(rx.seq, ssl.MBEDTLS_PRIVATE(in_ctr), sizeof(rx.seq));
+            kernel_rx_ = install_keys(fd, TLS_RX, tls13, key_len, rx);
+            if (!kernel_rx_) LOG_INFO("Kernel TLS refused the receive keys (%s)", error_to_string(errno).c_str());
+        }
+        if (kernel_tx_ || kernel_rx_) LOG_DEBUG("Kernel TLS offload for %s", get_kernel_offload().c_str());
+    }
+    mbedtls_platform_zeroize(&client, sizeof(client));
+    mbedtls_platform_zeroize(&server, sizeof(server));
+}
+
+int TLSWrapper::kernel_send(const IoSlice* slices, size_t count) {
+    // One record at most, as through mbedTLS.
+    iovec iov[8];
+    size_t n = 0;
+    size_t total = 0;
+    size_t record = max_record_payload();
+    for (size_t i = 0; i < count && n < 8 && total < record; ++i) {
+        if (slices[i].len == 0) continue;
+        size_t take = std::min(slices[i].len, record - total);
+        iov[n].iov_base = const_cast<void*>(slices[i].data);
+        iov[n].iov_len = take;
+        total += take;
+        ++n;
+    }
+    last_write_len_ = total;
+    if (total == 0) return 0;
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    ssize_t ret = ::sendmsg(static_cast<int>(socket_fd_), &msg, 0);
+    if (ret < 0) {
+        if (errno == EWOULDBLOCK || errno == EAGAIN) return MBEDTLS_ERR_SSL_WANT_WRITE;
+        return MBEDTLS_ERR_NET_SEND_FAILED;
+    }
+    return static_cast<int>(ret);
+}
+
+int TLSWrapper::kernel_recv(void* buf, size_t len) {
+    // Records other than application data come with their type attached;
+    // without room for it the kernel fails the read.
+    char control[CMSG_SPACE(sizeof(unsigned char))];
+    iovec iov{buf, len};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t ret = ::recvmsg(static_cast<int>(socket_fd_), &msg, 0);
+    if (ret < 0) {
+        if (errno == EWOULDBLOCK || errno == EAGAIN) return MBEDTLS_ERR_SSL_WANT_READ;
+        return MBEDTLS_ERR_NET_RECV_FAILED;
+    }
+    if (ret == 0) return MBEDTLS_ERR_SSL_CONN_EOF;
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_TLS && cmsg->cmsg_type == TLS_GET_RECORD_TYPE) {
+        unsigned char type = *CMSG_DATA(cmsg);
+        const unsigned char* p = static_cast<const unsigned char*>(buf);
+        if (type == MBEDTLS_SSL_MSG_ALERT) {
+            if (ret < 2 || p[1] == MBEDTLS_SSL_ALERT_MSG_CLOSE_NOTIFY) return MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY;
+            LOG_WARN("Peer sent TLS alert %u", p[1]);
+            return MBEDTLS_ERR_SSL_FATAL_ALERT_MESSAGE;
+        }
+        if (type != MBEDTLS_SSL_MSG_APPLICATION_DATA) {
+            // Post-handshake messages (key updates, renegotiation) need
+            // mbedTLS, which no longer has the keys.
+            LOG_ERROR("Unexpected TLS record of type %u on a kernel TLS connection", type);
+            return MBEDTLS_ERR_SSL_UNEXPECTED_MESSAGE;
+        }
+    }
+    return static_cast<int>(ret);
+}
+
+void TLSWrapper::kernel_close_notify() {
+    unsigned char alert[2] = {MBEDTLS_SSL_ALERT_LEVEL_WARNING, MBEDTLS_SSL_ALERT_MSG_CLOSE_NOTIFY};
+    char control[CMSG_SPACE(sizeof(unsigned char))] = {};
+    iovec iov{alert, sizeof(alert)};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_TLS;
+    cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+    *CMSG_DATA(cmsg) = MBEDTLS_SSL_MSG_ALERT;
+    ::sendmsg(static_cast<int>(socket_fd_), &msg, 0);
+}
+
+#else
+
+void TLSWrapper::enable_kernel_tls() {}
+int TLSWrapper::kernel_send(const IoSlice*, size_t) { return MBEDTLS_ERR_NET_SEND_FAILED; }
+int TLSWrapper::kernel_recv(void*, size_t) { return MBEDTLS_ERR_NET_RECV_FAILED; }
+void TLSWrapper::kernel_close_notify() {}
+
+#endif
+
 bool TLSWrapper::initialize_context() {
     const char* pers = "secure-tunnel";
     if (mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (const unsigned char*)pers, static_cast<size_t>(std::strlen(pers))) != 0) {
@@ -213,13 +745,43 @@ bool TLSWrapper::configure_ssl_internal(bool is_server) {
             LOG_ERROR("mbedtls_ssl_conf_own_cert failed");
             return false;
         }
+        if (ticket_keys_) {
+            ticket_keys_->attach(&conf);
+        }
+    } else {
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+        mbedtls_ssl_conf_session_tickets(&conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+#ifdef MBEDTLS_SSL_TLS1_3_SIGNAL_NEW_SESSION_TICKETS_ENABLED
+        // From mbedTLS 3.6.1 TLS 1.3 tickets only reach the application on request.
+        mbedtls_ssl_conf_tls13_enable_signal_new_session_tickets(&conf,
+                                                                 MBEDTLS_SSL_TLS1_3_SIGNAL_NEW_SESSION_TICKETS_ENABLED);
+#endif
     }
 
+#ifdef MBEDTLS_SSL_EARLY_DATA
+    if (allow_early_data_ && (!is_server_ || ticket_keys_)) {
+        mbedtls_ssl_conf_early_data(&conf, MBEDTLS_SSL_EARLY_DATA_ENABLED);
+        if (is_server_) {
+            mbedtls_ssl_conf_max_early_data_size(&conf, kMaxEarlyData);
+        }
+    }
+#endif
+
     if (mbedtls_ssl_setup(&ssl, &conf) != 0) {
         LOG_ERROR("mbedtls_ssl_setup failed");
         return false;
     }
 
+    if (kernel_tls_) {
+#ifdef __linux__
+        kernel_secrets_ = std::make_unique<KernelTlsSecrets>();
+        mbedtls_ssl_set_export_keys_cb(&ssl, export_kernel_secrets, kernel_secrets_.get());
+#else
+        LOG_WARN("Kernel TLS is only available on Linux; records stay with mbedTLS");
+#endif
+    }
+
     return true;
 }
 
@@ -1,14 +1,26 @@
 #pragma once
 
+#include <functional>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "mbedtls/ctr_drbg.h"
 #include "mbedtls/entropy.h"
 #include "mbedtls/net_sockets.h"
 #include "mbedtls/ssl.h"
 
+class TicketKeys;
+struct KernelTlsSecrets;
+
 class TLSWrapper {
 public:
+    // One segment of a gather write.
+    struct IoSlice {
+        const void* data;
+        size_t len;
+    };
+
     TLSWrapper();
     TLSWrapper(const std::string& cert_file, const std::string& key_file, const std::string& ca_file);
     ~TLSWrapper();
@@ -16,16 +28,70 @@ public:
     bool configure_ssl(bool is_server, const std::string& cert, const std::string& key, const std::string& ca);
 
     bool attach_socket(intptr_t fd);
+    // Records go through send/recv instead of a socket, e.g. an in-memory
+    // pipe. They follow mbedTLS's BIO contract: bytes moved, or
+    // MBEDTLS_ERR_SSL_WANT_WRITE/WANT_READ when nothing can be.
+    bool attach_bio(void* ctx, mbedtls_ssl_send_t* send, mbedtls_ssl_recv_t* recv);
     bool perform_handshake();
+    // One non-blocking handshake step: 0 when done, MBEDTLS_ERR_SSL_WANT_READ/
+    // WANT_WRITE to be called again on readiness, any other value is fatal.
+    int continue_handshake();
     int tls_write_all(const void* buf, size_t len);
     int tls_read_exact(void* buf, size_t len);
     int tls_write(const void* buf, size_t len);
+    // Gather write of at most one record from the front of slices[0..count).
+    // Returns the bytes consumed or an mbedTLS error. After WANT_READ/
+    // WANT_WRITE the same bytes must be retried through tls_write() with a
+    // length of last_write_len(), as mbedTLS requires.
+    int tls_writev(const IoSlice* slices, size_t count);
+    size_t last_write_len() const { return last_write_len_; }
     int tls_read(void* buf, size_t len);
     void close_notify();
     std::string get_peer_fingerprint();
     std::string get_tls_version();
     std::string get_ciphersuite();
     void set_verify_required(bool v) { verify_required_ = v; }
+    // Server: issue session tickets sealed with these keys and resume the
+    // sessions they carry. Set before configure_ssl().
+    void set_ticket_keys(std::shared_ptr<TicketKeys> keys) { ticket_keys_ = std::move(keys); }
+    // Allow TLS 1.3 0-RTT data on resumed sessions (needs mbedTLS built with
+    // MBEDTLS_SSL_EARLY_DATA). Set before configure_ssl().
+    void set_early_data(bool v) { allow_early_data_ = v; }
+    // Linux: once the handshake is done, have the kernel encrypt and decrypt
+    // records (TCP_ULP "tls") if the suite is AES-GCM, and move data with
+    // plain send/recv from then on. Whatever the kernel can't take stays
+    // with mbedTLS. Set before configure_ssl().
+    void set_kernel_tls(bool v) { kernel_tls_ = v; }
+    // "send and receive", "send", "receive", or empty with no offload.
+    std::string get_kernel_offload() const;
+
+    // Client: offer a session previously passed to on_session_ticket. Call
+    // after configure_ssl() and before the handshake.
+    bool resume_session(const std::vector<uint8_t>& saved);
+    // Client: receives the serialized session whenever the server hands out
+    // a ticket (after the handshake in TLS 1.2, on the next read in 1.3).
+    std::function<void(const std::vector<uint8_t>&)> on_session_ticket;
+    // Server: whether the handshake resumed a ticket session.
+    bool session_resumed() const { return resumed_; }
+
+    // Client: sends buf as 0-RTT data, running the handshake up to the
+    // ClientHello. Returns how many bytes of buf went out (0 if the session
+    // can't carry early data). Bytes the server turns down must be sent
+    // again once the handshake is done; see early_data_accepted().
+    size_t write_early_data(const void* buf, size_t len);
+    bool early_data_accepted();
+    // Server: accepted early data not yet returned by tls_read().
+    size_t early_data_pending() const { return early_data_.size() - early_off_; }
+    // Whether tls_read() has input already off the socket, which a select()
+    // on the socket would not report.
+    bool read_pending();
+    // Plaintext of the record tls_read() last returned from that is still
+    // to be read; 0 once the record has been read to its end.
+    size_t record_bytes_left();
+    // Largest plaintext that fits one outgoing record, and the per-record
+    // bytes (header, IV, tag) added on top of it.
+    size_t max_record_payload();
+    size_t record_expansion();
 
     intptr_t socket_fd() const { return socket_fd_; }
 
@@ -33,6 +99,13 @@ private:
     bool initialize_context();
     bool load_certificates();
     bool configure_ssl_internal(bool is_server);
+    void read_early_data();
+    void check_early_data();
+    void save_session();
+    void enable_kernel_tls();
+    int kernel_send(const IoSlice* slices, size_t count);
+    int kernel_recv(void* buf, size_t len);
+    void kernel_close_notify();
 
     mbedtls_entropy_context entropy;
     mbedtls_ctr_drbg_context ctr_drbg;
@@ -47,8 +120,22 @@ private:
     std::string ca_file;
     bool is_server_ = false;
     bool verify_required_ = false;
+    bool allow_early_data_ = false;
+    bool resumed_ = false;
+    std::shared_ptr<TicketKeys> ticket_keys_;
+    bool kernel_tls_ = false;
+    // Directions the kernel has keys for.
+    bool kernel_tx_ = false;
+    bool kernel_rx_ = false;
+    // Handed over by mbedTLS during the handshake; dropped once used.
+    std::unique_ptr<KernelTlsSecrets> kernel_secrets_;
+    std::vector<uint8_t> early_data_;
+    size_t early_off_ = 0;
 
     mbedtls_net_context server_fd;
 
     intptr_t socket_fd_ = -1;
+    size_t last_write_len_ = 0;
+    // Staging for gather writes, sized to one record on first use.
+    std::vector<unsigned char> gather_buf_;
 };
@@ -1,40 +1,399 @@
 #include "utils.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <cstdarg>
+#include <cstdint>
 #include <cstdio>
-#include <chrono>
-#include <iomanip>
-#include <iostream>
-#include <sstream>
-#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
 #include <system_error>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+// Each thread's ring; a message that doesn't fit is dropped, not waited for.
+static const size_t kRingBytes = 64 * 1024;
+// Longer messages are cut short.
+static const size_t kMaxMessage = 1024;
+
+static const char* level_name(LogLevel level) {
+    switch (level) {
+    case LogLevel::Debug: return "DEBUG";
+    case LogLevel::Info: return "INFO";
+    case LogLevel::Warn: return "WARN";
+    case LogLevel::Error: return "ERROR";
+    }
+    return "?";
+}
+
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+static void format_time(time_t t, char* out, size_t size) {
+    std::tm tm{};
+#ifdef _WIN32
+    localtime_s(&tm, &t);
+#else
+    localtime_r(&t, &tm);
+#endif
+    std::strftime(out, size, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+namespace {
+
+struct RecordHeader {
+    int64_t time_us;
+    uint32_t len;
+    LogLevel level;
+};
+
+// Single-producer, single-consumer byte ring: the owning thread appends
+// records (header, then text), the flusher consumes them. head and tail
+// only grow; their difference is what is queued.
+struct LogRing {
+    uint8_t data[kRingBytes];
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    std::atomic<uint64_t> dropped{0};
+    // Set when the owning thread exits; the flusher frees the ring once empty.
+    std::atomic<bool> retired{false};
+    // Set while the owning thread is in log_message, so shutdown can wait
+    // for it to finish a push.
+    std::atomic<bool> busy{false};
+
+    void copy_in(uint64_t pos, const void* src, size_t len) {
+        size_t at = static_cast<size_t>(pos % kRingBytes);
+        size_t first = std::min(len, kRingBytes - at);
+        std::memcpy(data + at, src, first);
+        std::memcpy(data, static_cast<const uint8_t*>(src) + first, len - first);
+    }
+
+    void copy_out(uint64_t pos, void* dst, size_t len) const {
+        size_t at = static_cast<size_t>(pos % kRingBytes);
+        size_t first = std::min(len, kRingBytes - at);
+        std::memcpy(dst, data + at, first);
+        std::memcpy(static_cast<uint8_t*>(dst) + first, data, len - first);
+    }
+
+    // Producer side; false when the record doesn't fit.
+    bool push(const RecordHeader& header, const char* text) {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        size_t need = sizeof(header) + header.len;
+        if (t + need - head.load(std::memory_order_acquire) > kRingBytes) {
+            dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+        copy_in(t, &header, sizeof(header));
+        copy_in(t + sizeof(header), text, header.len);
+        tail.store(t + need, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire);
+    }
+};
+
+struct Pending {
+    int64_t time_us;
+    LogLevel level;
+    std::string text;
+};
+
+struct Logger {
+    std::mutex mutex;  // rings, and the flusher's wakeups
+    std::condition_variable wake;
+    std::vector<std::shared_ptr<LogRing>> rings;
+    std::thread flusher;
+    bool stopping = false;
+    std::atomic<bool> async{false};
+    // The flusher found every ring empty and waits; the first message after
+    // that wakes it, the rest don't pay for a notify.
+    std::atomic<bool> sleeping{false};
+
+    // Touched by the flusher only, once started.
+    FILE* file = nullptr;
+    std::string path;
+    size_t max_bytes = 0;
+    int keep = 0;
+    size_t file_bytes = 0;
+    uint64_t dropped_reported = 0;
+    // Drops counted by rings that have since been freed.
+    uint64_t dropped_retired = 0;
+    time_t stamp_second = -1;
+    char stamp[32] = {};
+    std::vector<Pending> batch;
+    std::string out;
+
+    void run();
+    void wake_flusher();
+    bool rings_empty();
+    void drain();
+    void write_out();
+    void rotate();
+};
+
+Logger& logger() {
+    static Logger instance;
+    return instance;
+}
+
+// The calling thread's ring, registered on its first message.
+struct RingHandle {
+    std::shared_ptr<LogRing> ring;
+
+    ~RingHandle() {
+        if (ring) ring->retired.store(true, std::memory_order_release);
+    }
+};
+
+thread_local RingHandle t_ring;
+
+LogRing& thread_ring() {
+    if (!t_ring.ring) {
+        t_ring.ring = std::make_shared<LogRing>();
+        Logger& log = logger();
+        std::lock_guard<std::mutex> lock(log.mutex);
+        log.rings.push_back(t_ring.ring);
+    }
+    return *t_ring.ring;
+}
+
+void Logger::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        sleeping.store(true, std::memory_order_seq_cst);
+        // Pairs with the fence in wake_flusher: either this sees the record
+        // just pushed, or its producer sees sleeping and wakes us.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (rings_empty()) wake.wait(lock, [this] { return stopping || !sleeping.load(std::memory_order_relaxed); });
+        sleeping.store(false, std::memory_order_relaxed);
+        lock.unlock();
+        drain();
+        lock.lock();
+    }
+}
 
-void log_message(const char* level, const char* fmt, ...) {
-    fprintf(stderr, "[%s] [%s] ", get_timestamp().c_str(), level);
+void Logger::wake_flusher() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!sleeping.load(std::memory_order_relaxed) || !sleeping.exchange(false)) return;
+    // Taking the lock orders this after the flusher's check of sleeping, so
+    // the notify can't land before it waits.
+    { std::lock_guard<std::mutex> lock(mutex); }
+    wake.notify_one();
+}
+
+// Called with mutex held.
+bool Logger::rings_empty() {
+    for (const auto& ring : rings) {
+        if (!ring->empty()) return false;
+    }
+    return true;
+}
+
+void Logger::drain() {
+    std::vector<std::shared_ptr<LogRing>> snapshot;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        snapshot = rings;
+    }
+    uint64_t dropped = dropped_retired;
+    for (auto& ring : snapshot) {
+        uint64_t h = ring->head.load(std::memory_order_relaxed);
+        uint64_t t = ring->tail.load(std::memory_order_acquire);
+        while (h < t) {
+            RecordHeader header;
+            ring->copy_out(h, &header, sizeof(header));
+            Pending p{header.time_us, header.level, std::string(header.len, '\0')};
+            ring->copy_out(h + sizeof(header), &p.text[0], header.len);
+            batch.push_back(std::move(p));
+            h += sizeof(header) + header.len;
+        }
+        ring->head.store(h, std::memory_order_release);
+        dropped += ring->dropped.load(std::memory_order_relaxed);
+    }
+    {
+        // A retired ring has no producer left, so what was drained above
+        // is all it will ever hold.
+        std::lock_guard<std::mutex> lock(mutex);
+        rings.erase(std::remove_if(rings.begin(), rings.end(),
+                                   [this](const std::shared_ptr<LogRing>& r) {
+                                       if (!r->retired.load(std::memory_order_acquire) || !r->empty()) return false;
+                                       dropped_retired += r->dropped.load(std::memory_order_relaxed);
+                                       return true;
+                                   }),
+                    rings.end());
+    }
+    if (dropped > dropped_reported) {
+        batch.push_back(Pending{now_us(), LogLevel::Warn,
+                                std::to_string(dropped - dropped_reported) + " log messages dropped (ring full)"});
+        dropped_reported = dropped;
+    }
+    if (!batch.empty()) write_out();
+}
+
+void Logger::write_out() {
+    // Threads' rings are drained one after another; put the batch back in
+    // the order it was logged.
+    std::stable_sort(batch.begin(), batch.end(),
+                     [](const Pending& a, const Pending& b) { return a.time_us < b.time_us; });
+    out.clear();
+    for (const auto& p : batch) {
+        time_t second = static_cast<time_t>(p.time_us / 1000000);
+        if (second != stamp_second) {
+            format_time(second, stamp, sizeof(stamp));
+            stamp_second = second;
+        }
+        out += '[';
+        out += stamp;
+        out += "] [";
+        out += level_name(p.level);
+        out += "] ";
+        out += p.text;
+        out += '\n';
+    }
+    batch.clear();
+    std::fwrite(out.data(), 1, out.size(), stderr);
+    std::fflush(stderr);
+    if (file) {
+        std::fwrite(out.data(), 1, out.size(), file);
+        std::fflush(file);
+        file_bytes += out.size();
+        if (max_bytes > 0 && file_bytes >= max_bytes) rotate();
+    }
+}
+
+void Logger::rotate() {
+    std::fclose(file);
+    file = nullptr;
+    if (keep > 0) {
+        std::remove((path + "." + std::to_string(keep)).c_str());
+        for (int i = keep - 1; i >= 1; --i) {
+            std::rename((path + "." + std::to_string(i)).c_str(), (path + "." + std::to_string(i + 1)).c_str());
+        }
+        std::rename(path.c_str(), (path + ".1").c_str());
+    } else {
+        std::remove(path.c_str());
+    }
+    file = std::fopen(path.c_str(), "ab");
+    file_bytes = 0;
+}
+
+#ifndef _WIN32
+// The flusher isn't forked along; a child logs straight to stderr.
+void on_fork_child() {
+    logger().async.store(false, std::memory_order_relaxed);
+}
+#endif
+
+void shutdown_at_exit() {
+    shutdown_logging();
+}
+
+}  // namespace
+
+void log_message(LogLevel level, const char* fmt, ...) {
+    char text[kMaxMessage];
     va_list args;
     va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
+    int n = vsnprintf(text, sizeof(text), fmt, args);
     va_end(args);
-    fprintf(stderr, "\n");
+    if (n < 0) return;
+    size_t len = std::min(static_cast<size_t>(n), sizeof(text) - 1);
+
+    Logger& log = logger();
+    if (log.async.load(std::memory_order_acquire)) {
+        LogRing& ring = thread_ring();
+        ring.busy.store(true, std::memory_order_seq_cst);
+        // Checked again now shutdown can see busy: it either waits for this
+        // push or has already switched logging back to stderr.
+        if (log.async.load(std::memory_order_seq_cst)) {
+            RecordHeader header{now_us(), static_cast<uint32_t>(len), level};
+            bool pushed = ring.push(header, text);
+            ring.busy.store(false, std::memory_order_release);
+            if (pushed) log.wake_flusher();
+            return;
+        }
+        ring.busy.store(false, std::memory_order_relaxed);
+    }
+    fprintf(stderr, "[%s] [%s] %.*s\n", get_timestamp().c_str(), level_name(level), static_cast<int>(len), text);
 }
 
 std::string get_timestamp() {
-    auto now = std::chrono::system_clock::now();
-    auto in_time_t = std::chrono::system_clock::to_time_t(now);
-
-    std::stringstream ss;
-    ss << std::put_time(std::localtime(&in_time_t), "%Y-%m-%d %X");
-    return ss.str();
+    char stamp[32];
+    format_time(std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()), stamp, sizeof(stamp));
+    return stamp;
 }
 
-void initialize_logging(const std::string& path, bool debug) {
-    // Minimal stub: create log file if path is provided; debug flag unused here
+void initialize_logging(const std::string& path, bool debug, size_t max_bytes, int keep) {
+    log_detail::debug.store(debug, std::memory_order_relaxed);
+    Logger& log = logger();
+    if (log.flusher.joinable()) return;
+    log.path = path;
+    log.max_bytes = max_bytes;
+    log.keep = keep;
     if (!path.empty()) {
-        std::ofstream ofs(path, std::ios::app);
-        if (ofs) {
-            ofs << "[" << get_timestamp() << "] [INFO] Logging initialized" << (debug ? " (debug)" : "") << "\n";
+        log.file = std::fopen(path.c_str(), "ab");
+        if (log.file) {
+            std::fseek(log.file, 0, SEEK_END);
+            long size = std::ftell(log.file);
+            log.file_bytes = size > 0 ? static_cast<size_t>(size) : 0;
+        } else {
+            fprintf(stderr, "[%s] [WARN] Cannot open log file %s\n", get_timestamp().c_str(), path.c_str());
         }
     }
+    log.stopping = false;
+    log.flusher = std::thread([&log] { log.run(); });
+    log.async.store(true, std::memory_order_release);
+
+    static bool hooks_installed = false;
+    if (!hooks_installed) {
+#ifndef _WIN32
+        pthread_atfork(nullptr, nullptr, on_fork_child);
+#endif
+        std::atexit(shutdown_at_exit);
+        hooks_installed = true;
+    }
+    LOG_INFO("Logging initialized%s", debug ? " (debug)" : "");
+}
+
+void shutdown_logging() {
+    Logger& log = logger();
+    if (!log.async.load(std::memory_order_acquire)) return;
+    log.async.store(false, std::memory_order_seq_cst);
+    // Threads that saw async still set are finishing their push; later
+    // ones see it cleared and write to stderr.
+    std::vector<std::shared_ptr<LogRing>> rings;
+    {
+        std::lock_guard<std::mutex> lock(log.mutex);
+        rings = log.rings;
+    }
+    for (const auto& ring : rings) {
+        while (ring->busy.load(std::memory_order_acquire)) std::this_thread::yield();
+    }
+    {
+        std::lock_guard<std::mutex> lock(log.mutex);
+        log.stopping = true;
+    }
+    log.wake.notify_one();
+    log.flusher.join();
+    // Nothing can be pushed now; write out what the flusher didn't get to.
+    log.drain();
+    if (log.file) {
+        std::fclose(log.file);
+        log.file = nullptr;
+    }
 }
 
 std::string error_to_string(int errnum) {
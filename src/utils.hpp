@@ -1,15 +1,61 @@
 #pragma once
 
+#include <atomic>
+#include <cstddef>
 #include <string>
 
-#define LOG_INFO(fmt, ...) log_message("INFO", fmt, ##__VA_ARGS__)
-#define LOG_ERROR(fmt, ...) log_message("ERROR", fmt, ##__VA_ARGS__)
-#define LOG_WARN(fmt, ...) log_message("WARN", fmt, ##__VA_ARGS__)
+enum class LogLevel { Debug, Info, Warn, Error };
 
-void log_message(const char* level, const char* fmt, ...);
+// Messages below this level are compiled out of the binary: 0 keeps
+// LOG_DEBUG (still off unless --debug), 1 drops it, 2 also drops LOG_INFO.
+#ifndef SECURE_TUNNEL_LOG_LEVEL
+#define SECURE_TUNNEL_LOG_LEVEL 0
+#endif
+
+#define LOG_AT(level, fmt, ...)                                                   \
+    do {                                                                          \
+        if (static_cast<int>(level) >= SECURE_TUNNEL_LOG_LEVEL) {                 \
+            log_message(level, fmt, ##__VA_ARGS__);                               \
+        }                                                                         \
+    } while (0)
+
+#define LOG_DEBUG(fmt, ...)                                                       \
+    do {                                                                          \
+        if (SECURE_TUNNEL_LOG_LEVEL <= 0 && log_debug_enabled()) {                \
+            log_message(LogLevel::Debug, fmt, ##__VA_ARGS__);                     \
+        }                                                                         \
+    } while (0)
+#define LOG_INFO(fmt, ...) LOG_AT(LogLevel::Info, fmt, ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...) LOG_AT(LogLevel::Warn, fmt, ##__VA_ARGS__)
+#define LOG_ERROR(fmt, ...) LOG_AT(LogLevel::Error, fmt, ##__VA_ARGS__)
+
+// Formats the message into the calling thread's log ring and returns; a
+// background thread writes it out. Never blocks: when the ring is full the
+// message is dropped and counted. Before initialize_logging (and in a
+// forked child) it writes straight to stderr.
+void log_message(LogLevel level, const char* fmt, ...)
+#if defined(__GNUC__)
+    __attribute__((format(printf, 2, 3)))
+#endif
+    ;
+
+namespace log_detail {
+inline std::atomic<bool> debug{false};
+}
+
+inline bool log_debug_enabled() {
+    return log_detail::debug.load(std::memory_order_relaxed);
+}
 
 std::string get_timestamp();
 
-void initialize_logging(const std::string& path, bool debug);
+// Starts the flusher thread. Every message goes to stderr and, unless path
+// is empty, is appended to path; once the file grows past max_bytes (0 for
+// never) it is renamed to path.1, older ones shifting up to path.<keep>.
+void initialize_logging(const std::string& path, bool debug, size_t max_bytes = 10u << 20, int keep = 3);
+
+// Writes out what is still queued and stops the flusher. Runs at exit as
+// well; logging afterwards goes straight to stderr again.
+void shutdown_logging();
 
 std::string error_to_string(int errnum);
@@ -0,0 +1,832 @@
+#include "vt_screen.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+static const uint8_t ESC = 0x1B;
+
+// Longest OSC string kept; only window titles are used.
+static const size_t kMaxOsc = 1024;
+
+// DEC private modes that change what the client terminal sends, replayed
+// on repaint. Bit i of input_modes_ is kInputModes[i].
+static const int kInputModes[] = {1, 1000, 1002, 1003, 1004, 1005, 1006, 1015, 2004};
+static const int kNumInputModes = sizeof(kInputModes) / sizeof(kInputModes[0]);
+
+// Columns a code point occupies: 0 for combining marks and zero-width
+// characters, 2 for East Asian wide characters and emoji, else 1. A fixed
+// table rather than wcwidth(), whose answer depends on the server's locale.
+static int char_width(uint32_t cp) {
+    if (cp < 0x300) return 1;
+    if ((cp <= 0x36F) || (cp >= 0x1AB0 && cp <= 0x1AFF) || (cp >= 0x1DC0 && cp <= 0x1DFF) ||
+        (cp >= 0x200B && cp <= 0x200F) || (cp >= 0x20D0 && cp <= 0x20FF) || (cp >= 0xFE00 && cp <= 0xFE0F) ||
+        (cp >= 0xFE20 && cp <= 0xFE2F)) {
+        return 0;
+    }
+    if ((cp >= 0x1100 && cp <= 0x115F) || (cp >= 0x2E80 && cp <= 0x303E) || (cp >= 0x3041 && cp <= 0x33FF) ||
+        (cp >= 0x3400 && cp <= 0x4DBF) || (cp >= 0x4E00 && cp <= 0x9FFF) || (cp >= 0xA000 && cp <= 0xA4CF) ||
+        (cp >= 0xAC00 && cp <= 0xD7A3) || (cp >= 0xF900 && cp <= 0xFAFF) || (cp >= 0xFE30 && cp <= 0xFE4F) ||
+        (cp >= 0xFF00 && cp <= 0xFF60) || (cp >= 0xFFE0 && cp <= 0xFFE6) || (cp >= 0x1F300 && cp <= 0x1F64F) ||
+        (cp >= 0x1F900 && cp <= 0x1F9FF) || (cp >= 0x20000 && cp <= 0x3FFFD)) {
+        return 2;
+    }
+    return 1;
+}
+
+static void append_utf8(std::vector<uint8_t>& out, uint32_t cp) {
+    if (cp < 0x80) {
+        out.push_back(static_cast<uint8_t>(cp));
+    } else if (cp < 0x800) {
+        out.push_back(static_cast<uint8_t>(0xC0 | (cp >> 6)));
+        out.push_back(static_cast<uint8_t>(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        out.push_back(static_cast<uint8_t>(0xE0 | (cp >> 12)));
+        out.push_back(static_cast<uint8_t>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<uint8_t>(0x80 | (cp & 0x3F)));
+    } else {
+        out.push_back(static_cast<uint8_t>(0xF0 | (cp >> 18)));
+        out.push_back(static_cast<uint8_t>(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back(static_cast<uint8_t>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<uint8_t>(0x80 | (cp & 0x3F)));
+    }
+}
+
+static void append_str(std::vector<uint8_t>& out, const char* s) {
+    out.insert(out.end(), s, s + std::strlen(s));
+}
+
+VtScreen::VtScreen(int rows, int cols)
+    : rows_(std::min(std::max(1, rows), kMaxRows)), cols_(std::min(std::max(1, cols), kMaxCols)),
+      bottom_(rows_ - 1) {
+    main_.cells.resize(static_cast<size_t>(rows_) * cols_);
+}
+
+VtScreen::Cell VtScreen::blank() const {
+    // Erased cells take the current background, as in xterm.
+    Cell c;
+    c.attr.bg = pen_.bg;
+    return c;
+}
+
+size_t VtScreen::memory_bytes() const {
+    return (main_.cells.capacity() + alt_.cells.capacity()) * sizeof(Cell) + title_.capacity() + osc_.capacity();
+}
+
+void VtScreen::resize(int rows, int cols) {
+    if (rows < 1 || cols < 1) return;
+    rows = std::min(rows, kMaxRows);
+    cols = std::min(cols, kMaxCols);
+    if (rows == rows_ && cols == cols_) return;
+    // Rows that no longer fit go off the top, so the cursor line stays.
+    int shift = row_ >= rows ? row_ - rows + 1 : 0;
+    auto reshape = [&](Grid& g) {
+        if (g.cells.empty()) return;
+        std::vector<Cell> next(static_cast<size_t>(rows) * cols);
+        int keep_rows = std::min(rows, rows_ - shift);
+        int keep_cols = std::min(cols, cols_);
+        for (int r = 0; r < keep_rows; ++r) {
+            const Cell* src = g.cells.data() + static_cast<size_t>((r + shift + g.base) % rows_) * cols_;
+            std::copy(src, src + keep_cols, next.data() + static_cast<size_t>(r) * cols);
+        }
+        g.cells.swap(next);
+        g.base = 0;
+    };
+    reshape(main_);
+    reshape(alt_);
+    rows_ = rows;
+    cols_ = cols;
+    row_ = std::min(row_ - shift, rows_ - 1);
+    col_ = std::min(col_, cols_ - 1);
+    pending_wrap_ = false;
+    top_ = 0;
+    bottom_ = rows_ - 1;
+    for (SavedCursor* saved : {&saved_main_, &saved_alt_}) {
+        saved->row = std::min(saved->row, rows_ - 1);
+        saved->col = std::min(saved->col, cols_ - 1);
+    }
+}
+
+void VtScreen::feed(const uint8_t* data, size_t len) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + len;
+    while (p < end) {
+        switch (state_) {
+        case State::Ground: {
+            const uint8_t* run = p;
+            while (p < end && *p >= 0x20 && *p < 0x7F) ++p;
+            if (p > run) print_ascii(run, static_cast<size_t>(p - run));
+            if (p == end) break;
+            uint8_t c = *p++;
+            if (c < 0x20) {
+                control(c);
+            } else if (c >= 0xC2 && c <= 0xDF) {
+                utf8_cp_ = c & 0x1F;
+                utf8_need_ = 1;
+                state_ = State::Utf8;
+            } else if (c >= 0xE0 && c <= 0xEF) {
+                utf8_cp_ = c & 0x0F;
+                utf8_need_ = 2;
+                state_ = State::Utf8;
+            } else if (c >= 0xF0 && c <= 0xF4) {
+                utf8_cp_ = c & 0x07;
+                utf8_need_ = 3;
+                state_ = State::Utf8;
+            } else if (c != 0x7F) {
+                print(0xFFFD);
+            }
+            break;
+        }
+        case State::Utf8: {
+            uint8_t c = *p;
+            if ((c & 0xC0) != 0x80) {
+                // Truncated sequence: show a replacement and look at c afresh.
+                state_ = State::Ground;
+                print(0xFFFD);
+                break;
+            }
+            ++p;
+            utf8_cp_ = (utf8_cp_ << 6) | (c & 0x3F);
+            if (--utf8_need_ == 0) {
+                state_ = State::Ground;
+                print(utf8_cp_ <= 0x10FFFF ? utf8_cp_ : 0xFFFD);
+            }
+            break;
+        }
+        case State::Escape: {
+            uint8_t c = *p++;
+            if (c == '[') {
+                state_ = State::Csi;
+                nparams_ = 0;
+                params_[0] = 0;
+                private_ = 0;
+                intermediate_ = 0;
+            } else if (c == ']') {
+                state_ = State::Osc;
+                osc_.clear();
+            } else if (c == 'P' || c == 'X' || c == '^' || c == '_') {
+                state_ = State::String;
+            } else if (c >= 0x20 && c <= 0x2F) {
+                state_ = State::EscIntermediate;
+            } else if (c < 0x20) {
+                if (c != ESC) control(c);
+            } else {
+                state_ = State::Ground;
+                esc_dispatch(c);
+            }
+            break;
+        }
+        case State::EscIntermediate: {
+            // Character set designations and the like: nothing to model.
+            uint8_t c = *p++;
+            if (c < 0x20 || c > 0x2F) state_ = State::Ground;
+            break;
+        }
+        case State::Csi:
+            while (p < end) {
+                uint8_t c = *p++;
+                if (c >= '0' && c <= '9') {
+                    if (nparams_ == 0) nparams_ = 1;
+                    int& v = params_[nparams_ - 1];
+                    if (v < 100000) v = v * 10 + (c - '0');
+                } else if (c == ';' || c == ':') {
+                    if (nparams_ == 0) nparams_ = 1;
+                    if (nparams_ < kMaxParams) params_[nparams_++] = 0;
+                } else if (c >= 0x40 && c <= 0x7E) {
+                    state_ = State::Ground;
+                    csi_dispatch(c);
+                    break;
+                } else if (c >= 0x3C && c <= 0x3F) {
+                    private_ = c;
+                } else if (c >= 0x20 && c <= 0x2F) {
+                    intermediate_ = c;
+                } else if (c == ESC) {
+                    state_ = State::Escape;
+                    break;
+                } else if (c == 0x18 || c == 0x1A) {
+                    state_ = State::Ground;
+                    break;
+                } else if (c < 0x20) {
+                    control(c);
+                }
+            }
+            break;
+        case State::Osc:
+            while (p < end) {
+                uint8_t c = *p++;
+                if (c == 0x07) {
+                    state_ = State::Ground;
+                    osc_dispatch();
+                    break;
+                }
+                if (c == ESC) {
+                    state_ = State::OscEscape;
+                    break;
+                }
+                if (c == 0x18 || c == 0x1A) {
+                    state_ = State::Ground;
+                    break;
+                }
+                if (osc_.size() < kMaxOsc) osc_.push_back(static_cast<char>(c));
+            }
+            break;
+        case State::String: {
+            const void* esc = std::memchr(p, ESC, static_cast<size_t>(end - p));
+            if (!esc) {
+                p = end;
+                break;
+            }
+            p = static_cast<const uint8_t*>(esc) + 1;
+            state_ = State::StringEscape;
+            break;
+        }
+        case State::OscEscape:
+        case State::StringEscape:
+            // ESC \ is the terminator; any other ESC starts a new sequence.
+            if (state_ == State::OscEscape) osc_dispatch();
+            if (*p == '\\') {
+                ++p;
+                state_ = State::Ground;
+            } else {
+                state_ = State::Escape;
+            }
+            break;
+        }
+    }
+}
+
+void VtScreen::wrap_if_pending() {
+    if (!pending_wrap_) return;
+    col_ = 0;
+    linefeed();
+}
+
+void VtScreen::print_ascii(const uint8_t* p, size_t n) {
+    last_char_ = p[n - 1];
+    while (n > 0) {
+        wrap_if_pending();
+        if (insert_) {
+            print(*p++);
+            --n;
+            continue;
+        }
+        Cell* row = row_ptr(row_);
+        size_t k = std::min(n, static_cast<size_t>(cols_ - col_));
+        for (size_t i = 0; i < k; ++i) {
+            row[col_ + i].ch = p[i];
+            row[col_ + i].attr = pen_;
+        }
+        p += k;
+        n -= k;
+        col_ += static_cast<int>(k);
+        if (col_ >= cols_) {
+            col_ = cols_ - 1;
+            pending_wrap_ = autowrap_;
+        }
+    }
+}
+
+void VtScreen::print(uint32_t cp) {
+    int width = char_width(cp);
+    if (width == 0) return;
+    if (cols_ < 2) width = 1;
+    last_char_ = cp;
+    wrap_if_pending();
+    if (width == 2 && col_ == cols_ - 1) {
+        // A wide character doesn't split across lines.
+        clear_cells(row_, col_, cols_);
+        if (!autowrap_) return;
+        col_ = 0;
+        linefeed();
+    }
+    if (insert_) insert_cells(width);
+    Cell* row = row_ptr(row_);
+    row[col_].ch = cp;
+    row[col_].attr = pen_;
+    if (width == 2) {
+        row[col_ + 1].ch = 0;
+        row[col_ + 1].attr = pen_;
+    }
+    col_ += width;
+    if (col_ >= cols_) {
+        col_ = cols_ - 1;
+        pending_wrap_ = autowrap_;
+    }
+}
+
+void VtScreen::control(uint8_t c) {
+    switch (c) {
+    case 0x08:
+        pending_wrap_ = false;
+        if (col_ > 0) --col_;
+        break;
+    case 0x09:
+        // Fixed stops every eight columns; set/clear tab stop sequences are ignored.
+        col_ = std::min(cols_ - 1, (col_ / 8 + 1) * 8);
+        break;
+    case 0x0A:
+    case 0x0B:
+    case 0x0C:
+        linefeed();
+        break;
+    case 0x0D:
+        col_ = 0;
+        pending_wrap_ = false;
+        break;
+    case ESC:
+        state_ = State::Escape;
+        break;
+    case 0x18:
+    case 0x1A:
+        state_ = State::Ground;
+        break;
+    default:
+        break;
+    }
+}
+
+void VtScreen::esc_dispatch(uint8_t c) {
+    switch (c) {
+    case '7': save_cursor(); break;
+    case '8': restore_cursor(); break;
+    case 'D': linefeed(); break;
+    case 'E':
+        col_ = 0;
+        linefeed();
+        break;
+    case 'M': reverse_index(); break;
+    case 'c': reset(); break;
+    case '=': app_keypad_ = true; break;
+    case '>': app_keypad_ = false; break;
+    default: break;
+    }
+}
+
+int VtScreen::param(int i, int def) const {
+    return i < nparams_ && params_[i] != 0 ? params_[i] : def;
+}
+
+void VtScreen::csi_dispatch(uint8_t final) {
+    if (private_ == '?' && (final == 'h' || final == 'l')) {
+        for (int i = 0; i < std::max(1, nparams_); ++i) dec_mode(param(i, 0), final == 'h');
+        return;
+    }
+    // Selective erase is treated as plain erase; other private and
+    // intermediate forms are reports, cursor styles and the like.
+    if (private_ && !(private_ == '?' && (final == 'J' || final == 'K'))) return;
+    if (intermediate_) {
+        if (intermediate_ == '!' && final == 'p') { // DECSTR soft reset
+            pen_ = Attr();
+            insert_ = false;
+            origin_ = false;
+            autowrap_ = true;
+            cursor_visible_ = true;
+            top_ = 0;
+            bottom_ = rows_ - 1;
+            saved_main_ = saved_alt_ = SavedCursor();
+        }
+        return;
+    }
+    if (final != 'm' && final != 'b') pending_wrap_ = false;
+
+    int n = param(0, 1);
+    switch (final) {
+    case '@': insert_cells(n); break;
+    case 'A':
+    case 'F':
+        row_ = std::max(row_ >= top_ ? top_ : 0, row_ - n);
+        if (final == 'F') col_ = 0;
+        break;
+    case 'B':
+    case 'E':
+    case 'e':
+        row_ = std::min(row_ <= bottom_ ? bottom_ : rows_ - 1, row_ + n);
+        if (final == 'E') col_ = 0;
+        break;
+    case 'C':
+    case 'a':
+        col_ = std::min(cols_ - 1, col_ + n);
+        break;
+    case 'D': col_ = std::max(0, col_ - n); break;
+    case 'G':
+    case '`':
+        col_ = std::min(cols_ - 1, n - 1);
+        break;
+    case 'H':
+    case 'f':
+        move_to(param(0, 1) - 1, param(1, 1) - 1);
+        break;
+    case 'd': move_to(n - 1, col_); break;
+    case 'I':
+        for (int i = 0; i < n && col_ < cols_ - 1; ++i) col_ = std::min(cols_ - 1, (col_ / 8 + 1) * 8);
+        break;
+    case 'Z':
+        for (int i = 0; i < n && col_ > 0; ++i) col_ = (col_ - 1) / 8 * 8;
+        break;
+    case 'J': {
+        int mode = param(0, 0);
+        if (mode == 0) {
+            clear_cells(row_, col_, cols_);
+            for (int r = row_ + 1; r < rows_; ++r) clear_cells(r, 0, cols_);
+        } else if (mode == 1) {
+            for (int r = 0; r < row_; ++r) clear_cells(r, 0, cols_);
+            clear_cells(row_, 0, col_ + 1);
+        } else {
+            for (int r = 0; r < rows_; ++r) clear_cells(r, 0, cols_);
+        }
+        break;
+    }
+    case 'K': {
+        int mode = param(0, 0);
+        if (mode == 0) clear_cells(row_, col_, cols_);
+        else if (mode == 1) clear_cells(row_, 0, col_ + 1);
+        else clear_cells(row_, 0, cols_);
+        break;
+    }
+    case 'L':
+        if (row_ >= top_ && row_ <= bottom_) {
+            scroll_down(row_, bottom_, n);
+            col_ = 0;
+        }
+        break;
+    case 'M':
+        if (row_ >= top_ && row_ <= bottom_) {
+            scroll_up(row_, bottom_, n);
+            col_ = 0;
+        }
+        break;
+    case 'P': delete_cells(n); break;
+    case 'X': clear_cells(row_, col_, std::min(cols_, col_ + n)); break;
+    case 'S': scroll_up(top_, bottom_, n); break;
+    case 'T':
+        if (nparams_ <= 1) scroll_down(top_, bottom_, n); // five parameters: mouse tracking
+        break;
+    case 'b': {
+        int times = std::min(n, rows_ * cols_);
+        for (int i = 0; i < times; ++i) print(last_char_);
+        break;
+    }
+    case 'm': sgr(); break;
+    case 'r': {
+        int top = param(0, 1) - 1;
+        int bottom = param(1, rows_) - 1;
+        if (top < bottom && bottom < rows_) {
+            top_ = top;
+            bottom_ = bottom;
+            move_to(0, 0);
+        }
+        break;
+    }
+    case 's':
+        if (nparams_ == 0) save_cursor();
+        break;
+    case 'u': restore_cursor(); break;
+    case 'h':
+    case 'l':
+        for (int i = 0; i < nparams_; ++i) {
+            if (params_[i] == 4) insert_ = final == 'h';
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void VtScreen::dec_mode(int mode, bool on) {
+    switch (mode) {
+    case 6:
+        origin_ = on;
+        move_to(0, 0);
+        return;
+    case 7: autowrap_ = on; return;
+    case 25: cursor_visible_ = on; return;
+    case 47:
+    case 1047:
+        if (on) enter_alt(false, mode == 1047);
+        else leave_alt(false);
+        return;
+    case 1049:
+        if (on) enter_alt(true, true);
+        else leave_alt(true);
+        return;
+    default:
+        break;
+    }
+    for (int i = 0; i < kNumInputModes; ++i) {
+        if (kInputModes[i] != mode) continue;
+        if (on) input_modes_ |= static_cast<uint16_t>(1u << i);
+        else input_modes_ &= static_cast<uint16_t>(~(1u << i));
+        return;
+    }
+}
+
+void VtScreen::osc_dispatch() {
+    // 0 sets icon name and title, 2 the title alone.
+    if (osc_.size() >= 2 && (osc_[0] == '0' || osc_[0] == '2') && osc_[1] == ';') {
+        title_.assign(osc_, 2, std::string::npos);
+    }
+    osc_.clear();
+}
+
+void VtScreen::sgr() {
+    if (nparams_ == 0) {
+        pen_ = Attr();
+        return;
+    }
+    for (int i = 0; i < nparams_; ++i) {
+        int p = params_[i];
+        switch (p) {
+        case 0: pen_ = Attr(); break;
+        case 1: pen_.flags |= BOLD; break;
+        case 2: pen_.flags |= DIM; break;
+        case 3: pen_.flags |= ITALIC; break;
+        case 4:
+        case 21:
+            pen_.flags |= UNDERLINE;
+            break;
+        case 5:
+        case 6:
+            pen_.flags |= BLINK;
+            break;
+        case 7: pen_.flags |= INVERSE; break;
+        case 8: pen_.flags |= HIDDEN; break;
+        case 9: pen_.flags |= STRIKE; break;
+        case 22: pen_.flags &= ~(BOLD | DIM); break;
+        case 23: pen_.flags &= ~ITALIC; break;
+        case 24: pen_.flags &= ~UNDERLINE; break;
+        case 25: pen_.flags &= ~BLINK; break;
+        case 27: pen_.flags &= ~INVERSE; break;
+        case 28: pen_.flags &= ~HIDDEN; break;
+        case 29: pen_.flags &= ~STRIKE; break;
+        case 39: pen_.fg = 0; break;
+        case 49: pen_.bg = 0; break;
+        case 38:
+        case 48: {
+            uint32_t color = 0;
+            if (i + 2 < nparams_ && params_[i + 1] == 5) {
+                color = kPalette | (params_[i + 2] & 0xFF);
+                i += 2;
+            } else if (i + 4 < nparams_ && params_[i + 1] == 2) {
+                color = kRgb | ((params_[i + 2] & 0xFF) << 16) | ((params_[i + 3] & 0xFF) << 8) |
+                        (params_[i + 4] & 0xFF);
+                i += 4;
+            } else {
+                return; // malformed: drop the rest
+            }
+            (p == 38 ? pen_.fg : pen_.bg) = color;
+            break;
+        }
+        default:
+            if (p >= 30 && p <= 37) pen_.fg = kPalette | (p - 30);
+            else if (p >= 40 && p <= 47) pen_.bg = kPalette | (p - 40);
+            else if (p >= 90 && p <= 97) pen_.fg = kPalette | (p - 90 + 8);
+            else if (p >= 100 && p <= 107) pen_.bg = kPalette | (p - 100 + 8);
+            break;
+        }
+    }
+}
+
+void VtScreen::linefeed() {
+    pending_wrap_ = false;
+    if (row_ == bottom_) scroll_up(top_, bottom_, 1);
+    else if (row_ < rows_ - 1) ++row_;
+}
+
+void VtScreen::reverse_index() {
+    pending_wrap_ = false;
+    if (row_ == top_) scroll_down(top_, bottom_, 1);
+    else if (row_ > 0) --row_;
+}
+
+void VtScreen::scroll_up(int top, int bottom, int n) {
+    n = std::min(n, bottom - top + 1);
+    if (n <= 0) return;
+    if (top == 0 && bottom == rows_ - 1) {
+        Grid& g = grid();
+        g.base = (g.base + n) % rows_;
+    } else {
+        for (int r = top; r + n <= bottom; ++r) std::copy(row_ptr(r + n), row_ptr(r + n) + cols_, row_ptr(r));
+    }
+    for (int r = bottom + 1 - n; r <= bottom; ++r) clear_cells(r, 0, cols_);
+}
+
+void VtScreen::scroll_down(int top, int bottom, int n) {
+    n = std::min(n, bottom - top + 1);
+    if (n <= 0) return;
+    if (top == 0 && bottom == rows_ - 1) {
+        Grid& g = grid();
+        g.base = (g.base + rows_ - n) % rows_;
+    } else {
+        for (int r = bottom; r - n >= top; --r) std::copy(row_ptr(r - n), row_ptr(r - n) + cols_, row_ptr(r));
+    }
+    for (int r = top; r < top + n; ++r) clear_cells(r, 0, cols_);
+}
+
+void VtScreen::clear_cells(int row, int from, int to) {
+    if (from >= to) return;
+    Cell* r = row_ptr(row);
+    std::fill(r + from, r + to, blank());
+}
+
+void VtScreen::insert_cells(int n) {
+    n = std::min(n, cols_ - col_);
+    Cell* r = row_ptr(row_);
+    std::copy_backward(r + col_, r + cols_ - n, r + cols_);
+    std::fill(r + col_, r + col_ + n, blank());
+}
+
+void VtScreen::delete_cells(int n) {
+    n = std::min(n, cols_ - col_);
+    Cell* r = row_ptr(row_);
+    std::copy(r + col_ + n, r + cols_, r + col_);
+    std::fill(r + cols_ - n, r + cols_, blank());
+}
+
+void VtScreen::move_to(int row, int col) {
+    pending_wrap_ = false;
+    if (origin_) row_ = std::min(std::max(row + top_, top_), bottom_);
+    else row_ = std::min(std::max(row, 0), rows_ - 1);
+    col_ = std::min(std::max(col, 0), cols_ - 1);
+}
+
+void VtScreen::save_cursor() {
+    SavedCursor& saved = alt_active_ ? saved_alt_ : saved_main_;
+    saved.row = row_;
+    saved.col = col_;
+    saved.pen = pen_;
+    saved.origin = origin_;
+    saved.autowrap = autowrap_;
+}
+
+void VtScreen::restore_cursor() {
+    const SavedCursor& saved = alt_active_ ? saved_alt_ : saved_main_;
+    row_ = std::min(saved.row, rows_ - 1);
+    col_ = std::min(saved.col, cols_ - 1);
+    pen_ = saved.pen;
+    origin_ = saved.origin;
+    autowrap_ = saved.autowrap;
+    pending_wrap_ = false;
+}
+
+void VtScreen::enter_alt(bool save, bool clear) {
+    if (save) save_cursor();
+    if (!alt_active_) {
+        alt_active_ = true;
+        // Allocated on first use: plenty of shells never switch.
+        if (alt_.cells.size() != main_.cells.size()) alt_.cells.assign(main_.cells.size(), Cell());
+    }
+    if (clear) std::fill(alt_.cells.begin(), alt_.cells.end(), blank());
+}
+
+void VtScreen::leave_alt(bool restore) {
+    if (!alt_active_) return;
+    alt_active_ = false;
+    if (restore) restore_cursor();
+}
+
+void VtScreen::reset() {
+    main_.cells.assign(main_.cells.size(), Cell());
+    main_.base = 0;
+    alt_ = Grid();
+    alt_active_ = false;
+    row_ = col_ = 0;
+    pending_wrap_ = false;
+    pen_ = Attr();
+    top_ = 0;
+    bottom_ = rows_ - 1;
+    autowrap_ = true;
+    origin_ = false;
+    insert_ = false;
+    cursor_visible_ = true;
+    app_keypad_ = false;
+    input_modes_ = 0;
+    saved_main_ = saved_alt_ = SavedCursor();
+}
+
+static void append_color(std::vector<uint8_t>& out, uint32_t color, int base, int bright_base, int extended) {
+    char buf[32];
+    uint32_t kind = color >> 24;
+    if (kind == 2) {
+        std::snprintf(buf, sizeof(buf), ";%d;2;%u;%u;%u", extended, (color >> 16) & 0xFF, (color >> 8) & 0xFF,
+                      color & 0xFF);
+    } else {
+        unsigned idx = color & 0xFF;
+        if (idx < 8) std::snprintf(buf, sizeof(buf), ";%u", base + idx);
+        else if (idx < 16) std::snprintf(buf, sizeof(buf), ";%u", bright_base + idx - 8);
+        else std::snprintf(buf, sizeof(buf), ";%d;5;%u", extended, idx);
+    }
+    append_str(out, buf);
+}
+
+void VtScreen::append_sgr(std::vector<uint8_t>& out, const Attr& a) {
+    static const struct {
+        uint16_t flag;
+        const char* code;
+    } kFlagCodes[] = {{BOLD, ";1"}, {DIM, ";2"}, {ITALIC, ";3"}, {UNDERLINE, ";4"},
+                      {BLINK, ";5"}, {INVERSE, ";7"}, {HIDDEN, ";8"}, {STRIKE, ";9"}};
+    append_str(out, "\x1b[0");
+    for (const auto& fc : kFlagCodes) {
+        if (a.flags & fc.flag) append_str(out, fc.code);
+    }
+    if (a.fg) append_color(out, a.fg, 30, 90, 38);
+    if (a.bg) append_color(out, a.bg, 40, 100, 48);
+    out.push_back('m');
+}
+
+void VtScreen::repaint(std::vector<uint8_t>& out) const {
+    char buf[64];
+
+    if (!title_.empty()) {
+        append_str(out, "\x1b]0;");
+        out.insert(out.end(), title_.begin(), title_.end());
+        out.push_back(0x07);
+    }
+    // Start from a known state: primary or alternate screen, default
+    // attributes, full scroll region, cleared.
+    append_str(out, alt_active_ ? "\x1b[?1049h" : "\x1b[?1049l");
+    append_str(out, "\x1b[0m\x1b[r\x1b[?6l\x1b[?7h\x1b[4l\x1b[H\x1b[2J");
+
+    Attr cur;
+    for (int r = 0; r < rows_; ++r) {
+        const Cell* row = row_ptr(r);
+        int last = cols_ - 1;
+        while (last >= 0 && (row[last].ch == ' ' || row[last].ch == 0) && row[last].attr == Attr()) --last;
+        if (last < 0) continue;
+        std::snprintf(buf, sizeof(buf), "\x1b[%d;1H", r + 1);
+        append_str(out, buf);
+        int wide_at = -2;
+        for (int c = 0; c <= last; ++c) {
+            uint32_t ch = row[c].ch;
+            if (ch == 0) {
+                if (wide_at == c - 1) continue;
+                ch = ' '; // half of a wide character that was partly overwritten
+            } else if (char_width(ch) == 2) {
+                if (c + 1 < cols_ && row[c + 1].ch == 0) wide_at = c;
+                else ch = ' ';
+            }
+            if (row[c].attr != cur) {
+                cur = row[c].attr;
+                append_sgr(out, cur);
+            }
+            append_utf8(out, ch);
+        }
+    }
+
+    if (top_ != 0 || bottom_ != rows_ - 1) {
+        std::snprintf(buf, sizeof(buf), "\x1b[%d;%dr", top_ + 1, bottom_ + 1);
+        append_str(out, buf);
+    }
+    if (origin_) append_str(out, "\x1b[?6h");
+    if (!autowrap_) append_str(out, "\x1b[?7l");
+    if (insert_) append_str(out, "\x1b[4h");
+    // Input modes are set or cleared explicitly: the terminal may still have
+    // them from an earlier client.
+    std::string set, cleared;
+    for (int i = 0; i < kNumInputModes; ++i) {
+        std::string& list = (input_modes_ & (1u << i)) ? set : cleared;
+        list += (list.empty() ? "" : ";") + std::to_string(kInputModes[i]);
+    }
+    if (!set.empty()) append_str(out, ("\x1b[?" + set + "h").c_str());
+    if (!cleared.empty()) append_str(out, ("\x1b[?" + cleared + "l").c_str());
+    append_str(out, app_keypad_ ? "\x1b=" : "\x1b>");
+    repaint_cursor(out);
+    append_str(out, cursor_visible_ ? "\x1b[?25h" : "\x1b[?25l");
+}
+
+void VtScreen::repaint_cell(int row, int col, std::vector<uint8_t>& out) const {
+    if (row < 0 || row >= rows_ || col < 0 || col >= cols_) return;
+    const Cell* cells = row_ptr(row);
+    // Redraw a wide character from its left half.
+    if (cells[col].ch == 0 && col > 0) --col;
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (origin_ ? row - top_ : row) + 1, col + 1);
+    append_str(out, buf);
+    append_sgr(out, cells[col].attr);
+    uint32_t ch = cells[col].ch;
+    bool wide_ok = col + 1 < cols_ && cells[col + 1].ch == 0;
+    append_utf8(out, ch == 0 || (char_width(ch) == 2 && !wide_ok) ? ' ' : ch);
+}
+
+void VtScreen::repaint_cursor(std::vector<uint8_t>& out) const {
+    char buf[32];
+    if (pending_wrap_) {
+        // Rewriting the last column leaves the terminal about to wrap too.
+        repaint_cell(row_, cols_ - 1, out);
+    } else {
+        std::snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (origin_ ? row_ - top_ : row_) + 1, col_ + 1);
+        append_str(out, buf);
+    }
+    append_sgr(out, pen_);
+}
+
+std::string VtScreen::row_text(int row) const {
+    std::vector<uint8_t> out;
+    if (row < 0 || row >= rows_) return std::string();
+    const Cell* r = row_ptr(row);
+    int last = cols_ - 1;
+    while (last >= 0 && (r[last].ch == ' ' || r[last].ch == 0)) --last;
+    for (int c = 0; c <= last; ++c) {
+        if (r[c].ch != 0) append_utf8(out, r[c].ch);
+    }
+    return std::string(out.begin(), out.end());
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// What a terminal would be showing after a shell's output: the cell grid
+// with attributes, cursor, scroll region, alternate screen, title and the
+// modes that change what the terminal sends back (application cursor keys,
+// mouse reporting, bracketed paste). Covers the VT100/xterm subset shells
+// and full-screen programs use; other sequences are parsed and dropped.
+// Parser state carries over between calls, like AnsiFilter's.
+//
+// repaint() turns the state into one short byte string that reproduces it
+// on a fresh terminal, however much output produced it.
+class VtScreen {
+public:
+    // Larger sizes are clamped: a peer's window size must not be able to
+    // ask for gigabytes of cells.
+    static constexpr int kMaxRows = 1000;
+    static constexpr int kMaxCols = 1000;
+
+    explicit VtScreen(int rows = 24, int cols = 80);
+
+    // Keeps the rows around the cursor, as xterm does when shrinking.
+    // Sizes below 1x1 are ignored.
+    void resize(int rows, int cols);
+    void feed(const uint8_t* data, size_t len);
+    // Appends the repaint to out.
+    void repaint(std::vector<uint8_t>& out) const;
+    // Appends what restores one cell, or the cursor and current attributes,
+    // on a terminal showing this screen, after something else drew there.
+    // In origin mode only rows inside the scroll region can be addressed.
+    void repaint_cell(int row, int col, std::vector<uint8_t>& out) const;
+    void repaint_cursor(std::vector<uint8_t>& out) const;
+
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+    int cursor_row() const { return row_; }
+    int cursor_col() const { return col_; }
+    bool alt_screen() const { return alt_active_; }
+    bool insert_mode() const { return insert_; }
+    bool origin_mode() const { return origin_; }
+    // Code point in a cell; 0 for the right half of a wide character.
+    uint32_t cell_char(int row, int col) const { return row_ptr(row)[col].ch; }
+    const std::string& title() const { return title_; }
+    // UTF-8 text of one row, trailing blanks trimmed.
+    std::string row_text(int row) const;
+    size_t memory_bytes() const;
+
+private:
+    enum Flag : uint16_t {
+        BOLD = 1 << 0,
+        DIM = 1 << 1,
+        ITALIC = 1 << 2,
+        UNDERLINE = 1 << 3,
+        BLINK = 1 << 4,
+        INVERSE = 1 << 5,
+        HIDDEN = 1 << 6,
+        STRIKE = 1 << 7
+    };
+
+    // Colours: 0 is the default, kPalette | index a 256-colour entry,
+    // kRgb | 0xRRGGBB a true colour.
+    struct Attr {
+        uint32_t fg = 0;
+        uint32_t bg = 0;
+        uint16_t flags = 0;
+        bool operator==(const Attr& o) const { return fg == o.fg && bg == o.bg && flags == o.flags; }
+        bool operator!=(const Attr& o) const { return !(*this == o); }
+    };
+
+    // ch 0 marks the right half of a double-width character.
+    struct Cell {
+        uint32_t ch = ' ';
+        Attr attr;
+    };
+
+    struct SavedCursor {
+        int row = 0;
+        int col = 0;
+        Attr pen;
+        bool origin = false;
+        bool autowrap = true;
+    };
+
+    // Rows are stored circularly from base, so scrolling the whole screen
+    // moves base instead of the cells.
+    struct Grid {
+        std::vector<Cell> cells;
+        int base = 0;
+    };
+
+    enum class State : uint8_t { Ground, Utf8, Escape, EscIntermediate, Csi, Osc, OscEscape, String, StringEscape };
+
+    static constexpr int kMaxParams = 16;
+    static constexpr uint32_t kPalette = 1u << 24;
+    static constexpr uint32_t kRgb = 2u << 24;
+
+    Grid& grid() { return alt_active_ ? alt_ : main_; }
+    const Grid& grid() const { return alt_active_ ? alt_ : main_; }
+    Cell* row_ptr(int row) {
+        Grid& g = grid();
+        return g.cells.data() + static_cast<size_t>((row + g.base) % rows_) * cols_;
+    }
+    const Cell* row_ptr(int row) const {
+        const Grid& g = grid();
+        return g.cells.data() + static_cast<size_t>((row + g.base) % rows_) * cols_;
+    }
+    Cell blank() const;
+    static void append_sgr(std::vector<uint8_t>& out, const Attr& a);
+
+    void print_ascii(const uint8_t* p, size_t n);
+    void print(uint32_t cp);
+    void wrap_if_pending();
+    void control(uint8_t c);
+    void esc_dispatch(uint8_t c);
+    void csi_dispatch(uint8_t final);
+    void dec_mode(int mode, bool on);
+    void osc_dispatch();
+    void sgr();
+    int param(int i, int def) const;
+
+    void linefeed();
+    void reverse_index();
+    void scroll_up(int top, int bottom, int n);
+    void scroll_down(int top, int bottom, int n);
+    void clear_cells(int row, int from, int to);
+    void insert_cells(int n);
+    void delete_cells(int n);
+    void move_to(int row, int col);
+    void save_cursor();
+    void restore_cursor();
+    void enter_alt(bool save, bool clear);
+    void leave_alt(bool restore);
+    void reset();
+
+    int rows_;
+    int cols_;
+    Grid main_;
+    Grid alt_;
+    bool alt_active_ = false;
+
+    int row_ = 0;
+    int col_ = 0;
+    bool pending_wrap_ = false;
+    Attr pen_;
+    int top_ = 0;
+    int bottom_ = 0;
+    bool autowrap_ = true;
+    bool origin_ = false;
+    bool insert_ = false;
+    bool cursor_visible_ = true;
+    bool app_keypad_ = false;
+    // DEC private modes passed through to the client terminal on repaint.
+    uint16_t input_modes_ = 0;
+    SavedCursor saved_main_;
+    SavedCursor saved_alt_;
+    uint32_t last_char_ = ' ';
+    std::string title_;
+
+    State state_ = State::Ground;
+    int params_[kMaxParams];
+    int nparams_ = 0;
+    uint8_t private_ = 0;
+    uint8_t intermediate_ = 0;
+    std::string osc_;
+    uint32_t utf8_cp_ = 0;
+    uint8_t utf8_need_ = 0;
+};
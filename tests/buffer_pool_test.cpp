@@ -0,0 +1,102 @@
+#include "buffer_pool.hpp"
+#include "check.hpp"
+#include "egress_queue.hpp"
+
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+static void pooled_buffer() {
+    PooledBuffer a(100);
+    CHECK(a.size() == 100 && a.capacity() >= 100);
+    std::memset(a.data(), 'a', a.size());
+    PooledBuffer b = a;
+    CHECK(b.data() == a.data() && a.use_count() == 2);
+
+    // A shared buffer detaches before it changes size; the other handle
+    // keeps its bytes.
+    b.resize(50);
+    CHECK(b.data() != a.data() && b.size() == 50 && a.size() == 100);
+    CHECK(a.use_count() == 1 && b.use_count() == 1);
+    CHECK(b.data()[49] == 'a');
+
+    // Within capacity, a buffer of its own resizes in place.
+    uint8_t* at = a.data();
+    a.resize(a.capacity());
+    CHECK(a.data() == at);
+    a.resize(a.capacity() + 1);
+    CHECK(a.data() != at && a.data()[0] == 'a');
+
+    PooledBuffer moved = std::move(a);
+    CHECK(a.empty() && moved.size() > 100);
+    CHECK(PooledBuffer().data() == nullptr);
+}
+
+// Frames cross threads through an EgressQueue and wait in a backlog on the
+// consumer side, some by reference and some copied, as TLSChannel queues
+// them while the socket is backed up. Once warm, none of it reaches the heap.
+static void steady_state_is_flat() {
+    const size_t kFrameBytes = 4096;
+    const uint64_t kFramesPerRound = 2048;
+    std::vector<uint8_t> payload(kFrameBytes, 'x');
+    EgressQueue queue;
+    std::atomic<uint64_t> wanted{0};
+    std::atomic<bool> done{false};
+    std::thread producer([&]() {
+        uint64_t pushed = 0;
+        while (!done.load(std::memory_order_relaxed)) {
+            if (pushed == wanted.load(std::memory_order_acquire) || queue.queued_bytes() >= 256 * 1024) {
+                std::this_thread::yield();
+                continue;
+            }
+            queue.push(framing::FrameType::DATA, payload.data(), payload.size(), SendPriority::BULK);
+            ++pushed;
+        }
+    });
+
+    std::vector<PooledBuffer> backlog;
+    backlog.reserve(64);
+    uint64_t drained = 0;
+    uint64_t bad = 0;
+    auto take = [&](EgressQueue::Frame& frame) {
+        ++drained;
+        if (frame.bytes.size() != framing::HEADER_SIZE + kFrameBytes) ++bad;
+        if (drained % 2) {
+            backlog.push_back(frame.bytes);
+        } else {
+            PooledBuffer copy(frame.bytes.size());
+            std::memcpy(copy.data(), frame.bytes.data(), frame.bytes.size());
+            backlog.push_back(std::move(copy));
+        }
+        if (backlog.size() == 64) backlog.clear();
+    };
+    auto round = [&]() {
+        wanted.fetch_add(kFramesPerRound, std::memory_order_release);
+        uint64_t until = drained + kFramesPerRound;
+        while (drained < until) {
+            queue.drain(take);
+            std::this_thread::yield();
+        }
+    };
+
+    for (int i = 0; i < 16; ++i) round();
+    uint64_t before = buffer_pool::stats().heap_allocations;
+    for (int i = 0; i < 32; ++i) round();
+    uint64_t after = buffer_pool::stats().heap_allocations;
+    done = true;
+    producer.join();
+
+    CHECK(bad == 0);
+    CHECK(after == before);
+    if (after != before) {
+        std::fprintf(stderr, "%llu heap allocations over %llu frames\n", (unsigned long long)(after - before),
+                     (unsigned long long)(32 * kFramesPerRound));
+    }
+}
+
+int main() {
+    pooled_buffer();
+    steady_state_is_flat();
+    return check_failures();
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdio>
+
+// Just enough for the unit tests: a failed CHECK is reported and the test
+// carries on, and main() returns the failure count for ctest.
+inline int& check_failures() {
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(cond)                                                                   \
+    do {                                                                              \
+        if (!(cond)) {                                                                \
+            std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++check_failures();                                                       \
+        }                                                                             \
+    } while (0)
@@ -0,0 +1,77 @@
+#include "check.hpp"
+#include "compression.hpp"
+#include "framing.hpp"
+
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+static std::vector<uint8_t> inflate_all(FrameDecompressor& inflater, const uint8_t* data, size_t len, bool& ok) {
+    std::vector<uint8_t> out;
+    ok = inflater.decompress(data, len, [&out](const uint8_t* p, size_t n) { out.insert(out.end(), p, p + n); });
+    return out;
+}
+
+static void round_trip() {
+    FrameCompressor deflater;
+    FrameDecompressor inflater;
+    CHECK(deflater.init(framing::HEADER_SIZE));
+    CHECK(inflater.init());
+    // Frames share one stream: later ones lean on the history of earlier ones.
+    for (int i = 0; i < 20; ++i) {
+        std::string text;
+        while (text.size() < 16000) text += "drwxr-xr-x 2 root root 4096 Jan  1 00:00 dir" + std::to_string(i) + "\r\n";
+        size_t zlen = 0;
+        uint8_t* z = deflater.compress(reinterpret_cast<const uint8_t*>(text.data()), text.size(), zlen);
+        CHECK(z != nullptr && zlen < text.size());
+        if (!z) return;
+        bool ok = false;
+        std::vector<uint8_t> out = inflate_all(inflater, z, zlen, ok);
+        CHECK(ok);
+        CHECK(std::string(out.begin(), out.end()) == text);
+    }
+}
+
+// One raw-deflate frame, as a FrameCompressor would send it, of len zeros:
+// about a thousandth of that on the wire.
+static std::vector<uint8_t> zeros_frame(size_t len) {
+    z_stream zs{};
+    deflateInit2(&zs, 9, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    std::vector<uint8_t> zeros(len, 0);
+    std::vector<uint8_t> out(deflateBound(&zs, static_cast<uLong>(len)) + 16);
+    zs.next_in = zeros.data();
+    zs.avail_in = static_cast<uInt>(len);
+    zs.next_out = out.data();
+    zs.avail_out = static_cast<uInt>(out.size());
+    deflate(&zs, Z_SYNC_FLUSH);
+    out.resize(out.size() - zs.avail_out);
+    deflateEnd(&zs);
+    return out;
+}
+
+static void high_ratio_frame_is_refused() {
+    // Within the cap: inflated as usual.
+    std::vector<uint8_t> fits = zeros_frame(framing::MAX_PAYLOAD);
+    FrameDecompressor ok_inflater;
+    CHECK(ok_inflater.init());
+    bool ok = false;
+    CHECK(inflate_all(ok_inflater, fits.data(), fits.size(), ok).size() == framing::MAX_PAYLOAD);
+    CHECK(ok);
+
+    // 64 MiB from a payload well inside one frame: refused, and no more
+    // than the cap is handed on before that.
+    std::vector<uint8_t> bomb = zeros_frame(64u << 20);
+    CHECK(bomb.size() < framing::MAX_PAYLOAD / 8);
+    FrameDecompressor inflater;
+    CHECK(inflater.init());
+    size_t handed_on = inflate_all(inflater, bomb.data(), bomb.size(), ok).size();
+    CHECK(!ok);
+    CHECK(handed_on <= framing::MAX_PAYLOAD);
+}
+
+int main() {
+    round_trip();
+    high_ratio_frame_is_refused();
+    return check_failures();
+}
@@ -0,0 +1,99 @@
+#include "check.hpp"
+#include "control_codec.hpp"
+
+#include <cstring>
+#include <string>
+
+using namespace control;
+
+static void round_trips() {
+    uint8_t buf[kMaxOpenSize];
+    Message msg;
+
+    CHECK(decode(buf, encode_winch(50, 132, buf), msg));
+    CHECK(msg.type == MsgType::WINCH && msg.winch.rows == 50 && msg.winch.cols == 132);
+
+    CHECK(decode(buf, encode_ping(MsgType::PING, 7, 0x0102030405060708ull, buf), msg));
+    CHECK(msg.type == MsgType::PING && msg.ping.seq == 7 && msg.ping.sent_us == 0x0102030405060708ull);
+    CHECK(decode(buf, encode_ping(MsgType::PONG, 0xffffffffu, 1, buf), msg));
+    CHECK(msg.type == MsgType::PONG && msg.ping.seq == 0xffffffffu && msg.ping.sent_us == 1);
+
+    CHECK(decode(buf, encode_credit(65536, buf), msg));
+    CHECK(msg.type == MsgType::CREDIT && msg.credit.bytes == 65536);
+
+    CHECK(decode(buf, encode_input_mark(42, buf), msg));
+    CHECK(msg.type == MsgType::INPUT_MARK && msg.trace.seq == 42 && msg.trace.pty_us == 0 && msg.trace.echo_us == 0);
+    CHECK(decode(buf, encode_input_trace(InputTrace{42, 150, 2500}, buf), msg));
+    CHECK(msg.type == MsgType::INPUT_TRACE && msg.trace.seq == 42 && msg.trace.pty_us == 150 &&
+          msg.trace.echo_us == 2500);
+
+    const char target[] = "localhost:8080";
+    size_t len = encode_channel_open(3, 1, 1 << 20, reinterpret_cast<const uint8_t*>(target), sizeof(target) - 1, buf);
+    CHECK(decode(buf, len, msg));
+    CHECK(msg.type == MsgType::CHANNEL_OPEN && msg.open.id == 3 && msg.open.kind == 1 && msg.open.window == 1u << 20);
+    CHECK(std::string(reinterpret_cast<const char*>(msg.open.target), msg.open.target_len) == target);
+
+    for (MsgType type : {MsgType::CHANNEL_OPEN_OK, MsgType::CHANNEL_WINDOW, MsgType::CHANNEL_CLOSE}) {
+        CHECK(decode(buf, encode_channel(type, 9, 4096, buf), msg));
+        CHECK(msg.type == type && msg.channel.id == 9);
+        if (type != MsgType::CHANNEL_CLOSE) CHECK(msg.channel.bytes == 4096);
+    }
+}
+
+static void long_targets_are_capped() {
+    std::string target(1000, 'x');
+    uint8_t buf[kMaxOpenSize];
+    size_t len = encode_channel_open(1, 2, 0, reinterpret_cast<const uint8_t*>(target.data()), target.size(), buf);
+    CHECK(len <= kMaxOpenSize);
+    Message msg;
+    CHECK(decode(buf, len, msg));
+    CHECK(msg.open.target_len == kMaxChannelTarget);
+}
+
+static void malformed_input() {
+    uint8_t buf[kMaxOpenSize] = {};
+    Message msg;
+    CHECK(!decode(buf, 0, msg));
+
+    // Every message cut short by a byte or more.
+    uint8_t enc[6][kMaxEncodedSize];
+    size_t lens[] = {encode_winch(1, 1, enc[0]),
+                     encode_ping(MsgType::PING, 1, 1, enc[1]),
+                     encode_credit(1, enc[2]),
+                     encode_input_mark(1, enc[3]),
+                     encode_input_trace(InputTrace{1, 1, 1}, enc[4]),
+                     encode_channel(MsgType::CHANNEL_WINDOW, 1, 1, enc[5])};
+    for (int i = 0; i < 6; ++i) {
+        for (size_t cut = 0; cut < lens[i]; ++cut) CHECK(!decode(enc[i], cut, msg));
+    }
+    CHECK(!decode(buf, encode_channel_open(1, 1, 1, nullptr, 0, buf) - 1, msg));
+
+    // Unknown version and type.
+    size_t len = encode_winch(24, 80, buf);
+    buf[0] = kVersion + 1;
+    CHECK(!decode(buf, len, msg));
+    buf[0] = kVersion;
+    buf[1] = 0;
+    CHECK(!decode(buf, len, msg));
+    buf[1] = 0xff;
+    CHECK(!decode(buf, len, msg));
+
+    // JSON is told apart by its first byte and never decodes as binary.
+    const char json[] = "{\"type\":\"hello\"}";
+    CHECK(is_json(reinterpret_cast<const uint8_t*>(json), sizeof(json) - 1));
+    CHECK(!decode(reinterpret_cast<const uint8_t*>(json), sizeof(json) - 1, msg));
+    CHECK(!is_json(buf, encode_credit(1, buf)));
+
+    // Fields a later version appends are skipped.
+    len = encode_credit(77, buf);
+    std::memset(buf + len, 0xee, 4);
+    CHECK(decode(buf, len + 4, msg));
+    CHECK(msg.type == MsgType::CREDIT && msg.credit.bytes == 77);
+}
+
+int main() {
+    round_trips();
+    long_targets_are_capped();
+    malformed_input();
+    return check_failures();
+}
@@ -0,0 +1,114 @@
+#include "check.hpp"
+#include "framing.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+using namespace framing;
+
+// Feeds bytes to the decoder in pieces of at most step, as reads off a
+// socket would arrive, and collects the frames that complete.
+struct Decoded {
+    uint8_t type;
+    uint32_t channel;
+    std::vector<uint8_t> payload;
+};
+
+static std::vector<Decoded> decode_all(FrameDecoder& decoder, const std::vector<uint8_t>& bytes, size_t step) {
+    std::vector<Decoded> frames;
+    size_t off = 0;
+    while (off < bytes.size() && !decoder.error()) {
+        size_t n = std::min({step, decoder.next_size(), bytes.size() - off});
+        std::memcpy(decoder.next_buffer(), bytes.data() + off, n);
+        off += n;
+        if (decoder.advance(n)) frames.push_back(Decoded{decoder.type(), decoder.channel(), decoder.payload()});
+    }
+    return frames;
+}
+
+static std::vector<uint8_t> payload_of(size_t n) {
+    std::vector<uint8_t> p(n);
+    for (size_t i = 0; i < n; ++i) p[i] = static_cast<uint8_t>(i * 31 + 7);
+    return p;
+}
+
+static void round_trip() {
+    std::vector<uint8_t> wire;
+    std::vector<std::vector<uint8_t>> payloads = {payload_of(0), payload_of(1), payload_of(300), payload_of(70000)};
+    for (const auto& p : payloads) {
+        auto frame = build_frame(FrameType::DATA, p);
+        CHECK(frame.size() == HEADER_SIZE + p.size());
+        wire.insert(wire.end(), frame.begin(), frame.end());
+    }
+    // A channel frame, and one built in place behind its own headroom.
+    auto body = payload_of(100);
+    uint8_t header[CHANNEL_HEADER_SIZE];
+    write_channel_header(FrameType::DATA, 0xdeadbeef, body.size(), header);
+    wire.insert(wire.end(), header, header + sizeof(header));
+    wire.insert(wire.end(), body.begin(), body.end());
+    std::vector<uint8_t> in_place(HEADER_SIZE + 5);
+    std::memcpy(in_place.data() + HEADER_SIZE, "hello", 5);
+    uint8_t* frame = frame_in_place(FrameType::CONTROL, in_place.data() + HEADER_SIZE, 5);
+    CHECK(frame == in_place.data());
+    wire.insert(wire.end(), in_place.begin(), in_place.end());
+
+    for (size_t step : {size_t(1), size_t(3), size_t(4096), wire.size()}) {
+        FrameDecoder decoder;
+        auto frames = decode_all(decoder, wire, step);
+        CHECK(!decoder.error());
+        CHECK(frames.size() == payloads.size() + 2);
+        if (frames.size() != payloads.size() + 2) continue;
+        for (size_t i = 0; i < payloads.size(); ++i) {
+            CHECK(frames[i].type == static_cast<uint8_t>(FrameType::DATA));
+            CHECK(frames[i].channel == 0);
+            CHECK(frames[i].payload == payloads[i]);
+        }
+        const Decoded& chan = frames[payloads.size()];
+        CHECK(chan.type == (static_cast<uint8_t>(FrameType::DATA) | CHANNEL_FLAG));
+        CHECK(chan.channel == 0xdeadbeef);
+        CHECK(chan.payload == body);
+        const Decoded& control = frames.back();
+        CHECK(control.type == static_cast<uint8_t>(FrameType::CONTROL));
+        CHECK(control.payload == std::vector<uint8_t>({'h', 'e', 'l', 'l', 'o'}));
+    }
+}
+
+static void malformed_input() {
+    // Longer than MAX_PAYLOAD: an error once the header is in, before any
+    // payload is allocated.
+    std::vector<uint8_t> wire(HEADER_SIZE);
+    write_header(FrameType::DATA, MAX_PAYLOAD + 1, wire.data());
+    FrameDecoder oversized;
+    CHECK(decode_all(oversized, wire, 1).empty());
+    CHECK(oversized.error());
+
+    // A channel frame's length has to cover the channel ID.
+    for (uint32_t len = 0; len < 4; ++len) {
+        std::vector<uint8_t> chan = {static_cast<uint8_t>(static_cast<uint8_t>(FrameType::DATA) | CHANNEL_FLAG), 0, 0,
+                                     0, static_cast<uint8_t>(len), 0, 0, 0, 1};
+        FrameDecoder decoder;
+        CHECK(decode_all(decoder, chan, chan.size()).empty());
+        CHECK(decoder.error());
+    }
+
+    // A frame cut short never completes.
+    auto frame = build_frame(FrameType::DATA, payload_of(64));
+    for (size_t cut = 0; cut < frame.size(); ++cut) {
+        FrameDecoder decoder;
+        CHECK(decode_all(decoder, std::vector<uint8_t>(frame.begin(), frame.begin() + cut), 7).empty());
+        CHECK(!decoder.error());
+    }
+
+    // Unknown types are delivered for the caller to skip.
+    frame[0] = 0x7f;
+    FrameDecoder decoder;
+    auto frames = decode_all(decoder, frame, frame.size());
+    CHECK(frames.size() == 1 && frames[0].type == 0x7f);
+}
+
+int main() {
+    round_trip();
+    malformed_input();
+    return check_failures();
+}
@@ -0,0 +1,111 @@
+#include "check.hpp"
+#include "vt_screen.hpp"
+
+#include <string>
+#include <vector>
+
+static void feed(VtScreen& screen, const std::string& s) {
+    screen.feed(reinterpret_cast<const uint8_t*>(s.data()), s.size());
+}
+
+// A fresh screen of the same size, fed only the repaint, has to end up
+// showing the same thing, down to the repaint it would produce itself.
+static void check_replays(const VtScreen& screen) {
+    std::vector<uint8_t> repaint;
+    screen.repaint(repaint);
+    VtScreen copy(screen.rows(), screen.cols());
+    copy.feed(repaint.data(), repaint.size());
+    for (int r = 0; r < screen.rows(); ++r) CHECK(copy.row_text(r) == screen.row_text(r));
+    CHECK(copy.cursor_row() == screen.cursor_row());
+    CHECK(copy.cursor_col() == screen.cursor_col());
+    CHECK(copy.alt_screen() == screen.alt_screen());
+    CHECK(copy.insert_mode() == screen.insert_mode());
+    CHECK(copy.origin_mode() == screen.origin_mode());
+    CHECK(copy.title() == screen.title());
+    std::vector<uint8_t> again;
+    copy.repaint(again);
+    CHECK(again == repaint);
+}
+
+static std::string numbered_lines(int from, int to) {
+    std::string s;
+    for (int i = from; i <= to; ++i) {
+        if (i > from) s += "\r\n";
+        s += "line " + std::to_string(i);
+    }
+    return s;
+}
+
+static void replay() {
+    VtScreen screen(24, 80);
+    feed(screen, "\x1b]0;build\x07\x1b[1;31mred\x1b[0m plain \x1b[4munder\x1b[0m\r\n");
+    feed(screen, "wide: \xe4\xb8\xad\xe6\x96\x87 \xc3\xa9\r\n");
+    feed(screen, "\x1b[5;20r\x1b[20;1H" + numbered_lines(1, 40));
+    feed(screen, "\x1b[r\x1b[10;30H\x1b[7mcursor here\x1b[0m\x1b[4h");
+    CHECK(screen.title() == "build");
+    CHECK(screen.row_text(0) == "red plain under");
+    CHECK(screen.row_text(19) == "line 40");
+    check_replays(screen);
+
+    // Full-screen programs draw on the alternate screen.
+    feed(screen, "\x1b[4l\x1b[?1049h\x1b[H\x1b[2Jeditor\x1b[3;5Hx");
+    CHECK(screen.alt_screen());
+    CHECK(screen.row_text(0) == "editor");
+    check_replays(screen);
+    feed(screen, "\x1b[?1049l");
+    CHECK(!screen.alt_screen());
+    CHECK(screen.row_text(0) == "red plain under");
+    check_replays(screen);
+}
+
+static void resize() {
+    VtScreen screen(24, 80);
+    feed(screen, numbered_lines(1, 24));
+    CHECK(screen.cursor_row() == 23);
+
+    // Shrinking keeps the rows around the cursor.
+    screen.resize(10, 40);
+    CHECK(screen.rows() == 10 && screen.cols() == 40);
+    CHECK(screen.row_text(0) == "line 15");
+    CHECK(screen.row_text(9) == "line 24");
+    CHECK(screen.cursor_row() == 9);
+    check_replays(screen);
+
+    // Growing adds blank rows below and keeps what is there.
+    screen.resize(30, 100);
+    CHECK(screen.row_text(0) == "line 15");
+    CHECK(screen.row_text(10).empty());
+    feed(screen, "\r\nafter");
+    CHECK(screen.row_text(10) == "after");
+    check_replays(screen);
+
+    // Narrowing cuts rows off at the right edge.
+    feed(screen, "\r\n" + std::string(90, 'w'));
+    screen.resize(30, 20);
+    CHECK(screen.row_text(11) == std::string(20, 'w'));
+    CHECK(screen.cursor_col() == 19);
+    check_replays(screen);
+}
+
+static void sizes_are_bounded() {
+    VtScreen screen(24, 80);
+    screen.resize(0, 80);
+    screen.resize(24, 0);
+    screen.resize(-1, -1);
+    CHECK(screen.rows() == 24 && screen.cols() == 80);
+    screen.resize(65535, 65535);
+    CHECK(screen.rows() == VtScreen::kMaxRows && screen.cols() == VtScreen::kMaxCols);
+    feed(screen, "\x1b[5000;5000Hx");
+    CHECK(screen.cursor_row() == VtScreen::kMaxRows - 1 && screen.cursor_col() == VtScreen::kMaxCols - 1);
+    CHECK(screen.cell_char(VtScreen::kMaxRows - 1, VtScreen::kMaxCols - 1) == 'x');
+
+    VtScreen tiny(0, 100000);
+    CHECK(tiny.rows() == 1 && tiny.cols() == VtScreen::kMaxCols);
+}
+
+int main() {
+    replay();
+    resize();
+    sizes_are_bounded();
+    return check_failures();
+}
@@ -0,0 +1,210 @@
+// Plays back a session recorded by the server with --record-dir: in real
+// time, faster or slower, from any point in it, or as a listing of what was
+// typed and when.
+//
+//   session-play [--speed N] [--from TIME] [--max-idle SECONDS] recording
+//   session-play --info recording
+//   session-play --dump recording
+//
+// TIME is seconds or [h:]m:ss. --speed 0 plays without pauses; --max-idle
+// shortens any pause longer than that, as asciinema's idle limit does.
+
+#include "session_recording.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <thread>
+
+using Clock = std::chrono::steady_clock;
+
+static bool parse_time(const char* text, std::chrono::microseconds& out) {
+    double seconds = 0;
+    const char* p = text;
+    for (;;) {
+        char* end = nullptr;
+        double part = std::strtod(p, &end);
+        if (end == p || part < 0) return false;
+        seconds = seconds * 60 + part;
+        if (*end == '\0') break;
+        if (*end != ':') return false;
+        p = end + 1;
+    }
+    out = std::chrono::microseconds(static_cast<int64_t>(seconds * 1e6));
+    return true;
+}
+
+static double secs(std::chrono::microseconds us) {
+    return static_cast<double>(us.count()) / 1e6;
+}
+
+// Typed bytes as a C string literal, so control keys show.
+static std::string escaped(const std::vector<uint8_t>& data) {
+    std::string out = "\"";
+    for (uint8_t c : data) {
+        if (c == '\r') {
+            out += "\\r";
+        } else if (c == '\n') {
+            out += "\\n";
+        } else if (c == '\t') {
+            out += "\\t";
+        } else if (c == '"' || c == '\\') {
+            out += '\\';
+            out += static_cast<char>(c);
+        } else if (c < 0x20 || c == 0x7f) {
+            char hex[8];
+            std::snprintf(hex, sizeof(hex), "\\x%02x", c);
+            out += hex;
+        } else {
+            out += static_cast<char>(c);
+        }
+    }
+    return out + "\"";
+}
+
+static int info(RecordingReader& reader, const std::string& path) {
+    std::time_t started = static_cast<std::time_t>(reader.started_us() / 1000000);
+    char when[64] = "?";
+    if (std::tm* tm = std::localtime(&started)) std::strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", tm);
+    std::FILE* f = std::fopen(path.c_str(), "rb");
+    long file_bytes = 0;
+    if (f) {
+        std::fseek(f, 0, SEEK_END);
+        file_bytes = std::ftell(f);
+        std::fclose(f);
+    }
+    uint64_t out_bytes = 0;
+    uint64_t in_bytes = 0;
+    uint64_t resizes = 0;
+    uint64_t gaps = 0;
+    RecordedEvent event;
+    while (reader.next(event)) {
+        if (event.gap) {
+            ++gaps;
+            continue;
+        }
+        if (event.type == TraceEvent::Type::OUTPUT) out_bytes += event.data.size();
+        if (event.type == TraceEvent::Type::INPUT) in_bytes += event.data.size();
+        if (event.type == TraceEvent::Type::RESIZE) ++resizes;
+    }
+    std::printf("Session:  %s\n", reader.label().c_str());
+    std::printf("Started:  %s\n", when);
+    std::printf("Length:   %.1f s\n", secs(reader.duration()));
+    std::printf("Chunks:   %zu (%s)\n", reader.chunks().size(),
+                reader.indexed() ? "indexed" : "not closed; index rebuilt");
+    std::printf("Output:   %llu bytes, %llu typed, %llu resizes\n", (unsigned long long)out_bytes,
+                (unsigned long long)in_bytes, (unsigned long long)resizes);
+    if (gaps > 0) std::printf("Gaps:     %llu (the disk fell behind)\n", (unsigned long long)gaps);
+    if (out_bytes + in_bytes > 0) {
+        std::printf("On disk:  %ld bytes (%.1f%%)\n", file_bytes, 100.0 * file_bytes / (out_bytes + in_bytes));
+    }
+    if (reader.error()) std::printf("The recording is damaged past %.1f s\n", secs(event.at));
+    return reader.error() ? 1 : 0;
+}
+
+static int dump(RecordingReader& reader) {
+    RecordedEvent event;
+    while (reader.next(event)) {
+        if (event.gap) {
+            std::printf("%10.3f  gap     repaint %zu bytes\n", secs(event.at), event.data.size());
+        } else if (event.type == TraceEvent::Type::INPUT) {
+            std::printf("%10.3f  in      %s\n", secs(event.at), escaped(event.data).c_str());
+        } else if (event.type == TraceEvent::Type::OUTPUT) {
+            std::printf("%10.3f  out     %zu bytes\n", secs(event.at), event.data.size());
+        } else if (event.type == TraceEvent::Type::RESIZE && event.data.size() == 4) {
+            std::printf("%10.3f  resize  %ux%u\n", secs(event.at), event.data[0] << 8 | event.data[1],
+                        event.data[2] << 8 | event.data[3]);
+        }
+    }
+    if (reader.error()) std::fprintf(stderr, "session-play: the recording is damaged past %.3f s\n", secs(event.at));
+    return reader.error() ? 1 : 0;
+}
+
+static int play(RecordingReader& reader, std::chrono::microseconds from, double speed,
+                std::chrono::microseconds max_idle) {
+    std::vector<uint8_t> screen;
+    if (!reader.seek(from, screen)) {
+        std::fprintf(stderr, "session-play: the recording is damaged\n");
+        return 1;
+    }
+    static const char kClearScreen[] = "\x1b[0m\x1b[H\x1b[2J";
+    std::fwrite(kClearScreen, 1, sizeof(kClearScreen) - 1, stdout);
+    std::fwrite(screen.data(), 1, screen.size(), stdout);
+    std::fflush(stdout);
+
+    auto wall = Clock::now();
+    std::chrono::microseconds last = from;
+    std::chrono::duration<double, std::micro> elapsed(0);
+    RecordedEvent event;
+    while (reader.next(event)) {
+        if (event.type != TraceEvent::Type::OUTPUT) continue;
+        auto pause = event.at - last;
+        if (max_idle.count() > 0 && pause > max_idle) pause = max_idle;
+        last = event.at;
+        if (speed > 0 && pause.count() > 0) {
+            elapsed += std::chrono::duration<double, std::micro>(static_cast<double>(pause.count()) / speed);
+            auto due = wall + std::chrono::duration_cast<Clock::duration>(elapsed);
+            if (due > Clock::now()) {
+                std::fflush(stdout);
+                std::this_thread::sleep_until(due);
+            }
+        }
+        std::fwrite(event.data.data(), 1, event.data.size(), stdout);
+    }
+    std::fflush(stdout);
+    if (reader.error()) {
+        std::fprintf(stderr, "\r\nsession-play: the recording is damaged past %.1f s\r\n", secs(last));
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    enum class Mode { Play, Info, Dump } mode = Mode::Play;
+    double speed = 1.0;
+    std::chrono::microseconds from(0);
+    std::chrono::microseconds max_idle(0);
+    std::string path;
+    bool ok = true;
+    for (int i = 1; i < argc && ok; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--info") {
+            mode = Mode::Info;
+        } else if (arg == "--dump") {
+            mode = Mode::Dump;
+        } else if (arg == "--speed" && i + 1 < argc) {
+            char* end = nullptr;
+            speed = std::strtod(argv[++i], &end);
+            ok = *end == '\0' && speed >= 0;
+        } else if (arg == "--from" && i + 1 < argc) {
+            ok = parse_time(argv[++i], from);
+        } else if (arg == "--max-idle" && i + 1 < argc) {
+            ok = parse_time(argv[++i], max_idle);
+        } else if (path.empty() && arg[0] != '-') {
+            path = arg;
+        } else {
+            ok = false;
+        }
+    }
+    if (!ok || path.empty()) {
+        std::fprintf(stderr,
+                     "usage: session-play [--speed N] [--from TIME] [--max-idle SECONDS] recording\n"
+                     "       session-play --info recording\n"
+                     "       session-play --dump recording\n");
+        return 2;
+    }
+    RecordingReader reader;
+    if (!reader.open(path)) {
+        std::fprintf(stderr, "session-play: %s is not a session recording\n", path.c_str());
+        return 1;
+    }
+    switch (mode) {
+    case Mode::Info: return info(reader, path);
+    case Mode::Dump: return dump(reader);
+    case Mode::Play: break;
+    }
+    return play(reader, from, speed, max_idle);
+}